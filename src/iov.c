@@ -140,3 +140,66 @@ size_t vrend_read_from_iovec_cb(const struct iovec *iov, int iovlen,
 
 
 }
+
+void vrend_iov_cursor_init(struct vrend_iov_cursor *cursor,
+                           const struct iovec *iov, int iovlen)
+{
+  cursor->iov = iov;
+  cursor->iov_cnt = iovlen;
+  cursor->index = 0;
+  cursor->start = 0;
+}
+
+/* find the iovec holding offset, false when it is past the end */
+static int vrend_iov_cursor_seek(struct vrend_iov_cursor *cursor, size_t offset)
+{
+  assert(offset >= cursor->start);
+
+  while (cursor->index < cursor->iov_cnt) {
+    if (offset < cursor->start + cursor->iov[cursor->index].iov_len)
+      return 1;
+    cursor->start += cursor->iov[cursor->index].iov_len;
+    cursor->index++;
+  }
+  return 0;
+}
+
+static int vrend_iov_cursor_holds(struct vrend_iov_cursor *cursor,
+                                  size_t offset, size_t len)
+{
+  if (!vrend_iov_cursor_seek(cursor, offset))
+    return 0;
+  return offset + len <= cursor->start + cursor->iov[cursor->index].iov_len;
+}
+
+/*
+ * Splits rows of row_size bytes, stride bytes apart and starting at offset,
+ * into runs.  Either all rows of a run are inside one iovec and *ptr points
+ * at the first one, or they all cross from one iovec into the next and
+ * *ptr is NULL.  Returns the number of rows in the run, at most max_rows.
+ * Rows have to be passed in increasing order.
+ */
+size_t vrend_iov_rows(struct vrend_iov_cursor *cursor, size_t offset,
+                      size_t stride, size_t row_size, size_t max_rows,
+                      char **ptr)
+{
+  size_t rows = 1;
+  size_t end;
+
+  if (vrend_iov_cursor_holds(cursor, offset, row_size)) {
+    end = cursor->start + cursor->iov[cursor->index].iov_len;
+    if (stride)
+      rows = (end - offset - row_size) / stride + 1;
+    if (rows > max_rows)
+      rows = max_rows;
+    *ptr = (char*)cursor->iov[cursor->index].iov_base + (offset - cursor->start);
+    return rows;
+  }
+
+  *ptr = NULL;
+  while (rows < max_rows &&
+         !vrend_iov_cursor_holds(cursor, offset + rows * stride, row_size) &&
+         cursor->index < cursor->iov_cnt)
+    rows++;
+  return rows;
+}
@@ -35,6 +35,7 @@
 #include "util/u_format.h"
 #include "util/u_math.h"
 #include "vrend_renderer.h"
+#include "vrend_capture.h"
 
 #include "virglrenderer.h"
 
@@ -60,7 +61,10 @@ static int use_context = CONTEXT_NONE;
 
 int virgl_renderer_resource_create(struct virgl_renderer_resource_create_args *args, struct iovec *iov, uint32_t num_iovs)
 {
-   return vrend_renderer_resource_create((struct vrend_renderer_resource_create_args *)args, iov, num_iovs, NULL);
+   int ret = vrend_renderer_resource_create((struct vrend_renderer_resource_create_args *)args, iov, num_iovs, NULL);
+   if (!ret)
+      vrend_capture_resource_create(args, iov, num_iovs);
+   return ret;
 }
 
 int virgl_renderer_resource_import_eglimage(struct virgl_renderer_resource_create_args *args, void *image)
@@ -84,6 +88,7 @@ void *virgl_renderer_resource_get_priv(uint32_t res_handle)
 
 void virgl_renderer_resource_unref(uint32_t res_handle)
 {
+   vrend_capture_resource_unref(res_handle);
    vrend_renderer_resource_unref(res_handle);
 }
 
@@ -95,11 +100,15 @@ void virgl_renderer_fill_caps(uint32_t set, uint32_t version,
 
 int virgl_renderer_context_create(uint32_t handle, uint32_t nlen, const char *name)
 {
-   return vrend_renderer_context_create(handle, nlen, name);
+   int ret = vrend_renderer_context_create(handle, nlen, name);
+   if (!ret)
+      vrend_capture_context_create(handle, nlen, name);
+   return ret;
 }
 
 void virgl_renderer_context_destroy(uint32_t handle)
 {
+   vrend_capture_context_destroy(handle);
    vrend_renderer_context_destroy(handle);
 }
 
@@ -107,6 +116,7 @@ int virgl_renderer_submit_cmd(void *buffer,
                               int ctx_id,
                               int ndw)
 {
+   vrend_capture_submit_cmd(buffer, ctx_id, ndw);
    return vrend_decode_block(ctx_id, buffer, ndw);
 }
 
@@ -133,6 +143,8 @@ int virgl_renderer_transfer_write_iov(uint32_t handle,
    transfer_info.iovec_cnt = iovec_cnt;
    transfer_info.context0 = true;
 
+   vrend_capture_transfer(handle, ctx_id, level, stride, layer_stride, box, offset,
+                          iovec, iovec_cnt, VIRGL_TRANSFER_TO_HOST);
    return vrend_renderer_transfer_iov(&transfer_info, VIRGL_TRANSFER_TO_HOST);
 }
 
@@ -156,22 +168,29 @@ int virgl_renderer_transfer_read_iov(uint32_t handle, uint32_t ctx_id,
    transfer_info.iovec_cnt = iovec_cnt;
    transfer_info.context0 = true;
 
+   vrend_capture_transfer(handle, ctx_id, level, stride, layer_stride, box, offset,
+                          iovec, iovec_cnt, VIRGL_TRANSFER_FROM_HOST);
    return vrend_renderer_transfer_iov(&transfer_info, VIRGL_TRANSFER_FROM_HOST);
 }
 
 int virgl_renderer_resource_attach_iov(int res_handle, struct iovec *iov,
                                        int num_iovs)
 {
-   return vrend_renderer_resource_attach_iov(res_handle, iov, num_iovs);
+   int ret = vrend_renderer_resource_attach_iov(res_handle, iov, num_iovs);
+   if (!ret)
+      vrend_capture_attach_backing(res_handle, iov, num_iovs);
+   return ret;
 }
 
 void virgl_renderer_resource_detach_iov(int res_handle, struct iovec **iov_p, int *num_iovs_p)
 {
+   vrend_capture_detach_backing(res_handle);
    return vrend_renderer_resource_detach_iov(res_handle, iov_p, num_iovs_p);
 }
 
 int virgl_renderer_create_fence(int client_fence_id, uint32_t ctx_id)
 {
+   vrend_capture_create_fence(client_fence_id, ctx_id);
    return vrend_renderer_create_fence(client_fence_id, ctx_id);
 }
 
@@ -182,11 +201,20 @@ void virgl_renderer_force_ctx_0(void)
 
 void virgl_renderer_ctx_attach_resource(int ctx_id, int res_handle)
 {
-   vrend_renderer_attach_res_ctx(ctx_id, res_handle);
+   vrend_capture_ctx_resource(ctx_id, res_handle, true);
+   vrend_renderer_attach_res_ctx(ctx_id, res_handle, res_handle);
+}
+
+void virgl_renderer_ctx_attach_resource_as(int ctx_id, int res_handle,
+                                           int ctx_res_handle)
+{
+   vrend_capture_ctx_resource_as(ctx_id, res_handle, ctx_res_handle);
+   vrend_renderer_attach_res_ctx(ctx_id, res_handle, ctx_res_handle);
 }
 
 void virgl_renderer_ctx_detach_resource(int ctx_id, int res_handle)
 {
+   vrend_capture_ctx_resource(ctx_id, res_handle, false);
    vrend_renderer_detach_res_ctx(ctx_id, res_handle);
 }
 
@@ -203,6 +231,11 @@ int virgl_renderer_resource_get_info(int res_handle,
    return ret;
 }
 
+bool virgl_renderer_resource_busy(int res_handle)
+{
+   return vrend_renderer_resource_busy(res_handle);
+}
+
 int virgl_has_gl_colorspace(void)
 {
    bool egl_colorspace = false;
@@ -239,6 +272,11 @@ static void virgl_write_fence(uint32_t fence_id)
    rcbs->write_fence(dev_cookie, fence_id);
 }
 
+static void virgl_write_context_fence(uint32_t ctx_id, uint32_t fence_id)
+{
+   rcbs->write_context_fence(dev_cookie, ctx_id, fence_id);
+}
+
 static virgl_renderer_gl_context create_gl_context(int scanout_idx, struct virgl_gl_ctx_param *param)
 {
    struct virgl_renderer_gl_ctx_param vparam;
@@ -286,6 +324,7 @@ static int make_current(virgl_renderer_gl_context ctx)
 
 static struct vrend_if_cbs virgl_cbs = {
    virgl_write_fence,
+   NULL,
    create_gl_context,
    destroy_gl_context,
    make_current,
@@ -306,6 +345,7 @@ void virgl_renderer_poll(void)
 void virgl_renderer_cleanup(UNUSED void *cookie)
 {
    vrend_renderer_fini();
+   vrend_capture_fini();
 #ifdef HAVE_EPOXY_EGL_H
    if (use_context == CONTEXT_EGL) {
       virgl_egl_destroy(egl_info);
@@ -334,6 +374,11 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
    dev_cookie = cookie;
    rcbs = cbs;
 
+   if (cbs->version >= 3 && cbs->write_context_fence)
+      virgl_cbs.write_context_fence = virgl_write_context_fence;
+   else
+      virgl_cbs.write_context_fence = NULL;
+
    if (flags & VIRGL_RENDERER_USE_EGL) {
 #ifdef HAVE_EPOXY_EGL_H
       int fd = -1;
@@ -363,6 +408,11 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
 
    if (flags & VIRGL_RENDERER_THREAD_SYNC)
       renderer_flags |= VREND_USE_THREAD_SYNC;
+   if (flags & VIRGL_RENDERER_ASYNC_READBACK)
+      renderer_flags |= VREND_USE_ASYNC_READBACK;
+
+   if (getenv("VREND_CAPTURE_FILE"))
+      vrend_capture_init(getenv("VREND_CAPTURE_FILE"));
 
    return vrend_renderer_init(&virgl_cbs, renderer_flags);
 }
@@ -45,7 +45,7 @@ struct virgl_renderer_gl_ctx_param {
    int minor_ver;
 };
 
-#define VIRGL_RENDERER_CALLBACKS_VERSION 2
+#define VIRGL_RENDERER_CALLBACKS_VERSION 3
 
 struct virgl_renderer_callbacks {
    int version;
@@ -57,6 +57,11 @@ struct virgl_renderer_callbacks {
    int (*make_current)(void *cookie, int scanout_idx, virgl_renderer_gl_context ctx);
 
    int (*get_drm_fd)(void *cookie); /* v2, used with flags & VIRGL_RENDERER_USE_EGL */
+
+   /* v3, optional.  When set it is called instead of write_fence: fences
+    * of a context signal in order, but independently of other contexts,
+    * and fence_id is the last signaled fence of ctx_id. */
+   void (*write_context_fence)(void *cookie, uint32_t ctx_id, uint32_t fence_id);
 };
 
 /* virtio-gpu compatible interface */
@@ -69,6 +74,13 @@ struct virgl_renderer_callbacks {
 #define VIRGL_RENDERER_USE_GLX (1 << 2)
 #define VIRGL_RENDERER_USE_SURFACELESS (1 << 3)
 #define VIRGL_RENDERER_USE_GLES (1 << 4)
+/*
+ * Reads into the attached backing of a resource (transfer_read_iov with no
+ * iovecs) may complete after the call returns: the data is there once
+ * virgl_renderer_resource_busy reports the resource idle, or a fence
+ * created after the read was reported.
+ */
+#define VIRGL_RENDERER_ASYNC_READBACK (1 << 5)
 
 VIRGL_EXPORT int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cb);
 VIRGL_EXPORT void virgl_renderer_poll(void); /* force fences */
@@ -162,6 +174,14 @@ VIRGL_EXPORT void virgl_renderer_force_ctx_0(void);
 VIRGL_EXPORT void virgl_renderer_ctx_attach_resource(int ctx_id, int res_handle);
 VIRGL_EXPORT void virgl_renderer_ctx_detach_resource(int ctx_id, int res_handle);
 
+/* Attach a resource to a context under a different, context local handle.
+ * Command streams and transfers of that context then refer to the resource
+ * by ctx_res_handle.  This lets a server give each of its clients its own
+ * handle space; detach with the context local handle before unref'ing.
+ */
+VIRGL_EXPORT void virgl_renderer_ctx_attach_resource_as(int ctx_id, int res_handle,
+                                                        int ctx_res_handle);
+
 VIRGL_EXPORT virgl_debug_callback_type virgl_set_debug_callback(virgl_debug_callback_type cb);
 
 /* return information about a resource */
@@ -181,6 +201,10 @@ struct virgl_renderer_resource_info {
 VIRGL_EXPORT int virgl_renderer_resource_get_info(int res_handle,
                                                   struct virgl_renderer_resource_info *info);
 
+/* Whether commands submitted so far that use the resource are still
+ * executing.  Only work followed by a fence is ever reported done. */
+VIRGL_EXPORT bool virgl_renderer_resource_busy(int res_handle);
+
 VIRGL_EXPORT void virgl_renderer_cleanup(void *cookie);
 
 /* reset the rendererer - destroy all contexts and resource */
@@ -40,6 +40,7 @@
 #include "util/u_double_list.h"
 #include "util/u_format.h"
 #include "util/u_texture.h"
+#include "util/u_hash_table.h"
 #include "tgsi/tgsi_parse.h"
 
 #include "vrend_object.h"
@@ -48,6 +49,7 @@
 #include "vrend_renderer.h"
 
 #include "vrend_blitter.h"
+#include "vrend_hash.h"
 
 #define DEST_SWIZZLE_SNIPPET_SIZE 64
 
@@ -61,12 +63,12 @@ struct vrend_blitter_ctx {
 
    GLuint vs;
    GLuint vs_pos_only;
-   GLuint fs_texfetch_col[PIPE_MAX_TEXTURE_TYPES];
-   GLuint fs_texfetch_depth[PIPE_MAX_TEXTURE_TYPES];
-   GLuint fs_texfetch_depth_msaa[PIPE_MAX_TEXTURE_TYPES];
-   GLuint fs_texfetch_col_swizzle;
    GLuint fb_id;
 
+   /* linked blit programs, keyed by struct blit_prog_key */
+   struct util_hash_table *prog_hash;
+   struct vrend_blitter_stats stats;
+
    unsigned dst_width;
    unsigned dst_height;
 
@@ -76,6 +78,24 @@ struct vrend_blitter_ctx {
 
 static struct vrend_blitter_ctx vrend_blit_ctx;
 
+/* everything the generated fragment shader depends on */
+struct blit_prog_key {
+   uint8_t pipe_tex_target;
+   uint8_t nr_samples;
+   uint8_t tgsi_ret;
+   uint8_t write_depth;
+   uint8_t needs_swizzle;
+   uint8_t swizzle[4];
+};
+
+struct blit_prog {
+   struct blit_prog_key key;
+   GLuint id;
+   GLint pos_loc;
+   GLint tc_loc;
+   GLint samp_loc;
+};
+
 struct vrend_blitter_point {
     int x;
     int y;
@@ -368,73 +388,125 @@ static GLuint blit_build_frag_blit_msaa_depth(struct vrend_blitter_ctx *blit_ctx
    return fs_id;
 }
 
-static GLuint blit_get_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx, int pipe_tex_target, unsigned nr_samples)
+static GLuint blit_build_frag(struct vrend_blitter_ctx *blit_ctx,
+                              const struct blit_prog_key *key)
 {
-   assert(pipe_tex_target < PIPE_MAX_TEXTURE_TYPES);
-
-   if (nr_samples > 1) {
-      GLuint *shader = &blit_ctx->fs_texfetch_depth_msaa[pipe_tex_target];
-
-      if (!*shader) {
-         unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, nr_samples);
+   unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(key->pipe_tex_target,
+                                                 key->nr_samples);
+   enum tgsi_return_type tgsi_ret = key->tgsi_ret;
+   const uint8_t *swizzle = key->needs_swizzle ? key->swizzle : NULL;
+
+   if (key->write_depth) {
+      if (key->nr_samples > 1)
+         return blit_build_frag_blit_msaa_depth(blit_ctx, tgsi_tex);
+      return blit_build_frag_tex_writedepth(blit_ctx, tgsi_tex);
+   }
 
-         *shader = blit_build_frag_blit_msaa_depth(blit_ctx, tgsi_tex);
-      }
-      return *shader;
+   if (key->nr_samples > 1) {
+      // Integer textures are resolved using just one sample
+      int msaa_samples = tgsi_ret == TGSI_RETURN_TYPE_UNORM ? key->nr_samples : 1;
+      return blit_build_frag_tex_col_msaa(blit_ctx, tgsi_tex, tgsi_ret,
+                                          swizzle, msaa_samples);
+   }
+   return blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret, swizzle);
+}
 
-   } else {
-      GLuint *shader = &blit_ctx->fs_texfetch_depth[pipe_tex_target];
+static struct blit_prog *blit_link_program(struct vrend_blitter_ctx *blit_ctx,
+                                           const struct blit_prog_key *key)
+{
+   struct blit_prog *prog;
+   GLuint fs_id;
+   GLint lret;
 
-      if (!*shader) {
-         unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, 0);
+   fs_id = blit_build_frag(blit_ctx, key);
+   if (!fs_id)
+      return NULL;
 
-         *shader = blit_build_frag_tex_writedepth(blit_ctx, tgsi_tex);
-      }
-      return *shader;
+   prog = CALLOC_STRUCT(blit_prog);
+   if (!prog) {
+      glDeleteShader(fs_id);
+      return NULL;
+   }
+   prog->key = *key;
+   prog->id = glCreateProgram();
+   glAttachShader(prog->id, blit_ctx->vs);
+   glAttachShader(prog->id, fs_id);
+   glLinkProgram(prog->id);
+   /* the program keeps the shader alive as long as it needs it */
+   glDeleteShader(fs_id);
+
+   glGetProgramiv(prog->id, GL_LINK_STATUS, &lret);
+   if (lret == GL_FALSE) {
+      char infolog[65536];
+      int len;
+      glGetProgramInfoLog(prog->id, 65536, &len, infolog);
+      vrend_printf("got error linking\n%s\n", infolog);
+      glDeleteProgram(prog->id);
+      FREE(prog);
+      return NULL;
    }
+
+   prog->pos_loc = glGetAttribLocation(prog->id, "arg0");
+   prog->tc_loc = glGetAttribLocation(prog->id, "arg1");
+   prog->samp_loc = glGetUniformLocation(prog->id, "samp");
+   return prog;
 }
 
-static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
-                                    int pipe_tex_target,
-                                    unsigned nr_samples,
-                                    const struct vrend_format_table *src_entry,
-                                    const struct vrend_format_table *dst_entry)
+static struct blit_prog *blit_get_program(struct vrend_blitter_ctx *blit_ctx,
+                                          int pipe_tex_target,
+                                          unsigned nr_samples,
+                                          bool write_depth,
+                                          const struct vrend_format_table *src_entry,
+                                          const struct vrend_format_table *dst_entry)
 {
-   assert(pipe_tex_target < PIPE_MAX_TEXTURE_TYPES);
+   struct blit_prog_key key;
+   struct blit_prog *prog;
 
-   bool needs_swizzle = dst_entry->flags & VIRGL_BIND_NEED_SWIZZLE;
+   assert(pipe_tex_target < PIPE_MAX_TEXTURE_TYPES);
 
-   if (needs_swizzle || nr_samples > 1) {
-      const uint8_t *swizzle = needs_swizzle ? dst_entry->swizzle : NULL;
-      GLuint *shader = &blit_ctx->fs_texfetch_col_swizzle;
-      if (shader) {
-         glDeleteShader(*shader);
+   memset(&key, 0, sizeof(key));
+   key.pipe_tex_target = pipe_tex_target;
+   key.nr_samples = nr_samples > 1 ? nr_samples : 0;
+   key.write_depth = write_depth;
+   if (!write_depth) {
+      key.tgsi_ret = tgsi_ret_for_format(src_entry->format);
+      if (dst_entry->flags & VIRGL_BIND_NEED_SWIZZLE) {
+         key.needs_swizzle = true;
+         memcpy(key.swizzle, dst_entry->swizzle, sizeof(key.swizzle));
       }
+   }
 
-      unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, nr_samples);
-      enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
+   prog = util_hash_table_get(blit_ctx->prog_hash, &key);
+   if (prog) {
+      blit_ctx->stats.hits++;
+      return prog;
+   }
 
-      if (nr_samples > 1) {
-         // Integer textures are resolved using just one sample
-         int msaa_samples = tgsi_ret == TGSI_RETURN_TYPE_UNORM ? nr_samples : 1;
-         *shader = blit_build_frag_tex_col_msaa(blit_ctx, tgsi_tex, tgsi_ret,
-                                                swizzle, msaa_samples);
-      } else {
-         *shader = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret, swizzle);
-      }
+   prog = blit_link_program(blit_ctx, &key);
+   if (!prog)
+      return NULL;
+   blit_ctx->stats.compiles++;
+   util_hash_table_set(blit_ctx->prog_hash, &prog->key, prog);
+   return prog;
+}
 
-      return *shader;
-   } else {
-      GLuint *shader = &blit_ctx->fs_texfetch_col[pipe_tex_target];
+static unsigned blit_prog_key_hash(void *key)
+{
+   return vrend_hash_fold(vrend_hash_data(VREND_HASH_INIT, key,
+                                          sizeof(struct blit_prog_key)));
+}
+
+static int blit_prog_key_compare(void *key1, void *key2)
+{
+   return memcmp(key1, key2, sizeof(struct blit_prog_key));
+}
 
-      if (!*shader) {
-         unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, 0);
-         enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
+static void blit_prog_free(void *value)
+{
+   struct blit_prog *prog = value;
 
-         *shader = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret, NULL);
-      }
-      return *shader;
-   }
+   glDeleteProgram(prog->id);
+   FREE(prog);
 }
 
 static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
@@ -442,7 +514,7 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
    struct virgl_gl_ctx_param ctx_params;
    int i;
    if (blit_ctx->initialised) {
-      vrend_clicbs->make_current(blit_ctx->gl_context);
+      vrend_make_current(blit_ctx->gl_context);
       return;
    }
 
@@ -458,12 +530,15 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
          break;
    }
 
-   vrend_clicbs->make_current(blit_ctx->gl_context);
+   vrend_make_current(blit_ctx->gl_context);
    glGenVertexArrays(1, &blit_ctx->vaoid);
    glGenFramebuffers(1, &blit_ctx->fb_id);
 
    glGenBuffers(1, &blit_ctx->vbo_id);
    blit_build_vs_passthrough(blit_ctx);
+   blit_ctx->prog_hash = util_hash_table_create(blit_prog_key_hash,
+                                                blit_prog_key_compare,
+                                                blit_prog_free);
 
    for (i = 0; i < 4; i++)
       blit_ctx->vertices[i][0][3] = 1; /*v.w*/
@@ -703,13 +778,9 @@ void vrend_renderer_blit_gl(struct vrend_resource *src_res,
                             bool has_srgb_write_control)
 {
    struct vrend_blitter_ctx *blit_ctx = &vrend_blit_ctx;
+   struct blit_prog *prog;
    GLuint buffers;
-   GLuint prog_id;
-   GLuint fs_id;
-   GLint lret;
    GLenum filter;
-   GLuint pos_loc, tc_loc;
-   GLuint samp_loc;
    bool has_depth, has_stencil;
    bool blit_stencil, blit_depth;
    int dst_z;
@@ -755,32 +826,14 @@ void vrend_renderer_blit_gl(struct vrend_resource *src_res,
 
    blitter_set_rectangle(blit_ctx, dst0.x, dst0.y, dst1.x, dst1.y, 0);
 
-   prog_id = glCreateProgram();
-   glAttachShader(prog_id, blit_ctx->vs);
-
-   if (blit_depth || blit_stencil) {
-      fs_id = blit_get_frag_tex_writedepth(blit_ctx, src_res->base.target,
-                                           src_res->base.nr_samples);
-   } else {
-      fs_id = blit_get_frag_tex_col(blit_ctx, src_res->base.target,
-                                    src_res->base.nr_samples,
-                                    src_entry, dst_entry);
-   }
-   glAttachShader(prog_id, fs_id);
-
-   glLinkProgram(prog_id);
-   glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
-   if (lret == GL_FALSE) {
-      char infolog[65536];
-      int len;
-      glGetProgramInfoLog(prog_id, 65536, &len, infolog);
-      vrend_printf("got error linking\n%s\n", infolog);
-      /* dump shaders */
-      glDeleteProgram(prog_id);
+   prog = blit_get_program(blit_ctx, src_res->base.target,
+                           src_res->base.nr_samples,
+                           blit_depth || blit_stencil,
+                           src_entry, dst_entry);
+   if (!prog)
       return;
-   }
 
-   glUseProgram(prog_id);
+   glUseProgram(prog->id);
 
    glBindFramebuffer(GL_FRAMEBUFFER, blit_ctx->fb_id);
    vrend_fb_bind_texture(dst_res, 0, info->dst.level, info->dst.box.z);
@@ -818,17 +871,13 @@ void vrend_renderer_blit_gl(struct vrend_resource *src_res,
       glTexParameterf(src_res->target, GL_TEXTURE_MAG_FILTER, filter);
       glTexParameterf(src_res->target, GL_TEXTURE_MIN_FILTER, filter);
    }
-   pos_loc = glGetAttribLocation(prog_id, "arg0");
-   tc_loc = glGetAttribLocation(prog_id, "arg1");
-   samp_loc = glGetUniformLocation(prog_id, "samp");
-
-   glUniform1i(samp_loc, 0);
+   glUniform1i(prog->samp_loc, 0);
 
-   glVertexAttribPointer(pos_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)0);
-   glVertexAttribPointer(tc_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)(4 * sizeof(float)));
+   glVertexAttribPointer(prog->pos_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)0);
+   glVertexAttribPointer(prog->tc_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)(4 * sizeof(float)));
 
-   glEnableVertexAttribArray(pos_loc);
-   glEnableVertexAttribArray(tc_loc);
+   glEnableVertexAttribArray(prog->pos_loc);
+   glEnableVertexAttribArray(prog->tc_loc);
 
    set_dsa_write_depth_keep_stencil();
 
@@ -860,15 +909,23 @@ void vrend_renderer_blit_gl(struct vrend_resource *src_res,
    }
 
    glUseProgram(0);
-   glDeleteProgram(prog_id);
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
                              GL_TEXTURE_2D, 0, 0);
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                              GL_TEXTURE_2D, 0, 0);
 }
 
+void vrend_blitter_get_stats(struct vrend_blitter_stats *stats)
+{
+   *stats = vrend_blit_ctx.stats;
+}
+
 void vrend_blitter_fini(void)
 {
+   /* the programs live in the share group, so any current context can
+    * delete them */
+   if (vrend_blit_ctx.prog_hash)
+      util_hash_table_destroy(vrend_blit_ctx.prog_hash);
    vrend_blit_ctx.initialised = false;
    vrend_clicbs->destroy_gl_context(vrend_blit_ctx.gl_context);
    memset(&vrend_blit_ctx, 0, sizeof(vrend_blit_ctx));
@@ -0,0 +1,482 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/u_box.h"
+#include "util/u_format.h"
+#include "util/u_hash_table.h"
+#include "util/u_math.h"
+#include "util/u_memory.h"
+#include "util/u_pointer.h"
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "virglrenderer.h"
+#include "vrend_capture.h"
+#include "vrend_debug.h"
+
+/* what we need to know about a resource to find the bytes a transfer reads */
+struct capture_resource {
+   uint32_t target;
+   uint32_t format;
+   const struct iovec *iov;
+   int num_iovs;
+   size_t backing_size;
+};
+
+/* context local handle set up with virgl_renderer_ctx_attach_resource_as,
+ * the struct is its own key */
+struct capture_alias {
+   uint32_t ctx_id;
+   uint32_t ctx_handle;
+   uint32_t handle;
+};
+
+static struct {
+   FILE *fp;
+   uint64_t start_ns;
+   struct util_hash_table *resources;
+   struct util_hash_table *aliases;
+} capture;
+
+static uint64_t capture_time(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned hash_handle(void *key)
+{
+   return (unsigned)pointer_to_intptr(key);
+}
+
+static int compare_handle(void *key1, void *key2)
+{
+   return key1 != key2;
+}
+
+static void free_resource(void *value)
+{
+   FREE(value);
+}
+
+static unsigned hash_alias(void *key)
+{
+   const struct capture_alias *alias = key;
+
+   return alias->ctx_id * 31 + alias->ctx_handle;
+}
+
+static int compare_alias(void *key1, void *key2)
+{
+   const struct capture_alias *a = key1, *b = key2;
+
+   return a->ctx_id != b->ctx_id || a->ctx_handle != b->ctx_handle;
+}
+
+/* handle of the resource a context refers to as ctx_handle */
+static uint32_t capture_res_handle(uint32_t ctx_id, uint32_t ctx_handle)
+{
+   struct capture_alias key = { ctx_id, ctx_handle, 0 };
+   struct capture_alias *alias;
+
+   if (!ctx_id)
+      return ctx_handle;
+
+   alias = util_hash_table_get(capture.aliases, &key);
+   return alias ? alias->handle : ctx_handle;
+}
+
+static void write_record_header(uint32_t type, uint32_t size)
+{
+   struct vrend_capture_record rec;
+
+   rec.type = type;
+   rec.size = size;
+   rec.time_ns = capture_time() - capture.start_ns;
+   fwrite(&rec, sizeof(rec), 1, capture.fp);
+}
+
+static void write_padding(uint32_t size)
+{
+   static const char zeros[8];
+
+   if (size % 8)
+      fwrite(zeros, 8 - size % 8, 1, capture.fp);
+}
+
+static void write_record(uint32_t type, const void *data, uint32_t size)
+{
+   write_record_header(type, size);
+   fwrite(data, size, 1, capture.fp);
+   write_padding(size);
+}
+
+static void write_iov_cb(void *cookie, UNUSED unsigned int doff, void *src, int len)
+{
+   fwrite(src, len, 1, cookie);
+}
+
+static void write_backing_data(uint32_t handle, const struct capture_resource *res,
+                               uint64_t offset, uint32_t size)
+{
+   uint32_t hdr[3] = { handle, (uint32_t)offset, (uint32_t)(offset >> 32) };
+
+   write_record_header(VREND_CAPTURE_BACKING_DATA, sizeof(hdr) + size);
+   fwrite(hdr, sizeof(hdr), 1, capture.fp);
+   vrend_read_from_iovec_cb(res->iov, res->num_iovs, offset, size,
+                            write_iov_cb, capture.fp);
+   write_padding(sizeof(hdr) + size);
+}
+
+/* number of bytes starting at offset a transfer of box touches */
+static uint64_t transfer_size(const struct capture_resource *res,
+                              uint32_t stride, uint32_t layer_stride,
+                              const struct pipe_box *box)
+{
+   enum pipe_format format = res->format;
+   uint32_t nblocksy, row_size;
+
+   if (res->target == PIPE_BUFFER)
+      return box->width;
+
+   nblocksy = util_format_get_nblocksy(format, MAX2(box->height, 1));
+   row_size = util_format_get_stride(format, box->width);
+   if (!stride)
+      stride = row_size;
+   if (!layer_stride)
+      layer_stride = stride * nblocksy;
+
+   return (uint64_t)layer_stride * (MAX2(box->depth, 1) - 1) +
+          (uint64_t)stride * (nblocksy - 1) + row_size;
+}
+
+static uint32_t clamp_transfer(uint64_t offset, uint64_t size, size_t available)
+{
+   if (offset >= available)
+      return 0;
+   return MIN2(size, available - offset);
+}
+
+bool vrend_capture_init(const char *path)
+{
+   struct vrend_capture_header header = {
+      VREND_CAPTURE_MAGIC, VREND_CAPTURE_VERSION
+   };
+
+   if (capture.fp)
+      return true;
+
+   capture.fp = fopen(path, "wb");
+   if (!capture.fp) {
+      vrend_printf("failed to open capture file %s\n", path);
+      return false;
+   }
+
+   capture.resources = util_hash_table_create(hash_handle, compare_handle,
+                                              free_resource);
+   capture.aliases = util_hash_table_create(hash_alias, compare_alias,
+                                            free_resource);
+   if (!capture.resources || !capture.aliases) {
+      if (capture.resources)
+         util_hash_table_destroy(capture.resources);
+      if (capture.aliases)
+         util_hash_table_destroy(capture.aliases);
+      fclose(capture.fp);
+      capture.fp = NULL;
+      return false;
+   }
+
+   capture.start_ns = capture_time();
+   fwrite(&header, sizeof(header), 1, capture.fp);
+   return true;
+}
+
+void vrend_capture_fini(void)
+{
+   if (!capture.fp)
+      return;
+
+   util_hash_table_destroy(capture.resources);
+   capture.resources = NULL;
+   util_hash_table_destroy(capture.aliases);
+   capture.aliases = NULL;
+   fclose(capture.fp);
+   capture.fp = NULL;
+}
+
+void vrend_capture_context_create(uint32_t ctx_id, uint32_t nlen, const char *name)
+{
+   if (!capture.fp)
+      return;
+
+   write_record_header(VREND_CAPTURE_CONTEXT_CREATE, sizeof(ctx_id) + nlen);
+   fwrite(&ctx_id, sizeof(ctx_id), 1, capture.fp);
+   fwrite(name, nlen, 1, capture.fp);
+   write_padding(sizeof(ctx_id) + nlen);
+}
+
+void vrend_capture_context_destroy(uint32_t ctx_id)
+{
+   if (!capture.fp)
+      return;
+
+   write_record(VREND_CAPTURE_CONTEXT_DESTROY, &ctx_id, sizeof(ctx_id));
+}
+
+void vrend_capture_resource_create(const struct virgl_renderer_resource_create_args *args,
+                                   const struct iovec *iov, uint32_t num_iovs)
+{
+   struct vrend_capture_resource rec;
+   struct capture_resource *res;
+
+   if (!capture.fp)
+      return;
+
+   res = CALLOC_STRUCT(capture_resource);
+   if (!res)
+      return;
+   res->target = args->target;
+   res->format = args->format;
+   util_hash_table_set(capture.resources, intptr_to_pointer(args->handle), res);
+
+   rec.handle = args->handle;
+   rec.target = args->target;
+   rec.format = args->format;
+   rec.bind = args->bind;
+   rec.width = args->width;
+   rec.height = args->height;
+   rec.depth = args->depth;
+   rec.array_size = args->array_size;
+   rec.last_level = args->last_level;
+   rec.nr_samples = args->nr_samples;
+   rec.flags = args->flags;
+   write_record(VREND_CAPTURE_RESOURCE_CREATE, &rec, sizeof(rec));
+
+   if (num_iovs)
+      vrend_capture_attach_backing(args->handle, iov, num_iovs);
+}
+
+void vrend_capture_resource_unref(uint32_t handle)
+{
+   if (!capture.fp)
+      return;
+
+   util_hash_table_remove(capture.resources, intptr_to_pointer(handle));
+   write_record(VREND_CAPTURE_RESOURCE_UNREF, &handle, sizeof(handle));
+}
+
+void vrend_capture_attach_backing(uint32_t handle, const struct iovec *iov, int num_iovs)
+{
+   struct capture_resource *res;
+   uint64_t rec[2];
+
+   if (!capture.fp)
+      return;
+
+   res = util_hash_table_get(capture.resources, intptr_to_pointer(handle));
+   if (!res)
+      return;
+
+   res->iov = iov;
+   res->num_iovs = num_iovs;
+   res->backing_size = vrend_get_iovec_size(iov, num_iovs);
+
+   rec[0] = handle;
+   rec[1] = res->backing_size;
+   write_record(VREND_CAPTURE_ATTACH_BACKING, rec, sizeof(rec));
+}
+
+void vrend_capture_detach_backing(uint32_t handle)
+{
+   struct capture_resource *res;
+
+   if (!capture.fp)
+      return;
+
+   res = util_hash_table_get(capture.resources, intptr_to_pointer(handle));
+   if (!res || !res->iov)
+      return;
+
+   res->iov = NULL;
+   res->num_iovs = 0;
+   res->backing_size = 0;
+   write_record(VREND_CAPTURE_DETACH_BACKING, &handle, sizeof(handle));
+}
+
+void vrend_capture_ctx_resource(uint32_t ctx_id, uint32_t handle, bool attach)
+{
+   uint32_t rec[2] = { ctx_id, handle };
+   struct capture_alias key = { ctx_id, handle, 0 };
+
+   if (!capture.fp)
+      return;
+
+   if (!attach)
+      util_hash_table_remove(capture.aliases, &key);
+
+   write_record(attach ? VREND_CAPTURE_CTX_ATTACH_RESOURCE :
+                         VREND_CAPTURE_CTX_DETACH_RESOURCE, rec, sizeof(rec));
+}
+
+void vrend_capture_ctx_resource_as(uint32_t ctx_id, uint32_t handle, uint32_t ctx_handle)
+{
+   uint32_t rec[3] = { ctx_id, handle, ctx_handle };
+   struct capture_alias *alias;
+
+   if (!capture.fp)
+      return;
+
+   alias = CALLOC_STRUCT(capture_alias);
+   if (alias) {
+      alias->ctx_id = ctx_id;
+      alias->ctx_handle = ctx_handle;
+      alias->handle = handle;
+      util_hash_table_remove(capture.aliases, alias);
+      util_hash_table_set(capture.aliases, alias, alias);
+   }
+
+   write_record(VREND_CAPTURE_CTX_ATTACH_RESOURCE_AS, rec, sizeof(rec));
+}
+
+/* TRANSFER3D commands read guest memory we otherwise never see */
+static void capture_cmd_transfers(const uint32_t *buffer, uint32_t ctx_id, int ndw)
+{
+   int i = 0;
+
+   while (i < ndw) {
+      uint32_t header = buffer[i];
+      uint32_t len = header >> 16;
+
+      if (i + len + 1 > (uint32_t)ndw)
+         break;
+
+      if ((header & 0xff) == VIRGL_CCMD_TRANSFER3D && len >= VIRGL_TRANSFER3D_SIZE &&
+          buffer[i + VIRGL_TRANSFER3D_DIRECTION] == VIRGL_TRANSFER_TO_HOST) {
+         const uint32_t *cmd = &buffer[i];
+         uint32_t handle = capture_res_handle(ctx_id, cmd[VIRGL_RESOURCE_IW_RES_HANDLE]);
+         struct capture_resource *res;
+         struct pipe_box box;
+         uint64_t offset = cmd[VIRGL_TRANSFER3D_DATA_OFFSET];
+         uint32_t size;
+
+         res = util_hash_table_get(capture.resources, intptr_to_pointer(handle));
+         if (res && res->iov) {
+            u_box_3d(cmd[VIRGL_RESOURCE_IW_X], cmd[VIRGL_RESOURCE_IW_Y],
+                     cmd[VIRGL_RESOURCE_IW_Z], cmd[VIRGL_RESOURCE_IW_W],
+                     cmd[VIRGL_RESOURCE_IW_H], cmd[VIRGL_RESOURCE_IW_D], &box);
+            size = clamp_transfer(offset,
+                                  transfer_size(res, cmd[VIRGL_RESOURCE_IW_STRIDE],
+                                                cmd[VIRGL_RESOURCE_IW_LAYER_STRIDE], &box),
+                                  res->backing_size);
+            if (size)
+               write_backing_data(handle, res, offset, size);
+         }
+      }
+      i += len + 1;
+   }
+}
+
+void vrend_capture_submit_cmd(const uint32_t *buffer, uint32_t ctx_id, int ndw)
+{
+   if (!capture.fp || ndw < 0)
+      return;
+
+   capture_cmd_transfers(buffer, ctx_id, ndw);
+
+   write_record_header(VREND_CAPTURE_SUBMIT_CMD, sizeof(ctx_id) + ndw * 4);
+   fwrite(&ctx_id, sizeof(ctx_id), 1, capture.fp);
+   fwrite(buffer, 4, ndw, capture.fp);
+   write_padding(sizeof(ctx_id) + ndw * 4);
+}
+
+void vrend_capture_transfer(uint32_t handle, uint32_t ctx_id, uint32_t level,
+                            uint32_t stride, uint32_t layer_stride,
+                            const struct virgl_box *box, uint64_t offset,
+                            const struct iovec *iov, unsigned int iov_cnt,
+                            int direction)
+{
+   struct vrend_capture_transfer rec;
+   struct capture_resource *res;
+   uint32_t res_handle;
+   size_t available;
+
+   if (!capture.fp)
+      return;
+
+   res_handle = capture_res_handle(ctx_id, handle);
+   res = util_hash_table_get(capture.resources, intptr_to_pointer(res_handle));
+   if (!res)
+      return;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.handle = handle;
+   rec.ctx_id = ctx_id;
+   rec.level = level;
+   rec.direction = direction;
+   rec.stride = stride;
+   rec.layer_stride = layer_stride;
+   rec.box[0] = box->x;
+   rec.box[1] = box->y;
+   rec.box[2] = box->z;
+   rec.box[3] = box->w;
+   rec.box[4] = box->h;
+   rec.box[5] = box->d;
+   rec.offset = offset;
+   rec.user_iov = iov && iov_cnt;
+
+   available = rec.user_iov ? vrend_get_iovec_size(iov, iov_cnt) : res->backing_size;
+   rec.data_size = clamp_transfer(offset,
+                                  transfer_size(res, stride, layer_stride,
+                                                (const struct pipe_box *)box),
+                                  available);
+
+   if (direction == VIRGL_TRANSFER_TO_HOST && !rec.user_iov && rec.data_size)
+      write_backing_data(res_handle, res, offset, rec.data_size);
+
+   if (direction == VIRGL_TRANSFER_TO_HOST && rec.user_iov) {
+      write_record_header(VREND_CAPTURE_TRANSFER, sizeof(rec) + rec.data_size);
+      fwrite(&rec, sizeof(rec), 1, capture.fp);
+      vrend_read_from_iovec_cb(iov, iov_cnt, offset, rec.data_size,
+                               write_iov_cb, capture.fp);
+      write_padding(sizeof(rec) + rec.data_size);
+   } else {
+      write_record(VREND_CAPTURE_TRANSFER, &rec, sizeof(rec));
+   }
+}
+
+void vrend_capture_create_fence(uint32_t fence_id, uint32_t ctx_id)
+{
+   uint32_t rec[2] = { fence_id, ctx_id };
+
+   if (!capture.fp)
+      return;
+
+   write_record(VREND_CAPTURE_CREATE_FENCE, rec, sizeof(rec));
+}
@@ -0,0 +1,126 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef VREND_CAPTURE_H
+#define VREND_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vrend_iov.h"
+
+/* Trace of everything the guest sent through the virglrenderer API.
+ *
+ * The file starts with a vrend_capture_header, followed by records.  Every
+ * record is a vrend_capture_record and its payload, padded to 8 bytes.
+ * Backing storage contents are not captured when attached, only the ranges
+ * host transfers read from, as VREND_CAPTURE_BACKING_DATA records written
+ * right before the transfer or command buffer that uses them.
+ */
+
+#define VREND_CAPTURE_MAGIC 0x52545256 /* "VRTR" */
+#define VREND_CAPTURE_VERSION 1
+
+enum vrend_capture_type {
+   VREND_CAPTURE_CONTEXT_CREATE = 1,  /* ctx_id, name */
+   VREND_CAPTURE_CONTEXT_DESTROY,     /* ctx_id */
+   VREND_CAPTURE_RESOURCE_CREATE,     /* struct vrend_capture_resource */
+   VREND_CAPTURE_RESOURCE_UNREF,      /* handle */
+   VREND_CAPTURE_ATTACH_BACKING,      /* handle, size in bytes (uint64 each) */
+   VREND_CAPTURE_DETACH_BACKING,      /* handle */
+   VREND_CAPTURE_CTX_ATTACH_RESOURCE, /* ctx_id, handle */
+   VREND_CAPTURE_CTX_DETACH_RESOURCE, /* ctx_id, handle */
+   VREND_CAPTURE_BACKING_DATA,        /* handle, offset (2 dwords), data */
+   VREND_CAPTURE_SUBMIT_CMD,          /* ctx_id, command dwords */
+   VREND_CAPTURE_TRANSFER,            /* struct vrend_capture_transfer, data */
+   VREND_CAPTURE_CREATE_FENCE,        /* fence_id, ctx_id */
+   VREND_CAPTURE_CTX_ATTACH_RESOURCE_AS, /* ctx_id, handle, context local handle */
+};
+
+struct vrend_capture_header {
+   uint32_t magic;
+   uint32_t version;
+};
+
+struct vrend_capture_record {
+   uint32_t type;
+   uint32_t size;
+   /* since the start of the capture */
+   uint64_t time_ns;
+};
+
+struct vrend_capture_resource {
+   uint32_t handle;
+   uint32_t target;
+   uint32_t format;
+   uint32_t bind;
+   uint32_t width;
+   uint32_t height;
+   uint32_t depth;
+   uint32_t array_size;
+   uint32_t last_level;
+   uint32_t nr_samples;
+   uint32_t flags;
+};
+
+/* transfers with a caller supplied iovec carry their data range inline,
+ * starting at offset; otherwise the resource backing is used */
+struct vrend_capture_transfer {
+   uint32_t handle;
+   uint32_t ctx_id;
+   uint32_t level;
+   uint32_t direction;
+   uint32_t stride;
+   uint32_t layer_stride;
+   uint32_t box[6];
+   uint64_t offset;
+   uint32_t data_size;
+   uint32_t user_iov;
+};
+
+struct virgl_renderer_resource_create_args;
+struct virgl_box;
+
+/* the capture functions do nothing unless vrend_capture_init succeeded */
+bool vrend_capture_init(const char *path);
+void vrend_capture_fini(void);
+
+void vrend_capture_context_create(uint32_t ctx_id, uint32_t nlen, const char *name);
+void vrend_capture_context_destroy(uint32_t ctx_id);
+void vrend_capture_resource_create(const struct virgl_renderer_resource_create_args *args,
+                                   const struct iovec *iov, uint32_t num_iovs);
+void vrend_capture_resource_unref(uint32_t handle);
+void vrend_capture_attach_backing(uint32_t handle, const struct iovec *iov, int num_iovs);
+void vrend_capture_detach_backing(uint32_t handle);
+void vrend_capture_ctx_resource(uint32_t ctx_id, uint32_t handle, bool attach);
+void vrend_capture_ctx_resource_as(uint32_t ctx_id, uint32_t handle, uint32_t ctx_handle);
+void vrend_capture_submit_cmd(const uint32_t *buffer, uint32_t ctx_id, int ndw);
+void vrend_capture_transfer(uint32_t handle, uint32_t ctx_id, uint32_t level,
+                            uint32_t stride, uint32_t layer_stride,
+                            const struct virgl_box *box, uint64_t offset,
+                            const struct iovec *iov, unsigned int iov_cnt,
+                            int direction);
+void vrend_capture_create_fence(uint32_t fence_id, uint32_t ctx_id);
+
+#endif
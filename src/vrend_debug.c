@@ -117,6 +117,7 @@ static const struct debug_named_value vrend_debug_options[] = {
    {"feat", dbg_features, "Log features found"},
    {"tex", dbg_tex, "Log texture operations"},
    {"caller", dbg_caller, "Log who is creating the context"},
+   {"stats", dbg_stats, "Print cache statistics on shutdown"},
    {"all", dbg_all, "Enable all debugging output"},
    {"guestallow", dbg_allow_guest_override, "Allow the guest to override the debug flags"},
    DEBUG_NAMED_VALUE_END
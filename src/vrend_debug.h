@@ -43,7 +43,8 @@ enum virgl_debug_flags {
    dbg_features = 1 << 7,
    dbg_tex = 1 << 8,
    dbg_caller = 1 << 9,
-   dbg_all = (1 << 10) - 1,
+   dbg_stats = 1 << 10,
+   dbg_all = (1 << 11) - 1,
    dbg_allow_guest_override = 1 << 16,
    dbg_feature_use = 1 << 17,
 };
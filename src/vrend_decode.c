@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <epoxy/gl.h>
 
 #include "util/u_memory.h"
@@ -47,6 +48,7 @@ struct vrend_decoder_state {
 struct vrend_decode_ctx {
    struct vrend_decoder_state ids, *ds;
    struct vrend_context *grctx;
+   uint32_t ctx_id;
 };
 #define VREND_MAX_CTX 64
 static struct vrend_decode_ctx *dec_ctx[VREND_MAX_CTX];
@@ -146,9 +148,6 @@ static int vrend_decode_create_stream_output_target(struct vrend_decode_ctx *ctx
 
 static int vrend_decode_set_framebuffer_state(struct vrend_decode_ctx *ctx, int length)
 {
-   if (length < 2)
-      return EINVAL;
-
    int32_t nr_cbufs = get_buf_entry(ctx, VIRGL_SET_FRAMEBUFFER_STATE_NR_CBUFS);
    uint32_t zsurf_handle = get_buf_entry(ctx, VIRGL_SET_FRAMEBUFFER_STATE_NR_ZSURF_HANDLE);
    uint32_t surf_handle[8];
@@ -166,15 +165,12 @@ static int vrend_decode_set_framebuffer_state(struct vrend_decode_ctx *ctx, int
    return 0;
 }
 
-static int vrend_decode_set_framebuffer_state_no_attach(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_framebuffer_state_no_attach(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    uint32_t width, height;
    uint32_t layers, samples;
    uint32_t tmp;
 
-   if (length != VIRGL_SET_FRAMEBUFFER_STATE_NO_ATTACH_SIZE)
-      return EINVAL;
-
    tmp = get_buf_entry(ctx, VIRGL_SET_FRAMEBUFFER_STATE_NO_ATTACH_WIDTH_HEIGHT);
    width = VIRGL_SET_FRAMEBUFFER_STATE_NO_ATTACH_WIDTH(tmp);
    height = VIRGL_SET_FRAMEBUFFER_STATE_NO_ATTACH_HEIGHT(tmp);
@@ -187,15 +183,13 @@ static int vrend_decode_set_framebuffer_state_no_attach(struct vrend_decode_ctx
    return 0;
 }
 
-static int vrend_decode_clear(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_clear(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    union pipe_color_union color;
    double depth;
    unsigned stencil, buffers;
    int i;
 
-   if (length != VIRGL_OBJ_CLEAR_SIZE)
-      return EINVAL;
    buffers = get_buf_entry(ctx, VIRGL_OBJ_CLEAR_BUFFERS);
    for (i = 0; i < 4; i++)
       color.ui[i] = get_buf_entry(ctx, VIRGL_OBJ_CLEAR_COLOR_0 + i);
@@ -219,8 +213,6 @@ static int vrend_decode_set_viewport_state(struct vrend_decode_ctx *ctx, int len
    struct pipe_viewport_state vps[PIPE_MAX_VIEWPORTS];
    uint i, v;
    uint32_t num_viewports, start_slot;
-   if (length < 1)
-      return EINVAL;
 
    if ((length - 1) % 6)
       return EINVAL;
@@ -254,15 +246,12 @@ static int vrend_decode_set_index_buffer(struct vrend_decode_ctx *ctx, int lengt
    return 0;
 }
 
-static int vrend_decode_set_constant_buffer(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_set_constant_buffer(struct vrend_decode_ctx *ctx, int length)
 {
    uint32_t shader;
    uint32_t index;
    int nc = (length - 2);
 
-   if (length < 2)
-      return EINVAL;
-
    shader = get_buf_entry(ctx, VIRGL_SET_CONSTANT_BUFFER_SHADER_TYPE);
    index = get_buf_entry(ctx, VIRGL_SET_CONSTANT_BUFFER_INDEX);
 
@@ -273,11 +262,8 @@ static int vrend_decode_set_constant_buffer(struct vrend_decode_ctx *ctx, uint16
    return 0;
 }
 
-static int vrend_decode_set_uniform_buffer(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_uniform_buffer(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != VIRGL_SET_UNIFORM_BUFFER_SIZE)
-      return EINVAL;
-
    uint32_t shader = get_buf_entry(ctx, VIRGL_SET_UNIFORM_BUFFER_SHADER_TYPE);
    uint32_t index = get_buf_entry(ctx, VIRGL_SET_UNIFORM_BUFFER_INDEX);
    uint32_t offset = get_buf_entry(ctx, VIRGL_SET_UNIFORM_BUFFER_OFFSET);
@@ -294,7 +280,7 @@ static int vrend_decode_set_uniform_buffer(struct vrend_decode_ctx *ctx, int len
    return 0;
 }
 
-static int vrend_decode_set_vertex_buffers(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_set_vertex_buffers(struct vrend_decode_ctx *ctx, int length)
 {
    int num_vbo;
    int i;
@@ -317,15 +303,13 @@ static int vrend_decode_set_vertex_buffers(struct vrend_decode_ctx *ctx, uint16_
    return 0;
 }
 
-static int vrend_decode_set_sampler_views(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_set_sampler_views(struct vrend_decode_ctx *ctx, int length)
 {
    uint32_t num_samps;
    uint32_t i;
    uint32_t shader_type;
    uint32_t start_slot;
 
-   if (length < 2)
-      return EINVAL;
    num_samps = length - 2;
    shader_type = get_buf_entry(ctx, VIRGL_SET_SAMPLER_VIEWS_SHADER_TYPE);
    start_slot = get_buf_entry(ctx, VIRGL_SET_SAMPLER_VIEWS_START_SLOT);
@@ -360,7 +344,7 @@ static void vrend_decode_transfer_common(struct vrend_decode_ctx *ctx, struct vr
    info->box->depth = get_buf_entry(ctx, VIRGL_RESOURCE_IW_D);
 }
 
-static int vrend_decode_resource_inline_write(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_resource_inline_write(struct vrend_decode_ctx *ctx, int length)
 {
    struct pipe_box box;
    struct vrend_transfer_info info;
@@ -368,9 +352,6 @@ static int vrend_decode_resource_inline_write(struct vrend_decode_ctx *ctx, uint
    struct iovec dataiovec;
    void *data;
 
-   if (length < 12)
-      return EINVAL;
-
    if (length + ctx->ds->buf_offset > ctx->ds->buf_total)
       return EINVAL;
 
@@ -710,9 +691,6 @@ static int vrend_decode_create_query(struct vrend_decode_ctx *ctx, uint32_t hand
 
 static int vrend_decode_create_object(struct vrend_decode_ctx *ctx, int length)
 {
-   if (length < 1)
-      return EINVAL;
-
    uint32_t header = get_buf_entry(ctx, VIRGL_OBJ_CREATE_HEADER);
    uint32_t handle = get_buf_entry(ctx, VIRGL_OBJ_CREATE_HANDLE);
    uint8_t obj_type = (header >> 8) & 0xff;
@@ -762,11 +740,8 @@ static int vrend_decode_create_object(struct vrend_decode_ctx *ctx, int length)
    return ret;
 }
 
-static int vrend_decode_bind_object(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_bind_object(struct vrend_decode_ctx *ctx, int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t header = get_buf_entry(ctx, VIRGL_OBJ_BIND_HEADER);
    uint32_t handle = get_buf_entry(ctx, VIRGL_OBJ_BIND_HANDLE);
    uint8_t obj_type = (header >> 8) & 0xff;
@@ -795,11 +770,8 @@ static int vrend_decode_bind_object(struct vrend_decode_ctx *ctx, uint16_t lengt
    return 0;
 }
 
-static int vrend_decode_destroy_object(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_destroy_object(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t handle = get_buf_entry(ctx, VIRGL_OBJ_DESTROY_HANDLE);
 
    VREND_DEBUG_EXT(dbg_object, ctx->grctx,
@@ -811,11 +783,8 @@ static int vrend_decode_destroy_object(struct vrend_decode_ctx *ctx, int length)
    return 0;
 }
 
-static int vrend_decode_set_stencil_ref(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_stencil_ref(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != VIRGL_SET_STENCIL_REF_SIZE)
-      return EINVAL;
-
    struct pipe_stencil_ref ref;
    uint32_t val = get_buf_entry(ctx, VIRGL_SET_STENCIL_REF);
 
@@ -825,14 +794,11 @@ static int vrend_decode_set_stencil_ref(struct vrend_decode_ctx *ctx, int length
    return 0;
 }
 
-static int vrend_decode_set_blend_color(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_blend_color(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    struct pipe_blend_color color;
    int i;
 
-   if (length != VIRGL_SET_BLEND_COLOR_SIZE)
-      return EINVAL;
-
    for (i = 0; i < 4; i++)
       color.color[i] = uif(get_buf_entry(ctx, VIRGL_SET_BLEND_COLOR(i)));
 
@@ -847,8 +813,6 @@ static int vrend_decode_set_scissor_state(struct vrend_decode_ctx *ctx, int leng
    int32_t num_scissor;
    uint32_t start_slot;
    int s;
-   if (length < 1)
-      return EINVAL;
 
    if ((length - 1) % 2)
       return EINVAL;
@@ -873,14 +837,11 @@ static int vrend_decode_set_scissor_state(struct vrend_decode_ctx *ctx, int leng
    return 0;
 }
 
-static int vrend_decode_set_polygon_stipple(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_polygon_stipple(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    struct pipe_poly_stipple ps;
    int i;
 
-   if (length != VIRGL_POLYGON_STIPPLE_SIZE)
-      return EINVAL;
-
    for (i = 0; i < 32; i++)
       ps.stipple[i] = get_buf_entry(ctx, VIRGL_POLYGON_STIPPLE_P0 + i);
 
@@ -888,14 +849,11 @@ static int vrend_decode_set_polygon_stipple(struct vrend_decode_ctx *ctx, int le
    return 0;
 }
 
-static int vrend_decode_set_clip_state(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_clip_state(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    struct pipe_clip_state clip;
    int i, j;
 
-   if (length != VIRGL_SET_CLIP_STATE_SIZE)
-      return EINVAL;
-
    for (i = 0; i < 8; i++)
       for (j = 0; j < 4; j++)
          clip.ucp[i][j] = uif(get_buf_entry(ctx, VIRGL_SET_CLIP_STATE_C0 + (i * 4) + j));
@@ -903,38 +861,31 @@ static int vrend_decode_set_clip_state(struct vrend_decode_ctx *ctx, int length)
    return 0;
 }
 
-static int vrend_decode_set_sample_mask(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_sample_mask(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    unsigned mask;
 
-   if (length != VIRGL_SET_SAMPLE_MASK_SIZE)
-      return EINVAL;
    mask = get_buf_entry(ctx, VIRGL_SET_SAMPLE_MASK_MASK);
    vrend_set_sample_mask(ctx->grctx, mask);
    return 0;
 }
 
-static int vrend_decode_set_min_samples(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_min_samples(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    unsigned min_samples;
 
-   if (length != VIRGL_SET_MIN_SAMPLES_SIZE)
-      return EINVAL;
    min_samples = get_buf_entry(ctx, VIRGL_SET_MIN_SAMPLES_MASK);
    vrend_set_min_samples(ctx->grctx, min_samples);
    return 0;
 }
 
-static int vrend_decode_resource_copy_region(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_resource_copy_region(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    struct pipe_box box;
    uint32_t dst_handle, src_handle;
    uint32_t dst_level, dstx, dsty, dstz;
    uint32_t src_level;
 
-   if (length != VIRGL_CMD_RESOURCE_COPY_REGION_SIZE)
-      return EINVAL;
-
    dst_handle = get_buf_entry(ctx, VIRGL_CMD_RCR_DST_RES_HANDLE);
    dst_level = get_buf_entry(ctx, VIRGL_CMD_RCR_DST_LEVEL);
    dstx = get_buf_entry(ctx, VIRGL_CMD_RCR_DST_X);
@@ -957,13 +908,11 @@ static int vrend_decode_resource_copy_region(struct vrend_decode_ctx *ctx, int l
 }
 
 
-static int vrend_decode_blit(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_blit(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    struct pipe_blit_info info;
    uint32_t dst_handle, src_handle, temp;
 
-   if (length != VIRGL_CMD_BLIT_SIZE)
-      return EINVAL;
    temp = get_buf_entry(ctx, VIRGL_CMD_BLIT_S0);
    info.mask = temp & 0xff;
    info.filter = (temp >> 8) & 0x3;
@@ -1002,9 +951,6 @@ static int vrend_decode_blit(struct vrend_decode_ctx *ctx, int length)
 
 static int vrend_decode_bind_sampler_states(struct vrend_decode_ctx *ctx, int length)
 {
-   if (length < 2)
-      return EINVAL;
-
    uint32_t shader_type = get_buf_entry(ctx, VIRGL_BIND_SAMPLER_STATES_SHADER_TYPE);
    uint32_t start_slot = get_buf_entry(ctx, VIRGL_BIND_SAMPLER_STATES_START_SLOT);
    uint32_t num_states = length - 2;
@@ -1017,31 +963,22 @@ static int vrend_decode_bind_sampler_states(struct vrend_decode_ctx *ctx, int le
    return 0;
 }
 
-static int vrend_decode_begin_query(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_begin_query(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t handle = get_buf_entry(ctx, VIRGL_QUERY_BEGIN_HANDLE);
 
    return vrend_begin_query(ctx->grctx, handle);
 }
 
-static int vrend_decode_end_query(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_end_query(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t handle = get_buf_entry(ctx, VIRGL_QUERY_END_HANDLE);
 
    return vrend_end_query(ctx->grctx, handle);
 }
 
-static int vrend_decode_get_query_result(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_get_query_result(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 2)
-      return EINVAL;
-
    uint32_t handle = get_buf_entry(ctx, VIRGL_QUERY_RESULT_HANDLE);
    uint32_t wait = get_buf_entry(ctx, VIRGL_QUERY_RESULT_WAIT);
 
@@ -1049,11 +986,8 @@ static int vrend_decode_get_query_result(struct vrend_decode_ctx *ctx, int lengt
    return 0;
 }
 
-static int vrend_decode_get_query_result_qbo(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_get_query_result_qbo(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != VIRGL_QUERY_RESULT_QBO_SIZE)
-      return EINVAL;
-
    uint32_t handle = get_buf_entry(ctx, VIRGL_QUERY_RESULT_QBO_HANDLE);
    uint32_t qbo_handle = get_buf_entry(ctx, VIRGL_QUERY_RESULT_QBO_QBO_HANDLE);
    uint32_t wait = get_buf_entry(ctx, VIRGL_QUERY_RESULT_QBO_WAIT);
@@ -1065,11 +999,8 @@ static int vrend_decode_get_query_result_qbo(struct vrend_decode_ctx *ctx, int l
    return 0;
 }
 
-static int vrend_decode_set_render_condition(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_render_condition(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != VIRGL_RENDER_CONDITION_SIZE)
-      return EINVAL;
-
    uint32_t handle = get_buf_entry(ctx, VIRGL_RENDER_CONDITION_HANDLE);
    bool condition = get_buf_entry(ctx, VIRGL_RENDER_CONDITION_CONDITION) & 1;
    uint mode = get_buf_entry(ctx, VIRGL_RENDER_CONDITION_MODE);
@@ -1078,44 +1009,33 @@ static int vrend_decode_set_render_condition(struct vrend_decode_ctx *ctx, int l
    return 0;
 }
 
-static int vrend_decode_set_sub_ctx(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_set_sub_ctx(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t ctx_sub_id = get_buf_entry(ctx, 1);
 
    vrend_renderer_set_sub_ctx(ctx->grctx, ctx_sub_id);
    return 0;
 }
 
-static int vrend_decode_create_sub_ctx(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_create_sub_ctx(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t ctx_sub_id = get_buf_entry(ctx, 1);
 
    vrend_renderer_create_sub_ctx(ctx->grctx, ctx_sub_id);
    return 0;
 }
 
-static int vrend_decode_destroy_sub_ctx(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_destroy_sub_ctx(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != 1)
-      return EINVAL;
-
    uint32_t ctx_sub_id = get_buf_entry(ctx, 1);
 
    vrend_renderer_destroy_sub_ctx(ctx->grctx, ctx_sub_id);
    return 0;
 }
 
-static int vrend_decode_bind_shader(struct vrend_decode_ctx *ctx, int length)
+static int vrend_decode_bind_shader(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    uint32_t handle, type;
-   if (length != VIRGL_BIND_SHADER_SIZE)
-      return EINVAL;
 
    handle = get_buf_entry(ctx, VIRGL_BIND_SHADER_HANDLE);
    type = get_buf_entry(ctx, VIRGL_BIND_SHADER_TYPE);
@@ -1124,15 +1044,11 @@ static int vrend_decode_bind_shader(struct vrend_decode_ctx *ctx, int length)
    return 0;
 }
 
-static int vrend_decode_set_tess_state(struct vrend_decode_ctx *ctx,
-				       int length)
+static int vrend_decode_set_tess_state(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    float tess_factors[6];
    int i;
 
-   if (length != VIRGL_TESS_STATE_SIZE)
-      return EINVAL;
-
    for (i = 0; i < 6; i++) {
       tess_factors[i] = uif(get_buf_entry(ctx, i + 1));
    }
@@ -1140,14 +1056,11 @@ static int vrend_decode_set_tess_state(struct vrend_decode_ctx *ctx,
    return 0;
 }
 
-static int vrend_decode_set_shader_buffers(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_set_shader_buffers(struct vrend_decode_ctx *ctx, int length)
 {
    uint32_t num_ssbo;
    uint32_t shader_type, start_slot;
 
-   if (length < 2)
-      return EINVAL;
-
    num_ssbo = (length - 2) / VIRGL_SET_SHADER_BUFFER_ELEMENT_SIZE;
    shader_type = get_buf_entry(ctx, VIRGL_SET_SHADER_BUFFER_SHADER_TYPE);
    start_slot = get_buf_entry(ctx, VIRGL_SET_SHADER_BUFFER_START_SLOT);
@@ -1171,14 +1084,11 @@ static int vrend_decode_set_shader_buffers(struct vrend_decode_ctx *ctx, uint16_
    return 0;
 }
 
-static int vrend_decode_set_atomic_buffers(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_set_atomic_buffers(struct vrend_decode_ctx *ctx, int length)
 {
    uint32_t num_abo;
    uint32_t start_slot;
 
-   if (length < 2)
-      return EINVAL;
-
    num_abo = (length - 1) / VIRGL_SET_ATOMIC_BUFFER_ELEMENT_SIZE;
    start_slot = get_buf_entry(ctx, VIRGL_SET_ATOMIC_BUFFER_START_SLOT);
    if (num_abo < 1)
@@ -1198,12 +1108,10 @@ static int vrend_decode_set_atomic_buffers(struct vrend_decode_ctx *ctx, uint16_
    return 0;
 }
 
-static int vrend_decode_set_shader_images(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_set_shader_images(struct vrend_decode_ctx *ctx, int length)
 {
    uint32_t num_images;
    uint32_t shader_type, start_slot;
-   if (length < 2)
-      return EINVAL;
 
    num_images = (length - 2) / VIRGL_SET_SHADER_IMAGE_ELEMENT_SIZE;
    shader_type = get_buf_entry(ctx, VIRGL_SET_SHADER_IMAGE_SHADER_TYPE);
@@ -1230,22 +1138,17 @@ static int vrend_decode_set_shader_images(struct vrend_decode_ctx *ctx, uint16_t
    return 0;
 }
 
-static int vrend_decode_memory_barrier(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_memory_barrier(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != VIRGL_MEMORY_BARRIER_SIZE)
-      return EINVAL;
-
    unsigned flags = get_buf_entry(ctx, VIRGL_MEMORY_BARRIER_FLAGS);
    vrend_memory_barrier(ctx->grctx, flags);
    return 0;
 }
 
-static int vrend_decode_launch_grid(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_launch_grid(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    uint32_t block[3], grid[3];
    uint32_t indirect_handle, indirect_offset;
-   if (length != VIRGL_LAUNCH_GRID_SIZE)
-      return EINVAL;
 
    block[0] = get_buf_entry(ctx, VIRGL_LAUNCH_BLOCK_X);
    block[1] = get_buf_entry(ctx, VIRGL_LAUNCH_BLOCK_Y);
@@ -1259,16 +1162,13 @@ static int vrend_decode_launch_grid(struct vrend_decode_ctx *ctx, uint16_t lengt
    return 0;
 }
 
-static int vrend_decode_set_streamout_targets(struct vrend_decode_ctx *ctx,
-                                              uint16_t length)
+static int vrend_decode_set_streamout_targets(struct vrend_decode_ctx *ctx, int length)
 {
    uint32_t handles[16];
    uint32_t num_handles = length - 1;
    uint32_t append_bitmask;
    uint i;
 
-   if (length < 1)
-      return EINVAL;
    if (num_handles > ARRAY_SIZE(handles))
       return EINVAL;
 
@@ -1279,11 +1179,8 @@ static int vrend_decode_set_streamout_targets(struct vrend_decode_ctx *ctx,
    return 0;
 }
 
-static int vrend_decode_texture_barrier(struct vrend_decode_ctx *ctx, uint16_t length)
+static int vrend_decode_texture_barrier(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
-   if (length != VIRGL_TEXTURE_BARRIER_SIZE)
-      return EINVAL;
-
    unsigned flags = get_buf_entry(ctx, VIRGL_TEXTURE_BARRIER_FLAGS);
    vrend_texture_barrier(ctx->grctx, flags);
    return 0;
@@ -1295,9 +1192,6 @@ static int vrend_decode_set_debug_mask(struct vrend_decode_ctx *ctx, int length)
    int slen = sizeof(uint32_t) * length;
    uint32_t *buf;
 
-   if (length < VIRGL_SET_DEBUG_FLAGS_MIN_SIZE)
-      return EINVAL;
-
    buf = get_buf_ptr(ctx, VIRGL_SET_DEBUG_FLAGSTRING_OFFSET);
    flagstring = malloc(slen+1);
 
@@ -1314,17 +1208,14 @@ static int vrend_decode_set_debug_mask(struct vrend_decode_ctx *ctx, int length)
    return 0;
 }
 
-static int vrend_decode_transfer3d(struct vrend_decode_ctx *ctx, int length, uint32_t ctx_id)
+static int vrend_decode_transfer3d(struct vrend_decode_ctx *ctx, UNUSED int length)
 {
    struct pipe_box box;
    struct vrend_transfer_info info;
 
-   if (length < VIRGL_TRANSFER3D_SIZE)
-      return EINVAL;
-
    memset(&info, 0, sizeof(info));
    info.box = &box;
-   info.ctx_id = ctx_id;
+   info.ctx_id = ctx->ctx_id;
    vrend_decode_transfer_common(ctx, &info);
    info.offset = get_buf_entry(ctx, VIRGL_TRANSFER3D_DATA_OFFSET);
    int transfer_mode = get_buf_entry(ctx, VIRGL_TRANSFER3D_DIRECTION);
@@ -1337,6 +1228,109 @@ static int vrend_decode_transfer3d(struct vrend_decode_ctx *ctx, int length, uin
    return vrend_renderer_transfer_iov(&info, transfer_mode);
 }
 
+static int vrend_decode_end_transfers(UNUSED struct vrend_decode_ctx *ctx,
+                                      UNUSED int length)
+{
+   return 0;
+}
+
+typedef int (*vrend_decode_callback)(struct vrend_decode_ctx *ctx, int length);
+
+/* Every command is checked against its length bounds here before the
+ * handler runs, handlers only validate lengths derived from the payload.
+ */
+struct vrend_decode_cmd {
+   vrend_decode_callback decode;
+   uint16_t min_length;
+   uint16_t max_length;
+};
+
+#define DECODE_ANY_LENGTH UINT16_MAX
+#define DECODE_CMD(cmd, func, min, max) \
+   [VIRGL_CCMD_##cmd] = { func, min, max }
+
+static const struct vrend_decode_cmd decode_table[VIRGL_MAX_COMMANDS] = {
+   DECODE_CMD(CREATE_OBJECT, vrend_decode_create_object, 1, DECODE_ANY_LENGTH),
+   DECODE_CMD(BIND_OBJECT, vrend_decode_bind_object, 1, 1),
+   DECODE_CMD(DESTROY_OBJECT, vrend_decode_destroy_object, 1, 1),
+   DECODE_CMD(SET_VIEWPORT_STATE, vrend_decode_set_viewport_state, 1, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_FRAMEBUFFER_STATE, vrend_decode_set_framebuffer_state, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_VERTEX_BUFFERS, vrend_decode_set_vertex_buffers, 0, DECODE_ANY_LENGTH),
+   DECODE_CMD(CLEAR, vrend_decode_clear, VIRGL_OBJ_CLEAR_SIZE, VIRGL_OBJ_CLEAR_SIZE),
+   DECODE_CMD(DRAW_VBO, vrend_decode_draw_vbo, VIRGL_DRAW_VBO_SIZE, VIRGL_DRAW_VBO_SIZE_INDIRECT),
+   DECODE_CMD(RESOURCE_INLINE_WRITE, vrend_decode_resource_inline_write, 12, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_SAMPLER_VIEWS, vrend_decode_set_sampler_views, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_INDEX_BUFFER, vrend_decode_set_index_buffer, 1, 3),
+   DECODE_CMD(SET_CONSTANT_BUFFER, vrend_decode_set_constant_buffer, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_STENCIL_REF, vrend_decode_set_stencil_ref,
+              VIRGL_SET_STENCIL_REF_SIZE, VIRGL_SET_STENCIL_REF_SIZE),
+   DECODE_CMD(SET_BLEND_COLOR, vrend_decode_set_blend_color,
+              VIRGL_SET_BLEND_COLOR_SIZE, VIRGL_SET_BLEND_COLOR_SIZE),
+   DECODE_CMD(SET_SCISSOR_STATE, vrend_decode_set_scissor_state, 1, DECODE_ANY_LENGTH),
+   DECODE_CMD(BLIT, vrend_decode_blit, VIRGL_CMD_BLIT_SIZE, VIRGL_CMD_BLIT_SIZE),
+   DECODE_CMD(RESOURCE_COPY_REGION, vrend_decode_resource_copy_region,
+              VIRGL_CMD_RESOURCE_COPY_REGION_SIZE, VIRGL_CMD_RESOURCE_COPY_REGION_SIZE),
+   DECODE_CMD(BIND_SAMPLER_STATES, vrend_decode_bind_sampler_states, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(BEGIN_QUERY, vrend_decode_begin_query, 1, 1),
+   DECODE_CMD(END_QUERY, vrend_decode_end_query, 1, 1),
+   DECODE_CMD(GET_QUERY_RESULT, vrend_decode_get_query_result, 2, 2),
+   DECODE_CMD(SET_POLYGON_STIPPLE, vrend_decode_set_polygon_stipple,
+              VIRGL_POLYGON_STIPPLE_SIZE, VIRGL_POLYGON_STIPPLE_SIZE),
+   DECODE_CMD(SET_CLIP_STATE, vrend_decode_set_clip_state,
+              VIRGL_SET_CLIP_STATE_SIZE, VIRGL_SET_CLIP_STATE_SIZE),
+   DECODE_CMD(SET_SAMPLE_MASK, vrend_decode_set_sample_mask,
+              VIRGL_SET_SAMPLE_MASK_SIZE, VIRGL_SET_SAMPLE_MASK_SIZE),
+   DECODE_CMD(SET_STREAMOUT_TARGETS, vrend_decode_set_streamout_targets, 1, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_RENDER_CONDITION, vrend_decode_set_render_condition,
+              VIRGL_RENDER_CONDITION_SIZE, VIRGL_RENDER_CONDITION_SIZE),
+   DECODE_CMD(SET_UNIFORM_BUFFER, vrend_decode_set_uniform_buffer,
+              VIRGL_SET_UNIFORM_BUFFER_SIZE, VIRGL_SET_UNIFORM_BUFFER_SIZE),
+   DECODE_CMD(SET_SUB_CTX, vrend_decode_set_sub_ctx, 1, 1),
+   DECODE_CMD(CREATE_SUB_CTX, vrend_decode_create_sub_ctx, 1, 1),
+   DECODE_CMD(DESTROY_SUB_CTX, vrend_decode_destroy_sub_ctx, 1, 1),
+   DECODE_CMD(BIND_SHADER, vrend_decode_bind_shader,
+              VIRGL_BIND_SHADER_SIZE, VIRGL_BIND_SHADER_SIZE),
+   DECODE_CMD(SET_TESS_STATE, vrend_decode_set_tess_state,
+              VIRGL_TESS_STATE_SIZE, VIRGL_TESS_STATE_SIZE),
+   DECODE_CMD(SET_MIN_SAMPLES, vrend_decode_set_min_samples,
+              VIRGL_SET_MIN_SAMPLES_SIZE, VIRGL_SET_MIN_SAMPLES_SIZE),
+   DECODE_CMD(SET_SHADER_BUFFERS, vrend_decode_set_shader_buffers, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_SHADER_IMAGES, vrend_decode_set_shader_images, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(MEMORY_BARRIER, vrend_decode_memory_barrier,
+              VIRGL_MEMORY_BARRIER_SIZE, VIRGL_MEMORY_BARRIER_SIZE),
+   DECODE_CMD(LAUNCH_GRID, vrend_decode_launch_grid,
+              VIRGL_LAUNCH_GRID_SIZE, VIRGL_LAUNCH_GRID_SIZE),
+   DECODE_CMD(SET_FRAMEBUFFER_STATE_NO_ATTACH, vrend_decode_set_framebuffer_state_no_attach,
+              VIRGL_SET_FRAMEBUFFER_STATE_NO_ATTACH_SIZE, VIRGL_SET_FRAMEBUFFER_STATE_NO_ATTACH_SIZE),
+   DECODE_CMD(TEXTURE_BARRIER, vrend_decode_texture_barrier,
+              VIRGL_TEXTURE_BARRIER_SIZE, VIRGL_TEXTURE_BARRIER_SIZE),
+   DECODE_CMD(SET_ATOMIC_BUFFERS, vrend_decode_set_atomic_buffers, 2, DECODE_ANY_LENGTH),
+   DECODE_CMD(SET_DEBUG_FLAGS, vrend_decode_set_debug_mask,
+              VIRGL_SET_DEBUG_FLAGS_MIN_SIZE, DECODE_ANY_LENGTH),
+   DECODE_CMD(GET_QUERY_RESULT_QBO, vrend_decode_get_query_result_qbo,
+              VIRGL_QUERY_RESULT_QBO_SIZE, VIRGL_QUERY_RESULT_QBO_SIZE),
+   DECODE_CMD(TRANSFER3D, vrend_decode_transfer3d, VIRGL_TRANSFER3D_SIZE, DECODE_ANY_LENGTH),
+   DECODE_CMD(END_TRANSFERS, vrend_decode_end_transfers, 0, DECODE_ANY_LENGTH),
+};
+
+struct vrend_decode_stats {
+   uint64_t count;
+   uint64_t errors;
+};
+
+static struct vrend_decode_stats decode_stats[VIRGL_MAX_COMMANDS];
+
+void vrend_decode_print_stats(void)
+{
+   for (unsigned i = 0; i < VIRGL_MAX_COMMANDS; i++) {
+      if (!decode_stats[i].count)
+         continue;
+      vrend_printf("%-32s %12" PRIu64 " calls %8" PRIu64 " errors\n",
+                   vrend_get_comand_name(i), decode_stats[i].count,
+                   decode_stats[i].errors);
+   }
+}
+
 void vrend_renderer_context_create_internal(uint32_t handle, uint32_t nlen,
                                             const char *debug_name)
 {
@@ -1360,6 +1354,7 @@ void vrend_renderer_context_create_internal(uint32_t handle, uint32_t nlen,
    }
 
    dctx->ds = &dctx->ids;
+   dctx->ctx_id = handle;
 
    dec_ctx[handle] = dctx;
 }
@@ -1436,6 +1431,7 @@ int vrend_decode_block(uint32_t ctx_id, uint32_t *block, int ndw)
    while (gdctx->ds->buf_offset < gdctx->ds->buf_total) {
       uint32_t header = gdctx->ds->buf[gdctx->ds->buf_offset];
       uint32_t len = header >> 16;
+      uint32_t cmd;
 
       ret = 0;
       /* check if the guest is doing something bad */
@@ -1444,147 +1440,23 @@ int vrend_decode_block(uint32_t ctx_id, uint32_t *block, int ndw)
          break;
       }
 
+      cmd = header & 0xff;
       VREND_DEBUG(dbg_cmd, gdctx->grctx,"%-4d %-20s len:%d\n",
-                  gdctx->ds->buf_offset, vrend_get_comand_name(header & 0xff), len);
+                  gdctx->ds->buf_offset, vrend_get_comand_name(cmd), len);
 
-      switch (header & 0xff) {
-      case VIRGL_CCMD_CREATE_OBJECT:
-         ret = vrend_decode_create_object(gdctx, len);
-         break;
-      case VIRGL_CCMD_BIND_OBJECT:
-         ret = vrend_decode_bind_object(gdctx, len);
-         break;
-      case VIRGL_CCMD_DESTROY_OBJECT:
-         ret = vrend_decode_destroy_object(gdctx, len);
-         break;
-      case VIRGL_CCMD_CLEAR:
-         ret = vrend_decode_clear(gdctx, len);
-         break;
-      case VIRGL_CCMD_DRAW_VBO:
-         ret = vrend_decode_draw_vbo(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_FRAMEBUFFER_STATE:
-         ret = vrend_decode_set_framebuffer_state(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_VERTEX_BUFFERS:
-         ret = vrend_decode_set_vertex_buffers(gdctx, len);
-         break;
-      case VIRGL_CCMD_RESOURCE_INLINE_WRITE:
-         ret = vrend_decode_resource_inline_write(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_VIEWPORT_STATE:
-         ret = vrend_decode_set_viewport_state(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_SAMPLER_VIEWS:
-         ret = vrend_decode_set_sampler_views(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_INDEX_BUFFER:
-         ret = vrend_decode_set_index_buffer(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_CONSTANT_BUFFER:
-         ret = vrend_decode_set_constant_buffer(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_STENCIL_REF:
-         ret = vrend_decode_set_stencil_ref(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_BLEND_COLOR:
-         ret = vrend_decode_set_blend_color(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_SCISSOR_STATE:
-         ret = vrend_decode_set_scissor_state(gdctx, len);
-         break;
-      case VIRGL_CCMD_BLIT:
-         ret = vrend_decode_blit(gdctx, len);
-         break;
-      case VIRGL_CCMD_RESOURCE_COPY_REGION:
-         ret = vrend_decode_resource_copy_region(gdctx, len);
-         break;
-      case VIRGL_CCMD_BIND_SAMPLER_STATES:
-         ret = vrend_decode_bind_sampler_states(gdctx, len);
-         break;
-      case VIRGL_CCMD_BEGIN_QUERY:
-         ret = vrend_decode_begin_query(gdctx, len);
-         break;
-      case VIRGL_CCMD_END_QUERY:
-         ret = vrend_decode_end_query(gdctx, len);
-         break;
-      case VIRGL_CCMD_GET_QUERY_RESULT:
-         ret = vrend_decode_get_query_result(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_POLYGON_STIPPLE:
-         ret = vrend_decode_set_polygon_stipple(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_CLIP_STATE:
-         ret = vrend_decode_set_clip_state(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_SAMPLE_MASK:
-         ret = vrend_decode_set_sample_mask(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_MIN_SAMPLES:
-         ret = vrend_decode_set_min_samples(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_STREAMOUT_TARGETS:
-         ret = vrend_decode_set_streamout_targets(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_RENDER_CONDITION:
-         ret = vrend_decode_set_render_condition(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_UNIFORM_BUFFER:
-         ret = vrend_decode_set_uniform_buffer(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_SUB_CTX:
-         ret = vrend_decode_set_sub_ctx(gdctx, len);
-         break;
-      case VIRGL_CCMD_CREATE_SUB_CTX:
-         ret = vrend_decode_create_sub_ctx(gdctx, len);
-         break;
-      case VIRGL_CCMD_DESTROY_SUB_CTX:
-         ret = vrend_decode_destroy_sub_ctx(gdctx, len);
-         break;
-      case VIRGL_CCMD_BIND_SHADER:
-         ret = vrend_decode_bind_shader(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_TESS_STATE:
-         ret = vrend_decode_set_tess_state(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_SHADER_BUFFERS:
-         ret = vrend_decode_set_shader_buffers(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_SHADER_IMAGES:
-         ret = vrend_decode_set_shader_images(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_ATOMIC_BUFFERS:
-         ret = vrend_decode_set_atomic_buffers(gdctx, len);
-         break;
-      case VIRGL_CCMD_MEMORY_BARRIER:
-         ret = vrend_decode_memory_barrier(gdctx, len);
-         break;
-      case VIRGL_CCMD_LAUNCH_GRID:
-         ret = vrend_decode_launch_grid(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_FRAMEBUFFER_STATE_NO_ATTACH:
-         ret = vrend_decode_set_framebuffer_state_no_attach(gdctx, len);
-         break;
-      case VIRGL_CCMD_TEXTURE_BARRIER:
-         ret = vrend_decode_texture_barrier(gdctx, len);
-         break;
-      case VIRGL_CCMD_SET_DEBUG_FLAGS:
-         ret = vrend_decode_set_debug_mask(gdctx, len);
-         break;
-      case VIRGL_CCMD_GET_QUERY_RESULT_QBO:
-         ret = vrend_decode_get_query_result_qbo(gdctx, len);
-         break;
-      case VIRGL_CCMD_TRANSFER3D:
-         ret = vrend_decode_transfer3d(gdctx, len, ctx_id);
-         break;
-      case VIRGL_CCMD_END_TRANSFERS:
-         ret = 0;
-         break;
-      default:
-         ret = EINVAL;
+      if (cmd >= VIRGL_MAX_COMMANDS || !decode_table[cmd].decode) {
+         vrend_report_buffer_error(gdctx->grctx, header);
+         return EINVAL;
       }
 
+      decode_stats[cmd].count++;
+      if (len < decode_table[cmd].min_length || len > decode_table[cmd].max_length)
+         ret = EINVAL;
+      else
+         ret = decode_table[cmd].decode(gdctx, len);
+
       if (ret == EINVAL) {
+         decode_stats[cmd].errors++;
          vrend_report_buffer_error(gdctx->grctx, header);
          goto out;
       }
@@ -0,0 +1,392 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "os/os_thread.h"
+#include "util/u_memory.h"
+
+#include "vrend_debug.h"
+#include "vrend_disk_cache.h"
+
+#define CACHE_MAGIC 0x43445256 /* VRDC */
+#define CACHE_VERSION 1
+
+/* when over the limit, trim down to this fraction of it so we don't have
+ * to rescan the directory on every store */
+#define CACHE_TRIM_PERCENT 90
+
+/* temporary files of writers that died are removed after this long */
+#define CACHE_STALE_TMP_SECONDS (5 * 60)
+
+struct vrend_disk_cache_header {
+   uint32_t magic;
+   uint32_t version;
+   struct vrend_disk_cache_key key;
+   uint64_t size;
+};
+
+struct vrend_disk_cache {
+   char *dir;
+   uint64_t max_size;
+
+   pipe_mutex mutex;
+   struct vrend_disk_cache_stats stats;
+};
+
+struct cache_file {
+   char name[40];
+   time_t atime;
+   off_t size;
+};
+
+static int make_dir(const char *path)
+{
+   if (mkdir(path, 0700) && errno != EEXIST)
+      return -1;
+   return 0;
+}
+
+static void entry_name(const struct vrend_disk_cache_key *key, char *name, size_t len)
+{
+   snprintf(name, len, "%016" PRIx64 "%016" PRIx64, key->hash[0], key->hash[1]);
+}
+
+static bool is_entry_name(const char *name)
+{
+   return strlen(name) == 32 && strspn(name, "0123456789abcdef") == 32;
+}
+
+/* <entry>.<pid>.tmp, see vrend_disk_cache_put */
+static bool is_tmp_name(const char *name)
+{
+   size_t len = strlen(name);
+
+   return len > 37 && strspn(name, "0123456789abcdef") == 32 &&
+          name[32] == '.' && !strcmp(name + len - 4, ".tmp");
+}
+
+static int compare_atime(const void *a, const void *b)
+{
+   const struct cache_file *fa = a, *fb = b;
+
+   if (fa->atime < fb->atime)
+      return -1;
+   return fa->atime > fb->atime;
+}
+
+/* Scan the cache directory and return the entries found, the total size is
+ * returned in *total_size. Other processes may share the directory, so the
+ * size is recomputed from the directory instead of being tracked.  Stale
+ * temporary files are removed on the way. */
+static struct cache_file *scan_dir(struct vrend_disk_cache *cache,
+                                   unsigned *count, uint64_t *total_size)
+{
+   struct cache_file *files = NULL;
+   unsigned num = 0, allocated = 0;
+   time_t now = time(NULL);
+   struct dirent *ent;
+   struct stat st;
+   DIR *dir;
+   int dfd;
+
+   *count = 0;
+   *total_size = 0;
+
+   dir = opendir(cache->dir);
+   if (!dir)
+      return NULL;
+   dfd = dirfd(dir);
+
+   while ((ent = readdir(dir))) {
+      if (is_tmp_name(ent->d_name)) {
+         if (!fstatat(dfd, ent->d_name, &st, 0) && S_ISREG(st.st_mode) &&
+             now - st.st_mtime > CACHE_STALE_TMP_SECONDS)
+            unlinkat(dfd, ent->d_name, 0);
+         continue;
+      }
+      if (!is_entry_name(ent->d_name))
+         continue;
+      if (fstatat(dfd, ent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+         continue;
+
+      if (num == allocated) {
+         struct cache_file *tmp;
+         allocated = allocated ? allocated * 2 : 64;
+         tmp = realloc(files, allocated * sizeof(*files));
+         if (!tmp)
+            break;
+         files = tmp;
+      }
+      memcpy(files[num].name, ent->d_name, 33);
+      files[num].atime = st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime;
+      files[num].size = st.st_size;
+      *total_size += st.st_size;
+      num++;
+   }
+   closedir(dir);
+
+   *count = num;
+   return files;
+}
+
+static void evict_entries(struct vrend_disk_cache *cache)
+{
+   struct cache_file *files;
+   uint64_t total, target;
+   unsigned count;
+   int dfd;
+
+   files = scan_dir(cache, &count, &total);
+   if (total <= cache->max_size) {
+      cache->stats.size = total;
+      free(files);
+      return;
+   }
+
+   target = cache->max_size / 100 * CACHE_TRIM_PERCENT;
+   qsort(files, count, sizeof(*files), compare_atime);
+
+   dfd = open(cache->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   for (unsigned i = 0; i < count && total > target && dfd >= 0; i++) {
+      if (unlinkat(dfd, files[i].name, 0))
+         continue;
+      total -= files[i].size;
+      cache->stats.evictions++;
+   }
+   if (dfd >= 0)
+      close(dfd);
+
+   cache->stats.size = total;
+   free(files);
+}
+
+struct vrend_disk_cache *vrend_disk_cache_create(const char *path,
+                                                 const char *name,
+                                                 uint64_t max_size)
+{
+   struct vrend_disk_cache *cache;
+   struct cache_file *files;
+   unsigned count;
+   size_t len;
+
+   if (!path || !path[0] || !max_size)
+      return NULL;
+
+   cache = CALLOC_STRUCT(vrend_disk_cache);
+   if (!cache)
+      return NULL;
+
+   len = strlen(path) + strlen(name) + 2;
+   cache->dir = malloc(len);
+   if (!cache->dir) {
+      FREE(cache);
+      return NULL;
+   }
+   snprintf(cache->dir, len, "%s/%s", path, name);
+
+   if (make_dir(path) || make_dir(cache->dir)) {
+      vrend_printf("disk cache: can't create %s: %s\n", cache->dir, strerror(errno));
+      free(cache->dir);
+      FREE(cache);
+      return NULL;
+   }
+
+   cache->max_size = max_size;
+   pipe_mutex_init(cache->mutex);
+
+   files = scan_dir(cache, &count, &cache->stats.size);
+   free(files);
+   if (cache->stats.size > max_size)
+      evict_entries(cache);
+
+   return cache;
+}
+
+void vrend_disk_cache_destroy(struct vrend_disk_cache *cache)
+{
+   if (!cache)
+      return;
+
+   pipe_mutex_destroy(cache->mutex);
+   free(cache->dir);
+   FREE(cache);
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+   uint8_t *p = data;
+
+   while (size) {
+      ssize_t ret = read(fd, p, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      p += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+   const uint8_t *p = data;
+
+   while (size) {
+      ssize_t ret = write(fd, p, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      p += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+void *vrend_disk_cache_get(struct vrend_disk_cache *cache,
+                           const struct vrend_disk_cache_key *key,
+                           size_t *size)
+{
+   struct vrend_disk_cache_header hdr;
+   char name[40];
+   void *data = NULL;
+   struct stat st;
+   int dfd, fd;
+
+   entry_name(key, name, sizeof(name));
+
+   dfd = open(cache->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (dfd < 0)
+      goto out;
+
+   fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      goto out_dir;
+
+   if (fstat(fd, &st) ||
+       !read_all(fd, &hdr, sizeof(hdr)) ||
+       hdr.magic != CACHE_MAGIC ||
+       hdr.version != CACHE_VERSION ||
+       memcmp(&hdr.key, key, sizeof(*key)) ||
+       hdr.size != (uint64_t)st.st_size - sizeof(hdr))
+      goto out_file;
+
+   data = malloc(hdr.size);
+   if (data && !read_all(fd, data, hdr.size)) {
+      free(data);
+      data = NULL;
+   }
+
+   if (data) {
+      /* atime is often disabled, bump mtime for the LRU */
+      futimens(fd, NULL);
+      *size = hdr.size;
+   }
+
+out_file:
+   close(fd);
+out_dir:
+   close(dfd);
+out:
+   pipe_mutex_lock(cache->mutex);
+   if (data)
+      cache->stats.hits++;
+   else
+      cache->stats.misses++;
+   pipe_mutex_unlock(cache->mutex);
+   return data;
+}
+
+bool vrend_disk_cache_put(struct vrend_disk_cache *cache,
+                          const struct vrend_disk_cache_key *key,
+                          const void *data, size_t size)
+{
+   struct vrend_disk_cache_header hdr;
+   char name[40], tmp_name[64];
+   bool ret = false;
+   int dfd, fd;
+
+   if (size + sizeof(hdr) > cache->max_size)
+      return false;
+
+   entry_name(key, name, sizeof(name));
+   snprintf(tmp_name, sizeof(tmp_name), "%s.%d.tmp", name, (int)getpid());
+
+   dfd = open(cache->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (dfd < 0)
+      return false;
+
+   fd = openat(dfd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+   if (fd < 0) {
+      close(dfd);
+      return false;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = CACHE_MAGIC;
+   hdr.version = CACHE_VERSION;
+   hdr.key = *key;
+   hdr.size = size;
+
+   if (write_all(fd, &hdr, sizeof(hdr)) && write_all(fd, data, size))
+      ret = !renameat(dfd, tmp_name, dfd, name);
+   close(fd);
+   if (!ret)
+      unlinkat(dfd, tmp_name, 0);
+   close(dfd);
+
+   if (!ret)
+      return false;
+
+   pipe_mutex_lock(cache->mutex);
+   cache->stats.stores++;
+   cache->stats.size += size + sizeof(hdr);
+   if (cache->stats.size > cache->max_size)
+      evict_entries(cache);
+   pipe_mutex_unlock(cache->mutex);
+   return true;
+}
+
+void vrend_disk_cache_get_stats(struct vrend_disk_cache *cache,
+                                struct vrend_disk_cache_stats *stats)
+{
+   pipe_mutex_lock(cache->mutex);
+   *stats = cache->stats;
+   pipe_mutex_unlock(cache->mutex);
+}
@@ -0,0 +1,96 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifndef VREND_DISK_CACHE_H
+#define VREND_DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "vrend_hash.h"
+
+/* A directory of blobs keyed by a 128 bit hash. Entries are written to a
+ * temporary file and renamed into place so concurrent readers never see a
+ * partial entry, and the least recently used entries are deleted once the
+ * directory grows beyond max_size bytes. */
+struct vrend_disk_cache;
+
+struct vrend_disk_cache_key {
+   uint64_t hash[2];
+};
+
+struct vrend_disk_cache_stats {
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t stores;
+   uint64_t evictions;
+   uint64_t size;
+};
+
+static inline void vrend_disk_cache_key_init(struct vrend_disk_cache_key *key)
+{
+   key->hash[0] = VREND_HASH_INIT;
+   key->hash[1] = 0x9e3779b97f4a7c15ull;
+}
+
+static inline void vrend_disk_cache_key_add(struct vrend_disk_cache_key *key,
+                                            const void *data, size_t size)
+{
+   const uint8_t *p = data;
+
+   key->hash[0] = vrend_hash_data(key->hash[0], data, size);
+   /* second lane uses a different mix so the two don't collide together */
+   for (size_t i = 0; i < size; i++) {
+      key->hash[1] = ((key->hash[1] << 5) | (key->hash[1] >> 59)) ^ p[i];
+      key->hash[1] *= 0x9e3779b97f4a7c15ull;
+   }
+}
+
+static inline void vrend_disk_cache_key_add_str(struct vrend_disk_cache_key *key,
+                                                const char *str)
+{
+   /* include the terminator so consecutive strings can't run together */
+   vrend_disk_cache_key_add(key, str, str ? strlen(str) + 1 : 0);
+}
+
+struct vrend_disk_cache *vrend_disk_cache_create(const char *path,
+                                                 const char *name,
+                                                 uint64_t max_size);
+
+void vrend_disk_cache_destroy(struct vrend_disk_cache *cache);
+
+/* returns a malloc'ed copy of the entry or NULL */
+void *vrend_disk_cache_get(struct vrend_disk_cache *cache,
+                           const struct vrend_disk_cache_key *key,
+                           size_t *size);
+
+bool vrend_disk_cache_put(struct vrend_disk_cache *cache,
+                          const struct vrend_disk_cache_key *key,
+                          const void *data, size_t size);
+
+void vrend_disk_cache_get_stats(struct vrend_disk_cache *cache,
+                                struct vrend_disk_cache_stats *stats);
+
+#endif
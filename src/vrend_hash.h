@@ -0,0 +1,49 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifndef VREND_HASH_H
+#define VREND_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64 bit FNV-1a, used to build cache keys */
+#define VREND_HASH_INIT 0xcbf29ce484222325ull
+
+static inline uint64_t vrend_hash_data(uint64_t hash, const void *data, size_t size)
+{
+   const uint8_t *p = data;
+
+   for (size_t i = 0; i < size; i++) {
+      hash ^= p[i];
+      hash *= 0x100000001b3ull;
+   }
+   return hash;
+}
+
+static inline unsigned vrend_hash_fold(uint64_t hash)
+{
+   return (unsigned)(hash ^ (hash >> 32));
+}
+
+#endif
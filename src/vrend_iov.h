@@ -46,4 +46,19 @@ size_t vrend_write_to_iovec(const struct iovec *iov, int iov_cnt,
 size_t vrend_read_from_iovec_cb(const struct iovec *iov, int iov_cnt,
                           size_t offset, size_t bytes, iov_cb iocb, void *cookie);
 
+/* position in a list of iovecs that only moves forward */
+struct vrend_iov_cursor {
+   const struct iovec *iov;
+   int iov_cnt;
+   int index;
+   /* offset of iov[index] */
+   size_t start;
+};
+
+void vrend_iov_cursor_init(struct vrend_iov_cursor *cursor,
+                           const struct iovec *iov, int iov_cnt);
+size_t vrend_iov_rows(struct vrend_iov_cursor *cursor, size_t offset,
+                      size_t stride, size_t row_size, size_t max_rows,
+                      char **ptr);
+
 #endif
@@ -44,6 +44,35 @@ void vrend_resource_set_destroy_callback(void (*cb)(void *))
    resource_unref = cb;
 }
 
+/* Handles below VREND_OBJECT_DENSE_LIMIT are kept in a two level array:
+ * the top level points at pages of slots that are allocated when the first
+ * handle in their range is inserted, pages not in use point at empty_page
+ * so a lookup is one range check and one type compare.  Guests hand out
+ * handles from small counters, anything beyond the limit goes to a hash.
+ */
+#define VREND_OBJECT_PAGE_SHIFT 8
+#define VREND_OBJECT_PAGE_SIZE (1 << VREND_OBJECT_PAGE_SHIFT)
+#define VREND_OBJECT_PAGE_MASK (VREND_OBJECT_PAGE_SIZE - 1)
+#define VREND_OBJECT_MAX_PAGES 4096
+#define VREND_OBJECT_DENSE_LIMIT (VREND_OBJECT_MAX_PAGES * VREND_OBJECT_PAGE_SIZE)
+
+struct vrend_object_slot {
+   void *data;
+   uint32_t type;
+   bool free_data;
+};
+
+struct vrend_object_table {
+   struct vrend_object_slot **pages;
+   uint32_t num_pages;
+   /* handles >= VREND_OBJECT_DENSE_LIMIT, created on first use */
+   struct util_hash_table *sparse;
+   /* the global resource table, entries are released with resource_unref */
+   bool resources;
+};
+
+static const struct vrend_object_slot empty_page[VREND_OBJECT_PAGE_SIZE];
+
 static unsigned
 hash_func(void *key)
 {
@@ -62,7 +91,7 @@ compare(void *key1, void *key2)
       return 0;
 }
 
-static struct util_hash_table *res_hash;
+static struct vrend_object_table *res_table;
 
 struct vrend_object {
    enum virgl_object_type type;
@@ -71,132 +100,265 @@ struct vrend_object {
    bool free_data;
 };
 
+static void unref_object(uint32_t type, void *data)
+{
+   if (obj_types[type].unref)
+      obj_types[type].unref(data);
+   else {
+      /* for objects with no callback just free them */
+      free(data);
+   }
+}
+
 static void free_object(void *value)
 {
    struct vrend_object *obj = value;
 
-   if (obj->free_data) {
-      if (obj_types[obj->type].unref)
-         obj_types[obj->type].unref(obj->data);
-      else {
-         /* for objects with no callback just free them */
-         free(obj->data);
-      }
-   }
+   if (obj->free_data)
+      unref_object(obj->type, obj->data);
    free(obj);
 }
 
-struct util_hash_table *vrend_object_init_ctx_table(void)
+static void free_res(void *value)
 {
-   struct util_hash_table *ctx_hash;
-   ctx_hash = util_hash_table_create(hash_func, compare, free_object);
-   return ctx_hash;
+   struct vrend_object *obj = value;
+   (*resource_unref)(obj->data);
+   free(obj);
 }
 
-void vrend_object_fini_ctx_table(struct util_hash_table *ctx_hash)
+static void release_slot(const struct vrend_object_table *table,
+                         const struct vrend_object_slot *slot)
 {
-   if (!ctx_hash)
+   if (!slot->data || !slot->free_data)
       return;
 
-   util_hash_table_destroy(ctx_hash);
+   if (table->resources)
+      (*resource_unref)(slot->data);
+   else
+      unref_object(slot->type, slot->data);
 }
 
-static void free_res(void *value)
+static struct vrend_object_table *create_table(bool resources)
 {
-   struct vrend_object *obj = value;
-   (*resource_unref)(obj->data);
-   free(obj);
+   struct vrend_object_table *table = CALLOC_STRUCT(vrend_object_table);
+
+   if (!table)
+      return NULL;
+   table->resources = resources;
+   return table;
 }
 
-void
-vrend_object_init_resource_table(void)
+static void destroy_table(struct vrend_object_table *table)
 {
-   if (!res_hash)
-      res_hash = util_hash_table_create(hash_func, compare, free_res);
+   struct vrend_object_slot slot;
+   uint32_t i, j;
+
+   for (i = 0; i < table->num_pages; i++) {
+      if (table->pages[i] == empty_page)
+         continue;
+
+      for (j = 0; j < VREND_OBJECT_PAGE_SIZE; j++) {
+         /* clear the slot first, the callbacks may look at the table */
+         slot = table->pages[i][j];
+         table->pages[i][j].data = NULL;
+         release_slot(table, &slot);
+      }
+      free(table->pages[i]);
+   }
+   free(table->pages);
+
+   if (table->sparse)
+      util_hash_table_destroy(table->sparse);
+   free(table);
 }
 
-void vrend_object_fini_resource_table(void)
+/* returns the slot for a dense handle, allocating its page if needed */
+static struct vrend_object_slot *
+get_dense_slot(struct vrend_object_table *table, uint32_t handle)
 {
-   if (res_hash) {
-      util_hash_table_destroy(res_hash);
+   uint32_t page = handle >> VREND_OBJECT_PAGE_SHIFT;
+
+   if (page >= table->num_pages) {
+      struct vrend_object_slot **pages;
+      uint32_t num_pages = table->num_pages ? table->num_pages : 1;
+      uint32_t i;
+
+      while (num_pages <= page)
+         num_pages *= 2;
+      if (num_pages > VREND_OBJECT_MAX_PAGES)
+         num_pages = VREND_OBJECT_MAX_PAGES;
+
+      pages = realloc(table->pages, num_pages * sizeof(*pages));
+      if (!pages)
+         return NULL;
+      for (i = table->num_pages; i < num_pages; i++)
+         pages[i] = (struct vrend_object_slot *)empty_page;
+      table->pages = pages;
+      table->num_pages = num_pages;
+   }
+
+   if (table->pages[page] == empty_page) {
+      struct vrend_object_slot *slots = calloc(VREND_OBJECT_PAGE_SIZE,
+                                               sizeof(*slots));
+      if (!slots)
+         return NULL;
+      table->pages[page] = slots;
    }
-   res_hash = NULL;
+
+   return &table->pages[page][handle & VREND_OBJECT_PAGE_MASK];
 }
 
-uint32_t
-vrend_object_insert_nofree(struct util_hash_table *handle_hash,
-                           void *data, UNUSED uint32_t length, uint32_t handle,
-                           enum virgl_object_type type, bool free_data)
+static uint32_t
+table_insert(struct vrend_object_table *table, void *data, uint32_t handle,
+             enum virgl_object_type type, bool free_data)
 {
-   struct vrend_object *obj = CALLOC_STRUCT(vrend_object);
+   struct vrend_object_slot *slot, old;
+   struct vrend_object *obj;
+
+   if (handle < VREND_OBJECT_DENSE_LIMIT) {
+      slot = get_dense_slot(table, handle);
+      if (!slot)
+         return 0;
+
+      /* replacing a live handle drops the old object like the hash did */
+      old = *slot;
+      slot->data = data;
+      slot->type = type;
+      slot->free_data = free_data;
+      release_slot(table, &old);
+      return handle;
+   }
 
+   if (!table->sparse) {
+      table->sparse = util_hash_table_create(hash_func, compare,
+                                             table->resources ? free_res : free_object);
+      if (!table->sparse)
+         return 0;
+   }
+
+   obj = CALLOC_STRUCT(vrend_object);
    if (!obj)
       return 0;
    obj->handle = handle;
    obj->data = data;
    obj->type = type;
    obj->free_data = free_data;
-   util_hash_table_set(handle_hash, intptr_to_pointer(obj->handle), obj);
+   util_hash_table_set(table->sparse, intptr_to_pointer(obj->handle), obj);
    return obj->handle;
 }
 
+static void table_remove(struct vrend_object_table *table, uint32_t handle)
+{
+   uint32_t page = handle >> VREND_OBJECT_PAGE_SHIFT;
+   struct vrend_object_slot *slot, old;
+
+   if (page < table->num_pages) {
+      if (table->pages[page] == empty_page)
+         return;
+
+      slot = &table->pages[page][handle & VREND_OBJECT_PAGE_MASK];
+      old = *slot;
+      slot->data = NULL;
+      release_slot(table, &old);
+      return;
+   }
+
+   if (handle >= VREND_OBJECT_DENSE_LIMIT && table->sparse)
+      util_hash_table_remove(table->sparse, intptr_to_pointer(handle));
+}
+
+static void *table_lookup(struct vrend_object_table *table, uint32_t handle,
+                          enum virgl_object_type type)
+{
+   uint32_t page = handle >> VREND_OBJECT_PAGE_SHIFT;
+   const struct vrend_object_slot *slot;
+   struct vrend_object *obj;
+
+   /* empty slots have no data, the type does not matter for them */
+   if (page < table->num_pages) {
+      slot = &table->pages[page][handle & VREND_OBJECT_PAGE_MASK];
+      return slot->type == type ? slot->data : NULL;
+   }
+
+   if (handle < VREND_OBJECT_DENSE_LIMIT || !table->sparse)
+      return NULL;
+
+   obj = util_hash_table_get(table->sparse, intptr_to_pointer(handle));
+   if (!obj || obj->type != type)
+      return NULL;
+   return obj->data;
+}
+
+struct vrend_object_table *vrend_object_init_ctx_table(void)
+{
+   return create_table(false);
+}
+
+void vrend_object_fini_ctx_table(struct vrend_object_table *ctx_table)
+{
+   if (!ctx_table)
+      return;
+
+   destroy_table(ctx_table);
+}
+
+void
+vrend_object_init_resource_table(void)
+{
+   if (!res_table)
+      res_table = create_table(true);
+}
+
+void vrend_object_fini_resource_table(void)
+{
+   if (res_table)
+      destroy_table(res_table);
+   res_table = NULL;
+}
+
+uint32_t
+vrend_object_insert_nofree(struct vrend_object_table *ctx_table,
+                           void *data, UNUSED uint32_t length, uint32_t handle,
+                           enum virgl_object_type type, bool free_data)
+{
+   return table_insert(ctx_table, data, handle, type, free_data);
+}
+
 uint32_t
-vrend_object_insert(struct util_hash_table *handle_hash,
+vrend_object_insert(struct vrend_object_table *ctx_table,
                     void *data, uint32_t length, uint32_t handle, enum virgl_object_type type)
 {
-   return vrend_object_insert_nofree(handle_hash, data, length,
+   return vrend_object_insert_nofree(ctx_table, data, length,
                                      handle, type, true);
 }
 
 void
-vrend_object_remove(struct util_hash_table *handle_hash,
+vrend_object_remove(struct vrend_object_table *ctx_table,
                     uint32_t handle, UNUSED enum virgl_object_type type)
 {
-   util_hash_table_remove(handle_hash, intptr_to_pointer(handle));
+   table_remove(ctx_table, handle);
 }
 
-void *vrend_object_lookup(struct util_hash_table *handle_hash,
+void *vrend_object_lookup(struct vrend_object_table *ctx_table,
                           uint32_t handle, enum virgl_object_type type)
 {
-   struct vrend_object *obj;
-
-   obj = util_hash_table_get(handle_hash, intptr_to_pointer(handle));
-   if (!obj) {
-      return NULL;
-   }
-
-   if (obj->type != type)
-      return NULL;
-   return obj->data;
+   return table_lookup(ctx_table, handle, type);
 }
 
 int vrend_resource_insert(void *data, uint32_t handle)
 {
-   struct vrend_object *obj;
-
    if (!handle)
       return 0;
 
-   obj = CALLOC_STRUCT(vrend_object);
-   if (!obj)
-      return 0;
-
-   obj->handle = handle;
-   obj->data = data;
-   util_hash_table_set(res_hash, intptr_to_pointer(obj->handle), obj);
-   return obj->handle;
+   return table_insert(res_table, data, handle, 0, true);
 }
 
 void vrend_resource_remove(uint32_t handle)
 {
-   util_hash_table_remove(res_hash, intptr_to_pointer(handle));
+   table_remove(res_table, handle);
 }
 
 void *vrend_resource_lookup(uint32_t handle, UNUSED uint32_t ctx_id)
 {
-   struct vrend_object *obj;
-   obj = util_hash_table_get(res_hash, intptr_to_pointer(handle));
-   if (!obj)
-      return NULL;
-   return obj->data;
+   return table_lookup(res_table, handle, 0);
 }
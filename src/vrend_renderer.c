@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 #include "pipe/p_shader_tokens.h"
 
 #include "pipe/p_context.h"
@@ -37,6 +39,7 @@
 #include "util/u_inlines.h"
 #include "util/u_memory.h"
 #include "util/u_dual_blend.h"
+#include "util/u_hash_table.h"
 
 #include "os/os_thread.h"
 #include "util/u_double_list.h"
@@ -48,6 +51,9 @@
 
 #include "vrend_renderer.h"
 #include "vrend_debug.h"
+#include "vrend_hash.h"
+#include "vrend_disk_cache.h"
+#include "vrend_ring.h"
 
 #include "virgl_hw.h"
 
@@ -62,11 +68,59 @@ int vrend_use_debug_cb = 0;
 
 struct vrend_if_cbs *vrend_clicbs;
 
+/* Fences of one context signal in order, independent of other contexts. */
+struct vrend_fence_timeline {
+   uint32_t ctx_id;
+   /* fences created and not seen signaled yet */
+   uint32_t num_outstanding;
+   /* last fence seen signaled, to report to the client */
+   uint32_t signaled_id;
+   bool report;
+   struct list_head head;
+
+   /* owned by the thread polling the fences */
+   /* fences handed to the poller, in creation order */
+   struct list_head pending;
+   /* in vrend_state.fence_poll_list while pending isn't empty */
+   struct list_head poll_head;
+};
+
 struct vrend_fence {
    uint32_t fence_id;
    uint32_t ctx_id;
+   /* vrend_state.fence_serial when created */
+   uint32_t serial;
    GLsync syncobj;
+   bool signaled;
+   /* inserted by the renderer itself, never reported */
+   bool internal;
+   /* the readback an internal fence completes */
+   struct vrend_readback *readback;
+   struct vrend_fence_timeline *timeline;
+   /* vrend_state.fence_list, in creation order */
    struct list_head fences;
+   /* timeline->pending or a list of fences waiting for a ring */
+   struct list_head timeline_fences;
+};
+
+/* A glReadPixels into a pixel pack buffer, the data is copied to the
+ * backing of the resource once its fence signaled. */
+struct vrend_readback {
+   /* vrend_state.readback_list or readback_free_list */
+   struct list_head head;
+   GLuint pbo;
+   uint32_t pbo_size;
+   uint32_t size;
+
+   struct vrend_resource *res;
+   struct pipe_box box;
+   int level;
+   uint32_t stride;
+   uint64_t offset;
+   bool separate_invert;
+   /* vrend_state.fence_serial when issued */
+   uint32_t serial;
+   struct vrend_fence *fence;
 };
 
 struct vrend_query {
@@ -87,6 +141,7 @@ struct global_error_state {
 
 enum features_id
 {
+   feat_arb_buffer_storage,
    feat_arb_or_gles_ext_texture_buffer,
    feat_arb_robustness,
    feat_arrays_of_arrays,
@@ -95,6 +150,7 @@ enum features_id
    feat_barrier,
    feat_bind_vertex_buffers,
    feat_bit_encoding,
+   feat_clear_texture,
    feat_compute_shader,
    feat_copy_image,
    feat_conditional_render_inverted,
@@ -107,6 +163,8 @@ enum features_id
    feat_enhanced_layouts,
    feat_framebuffer_fetch,
    feat_geometry_shader,
+   feat_get_program_binary,
+   feat_get_texture_sub_image,
    feat_gl_conditional_render,
    feat_gl_prim_restart,
    feat_gles_khr_robustness,
@@ -121,6 +179,7 @@ enum features_id
    feat_multisample,
    feat_nv_conditional_render,
    feat_nv_prim_restart,
+   feat_parallel_shader_compile,
    feat_polygon_offset_clamp,
    feat_qbo,
    feat_robust_buffer_access,
@@ -167,6 +226,7 @@ static const  struct {
    const char *gl_ext[FEAT_MAX_EXTS];
    const char *log_name;
 } feature_list[] = {
+   FEAT(arb_buffer_storage, 44, UNAVAIL, "GL_ARB_buffer_storage", "GL_EXT_buffer_storage"),
    FEAT(arb_or_gles_ext_texture_buffer, 31, UNAVAIL, "GL_ARB_texture_buffer_object", "GL_EXT_texture_buffer", NULL),
    FEAT(arb_robustness, UNAVAIL, UNAVAIL,  "GL_ARB_robustness" ),
    FEAT(arrays_of_arrays, 43, 31, "GL_ARB_arrays_of_arrays"),
@@ -175,6 +235,7 @@ static const  struct {
    FEAT(barrier, 42, 31, NULL),
    FEAT(bind_vertex_buffers, 44, UNAVAIL, NULL),
    FEAT(bit_encoding, 33, UNAVAIL,  "GL_ARB_shader_bit_encoding" ),
+   FEAT(clear_texture, 44, UNAVAIL, "GL_ARB_clear_texture"),
    FEAT(compute_shader, 43, 31,  "GL_ARB_compute_shader" ),
    FEAT(copy_image, 43, 32,  "GL_ARB_copy_image", "GL_EXT_copy_image", "GL_OES_copy_image" ),
    FEAT(conditional_render_inverted, 45, UNAVAIL,  "GL_ARB_conditional_render_inverted" ),
@@ -187,6 +248,8 @@ static const  struct {
    FEAT(fb_no_attach, 43, 31,  "GL_ARB_framebuffer_no_attachments" ),
    FEAT(framebuffer_fetch, UNAVAIL, UNAVAIL,  "GL_EXT_shader_framebuffer_fetch" ),
    FEAT(geometry_shader, 32, 32, "GL_EXT_geometry_shader", "GL_OES_geometry_shader"),
+   FEAT(get_program_binary, 41, 30, "GL_ARB_get_program_binary", "GL_OES_get_program_binary"),
+   FEAT(get_texture_sub_image, 45, UNAVAIL, "GL_ARB_get_texture_sub_image"),
    FEAT(gl_conditional_render, 30, UNAVAIL, NULL),
    FEAT(gl_prim_restart, 31, 30, NULL),
    FEAT(gles_khr_robustness, UNAVAIL, UNAVAIL,  "GL_KHR_robustness" ),
@@ -201,6 +264,7 @@ static const  struct {
    FEAT(multisample, 32, 30,  "GL_ARB_texture_multisample" ),
    FEAT(nv_conditional_render, UNAVAIL, UNAVAIL,  "GL_NV_conditional_render" ),
    FEAT(nv_prim_restart, UNAVAIL, UNAVAIL,  "GL_NV_primitive_restart" ),
+   FEAT(parallel_shader_compile, UNAVAIL, UNAVAIL,  "GL_KHR_parallel_shader_compile", "GL_ARB_parallel_shader_compile" ),
    FEAT(polygon_offset_clamp, 46, UNAVAIL,  "GL_ARB_polygon_offset_clamp" ),
    FEAT(qbo, 44, UNAVAIL, "GL_ARB_query_buffer_object" ),
    FEAT(robust_buffer_access, 43, UNAVAIL,  "GL_ARB_robust_buffer_access_behavior", "GL_KHR_robust_buffer_access_behavior" ),
@@ -234,6 +298,95 @@ static const  struct {
    FEAT(angle_robustness, UNAVAIL, UNAVAIL,  "GL_EXT_robustness" ),
 };
 
+#define VREND_MAX_COMPILE_THREADS 8
+#define VREND_FENCE_RING_SIZE 1024
+#define VREND_UPLOAD_RING_SEGMENTS 4
+/* GL contexts that may upload from one ring segment without waiting */
+#define VREND_UPLOAD_RING_SYNCS 8
+
+/* how buffer resources are mapped, see vrend_create_buffer */
+#define VREND_BUFFER_MAP_PER_TRANSFER 0
+#define VREND_BUFFER_MAP_COHERENT 1
+#define VREND_BUFFER_MAP_FLUSH_EXPLICIT 2
+
+/* Freed textures and buffers waiting to back a new resource of the same
+ * shape, see vrend_pool_acquire */
+struct vrend_pool_key {
+   GLenum target;
+   uint32_t format;
+   uint32_t width;
+   uint32_t height;
+   uint32_t depth;
+   uint32_t array_size;
+   uint32_t last_level;
+   uint32_t nr_samples;
+};
+
+struct vrend_pool_bucket {
+   struct vrend_pool_key key;
+   struct list_head entries;
+};
+
+struct vrend_pool_entry {
+   /* in vrend_state.pool_lru, oldest first */
+   struct list_head head;
+   struct list_head bucket_head;
+   struct vrend_pool_bucket *bucket;
+   GLuint id;
+   char *map;
+   uint32_t size;
+   /* the GPU may still use the storage until this serial retired */
+   uint32_t fence_serial;
+   uint64_t release_ms;
+};
+
+/* chunk sizes of the buffer heap go from vrend_state.heap_min_chunk up in
+ * powers of two */
+#define VREND_HEAP_CLASSES 9
+#define VREND_HEAP_MAX_CHUNK (64 * 1024)
+
+struct vrend_heap_slab {
+   /* in the heap_slabs of its owner for its chunk size, slabs of buffers
+    * no context has been attached to yet are in vrend_state.heap_slabs and
+    * those of destroyed contexts in vrend_state.heap_orphans */
+   struct list_head head;
+   struct vrend_context *owner;
+   bool orphan;
+   GLuint id;
+   char *map;
+   uint32_t chunk_size;
+   uint32_t num_chunks;
+   /* stack of free chunk indices */
+   uint32_t num_free;
+   uint32_t *free_chunks;
+};
+
+/* a chunk that is only free once the GPU is done with it */
+struct vrend_heap_pending {
+   struct list_head head;
+   struct vrend_heap_slab *slab;
+   uint32_t chunk;
+   uint32_t fence_serial;
+};
+
+/* Pixel unpack buffer texture uploads are staged in.  With buffer storage
+ * it stays mapped and every segment gets a fence when the write position
+ * leaves it, which is waited for before the segment is written again.
+ * Otherwise the buffer is orphaned whenever the position wraps around and
+ * ranges of it are mapped unsynchronized. */
+struct vrend_upload_ring {
+   GLuint buffer;
+   uint32_t size;
+   uint32_t offset;
+   char *map;
+   /* a fence per GL context that uploaded from the segment, see
+    * vrend_upload_ring_fence_context */
+   GLsync segment_syncs[VREND_UPLOAD_RING_SEGMENTS][VREND_UPLOAD_RING_SYNCS];
+   uint32_t num_syncs[VREND_UPLOAD_RING_SEGMENTS];
+   /* the current GL context uploaded from the ring since its last fence */
+   bool unfenced;
+};
+
 struct global_renderer_state {
    int gl_major_ver;
    int gl_minor_ver;
@@ -255,20 +408,153 @@ struct global_renderer_state {
    struct list_head active_ctx_list;
 
    /* threaded sync */
-   bool stop_sync_thread;
+   int stop_sync_thread;
    int eventfd;
-
-   pipe_mutex fence_mutex;
+   /* wakes the sync thread when it is idle */
+   int sync_wake_fd;
+   /* one of VREND_SYNC_*, what the sync thread sleeps on */
+   int sync_thread_idle;
+
+   /* New fences go to the sync thread through fence_submit_ring and come
+    * back through fence_signaled_ring once they signaled.  Each ring has
+    * one producer and one consumer, everything else is owned by one of the
+    * threads: the fence and timeline lists by the main thread, the poll
+    * and done lists by the thread polling the fences, which is the main
+    * thread when there is no sync thread. */
+   struct vrend_ring fence_submit_ring;
+   struct vrend_ring fence_signaled_ring;
    struct list_head fence_list;
-   struct list_head fence_wait_list;
-   pipe_condvar fence_cond;
+   struct list_head fence_timelines;
+   /* fences that didn't fit into fence_submit_ring yet */
+   struct list_head fence_overflow_list;
+   struct list_head fence_poll_list;
+   /* signaled fences that didn't fit into fence_signaled_ring yet */
+   struct list_head fence_done_list;
+   /* the eventfd was signaled and vrend_renderer_check_fences didn't run
+    * since */
+   int fences_to_collect;
+   /* fence structs for reuse */
+   struct list_head fence_free_list;
+   uint64_t fences_created;
+   uint64_t fence_batches;
+   uint64_t fence_wakeups;
+   uint64_t sync_thread_wakeups;
 
    pipe_thread sync_thread;
    virgl_gl_context sync_context;
+
+   /* Resources used by the GPU are stamped with the serial the next fence
+    * gets, they are idle once the fence with that serial retired. */
+   uint32_t fence_serial;
+   uint32_t retired_serial;
+
+   /* one of VREND_BUFFER_MAP_* */
+   int buffer_map_mode;
+
+   /* transfers walking the guest iovecs row by row, see
+    * vrend_transfer_iov_rows */
+   char *row_scratch;
+   uint32_t row_scratch_size;
+   uint64_t rows_direct_bytes;
+   uint64_t rows_staged_bytes;
+
+   /* texture uploads, see vrend_upload_ring_map */
+   unsigned upload_ring_size;
+   bool upload_ring_failed;
+   struct vrend_upload_ring upload_ring;
+   uint64_t ring_uploads;
+   uint64_t ring_upload_bytes;
+   uint64_t ring_stalls;
+   uint64_t ring_orphans;
+
+   /* asynchronous readback, see vrend_readback_issue */
+   bool use_async_readback;
+   unsigned max_readback_pbos;
+   unsigned num_readback_pbos;
+   /* in issue order */
+   struct list_head readback_list;
+   struct list_head readback_free_list;
+   uint64_t readbacks_async;
+   uint64_t readbacks_sync;
+   uint64_t readback_stalls;
+
+   /* resource_copy_region, by the path that did the copy */
+   uint64_t copies_copy_image;
+   uint64_t copies_blit;
+   uint64_t copies_pbo;
+   uint64_t copies_cpu;
+   /* staging buffer of vrend_resource_copy_pbo, grown as needed */
+   GLuint copy_pbo;
+   uint32_t copy_pbo_size;
+
+   /* resource storage recycling, see vrend_pool_acquire */
+   struct util_hash_table *pool_hash;
+   struct list_head pool_lru;
+   uint64_t pool_size;
+   uint64_t pool_max_size;
+   uint64_t pool_max_age_ms;
+   uint64_t pool_hits;
+   uint64_t pool_misses;
+   uint64_t pool_trimmed;
+
+   /* small buffers sub-allocated from shared slabs, see vrend_heap_alloc */
+   uint32_t heap_slab_size;
+   uint32_t heap_min_chunk;
+   struct list_head heap_slabs[VREND_HEAP_CLASSES];
+   struct list_head heap_orphans;
+   struct list_head heap_pending;
+   uint32_t heap_num_slabs;
+   uint64_t heap_allocs;
+   uint64_t heap_slabs_created;
+   /* bumped whenever a heap buffer moves to a GL buffer of its own */
+   uint32_t heap_evictions;
+
+   /* asynchronous shader compilation, see vrend_shader_wait_compiled */
+   bool use_parallel_compile;
+   bool stop_compile_threads;
+   unsigned num_compile_threads;
+   pipe_thread compile_threads[VREND_MAX_COMPILE_THREADS];
+   pipe_mutex compile_mutex;
+   pipe_condvar compile_cond;
+   pipe_condvar compile_done_cond;
+   struct list_head compile_queue;
+   uint64_t shader_compiles_async;
+   uint64_t shader_compile_stalls;
+
+   /* bumped whenever sampler objects are deleted */
+   uint32_t sampler_generation;
+   uint64_t gl_calls_elided;
+
+   /* state updates dropped because they matched what was already set */
+   struct {
+      uint64_t viewports;
+      uint64_t scissors;
+      uint64_t blend_colors;
+      uint64_t stencil_refs;
+      uint64_t sampler_views;
+      uint64_t constants;
+   } elided;
+
+   /* linked program cache, per sub context; 0 means unbounded */
+   unsigned max_programs;
+   uint64_t program_cache_hits;
+   uint64_t program_cache_misses;
+   uint64_t program_cache_evictions;
+
+   /* optional on disk cache of linked program binaries */
+   struct vrend_disk_cache *program_binary_cache;
+   struct vrend_disk_cache_key driver_key;
 };
 
 static struct global_renderer_state vrend_state;
 
+/* the sync thread runs */
+#define VREND_SYNC_RUNNING 0
+/* it waits for vrend_submit_fence */
+#define VREND_SYNC_WAIT_FENCES 1
+/* it waits for the main thread to make room in fence_signaled_ring */
+#define VREND_SYNC_WAIT_ROOM 2
+
 static inline bool has_feature(enum features_id feature_id)
 {
    VREND_DEBUG(dbg_feature_use, NULL, "Try using feature %s:%d\n",
@@ -282,10 +568,22 @@ static inline void set_feature(enum features_id feature_id)
    vrend_state.features[feature_id] = true;
 }
 
+struct vrend_program_key {
+   GLuint vs_id;
+   GLuint fs_id;
+   GLuint gs_id;
+   GLuint tcs_id;
+   GLuint tes_id;
+   GLuint cs_id;
+   uint32_t dual_src;
+};
+
 struct vrend_linked_shader_program {
+   /* in least recently used order, see lookup_program */
    struct list_head head;
    struct list_head sl[PIPE_SHADER_TYPES];
    GLuint id;
+   struct vrend_program_key key;
 
    bool dual_src_linked;
    struct vrend_shader *ss[PIPE_SHADER_TYPES];
@@ -314,6 +612,16 @@ struct vrend_linked_shader_program {
    GLuint *ssbo_locs[PIPE_SHADER_TYPES];
 
    struct vrend_sub_context *ref_context;
+   struct vrend_sub_context *sub_ctx;
+};
+
+enum vrend_compile_state {
+   VREND_COMPILE_DONE,
+   /* waiting in compile_queue for a worker thread */
+   VREND_COMPILE_QUEUED,
+   VREND_COMPILE_RUNNING,
+   /* handed to the driver, see GL_KHR_parallel_shader_compile */
+   VREND_COMPILE_DRIVER,
 };
 
 struct vrend_shader {
@@ -324,7 +632,13 @@ struct vrend_shader {
    GLuint id;
    GLuint compiled_fs_id;
    struct vrend_shader_key key;
+   uint64_t key_hash;
    struct list_head programs;
+
+   /* protected by compile_mutex while a worker thread owns the shader */
+   struct list_head compile_head;
+   enum vrend_compile_state compile_state;
+   bool compile_failed;
 };
 
 struct vrend_shader_selector {
@@ -335,6 +649,9 @@ struct vrend_shader_selector {
    struct vrend_shader_info sinfo;
 
    struct vrend_shader *current;
+   /* all variants, chained through next_variant and indexed by key_hash */
+   struct vrend_shader *variants;
+   struct util_hash_table *variant_hash;
    struct tgsi_token *tokens;
 
    uint32_t req_local_mem;
@@ -469,6 +786,107 @@ struct vrend_streamout_object {
 #define XFB_STATE_STARTED 2
 #define XFB_STATE_PAUSED 3
 
+/* glEnable/glDisable capabilities tracked by vrend_gl_state, GL_BLEND is
+ * tracked per render target instead */
+enum vrend_gl_cap {
+   VREND_GL_COLOR_LOGIC_OP,
+   VREND_GL_SAMPLE_ALPHA_TO_COVERAGE,
+   VREND_GL_SAMPLE_ALPHA_TO_ONE,
+   VREND_GL_DITHER,
+   VREND_GL_DEPTH_TEST,
+   VREND_GL_ALPHA_TEST,
+   VREND_GL_STENCIL_TEST,
+   VREND_GL_DEPTH_CLAMP,
+   VREND_GL_PROGRAM_POINT_SIZE,
+   VREND_GL_RASTERIZER_DISCARD,
+   VREND_GL_POLYGON_OFFSET_FILL,
+   VREND_GL_POLYGON_OFFSET_LINE,
+   VREND_GL_POLYGON_OFFSET_POINT,
+   VREND_GL_POLYGON_STIPPLE,
+   VREND_GL_POINT_SPRITE,
+   VREND_GL_CULL_FACE,
+   VREND_GL_VERTEX_PROGRAM_TWO_SIDE,
+   VREND_GL_LINE_STIPPLE,
+   VREND_GL_LINE_SMOOTH,
+   VREND_GL_POLYGON_SMOOTH,
+   VREND_GL_SAMPLE_MASK,
+   VREND_GL_MULTISAMPLE,
+   VREND_GL_SAMPLE_SHADING,
+   VREND_GL_SCISSOR_TEST,
+   VREND_GL_FRAMEBUFFER_SRGB,
+   VREND_GL_TEXTURE_CUBE_MAP_SEAMLESS,
+   VREND_GL_NUM_CAPS,
+};
+
+/* other tracked values, bits in vrend_gl_state::values_known */
+enum vrend_gl_value {
+   VREND_GL_LOGIC_OP,
+   VREND_GL_BLEND_COLOR,
+   VREND_GL_DEPTH_FUNC,
+   VREND_GL_DEPTH_MASK,
+   VREND_GL_STENCIL_FUNC_FRONT,
+   VREND_GL_STENCIL_FUNC_BACK,
+   VREND_GL_STENCIL_OP_FRONT,
+   VREND_GL_STENCIL_OP_BACK,
+   VREND_GL_STENCIL_MASK_FRONT,
+   VREND_GL_STENCIL_MASK_BACK,
+   VREND_GL_FRONT_FACE,
+   VREND_GL_CULL_FACE_MODE,
+   VREND_GL_POLYGON_MODE_FRONT,
+   VREND_GL_POLYGON_MODE_BACK,
+   VREND_GL_POLYGON_OFFSET,
+   VREND_GL_LINE_WIDTH,
+   VREND_GL_POINT_SIZE,
+};
+
+#define VREND_GL_MAX_SAMPLER_UNITS (PIPE_SHADER_TYPES * PIPE_MAX_SHADER_SAMPLER_VIEWS)
+
+struct vrend_gl_stencil_face {
+   GLenum func;
+   GLint ref;
+   GLuint valuemask;
+   GLenum op[3];
+   GLuint writemask;
+};
+
+/* Shadow of the GL state the renderer sets, used to drop calls that
+ * wouldn't change anything.  Each sub context owns its GL context, so the
+ * shadow lives in the sub context.  A value is only trusted while its bit
+ * is set in the matching *_known mask, clearing those masks invalidates
+ * the whole shadow.
+ */
+struct vrend_gl_state {
+   uint32_t caps_known;
+   uint32_t caps_enabled;
+   uint32_t values_known;
+
+   uint32_t blend_known;
+   uint32_t blend_enabled;
+   uint32_t blend_func_known;
+   uint32_t blend_eq_known;
+   GLenum blend_func[PIPE_MAX_COLOR_BUFS][4];
+   GLenum blend_eq[PIPE_MAX_COLOR_BUFS][2];
+   GLfloat blend_color[4];
+   GLenum logic_op;
+
+   GLenum depth_func;
+   GLboolean depth_mask;
+   struct vrend_gl_stencil_face stencil[2];
+
+   GLenum front_face;
+   GLenum cull_face;
+   GLenum polygon_mode[2];
+   GLfloat polygon_offset[3];
+   GLfloat line_width;
+   GLfloat point_size;
+
+   /* sampler objects can be deleted while bound, in which case GL unbinds
+    * them, so the bindings are only valid for one sampler generation */
+   uint32_t sampler_generation;
+   uint32_t samplers_known[VREND_GL_MAX_SAMPLER_UNITS / 32];
+   GLuint samplers[VREND_GL_MAX_SAMPLER_UNITS];
+};
+
 struct vrend_sub_context {
    struct list_head head;
 
@@ -480,7 +898,9 @@ struct vrend_sub_context {
    uint32_t enabled_attribs_bitmask;
 
    struct list_head programs;
-   struct util_hash_table *object_hash;
+   struct util_hash_table *program_hash;
+   unsigned num_programs;
+   struct vrend_object_table *object_hash;
 
    struct vrend_vertex_element_array *ve;
    int num_vbos;
@@ -528,9 +948,13 @@ struct vrend_sub_context {
    uint32_t scissor_state_dirty;
    uint32_t viewport_state_dirty;
    uint32_t viewport_state_initialized;
+   /* slots the guest has set, vp_state/ss are only valid for those */
+   uint32_t viewport_state_set;
+   uint32_t scissor_state_set;
 
    uint32_t fb_height;
 
+   struct pipe_viewport_state vp_state[PIPE_MAX_VIEWPORTS];
    struct pipe_scissor_state ss[PIPE_MAX_VIEWPORTS];
 
    struct pipe_blend_state blend_state;
@@ -549,9 +973,7 @@ struct vrend_sub_context {
 
    struct pipe_clip_state ucp_state;
 
-   bool depth_test_enabled;
-   bool alpha_test_enabled;
-   bool stencil_test_enabled;
+   struct vrend_gl_state gl_state;
 
    GLuint program_id;
    int last_shader_idx;
@@ -577,6 +999,11 @@ struct vrend_sub_context {
 
    struct vrend_abo abo[PIPE_MAX_HW_ATOMIC_BUFFERS];
    uint32_t abo_used_mask;
+
+   /* fence serial the bound resources were last stamped with */
+   uint32_t stamped_serial;
+   /* vrend_state.heap_evictions when the buffer bindings were last set */
+   uint32_t heap_evictions;
 };
 
 struct vrend_context {
@@ -598,7 +1025,10 @@ struct vrend_context {
    enum virgl_ctx_errors last_error;
 
    /* resource bounds to this context */
-   struct util_hash_table *res_hash;
+   struct vrend_object_table *res_hash;
+
+   /* heap slabs of the buffers first attached to this context */
+   struct list_head heap_slabs[VREND_HEAP_CLASSES];
 
    struct list_head active_nontimer_query_list;
    struct list_head ctx_entry;
@@ -609,6 +1039,23 @@ struct vrend_context {
 };
 
 static struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx, int res_handle);
+static struct vrend_resource *vrend_renderer_ctx_res_use(struct vrend_context *ctx, int res_handle);
+static void vrend_stamp_bound_resources(struct vrend_sub_context *sub);
+static void vrend_reset_fences(void);
+static void vrend_upload_ring_fini(void);
+static void vrend_copy_pbo_fini(void);
+static void vrend_pool_init(void);
+static void vrend_pool_fini(void);
+static void vrend_heap_init(void);
+static void vrend_heap_fini(void);
+static void vrend_heap_orphan_slabs(struct vrend_context *ctx);
+static void vrend_heap_adopt(struct vrend_context *ctx, struct vrend_resource *res);
+static bool vrend_heap_evict(struct vrend_resource *res);
+static void vrend_heap_rebind_evicted(struct vrend_sub_context *sub);
+static void vrend_buffer_map_sync(void);
+static struct vrend_fence *vrend_fence_alloc(void);
+static int vrend_insert_fence(struct vrend_fence *fence, uint32_t ctx_id);
+static void vrend_readback_flush_resource(struct vrend_resource *res);
 static void vrend_pause_render_condition(struct vrend_context *ctx, bool pause);
 static void vrend_update_viewport_state(struct vrend_context *ctx);
 static void vrend_update_scissor_state(struct vrend_context *ctx);
@@ -879,6 +1326,121 @@ static void vrend_shader_dump(struct vrend_shader *shader)
    vrend_printf("\n");
 }
 
+static void vrend_shader_start_compile(struct vrend_shader *shader)
+{
+   const char *shader_parts[SHADER_MAX_STRINGS];
+
+   for (int i = 0; i < shader->glsl_strings.num_strings; i++)
+      shader_parts[i] = shader->glsl_strings.strings[i].buf;
+   glShaderSource(shader->id, shader->glsl_strings.num_strings, shader_parts, NULL);
+   glCompileShader(shader->id);
+}
+
+/* blocks until the driver is done with the shader, may run on a worker */
+static bool vrend_shader_check_compiled(struct vrend_shader *shader)
+{
+   GLint param;
+
+   glGetShaderiv(shader->id, GL_COMPILE_STATUS, &param);
+   if (param == GL_FALSE) {
+      char infolog[65536];
+      int len;
+      glGetShaderInfoLog(shader->id, 65536, &len, infolog);
+      vrend_printf("shader failed to compile\n%s\n", infolog);
+      vrend_shader_dump(shader);
+      return false;
+   }
+   return true;
+}
+
+static bool vrend_compile_shader(struct vrend_context *ctx,
+                                 struct vrend_shader *shader)
+{
+   vrend_shader_start_compile(shader);
+   if (!vrend_shader_check_compiled(shader)) {
+      report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
+      return false;
+   }
+   return true;
+}
+
+/* Start compiling a freshly translated shader without waiting for the
+ * result.  Either a worker thread compiles it on its own shared context,
+ * or the driver does when it supports parallel compilation, which only
+ * blocks once we ask for the compile status.
+ */
+static void vrend_compile_shader_async(struct vrend_shader *shader)
+{
+   vrend_state.shader_compiles_async++;
+
+   if (vrend_state.num_compile_threads) {
+      pipe_mutex_lock(vrend_state.compile_mutex);
+      shader->compile_state = VREND_COMPILE_QUEUED;
+      list_addtail(&shader->compile_head, &vrend_state.compile_queue);
+      pipe_condvar_signal(vrend_state.compile_cond);
+      pipe_mutex_unlock(vrend_state.compile_mutex);
+   } else {
+      vrend_shader_start_compile(shader);
+      shader->compile_state = VREND_COMPILE_DRIVER;
+   }
+}
+
+/* Called whenever the GL shader object is about to be used, this is the
+ * only point where the renderer thread blocks on an asynchronous compile.
+ */
+static bool vrend_shader_wait_compiled(struct vrend_context *ctx,
+                                       struct vrend_shader *shader)
+{
+   if (vrend_state.num_compile_threads) {
+      pipe_mutex_lock(vrend_state.compile_mutex);
+      if (shader->compile_state == VREND_COMPILE_QUEUED) {
+         /* no worker got to it yet, don't wait behind the rest of the queue */
+         list_del(&shader->compile_head);
+         pipe_mutex_unlock(vrend_state.compile_mutex);
+
+         vrend_state.shader_compile_stalls++;
+         vrend_shader_start_compile(shader);
+         shader->compile_failed = !vrend_shader_check_compiled(shader);
+         shader->compile_state = VREND_COMPILE_DONE;
+      } else {
+         if (shader->compile_state == VREND_COMPILE_RUNNING)
+            vrend_state.shader_compile_stalls++;
+         while (shader->compile_state == VREND_COMPILE_RUNNING)
+            pipe_condvar_wait(vrend_state.compile_done_cond, vrend_state.compile_mutex);
+         pipe_mutex_unlock(vrend_state.compile_mutex);
+      }
+   } else if (shader->compile_state == VREND_COMPILE_DRIVER) {
+      GLint done = GL_FALSE;
+
+      glGetShaderiv(shader->id, GL_COMPLETION_STATUS_KHR, &done);
+      if (done == GL_FALSE)
+         vrend_state.shader_compile_stalls++;
+      shader->compile_failed = !vrend_shader_check_compiled(shader);
+      shader->compile_state = VREND_COMPILE_DONE;
+   }
+
+   if (shader->compile_failed) {
+      report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
+      return false;
+   }
+   return true;
+}
+
+/* drop a pending compile, or wait for it if a worker is already busy */
+static void vrend_shader_cancel_compile(struct vrend_shader *shader)
+{
+   if (!vrend_state.num_compile_threads)
+      return;
+
+   pipe_mutex_lock(vrend_state.compile_mutex);
+   if (shader->compile_state == VREND_COMPILE_QUEUED)
+      list_del(&shader->compile_head);
+   while (shader->compile_state == VREND_COMPILE_RUNNING)
+      pipe_condvar_wait(vrend_state.compile_done_cond, vrend_state.compile_mutex);
+   shader->compile_state = VREND_COMPILE_DONE;
+   pipe_mutex_unlock(vrend_state.compile_mutex);
+}
+
 static void vrend_shader_destroy(struct vrend_shader *shader)
 {
    struct vrend_linked_shader_program *ent, *tmp;
@@ -887,6 +1449,7 @@ static void vrend_shader_destroy(struct vrend_shader *shader)
       vrend_destroy_program(ent);
    }
 
+   vrend_shader_cancel_compile(shader);
    glDeleteShader(shader->id);
    strarray_free(&shader->glsl_strings, true);
    free(shader);
@@ -894,13 +1457,15 @@ static void vrend_shader_destroy(struct vrend_shader *shader)
 
 static void vrend_destroy_shader_selector(struct vrend_shader_selector *sel)
 {
-   struct vrend_shader *p = sel->current, *c;
+   struct vrend_shader *p = sel->variants, *c;
    unsigned i;
    while (p) {
       c = p->next_variant;
       vrend_shader_destroy(p);
       p = c;
    }
+   if (sel->variant_hash)
+      util_hash_table_destroy(sel->variant_hash);
    if (sel->sinfo.so_names)
       for (i = 0; i < sel->sinfo.so_info.num_outputs; i++)
          free(sel->sinfo.so_names[i]);
@@ -913,29 +1478,6 @@ static void vrend_destroy_shader_selector(struct vrend_shader_selector *sel)
    free(sel);
 }
 
-static bool vrend_compile_shader(struct vrend_context *ctx,
-                                 struct vrend_shader *shader)
-{
-   GLint param;
-   const char *shader_parts[SHADER_MAX_STRINGS];
-
-   for (int i = 0; i < shader->glsl_strings.num_strings; i++)
-      shader_parts[i] = shader->glsl_strings.strings[i].buf;
-   glShaderSource(shader->id, shader->glsl_strings.num_strings, shader_parts, NULL);
-   glCompileShader(shader->id);
-   glGetShaderiv(shader->id, GL_COMPILE_STATUS, &param);
-   if (param == GL_FALSE) {
-      char infolog[65536];
-      int len;
-      glGetShaderInfoLog(shader->id, 65536, &len, infolog);
-      report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
-      vrend_printf("shader failed to compile\n%s\n", infolog);
-      vrend_shader_dump(shader);
-      return false;
-   }
-   return true;
-}
-
 static inline void
 vrend_shader_state_reference(struct vrend_shader_selector **ptr, struct vrend_shader_selector *shader)
 {
@@ -997,133 +1539,526 @@ static void vrend_init_pstipple_texture(struct vrend_context *ctx)
    ctx->pstip_inited = true;
 }
 
-static void vrend_depth_test_enable(struct vrend_context *ctx, bool depth_test_enable)
+static const GLenum vrend_gl_caps[VREND_GL_NUM_CAPS] = {
+   [VREND_GL_COLOR_LOGIC_OP] = GL_COLOR_LOGIC_OP,
+   [VREND_GL_SAMPLE_ALPHA_TO_COVERAGE] = GL_SAMPLE_ALPHA_TO_COVERAGE,
+   [VREND_GL_SAMPLE_ALPHA_TO_ONE] = GL_SAMPLE_ALPHA_TO_ONE,
+   [VREND_GL_DITHER] = GL_DITHER,
+   [VREND_GL_DEPTH_TEST] = GL_DEPTH_TEST,
+   [VREND_GL_ALPHA_TEST] = GL_ALPHA_TEST,
+   [VREND_GL_STENCIL_TEST] = GL_STENCIL_TEST,
+   [VREND_GL_DEPTH_CLAMP] = GL_DEPTH_CLAMP,
+   [VREND_GL_PROGRAM_POINT_SIZE] = GL_PROGRAM_POINT_SIZE,
+   [VREND_GL_RASTERIZER_DISCARD] = GL_RASTERIZER_DISCARD,
+   [VREND_GL_POLYGON_OFFSET_FILL] = GL_POLYGON_OFFSET_FILL,
+   [VREND_GL_POLYGON_OFFSET_LINE] = GL_POLYGON_OFFSET_LINE,
+   [VREND_GL_POLYGON_OFFSET_POINT] = GL_POLYGON_OFFSET_POINT,
+   [VREND_GL_POLYGON_STIPPLE] = GL_POLYGON_STIPPLE,
+   [VREND_GL_POINT_SPRITE] = GL_POINT_SPRITE,
+   [VREND_GL_CULL_FACE] = GL_CULL_FACE,
+   [VREND_GL_VERTEX_PROGRAM_TWO_SIDE] = GL_VERTEX_PROGRAM_TWO_SIDE,
+   [VREND_GL_LINE_STIPPLE] = GL_LINE_STIPPLE,
+   [VREND_GL_LINE_SMOOTH] = GL_LINE_SMOOTH,
+   [VREND_GL_POLYGON_SMOOTH] = GL_POLYGON_SMOOTH,
+   [VREND_GL_SAMPLE_MASK] = GL_SAMPLE_MASK,
+   [VREND_GL_MULTISAMPLE] = GL_MULTISAMPLE,
+   [VREND_GL_SAMPLE_SHADING] = GL_SAMPLE_SHADING,
+   [VREND_GL_SCISSOR_TEST] = GL_SCISSOR_TEST,
+   [VREND_GL_FRAMEBUFFER_SRGB] = GL_FRAMEBUFFER_SRGB,
+   [VREND_GL_TEXTURE_CUBE_MAP_SEAMLESS] = GL_TEXTURE_CUBE_MAP_SEAMLESS,
+};
+
+#define VREND_GL_ALL_RTS ((1u << PIPE_MAX_COLOR_BUFS) - 1)
+
+/* forget everything about the GL state, used when it was changed behind
+ * the back of the shadow */
+static void vrend_gl_state_invalidate(struct vrend_gl_state *gl)
 {
-   if (ctx->sub->depth_test_enabled != depth_test_enable) {
-      ctx->sub->depth_test_enabled = depth_test_enable;
-      if (depth_test_enable)
-         glEnable(GL_DEPTH_TEST);
-      else
-         glDisable(GL_DEPTH_TEST);
+   gl->caps_known = 0;
+   gl->values_known = 0;
+   gl->blend_known = 0;
+   gl->blend_func_known = 0;
+   gl->blend_eq_known = 0;
+   memset(gl->samplers_known, 0, sizeof(gl->samplers_known));
+}
+
+/* returns true if the value is already set, otherwise marks it as set
+ * and the caller issues the GL call */
+static inline bool vrend_gl_value_cached(struct vrend_gl_state *gl,
+                                         enum vrend_gl_value value,
+                                         bool equal)
+{
+   if ((gl->values_known & (1u << value)) && equal) {
+      vrend_state.gl_calls_elided++;
+      return true;
    }
+   gl->values_known |= 1u << value;
+   return false;
 }
 
-static void vrend_alpha_test_enable(struct vrend_context *ctx, bool alpha_test_enable)
+static void vrend_gl_enable(struct vrend_context *ctx, enum vrend_gl_cap cap,
+                            bool enable)
 {
-   if (vrend_state.use_core_profile) {
-      /* handled in shaders */
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+   uint32_t bit = 1u << cap;
+
+   if ((gl->caps_known & bit) && !!(gl->caps_enabled & bit) == enable) {
+      vrend_state.gl_calls_elided++;
       return;
    }
-   if (ctx->sub->alpha_test_enabled != alpha_test_enable) {
-      ctx->sub->alpha_test_enabled = alpha_test_enable;
-      if (alpha_test_enable)
-         glEnable(GL_ALPHA_TEST);
-      else
-         glDisable(GL_ALPHA_TEST);
+
+   gl->caps_known |= bit;
+   if (enable) {
+      gl->caps_enabled |= bit;
+      glEnable(vrend_gl_caps[cap]);
+   } else {
+      gl->caps_enabled &= ~bit;
+      glDisable(vrend_gl_caps[cap]);
    }
 }
 
-static void vrend_stencil_test_enable(struct vrend_context *ctx, bool stencil_test_enable)
+/* rt < 0 sets GL_BLEND for all render targets */
+static void vrend_gl_blend_enable(struct vrend_context *ctx, int rt, bool enable)
 {
-   if (ctx->sub->stencil_test_enabled != stencil_test_enable) {
-      ctx->sub->stencil_test_enabled = stencil_test_enable;
-      if (stencil_test_enable)
-         glEnable(GL_STENCIL_TEST);
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+   uint32_t mask = rt < 0 ? VREND_GL_ALL_RTS : 1u << rt;
+
+   if ((gl->blend_known & mask) == mask &&
+       (gl->blend_enabled & mask) == (enable ? mask : 0)) {
+      vrend_state.gl_calls_elided++;
+      return;
+   }
+
+   gl->blend_known |= mask;
+   if (enable)
+      gl->blend_enabled |= mask;
+   else
+      gl->blend_enabled &= ~mask;
+
+   if (rt < 0) {
+      if (enable)
+         glEnable(GL_BLEND);
       else
-         glDisable(GL_STENCIL_TEST);
+         glDisable(GL_BLEND);
+   } else if (enable) {
+      glEnableIndexedEXT(GL_BLEND, rt);
+   } else {
+      glDisableIndexedEXT(GL_BLEND, rt);
    }
 }
 
-static void dump_stream_out(struct pipe_stream_output_info *so)
+static void vrend_gl_blend_func(struct vrend_context *ctx, int rt,
+                                GLenum src_rgb, GLenum dst_rgb,
+                                GLenum src_alpha, GLenum dst_alpha)
 {
-   unsigned i;
-   if (!so)
-      return;
-   vrend_printf("streamout: %d\n", so->num_outputs);
-   vrend_printf("strides: ");
-   for (i = 0; i < 4; i++)
-      vrend_printf("%d ", so->stride[i]);
-   vrend_printf("\n");
-   vrend_printf("outputs:\n");
-   for (i = 0; i < so->num_outputs; i++) {
-      vrend_printf("\t%d: reg: %d sc: %d, nc: %d ob: %d do: %d st: %d\n",
-                   i,
-                   so->output[i].register_index,
-                   so->output[i].start_component,
-                   so->output[i].num_components,
-                   so->output[i].output_buffer,
-                   so->output[i].dst_offset,
-                   so->output[i].stream);
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+   const GLenum func[4] = { src_rgb, dst_rgb, src_alpha, dst_alpha };
+   uint32_t mask = rt < 0 ? VREND_GL_ALL_RTS : 1u << rt;
+   uint32_t m;
+
+   if ((gl->blend_func_known & mask) == mask) {
+      bool equal = true;
+      for (m = mask; m && equal; ) {
+         int i = u_bit_scan(&m);
+         equal = !memcmp(gl->blend_func[i], func, sizeof(func));
+      }
+      if (equal) {
+         vrend_state.gl_calls_elided++;
+         return;
+      }
    }
+
+   gl->blend_func_known |= mask;
+   for (m = mask; m; ) {
+      int i = u_bit_scan(&m);
+      memcpy(gl->blend_func[i], func, sizeof(func));
+   }
+
+   if (rt < 0)
+      glBlendFuncSeparate(src_rgb, dst_rgb, src_alpha, dst_alpha);
+   else
+      glBlendFuncSeparateiARB(rt, src_rgb, dst_rgb, src_alpha, dst_alpha);
 }
 
-static char *get_skip_str(int *skip_val)
+static void vrend_gl_blend_equation(struct vrend_context *ctx, int rt,
+                                    GLenum mode_rgb, GLenum mode_alpha)
 {
-   char *start_skip = NULL;
-   if (*skip_val < 0) {
-      *skip_val = 0;
-      return NULL;
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+   uint32_t mask = rt < 0 ? VREND_GL_ALL_RTS : 1u << rt;
+   uint32_t m;
+
+   if ((gl->blend_eq_known & mask) == mask) {
+      bool equal = true;
+      for (m = mask; m && equal; ) {
+         int i = u_bit_scan(&m);
+         equal = gl->blend_eq[i][0] == mode_rgb && gl->blend_eq[i][1] == mode_alpha;
+      }
+      if (equal) {
+         vrend_state.gl_calls_elided++;
+         return;
+      }
    }
 
-   if (*skip_val == 1) {
-      start_skip = strdup("gl_SkipComponents1");
-      *skip_val -= 1;
-   } else if (*skip_val == 2) {
-      start_skip = strdup("gl_SkipComponents2");
-      *skip_val -= 2;
-   } else if (*skip_val == 3) {
-      start_skip = strdup("gl_SkipComponents3");
-      *skip_val -= 3;
-   } else if (*skip_val >= 4) {
-      start_skip = strdup("gl_SkipComponents4");
-      *skip_val -= 4;
+   gl->blend_eq_known |= mask;
+   for (m = mask; m; ) {
+      int i = u_bit_scan(&m);
+      gl->blend_eq[i][0] = mode_rgb;
+      gl->blend_eq[i][1] = mode_alpha;
    }
-   return start_skip;
+
+   if (rt < 0)
+      glBlendEquationSeparate(mode_rgb, mode_alpha);
+   else
+      glBlendEquationSeparateiARB(rt, mode_rgb, mode_alpha);
 }
 
-static void set_stream_out_varyings(struct vrend_context *ctx, int prog_id,
-                                    struct vrend_shader_info *sinfo)
+static void vrend_gl_blend_color(struct vrend_context *ctx, const GLfloat color[4])
 {
-   struct pipe_stream_output_info *so = &sinfo->so_info;
-   char *varyings[PIPE_MAX_SHADER_OUTPUTS*2];
-   int j;
-   uint i, n_outputs = 0;
-   int last_buffer = 0;
-   char *start_skip;
-   int buf_offset = 0;
-   int skip;
-   if (!so->num_outputs)
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_BLEND_COLOR,
+                             !memcmp(gl->blend_color, color, sizeof(gl->blend_color))))
       return;
+   memcpy(gl->blend_color, color, sizeof(gl->blend_color));
+   glBlendColor(color[0], color[1], color[2], color[3]);
+}
 
-   VREND_DEBUG_EXT(dbg_shader_streamout, ctx, dump_stream_out(so));
+static void vrend_gl_logic_op(struct vrend_context *ctx, GLenum op)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
 
-   for (i = 0; i < so->num_outputs; i++) {
-      if (last_buffer != so->output[i].output_buffer) {
+   if (vrend_gl_value_cached(gl, VREND_GL_LOGIC_OP, gl->logic_op == op))
+      return;
+   gl->logic_op = op;
+   glLogicOp(op);
+}
 
-         skip = so->stride[last_buffer] - buf_offset;
-         while (skip) {
-            start_skip = get_skip_str(&skip);
-            if (start_skip)
-               varyings[n_outputs++] = start_skip;
-         }
-         for (j = last_buffer; j < so->output[i].output_buffer; j++)
-            varyings[n_outputs++] = strdup("gl_NextBuffer");
-         last_buffer = so->output[i].output_buffer;
-         buf_offset = 0;
-      }
+static void vrend_gl_depth_func(struct vrend_context *ctx, GLenum func)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
 
-      skip = so->output[i].dst_offset - buf_offset;
-      while (skip) {
-         start_skip = get_skip_str(&skip);
-         if (start_skip)
-            varyings[n_outputs++] = start_skip;
-      }
-      buf_offset = so->output[i].dst_offset;
+   if (vrend_gl_value_cached(gl, VREND_GL_DEPTH_FUNC, gl->depth_func == func))
+      return;
+   gl->depth_func = func;
+   glDepthFunc(func);
+}
 
-      buf_offset += so->output[i].num_components;
-      if (sinfo->so_names[i])
-         varyings[n_outputs++] = strdup(sinfo->so_names[i]);
-   }
+static void vrend_gl_depth_mask(struct vrend_context *ctx, GLboolean mask)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_DEPTH_MASK, gl->depth_mask == mask))
+      return;
+   gl->depth_mask = mask;
+   glDepthMask(mask);
+}
+
+/* face is GL_FRONT, GL_BACK or GL_FRONT_AND_BACK; returns true if the
+ * faces already have the given value of a stencil field */
+static bool vrend_gl_stencil_cached(struct vrend_gl_state *gl, GLenum face,
+                                    enum vrend_gl_value front_value,
+                                    const struct vrend_gl_stencil_face *state,
+                                    size_t offset, size_t size)
+{
+   bool cached = true;
+   int i;
+
+   for (i = 0; i < 2; i++) {
+      uint32_t bit = 1u << (front_value + i);
+
+      if (face != GL_FRONT_AND_BACK && face != (i ? GL_BACK : GL_FRONT))
+         continue;
+      if (!(gl->values_known & bit) ||
+          memcmp((const char *)&gl->stencil[i] + offset,
+                 (const char *)state + offset, size))
+         cached = false;
+   }
+   if (cached) {
+      vrend_state.gl_calls_elided++;
+      return true;
+   }
+
+   for (i = 0; i < 2; i++) {
+      if (face != GL_FRONT_AND_BACK && face != (i ? GL_BACK : GL_FRONT))
+         continue;
+      gl->values_known |= 1u << (front_value + i);
+      memcpy((char *)&gl->stencil[i] + offset, (const char *)state + offset, size);
+   }
+   return false;
+}
+
+static void vrend_gl_stencil_func(struct vrend_context *ctx, GLenum face,
+                                  GLenum func, GLint ref, GLuint valuemask)
+{
+   struct vrend_gl_stencil_face state;
+
+   state.func = func;
+   state.ref = ref;
+   state.valuemask = valuemask;
+   if (vrend_gl_stencil_cached(&ctx->sub->gl_state, face, VREND_GL_STENCIL_FUNC_FRONT,
+                               &state, offsetof(struct vrend_gl_stencil_face, func),
+                               offsetof(struct vrend_gl_stencil_face, op) -
+                               offsetof(struct vrend_gl_stencil_face, func)))
+      return;
+
+   if (face == GL_FRONT_AND_BACK)
+      glStencilFunc(func, ref, valuemask);
+   else
+      glStencilFuncSeparate(face, func, ref, valuemask);
+}
+
+static void vrend_gl_stencil_op(struct vrend_context *ctx, GLenum face,
+                                GLenum fail, GLenum zfail, GLenum zpass)
+{
+   struct vrend_gl_stencil_face state;
+
+   state.op[0] = fail;
+   state.op[1] = zfail;
+   state.op[2] = zpass;
+   if (vrend_gl_stencil_cached(&ctx->sub->gl_state, face, VREND_GL_STENCIL_OP_FRONT,
+                               &state, offsetof(struct vrend_gl_stencil_face, op),
+                               sizeof(state.op)))
+      return;
+
+   if (face == GL_FRONT_AND_BACK)
+      glStencilOp(fail, zfail, zpass);
+   else
+      glStencilOpSeparate(face, fail, zfail, zpass);
+}
+
+static void vrend_gl_stencil_mask(struct vrend_context *ctx, GLenum face,
+                                  GLuint writemask)
+{
+   struct vrend_gl_stencil_face state;
+
+   state.writemask = writemask;
+   if (vrend_gl_stencil_cached(&ctx->sub->gl_state, face, VREND_GL_STENCIL_MASK_FRONT,
+                               &state, offsetof(struct vrend_gl_stencil_face, writemask),
+                               sizeof(state.writemask)))
+      return;
+
+   if (face == GL_FRONT_AND_BACK)
+      glStencilMask(writemask);
+   else
+      glStencilMaskSeparate(face, writemask);
+}
+
+static void vrend_gl_front_face(struct vrend_context *ctx, GLenum mode)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_FRONT_FACE, gl->front_face == mode))
+      return;
+   gl->front_face = mode;
+   glFrontFace(mode);
+}
+
+static void vrend_gl_cull_face(struct vrend_context *ctx, GLenum mode)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_CULL_FACE_MODE, gl->cull_face == mode))
+      return;
+   gl->cull_face = mode;
+   glCullFace(mode);
+}
+
+static void vrend_gl_polygon_mode(struct vrend_context *ctx, GLenum face, GLenum mode)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+   bool front = face != GL_BACK;
+   bool back = face != GL_FRONT;
+   uint32_t mask = (front ? 1u << VREND_GL_POLYGON_MODE_FRONT : 0) |
+                   (back ? 1u << VREND_GL_POLYGON_MODE_BACK : 0);
+
+   if ((gl->values_known & mask) == mask &&
+       (!front || gl->polygon_mode[0] == mode) &&
+       (!back || gl->polygon_mode[1] == mode)) {
+      vrend_state.gl_calls_elided++;
+      return;
+   }
+
+   gl->values_known |= mask;
+   if (front)
+      gl->polygon_mode[0] = mode;
+   if (back)
+      gl->polygon_mode[1] = mode;
+   glPolygonMode(face, mode);
+}
+
+static void vrend_gl_polygon_offset(struct vrend_context *ctx, GLfloat factor,
+                                    GLfloat units, GLfloat clamp)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_POLYGON_OFFSET,
+                             gl->polygon_offset[0] == factor &&
+                             gl->polygon_offset[1] == units &&
+                             gl->polygon_offset[2] == clamp))
+      return;
+   gl->polygon_offset[0] = factor;
+   gl->polygon_offset[1] = units;
+   gl->polygon_offset[2] = clamp;
+
+   if (!vrend_state.use_gles && has_feature(feat_polygon_offset_clamp))
+      glPolygonOffsetClampEXT(factor, units, clamp);
+   else
+      glPolygonOffset(factor, units);
+}
+
+static void vrend_gl_line_width(struct vrend_context *ctx, GLfloat width)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_LINE_WIDTH, gl->line_width == width))
+      return;
+   gl->line_width = width;
+   glLineWidth(width);
+}
+
+static void vrend_gl_point_size(struct vrend_context *ctx, GLfloat size)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (vrend_gl_value_cached(gl, VREND_GL_POINT_SIZE, gl->point_size == size))
+      return;
+   gl->point_size = size;
+   glPointSize(size);
+}
+
+static void vrend_gl_bind_sampler(struct vrend_context *ctx, GLuint unit, GLuint sampler)
+{
+   struct vrend_gl_state *gl = &ctx->sub->gl_state;
+
+   if (unit >= VREND_GL_MAX_SAMPLER_UNITS) {
+      glBindSampler(unit, sampler);
+      return;
+   }
+
+   if (gl->sampler_generation != vrend_state.sampler_generation) {
+      memset(gl->samplers_known, 0, sizeof(gl->samplers_known));
+      gl->sampler_generation = vrend_state.sampler_generation;
+   }
+
+   if ((gl->samplers_known[unit / 32] & (1u << (unit % 32))) &&
+       gl->samplers[unit] == sampler) {
+      vrend_state.gl_calls_elided++;
+      return;
+   }
+   gl->samplers_known[unit / 32] |= 1u << (unit % 32);
+   gl->samplers[unit] = sampler;
+   glBindSampler(unit, sampler);
+}
+
+static void vrend_depth_test_enable(struct vrend_context *ctx, bool depth_test_enable)
+{
+   vrend_gl_enable(ctx, VREND_GL_DEPTH_TEST, depth_test_enable);
+}
+
+static void vrend_alpha_test_enable(struct vrend_context *ctx, bool alpha_test_enable)
+{
+   if (vrend_state.use_core_profile) {
+      /* handled in shaders */
+      return;
+   }
+   vrend_gl_enable(ctx, VREND_GL_ALPHA_TEST, alpha_test_enable);
+}
+
+static void vrend_stencil_test_enable(struct vrend_context *ctx, bool stencil_test_enable)
+{
+   vrend_gl_enable(ctx, VREND_GL_STENCIL_TEST, stencil_test_enable);
+}
+
+static void dump_stream_out(struct pipe_stream_output_info *so)
+{
+   unsigned i;
+   if (!so)
+      return;
+   vrend_printf("streamout: %d\n", so->num_outputs);
+   vrend_printf("strides: ");
+   for (i = 0; i < 4; i++)
+      vrend_printf("%d ", so->stride[i]);
+   vrend_printf("\n");
+   vrend_printf("outputs:\n");
+   for (i = 0; i < so->num_outputs; i++) {
+      vrend_printf("\t%d: reg: %d sc: %d, nc: %d ob: %d do: %d st: %d\n",
+                   i,
+                   so->output[i].register_index,
+                   so->output[i].start_component,
+                   so->output[i].num_components,
+                   so->output[i].output_buffer,
+                   so->output[i].dst_offset,
+                   so->output[i].stream);
+   }
+}
+
+static char *get_skip_str(int *skip_val)
+{
+   char *start_skip = NULL;
+   if (*skip_val < 0) {
+      *skip_val = 0;
+      return NULL;
+   }
+
+   if (*skip_val == 1) {
+      start_skip = strdup("gl_SkipComponents1");
+      *skip_val -= 1;
+   } else if (*skip_val == 2) {
+      start_skip = strdup("gl_SkipComponents2");
+      *skip_val -= 2;
+   } else if (*skip_val == 3) {
+      start_skip = strdup("gl_SkipComponents3");
+      *skip_val -= 3;
+   } else if (*skip_val >= 4) {
+      start_skip = strdup("gl_SkipComponents4");
+      *skip_val -= 4;
+   }
+   return start_skip;
+}
+
+static void set_stream_out_varyings(struct vrend_context *ctx, int prog_id,
+                                    struct vrend_shader_info *sinfo)
+{
+   struct pipe_stream_output_info *so = &sinfo->so_info;
+   char *varyings[PIPE_MAX_SHADER_OUTPUTS*2];
+   int j;
+   uint i, n_outputs = 0;
+   int last_buffer = 0;
+   char *start_skip;
+   int buf_offset = 0;
+   int skip;
+   if (!so->num_outputs)
+      return;
+
+   VREND_DEBUG_EXT(dbg_shader_streamout, ctx, dump_stream_out(so));
+
+   for (i = 0; i < so->num_outputs; i++) {
+      if (last_buffer != so->output[i].output_buffer) {
+
+         skip = so->stride[last_buffer] - buf_offset;
+         while (skip) {
+            start_skip = get_skip_str(&skip);
+            if (start_skip)
+               varyings[n_outputs++] = start_skip;
+         }
+         for (j = last_buffer; j < so->output[i].output_buffer; j++)
+            varyings[n_outputs++] = strdup("gl_NextBuffer");
+         last_buffer = so->output[i].output_buffer;
+         buf_offset = 0;
+      }
+
+      skip = so->output[i].dst_offset - buf_offset;
+      while (skip) {
+         start_skip = get_skip_str(&skip);
+         if (start_skip)
+            varyings[n_outputs++] = start_skip;
+      }
+      buf_offset = so->output[i].dst_offset;
+
+      buf_offset += so->output[i].num_components;
+      if (sinfo->so_names[i])
+         varyings[n_outputs++] = strdup(sinfo->so_names[i]);
+   }
 
    skip = so->stride[last_buffer] - buf_offset;
    while (skip) {
@@ -1288,15 +2223,153 @@ static void bind_image_locs(struct vrend_linked_shader_program *sprog,
    sprog->images_used_mask[id] = mask;
 }
 
+static unsigned program_key_hash(void *key)
+{
+   /* the cso hash just xors the words together which makes
+    * permutations of the same shader ids collide */
+   return vrend_hash_fold(vrend_hash_data(VREND_HASH_INIT, key,
+                                          sizeof(struct vrend_program_key)));
+}
+
+static int program_key_compare(void *key1, void *key2)
+{
+   return memcmp(key1, key2, sizeof(struct vrend_program_key));
+}
+
+static void program_hash_free(UNUSED void *value)
+{
+   /* the programs are owned by the sub context program list */
+}
+
+static void vrend_evict_programs(struct vrend_sub_context *sub)
+{
+   struct vrend_linked_shader_program *ent, *tmp;
+
+   if (!vrend_state.max_programs)
+      return;
+
+   LIST_FOR_EACH_ENTRY_SAFE(ent, tmp, &sub->programs, head) {
+      if (sub->num_programs <= vrend_state.max_programs)
+         break;
+      /* never evict the bound program or the one just linked */
+      if (ent == sub->prog || &ent->head == sub->programs.prev)
+         continue;
+      vrend_destroy_program(ent);
+      vrend_state.program_cache_evictions++;
+   }
+}
+
+static void vrend_insert_program(struct vrend_sub_context *sub,
+                                 struct vrend_linked_shader_program *sprog)
+{
+   sprog->sub_ctx = sub;
+   list_addtail(&sprog->head, &sub->programs);
+   util_hash_table_set(sub->program_hash, &sprog->key, sprog);
+   sub->num_programs++;
+   vrend_evict_programs(sub);
+}
+
+static void program_binary_key_add_shader(struct vrend_disk_cache_key *key,
+                                          struct vrend_shader *shader)
+{
+   uint32_t type = shader->sel->type;
+
+   vrend_disk_cache_key_add(key, &type, sizeof(type));
+   for (int i = 0; i < shader->glsl_strings.num_strings; i++)
+      vrend_disk_cache_key_add_str(key, shader->glsl_strings.strings[i].buf);
+}
+
+static void program_binary_key_add_so(struct vrend_disk_cache_key *key,
+                                      struct vrend_shader_info *sinfo)
+{
+   struct pipe_stream_output_info *so = &sinfo->so_info;
+
+   vrend_disk_cache_key_add(key, &so->num_outputs, sizeof(so->num_outputs));
+   vrend_disk_cache_key_add(key, so->stride, sizeof(so->stride));
+   for (unsigned i = 0; i < so->num_outputs; i++) {
+      uint32_t out[3] = { so->output[i].output_buffer,
+                          so->output[i].dst_offset,
+                          so->output[i].num_components };
+      vrend_disk_cache_key_add(key, out, sizeof(out));
+      vrend_disk_cache_key_add_str(key, sinfo->so_names ? sinfo->so_names[i] : NULL);
+   }
+}
+
+/* Link the program, or load it from the binary cache if it was linked
+ * before with the same sources, link state and driver. */
+static void vrend_link_program(GLuint prog_id,
+                               const struct vrend_disk_cache_key *binary_key)
+{
+   struct vrend_disk_cache *cache = vrend_state.program_binary_cache;
+   GLint lret, len;
+   GLenum format;
+   uint8_t *data;
+   size_t size;
+
+   if (!cache) {
+      glLinkProgram(prog_id);
+      return;
+   }
+
+   data = vrend_disk_cache_get(cache, binary_key, &size);
+   if (data) {
+      if (size > sizeof(format)) {
+         memcpy(&format, data, sizeof(format));
+         glProgramBinary(prog_id, format, data + sizeof(format), size - sizeof(format));
+      }
+      free(data);
+
+      glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
+      if (lret == GL_TRUE)
+         return;
+      /* the driver may reject binaries after an update, link from source */
+   }
+
+   glProgramParameteri(prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+   glLinkProgram(prog_id);
+
+   glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
+   if (lret == GL_FALSE)
+      return;
+
+   glGetProgramiv(prog_id, GL_PROGRAM_BINARY_LENGTH, &len);
+   if (len <= 0)
+      return;
+
+   data = malloc(sizeof(format) + len);
+   if (!data)
+      return;
+
+   glGetProgramBinary(prog_id, len, &len, &format, data + sizeof(format));
+   if (len > 0) {
+      memcpy(data, &format, sizeof(format));
+      vrend_disk_cache_put(cache, binary_key, data, sizeof(format) + len);
+   }
+   free(data);
+}
+
 static struct vrend_linked_shader_program *add_cs_shader_program(struct vrend_context *ctx,
                                                                  struct vrend_shader *cs)
 {
    struct vrend_linked_shader_program *sprog = CALLOC_STRUCT(vrend_linked_shader_program);
+   struct vrend_disk_cache_key binary_key = vrend_state.driver_key;
    GLuint prog_id;
    GLint lret;
+
+   if (!sprog)
+      return NULL;
+
+   if (!vrend_shader_wait_compiled(ctx, cs)) {
+      free(sprog);
+      return NULL;
+   }
+
    prog_id = glCreateProgram();
    glAttachShader(prog_id, cs->id);
-   glLinkProgram(prog_id);
+
+   if (vrend_state.program_binary_cache)
+      program_binary_key_add_shader(&binary_key, cs);
+   vrend_link_program(prog_id, &binary_key);
 
    glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
    if (lret == GL_FALSE) {
@@ -1315,7 +2388,8 @@ static struct vrend_linked_shader_program *add_cs_shader_program(struct vrend_co
 
    list_add(&sprog->sl[PIPE_SHADER_COMPUTE], &cs->programs);
    sprog->id = prog_id;
-   list_addtail(&sprog->head, &ctx->sub->programs);
+   sprog->key.cs_id = cs->id;
+   vrend_insert_program(ctx->sub, sprog);
 
    vrend_use_program(ctx, prog_id);
 
@@ -1336,6 +2410,7 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_conte
                                                               struct vrend_shader *tes)
 {
    struct vrend_linked_shader_program *sprog = CALLOC_STRUCT(vrend_linked_shader_program);
+   struct vrend_disk_cache_key binary_key = vrend_state.driver_key;
    char name[64];
    int i;
    GLuint prog_id;
@@ -1346,6 +2421,16 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_conte
    if (!sprog)
       return NULL;
 
+   /* the patching below rewrites the GLSL a worker might still be reading */
+   if (!vrend_shader_wait_compiled(ctx, vs) ||
+       !vrend_shader_wait_compiled(ctx, fs) ||
+       (gs && !vrend_shader_wait_compiled(ctx, gs)) ||
+       (tcs && !vrend_shader_wait_compiled(ctx, tcs)) ||
+       (tes && !vrend_shader_wait_compiled(ctx, tes))) {
+      free(sprog);
+      return NULL;
+   }
+
    /* need to rewrite VS code to add interpolation params */
    if (gs && gs->compiled_fs_id != fs->id)
       do_patch = true;
@@ -1422,7 +2507,26 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_conte
       }
    }
 
-   glLinkProgram(prog_id);
+   if (vrend_state.program_binary_cache) {
+      uint32_t link_state[2];
+
+      program_binary_key_add_shader(&binary_key, vs);
+      if (tcs && tcs->id > 0)
+         program_binary_key_add_shader(&binary_key, tcs);
+      if (tes && tes->id > 0)
+         program_binary_key_add_shader(&binary_key, tes);
+      if (gs && gs->id > 0)
+         program_binary_key_add_shader(&binary_key, gs);
+      program_binary_key_add_shader(&binary_key, fs);
+      program_binary_key_add_so(&binary_key, gs ? &gs->sel->sinfo :
+                                (tes ? &tes->sel->sinfo : &vs->sel->sinfo));
+      link_state[0] = sprog->dual_src_linked;
+      link_state[1] = has_feature(feat_gles31_vertex_attrib_binding) ?
+                      vs->sel->sinfo.attrib_input_mask : 0;
+      vrend_disk_cache_key_add(&binary_key, link_state, sizeof(link_state));
+   }
+
+   vrend_link_program(prog_id, &binary_key);
 
    glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
    if (lret == GL_FALSE) {
@@ -1459,7 +2563,13 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_conte
    last_shader = tes ? PIPE_SHADER_TESS_EVAL : (gs ? PIPE_SHADER_GEOMETRY : PIPE_SHADER_FRAGMENT);
    sprog->id = prog_id;
 
-   list_addtail(&sprog->head, &ctx->sub->programs);
+   sprog->key.vs_id = vs->id;
+   sprog->key.fs_id = fs->id;
+   sprog->key.gs_id = gs ? gs->id : 0;
+   sprog->key.tcs_id = tcs ? tcs->id : 0;
+   sprog->key.tes_id = tes ? tes->id : 0;
+   sprog->key.dual_src = sprog->dual_src_linked;
+   vrend_insert_program(ctx->sub, sprog);
 
    if (fs->key.pstipple_tex)
       sprog->fs_stipple_loc = glGetUniformLocation(prog_id, "pstipple_sampler");
@@ -1503,17 +2613,32 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_conte
    return sprog;
 }
 
-static struct vrend_linked_shader_program *lookup_cs_shader_program(struct vrend_context *ctx,
-                                                                    GLuint cs_id)
+static struct vrend_linked_shader_program *lookup_program(struct vrend_sub_context *sub,
+                                                          struct vrend_program_key *key)
 {
    struct vrend_linked_shader_program *ent;
-   LIST_FOR_EACH_ENTRY(ent, &ctx->sub->programs, head) {
-      if (!ent->ss[PIPE_SHADER_COMPUTE])
-         continue;
-      if (ent->ss[PIPE_SHADER_COMPUTE]->id == cs_id)
-         return ent;
+
+   ent = util_hash_table_get(sub->program_hash, key);
+   if (!ent) {
+      vrend_state.program_cache_misses++;
+      return NULL;
    }
-   return NULL;
+
+   /* keep the list in LRU order so eviction starts at the head */
+   list_del(&ent->head);
+   list_addtail(&ent->head, &sub->programs);
+   vrend_state.program_cache_hits++;
+   return ent;
+}
+
+static struct vrend_linked_shader_program *lookup_cs_shader_program(struct vrend_context *ctx,
+                                                                    GLuint cs_id)
+{
+   struct vrend_program_key key;
+
+   memset(&key, 0, sizeof(key));
+   key.cs_id = cs_id;
+   return lookup_program(ctx->sub, &key);
 }
 
 static struct vrend_linked_shader_program *lookup_shader_program(struct vrend_context *ctx,
@@ -1524,28 +2649,16 @@ static struct vrend_linked_shader_program *lookup_shader_program(struct vrend_co
                                                                  GLuint tes_id,
                                                                  bool dual_src)
 {
-   struct vrend_linked_shader_program *ent;
-   LIST_FOR_EACH_ENTRY(ent, &ctx->sub->programs, head) {
-      if (ent->dual_src_linked != dual_src)
-         continue;
-      if (ent->ss[PIPE_SHADER_COMPUTE])
-         continue;
-      if (ent->ss[PIPE_SHADER_VERTEX]->id != vs_id)
-        continue;
-      if (ent->ss[PIPE_SHADER_FRAGMENT]->id != fs_id)
-        continue;
-      if (ent->ss[PIPE_SHADER_GEOMETRY] &&
-          ent->ss[PIPE_SHADER_GEOMETRY]->id != gs_id)
-        continue;
-      if (ent->ss[PIPE_SHADER_TESS_CTRL] &&
-          ent->ss[PIPE_SHADER_TESS_CTRL]->id != tcs_id)
-         continue;
-      if (ent->ss[PIPE_SHADER_TESS_EVAL] &&
-          ent->ss[PIPE_SHADER_TESS_EVAL]->id != tes_id)
-         continue;
-      return ent;
-   }
-   return NULL;
+   struct vrend_program_key key;
+
+   memset(&key, 0, sizeof(key));
+   key.vs_id = vs_id;
+   key.fs_id = fs_id;
+   key.gs_id = gs_id;
+   key.tcs_id = tcs_id;
+   key.tes_id = tes_id;
+   key.dual_src = dual_src;
+   return lookup_program(ctx->sub, &key);
 }
 
 static void vrend_destroy_program(struct vrend_linked_shader_program *ent)
@@ -1556,6 +2669,11 @@ static void vrend_destroy_program(struct vrend_linked_shader_program *ent)
 
    glDeleteProgram(ent->id);
    list_del(&ent->head);
+   if (ent->sub_ctx) {
+      if (util_hash_table_get(ent->sub_ctx->program_hash, &ent->key) == ent)
+         util_hash_table_remove(ent->sub_ctx->program_hash, &ent->key);
+      ent->sub_ctx->num_programs--;
+   }
 
    for (i = PIPE_SHADER_VERTEX; i <= PIPE_SHADER_COMPUTE; i++) {
       if (ent->ss[i])
@@ -1605,7 +2723,7 @@ int vrend_create_surface(struct vrend_context *ctx,
       return EINVAL;
    }
 
-   res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+   res = vrend_renderer_ctx_res_use(ctx, res_handle);
    if (!res) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
       return EINVAL;
@@ -1717,8 +2835,10 @@ static void vrend_destroy_sampler_state_object(void *obj_ptr)
 {
    struct vrend_sampler_state *state = obj_ptr;
 
-   if (has_feature(feat_samplers))
+   if (has_feature(feat_samplers)) {
       glDeleteSamplers(2, state->ids);
+      vrend_state.sampler_generation++;
+   }
    FREE(state);
 }
 
@@ -1843,7 +2963,7 @@ int vrend_create_sampler_view(struct vrend_context *ctx,
    int ret_handle;
    uint8_t swizzle[4];
 
-   res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+   res = vrend_renderer_ctx_res_use(ctx, res_handle);
    if (!res) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
       return EINVAL;
@@ -2148,7 +3268,7 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_context *ctx)
    if (ctx->sub->nr_cbufs == 0) {
       glReadBuffer(GL_NONE);
       if (has_feature(feat_srgb_write_control)) {
-         glDisable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_gl_enable(ctx, VREND_GL_FRAMEBUFFER_SRGB, false);
       }
    } else if (has_feature(feat_srgb_write_control)) {
       struct vrend_surface *surf = NULL;
@@ -2162,11 +3282,7 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_context *ctx)
             }
          }
       }
-      if (use_srgb) {
-         glEnable(GL_FRAMEBUFFER_SRGB_EXT);
-      } else {
-         glDisable(GL_FRAMEBUFFER_SRGB_EXT);
-      }
+      vrend_gl_enable(ctx, VREND_GL_FRAMEBUFFER_SRGB, use_srgb);
    }
    glDrawBuffers(ctx->sub->nr_cbufs, buffers);
 }
@@ -2311,6 +3427,14 @@ void vrend_set_viewport_states(struct vrend_context *ctx,
       GLfloat abs_s1 = fabsf(state[i].scale[1]);
 
       idx = start_slot + i;
+      if ((ctx->sub->viewport_state_set & (1 << idx)) &&
+          !memcmp(&ctx->sub->vp_state[idx], &state[i], sizeof(state[i]))) {
+         vrend_state.elided.viewports++;
+         continue;
+      }
+      ctx->sub->vp_state[idx] = state[i];
+      ctx->sub->viewport_state_set |= 1 << idx;
+
       width = state[i].scale[0] * 2.0f;
       height = abs_s1 * 2.0f;
       x = state[i].translate[0] - state[i].scale[0];
@@ -2493,6 +3617,11 @@ void vrend_set_constants(struct vrend_context *ctx,
    struct vrend_constants *consts;
 
    consts = &ctx->sub->consts[shader];
+   if (consts->num_consts == num_constant && consts->consts &&
+       !memcmp(consts->consts, data, num_constant * sizeof(float))) {
+      vrend_state.elided.constants++;
+      return;
+   }
    ctx->sub->const_dirty[shader] = true;
 
    /* avoid reallocations by only growing the buffer */
@@ -2508,6 +3637,27 @@ void vrend_set_constants(struct vrend_context *ctx,
    consts->num_consts = num_constant;
 }
 
+/* Buffers sub-allocated from a heap slab share their GL buffer with the
+ * chunks around them, so GL does not keep a range past width0 inside the
+ * guest's buffer.  Ranges starting past the end are rejected, longer
+ * ones are clamped. */
+static bool vrend_clamp_buffer_range(struct vrend_resource *res,
+                                     uint32_t offset, uint32_t *size)
+{
+   if (res->base.target != PIPE_BUFFER)
+      return true;
+   if (offset > res->base.width0)
+      return false;
+   *size = MIN2(*size, res->base.width0 - offset);
+   return true;
+}
+
+static bool vrend_buffer_range_valid(struct vrend_resource *res,
+                                     uint32_t offset, uint32_t size)
+{
+   return offset <= res->base.width0 && size <= res->base.width0 - offset;
+}
+
 void vrend_set_uniform_buffer(struct vrend_context *ctx,
                               uint32_t shader,
                               uint32_t index,
@@ -2521,9 +3671,9 @@ void vrend_set_uniform_buffer(struct vrend_context *ctx,
       return;
 
    if (res_handle) {
-      res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+      res = vrend_renderer_ctx_res_use(ctx, res_handle);
 
-      if (!res) {
+      if (!res || !vrend_clamp_buffer_range(res, offset, &length)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
          return;
       }
@@ -2552,7 +3702,7 @@ void vrend_set_index_buffer(struct vrend_context *ctx,
    ctx->sub->ib.offset = offset;
    if (res_handle) {
       if (ctx->sub->index_buffer_res_id != res_handle) {
-         res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+         res = vrend_renderer_ctx_res_use(ctx, res_handle);
          if (!res) {
             vrend_resource_reference((struct vrend_resource **)&ctx->sub->ib.buffer, NULL);
             ctx->sub->index_buffer_res_id = 0;
@@ -2588,7 +3738,7 @@ void vrend_set_single_vbo(struct vrend_context *ctx,
       vrend_resource_reference((struct vrend_resource **)&ctx->sub->vbo[index].buffer, NULL);
       ctx->sub->vbo_res_ids[index] = 0;
    } else if (ctx->sub->vbo_res_ids[index] != res_handle) {
-      res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+      res = vrend_renderer_ctx_res_use(ctx, res_handle);
       if (!res) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
          ctx->sub->vbo_res_ids[index] = 0;
@@ -2634,6 +3784,7 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
          return;
       }
       if (ctx->sub->views[shader_type].views[index] == view) {
+         vrend_state.elided.sampler_views++;
          return;
       }
       /* we should have a reference to this texture taken at create time */
@@ -2718,10 +3869,18 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
 
             offset *= blsize;
             size *= blsize;
+            if (!vrend_clamp_buffer_range(view->texture, offset, &size)) {
+               report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_HANDLE, handle);
+               return;
+            }
+            offset += view->texture->heap_offset;
             glTexBufferRange(GL_TEXTURE_BUFFER, internalformat, view->texture->id, offset, size);
          } else
             glTexBuffer(GL_TEXTURE_BUFFER, internalformat, view->texture->id);
       }
+   } else if (!ctx->sub->views[shader_type].views[index]) {
+      vrend_state.elided.sampler_views++;
+      return;
    }
 
    vrend_sampler_view_reference(&ctx->sub->views[shader_type].views[index], view);
@@ -2755,7 +3914,7 @@ void vrend_set_single_image_view(struct vrend_context *ctx,
       if (!has_feature(feat_images))
          return;
 
-      res = vrend_renderer_ctx_res_lookup(ctx, handle);
+      res = vrend_renderer_ctx_res_use(ctx, handle);
       if (!res) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, handle);
          return;
@@ -2786,8 +3945,8 @@ void vrend_set_single_ssbo(struct vrend_context *ctx,
       return;
 
    if (handle) {
-      res = vrend_renderer_ctx_res_lookup(ctx, handle);
-      if (!res) {
+      res = vrend_renderer_ctx_res_use(ctx, handle);
+      if (!res || !vrend_clamp_buffer_range(res, offset, &length)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, handle);
          return;
       }
@@ -2815,8 +3974,8 @@ void vrend_set_single_abo(struct vrend_context *ctx,
       return;
 
    if (handle) {
-      res = vrend_renderer_ctx_res_lookup(ctx, handle);
-      if (!res) {
+      res = vrend_renderer_ctx_res_use(ctx, handle);
+      if (!res || !vrend_clamp_buffer_range(res, offset, &length)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, handle);
          return;
       }
@@ -3039,6 +4198,8 @@ static int vrend_shader_create(struct vrend_context *ctx,
 
    shader->id = glCreateShader(conv_shader_type(shader->sel->type));
    shader->compiled_fs_id = 0;
+   /* keep the key as requested, the translator may update its copy */
+   shader->key = key;
    bool ret = vrend_convert_shader(ctx, &ctx->shader_cfg, shader->sel->tokens,
                                    shader->sel->req_local_mem, &key, &shader->sel->sinfo, &shader->glsl_strings);
    if (!ret) {
@@ -3046,8 +4207,9 @@ static int vrend_shader_create(struct vrend_context *ctx,
       glDeleteShader(shader->id);
       return -1;
    }
-   shader->key = key;
-   if (1) {//shader->sel->type == PIPE_SHADER_FRAGMENT || shader->sel->type == PIPE_SHADER_GEOMETRY) {
+   if (vrend_state.num_compile_threads || vrend_state.use_parallel_compile) {
+      vrend_compile_shader_async(shader);
+   } else {
       bool ret;
 
       ret = vrend_compile_shader(ctx, shader);
@@ -3066,25 +4228,21 @@ static int vrend_shader_select(struct vrend_context *ctx,
 {
    struct vrend_shader_key key;
    struct vrend_shader *shader = NULL;
+   uint64_t key_hash;
    int r;
 
    memset(&key, 0, sizeof(key));
    vrend_fill_shader_key(ctx, sel->type, &key);
+   key_hash = vrend_shader_key_hash(&key);
 
-   if (sel->current && !memcmp(&sel->current->key, &key, sizeof(key)))
+   if (sel->current && sel->current->key_hash == key_hash &&
+       vrend_shader_key_equal(&sel->current->key, &key))
       return 0;
 
    if (sel->num_shaders > 1) {
-      struct vrend_shader *p = sel->current;
-      struct vrend_shader *c = p->next_variant;
-      while (c && memcmp(&c->key, &key, sizeof(key)) != 0) {
-         p = c;
-         c = c->next_variant;
-      }
-      if (c) {
-         p->next_variant = c->next_variant;
-         shader = c;
-      }
+      shader = util_hash_table_get(sel->variant_hash, &key_hash);
+      if (shader && !vrend_shader_key_equal(&shader->key, &key))
+         shader = NULL;
    }
 
    if (!shader) {
@@ -3099,16 +4257,36 @@ static int vrend_shader_select(struct vrend_context *ctx,
          FREE(shader);
          return r;
       }
+      shader->key_hash = key_hash;
+      shader->next_variant = sel->variants;
+      sel->variants = shader;
+      util_hash_table_set(sel->variant_hash, &shader->key_hash, shader);
       sel->num_shaders++;
    }
    if (dirty)
       *dirty = true;
 
-   shader->next_variant = sel->current;
    sel->current = shader;
    return 0;
 }
 
+static unsigned variant_key_hash(void *key)
+{
+   return vrend_hash_fold(*(uint64_t *)key);
+}
+
+static int variant_key_compare(void *key1, void *key2)
+{
+   uint64_t h1 = *(uint64_t *)key1, h2 = *(uint64_t *)key2;
+
+   return h1 < h2 ? -1 : (h1 > h2 ? 1 : 0);
+}
+
+static void variant_hash_free(UNUSED void *value)
+{
+   /* the variants are owned by the selector */
+}
+
 static void *vrend_create_shader_state(UNUSED struct vrend_context *ctx,
                                        const struct pipe_stream_output_info *so_info,
                                        uint32_t req_local_mem,
@@ -3119,6 +4297,14 @@ static void *vrend_create_shader_state(UNUSED struct vrend_context *ctx,
    if (!sel)
       return NULL;
 
+   sel->variant_hash = util_hash_table_create(variant_key_hash,
+                                              variant_key_compare,
+                                              variant_hash_free);
+   if (!sel->variant_hash) {
+      FREE(sel);
+      return NULL;
+   }
+
    sel->req_local_mem = req_local_mem;
    sel->type = pipe_shader_type;
    sel->sinfo.so_info = *so_info;
@@ -3345,6 +4531,8 @@ void vrend_clear(struct vrend_context *ctx,
    if (ctx->ctx_switch_pending)
       vrend_finish_context_switch(ctx);
 
+   vrend_stamp_bound_resources(ctx->sub);
+
    vrend_update_frontface_state(ctx);
    if (ctx->sub->stencil_state_dirty)
       vrend_update_stencil_state(ctx);
@@ -3376,7 +4564,7 @@ void vrend_clear(struct vrend_context *ctx,
 
    if (buffers & PIPE_CLEAR_DEPTH) {
       /* gallium clears don't respect depth mask */
-      glDepthMask(GL_TRUE);
+      vrend_gl_depth_mask(ctx, GL_TRUE);
       if (vrend_state.use_gles) {
          if (0.0f < depth && depth > 1.0f) {
             // Only warn, it is clamped by the function.
@@ -3389,12 +4577,12 @@ void vrend_clear(struct vrend_context *ctx,
    }
 
    if (buffers & PIPE_CLEAR_STENCIL) {
-      glStencilMask(~0u);
+      vrend_gl_stencil_mask(ctx, GL_FRONT_AND_BACK, ~0u);
       glClearStencil(stencil);
    }
 
    if (ctx->sub->hw_rs_state.rasterizer_discard)
-       glDisable(GL_RASTERIZER_DISCARD);
+       vrend_gl_enable(ctx, VREND_GL_RASTERIZER_DISCARD, false);
 
    if (buffers & PIPE_CLEAR_COLOR) {
       uint32_t mask = 0;
@@ -3434,17 +4622,17 @@ void vrend_clear(struct vrend_context *ctx,
     * didn't forward them before calling the clear command
     */
    if (ctx->sub->hw_rs_state.rasterizer_discard)
-       glEnable(GL_RASTERIZER_DISCARD);
+       vrend_gl_enable(ctx, VREND_GL_RASTERIZER_DISCARD, true);
 
    if (buffers & PIPE_CLEAR_DEPTH) {
       if (!ctx->sub->dsa_state.depth.writemask)
-         glDepthMask(GL_FALSE);
+         vrend_gl_depth_mask(ctx, GL_FALSE);
    }
 
    /* Restore previous stencil buffer write masks for both front and back faces */
    if (buffers & PIPE_CLEAR_STENCIL) {
-      glStencilMaskSeparate(GL_FRONT, ctx->sub->dsa_state.stencil[0].writemask);
-      glStencilMaskSeparate(GL_BACK, ctx->sub->dsa_state.stencil[1].writemask);
+      vrend_gl_stencil_mask(ctx, GL_FRONT, ctx->sub->dsa_state.stencil[0].writemask);
+      vrend_gl_stencil_mask(ctx, GL_BACK, ctx->sub->dsa_state.stencil[1].writemask);
    }
 
    /* Restore previous colormask */
@@ -3619,7 +4807,12 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
       if (ctx->sub->vbo[vbo_index].stride == 0) {
          void *data;
          /* for 0 stride we are kinda screwed */
-         data = glMapBufferRange(GL_ARRAY_BUFFER, ctx->sub->vbo[vbo_index].buffer_offset, ve->nr_chan * sizeof(GLfloat), GL_MAP_READ_BIT);
+         if (res->map) {
+            vrend_buffer_map_sync();
+            data = res->map + ctx->sub->vbo[vbo_index].buffer_offset;
+         } else {
+            data = glMapBufferRange(GL_ARRAY_BUFFER, ctx->sub->vbo[vbo_index].buffer_offset, ve->nr_chan * sizeof(GLfloat), GL_MAP_READ_BIT);
+         }
 
          switch (ve->nr_chan) {
          case 1:
@@ -3636,14 +4829,15 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
             glVertexAttrib4fv(loc, data);
             break;
          }
-         glUnmapBuffer(GL_ARRAY_BUFFER);
+         if (!res->map)
+            glUnmapBuffer(GL_ARRAY_BUFFER);
          disable_bitmask |= (1 << loc);
       } else {
          enable_bitmask |= (1 << loc);
          if (util_format_is_pure_integer(ve->base.src_format)) {
-            glVertexAttribIPointer(loc, ve->nr_chan, ve->type, ctx->sub->vbo[vbo_index].stride, (void *)(uintptr_t)(ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset));
+            glVertexAttribIPointer(loc, ve->nr_chan, ve->type, ctx->sub->vbo[vbo_index].stride, (void *)(uintptr_t)(ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset + res->heap_offset));
          } else {
-            glVertexAttribPointer(loc, ve->nr_chan, ve->type, ve->norm, ctx->sub->vbo[vbo_index].stride, (void *)(uintptr_t)(ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset));
+            glVertexAttribPointer(loc, ve->nr_chan, ve->type, ve->norm, ctx->sub->vbo[vbo_index].stride, (void *)(uintptr_t)(ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset + res->heap_offset));
          }
          glVertexAttribDivisorARB(loc, ve->base.instance_divisor);
       }
@@ -3688,7 +4882,7 @@ static void vrend_draw_bind_vertex_binding(struct vrend_context *ctx,
             strides[count++] = 0;
          } else {
             buffers[count] = res->id;
-            offsets[count] = ctx->sub->vbo[i].buffer_offset,
+            offsets[count] = ctx->sub->vbo[i].buffer_offset + res->heap_offset,
             strides[count++] = ctx->sub->vbo[i].stride;
          }
       }
@@ -3796,7 +4990,7 @@ static void vrend_draw_bind_ubo_shader(struct vrend_context *ctx,
          res = (struct vrend_resource *)cb->buffer;
 
          glBindBufferRange(GL_UNIFORM_BUFFER, *ubo_id, res->id,
-                           cb->buffer_offset, cb->buffer_size);
+                           cb->buffer_offset + res->heap_offset, cb->buffer_size);
          dirty &= ~(1 << i);
       }
       (*ubo_id)++;
@@ -3841,7 +5035,7 @@ static void vrend_draw_bind_ssbo_shader(struct vrend_context *ctx, int shader_ty
       ssbo = &ctx->sub->ssbo[shader_type][i];
       res = (struct vrend_resource *)ssbo->res;
       glBindBufferRange(GL_SHADER_STORAGE_BUFFER, i, res->id,
-                        ssbo->buffer_offset, ssbo->buffer_size);
+                        ssbo->buffer_offset + res->heap_offset, ssbo->buffer_size);
       if (ctx->sub->prog->ssbo_locs[shader_type][i] != GL_INVALID_INDEX) {
          if (!vrend_state.use_gles)
             glShaderStorageBlockBinding(ctx->sub->prog->id, ctx->sub->prog->ssbo_locs[shader_type][i], i);
@@ -3868,7 +5062,7 @@ static void vrend_draw_bind_abo_shader(struct vrend_context *ctx)
       abo = &ctx->sub->abo[i];
       res = (struct vrend_resource *)abo->res;
       glBindBufferRange(GL_ATOMIC_COUNTER_BUFFER, i, res->id,
-                        abo->buffer_offset, abo->buffer_size);
+                        abo->buffer_offset + res->heap_offset, abo->buffer_size);
    }
 }
 
@@ -3907,7 +5101,10 @@ static void vrend_draw_bind_images_shader(struct vrend_context *ctx, int shader_
          glBindBufferARB(GL_TEXTURE_BUFFER, iview->texture->id);
          glBindTexture(GL_TEXTURE_BUFFER, iview->texture->tbo_tex_id);
 
-         if (has_feature(feat_arb_or_gles_ext_texture_buffer))
+         if (iview->texture->heap_slab)
+            glTexBufferRange(GL_TEXTURE_BUFFER, format, iview->texture->id,
+                             iview->texture->heap_offset, iview->texture->base.width0);
+         else if (has_feature(feat_arb_or_gles_ext_texture_buffer))
             glTexBuffer(GL_TEXTURE_BUFFER, format, iview->texture->id);
 
          tex_id = iview->texture->tbo_tex_id;
@@ -3983,13 +5180,18 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (indirect_handle) {
       if (!has_feature(feat_indirect_draw))
          return EINVAL;
-      indirect_res = vrend_renderer_ctx_res_lookup(ctx, indirect_handle);
-      if (!indirect_res) {
+      indirect_res = vrend_renderer_ctx_res_use(ctx, indirect_handle);
+      if (!indirect_res ||
+          !vrend_buffer_range_valid(indirect_res, info->indirect.offset,
+                                    (info->indexed ? 5 : 4) * sizeof(GLuint))) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, indirect_handle);
          return 0;
       }
    }
 
+   vrend_stamp_bound_resources(ctx->sub);
+   vrend_heap_rebind_evicted(ctx->sub);
+
    /* this must be zero until we support the feature */
    if (indirect_draw_count_handle) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, indirect_handle);
@@ -4014,7 +5216,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (ctx->sub->shader_dirty) {
       struct vrend_linked_shader_program *prog;
       bool fs_dirty, vs_dirty, gs_dirty, tcs_dirty, tes_dirty;
-      bool dual_src = util_blend_state_is_dual(&ctx->sub->blend_state, 0);
+      bool dual_src;
       bool same_prog;
 
       ctx->sub->shader_dirty = false;
@@ -4024,6 +5226,10 @@ int vrend_draw_vbo(struct vrend_context *ctx,
          return 0;
       }
 
+      /* programs are only linked for dual source if the fs can use it */
+      dual_src = util_blend_state_is_dual(&ctx->sub->blend_state, 0) &&
+                 ctx->sub->shaders[PIPE_SHADER_FRAGMENT]->sinfo.num_outputs > 1;
+
       vrend_shader_select(ctx, ctx->sub->shaders[PIPE_SHADER_FRAGMENT], &fs_dirty);
       vrend_shader_select(ctx, ctx->sub->shaders[PIPE_SHADER_VERTEX], &vs_dirty);
       if (ctx->sub->shaders[PIPE_SHADER_GEOMETRY])
@@ -4191,7 +5397,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       int start = cso ? 0 : info->start;
 
       if (indirect_handle)
-         glDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset);
+         glDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)(info->indirect.offset + indirect_res->heap_offset));
       else if (info->instance_count <= 1)
          glDrawArrays(mode, start, count);
       else if (info->start_instance)
@@ -4201,6 +5407,9 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    } else {
       GLenum elsz;
       GLenum mode = info->mode;
+      struct vrend_resource *ib_res = (struct vrend_resource *)ctx->sub->ib.buffer;
+      uintptr_t ib_offset = ctx->sub->ib.offset + ib_res->heap_offset;
+
       switch (ctx->sub->ib.index_size) {
       case 1:
          elsz = GL_UNSIGNED_BYTE;
@@ -4215,20 +5424,20 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       }
 
       if (indirect_handle)
-         glDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset);
+         glDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)(info->indirect.offset + indirect_res->heap_offset));
       else if (info->index_bias) {
          if (info->instance_count > 1)
-            glDrawElementsInstancedBaseVertex(mode, info->count, elsz, (void *)(uintptr_t)ctx->sub->ib.offset, info->instance_count, info->index_bias);
+            glDrawElementsInstancedBaseVertex(mode, info->count, elsz, (void *)ib_offset, info->instance_count, info->index_bias);
          else if (info->min_index != 0 || info->max_index != (unsigned)-1)
-            glDrawRangeElementsBaseVertex(mode, info->min_index, info->max_index, info->count, elsz, (void *)(uintptr_t)ctx->sub->ib.offset, info->index_bias);
+            glDrawRangeElementsBaseVertex(mode, info->min_index, info->max_index, info->count, elsz, (void *)ib_offset, info->index_bias);
          else
-            glDrawElementsBaseVertex(mode, info->count, elsz, (void *)(uintptr_t)ctx->sub->ib.offset, info->index_bias);
+            glDrawElementsBaseVertex(mode, info->count, elsz, (void *)ib_offset, info->index_bias);
       } else if (info->instance_count > 1) {
-         glDrawElementsInstancedARB(mode, info->count, elsz, (void *)(uintptr_t)ctx->sub->ib.offset, info->instance_count);
+         glDrawElementsInstancedARB(mode, info->count, elsz, (void *)ib_offset, info->instance_count);
       } else if (info->min_index != 0 || info->max_index != (unsigned)-1)
-         glDrawRangeElements(mode, info->min_index, info->max_index, info->count, elsz, (void *)(uintptr_t)ctx->sub->ib.offset);
+         glDrawRangeElements(mode, info->min_index, info->max_index, info->count, elsz, (void *)ib_offset);
       else
-         glDrawElements(mode, info->count, elsz, (void *)(uintptr_t)ctx->sub->ib.offset);
+         glDrawElements(mode, info->count, elsz, (void *)ib_offset);
    }
 
    if (info->primitive_restart) {
@@ -4262,6 +5471,9 @@ void vrend_launch_grid(struct vrend_context *ctx,
    if (!has_feature(feat_compute_shader))
       return;
 
+   vrend_stamp_bound_resources(ctx->sub);
+   vrend_heap_rebind_evicted(ctx->sub);
+
    if (ctx->sub->cs_shader_dirty) {
       struct vrend_linked_shader_program *prog;
       bool cs_dirty;
@@ -4308,8 +5520,9 @@ void vrend_launch_grid(struct vrend_context *ctx,
    vrend_draw_bind_abo_shader(ctx);
 
    if (indirect_handle) {
-      indirect_res = vrend_renderer_ctx_res_lookup(ctx, indirect_handle);
-      if (!indirect_res) {
+      indirect_res = vrend_renderer_ctx_res_use(ctx, indirect_handle);
+      if (!indirect_res ||
+          !vrend_buffer_range_valid(indirect_res, indirect_offset, 3 * sizeof(GLuint))) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, indirect_handle);
          return;
       }
@@ -4321,7 +5534,7 @@ void vrend_launch_grid(struct vrend_context *ctx,
       glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
 
    if (indirect_res) {
-      glDispatchComputeIndirect(indirect_offset);
+      glDispatchComputeIndirect(indirect_offset + indirect_res->heap_offset);
    } else {
       glDispatchCompute(grid[0], grid[1], grid[2]);
    }
@@ -4467,10 +5680,10 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
             report_gles_warn(ctx, GLES_WARN_LOGIC_OP);
          }
       } else if (state->logicop_enable) {
-         glEnable(GL_COLOR_LOGIC_OP);
-         glLogicOp(translate_logicop(state->logicop_func));
+         vrend_gl_enable(ctx, VREND_GL_COLOR_LOGIC_OP, true);
+         vrend_gl_logic_op(ctx, translate_logicop(state->logicop_func));
       } else {
-         glDisable(GL_COLOR_LOGIC_OP);
+         vrend_gl_enable(ctx, VREND_GL_COLOR_LOGIC_OP, false);
       }
    }
 
@@ -4489,15 +5702,15 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
                continue;
             }
 
-            glBlendFuncSeparateiARB(i, translate_blend_factor(state->rt[i].rgb_src_factor),
-                                    translate_blend_factor(state->rt[i].rgb_dst_factor),
-                                    translate_blend_factor(state->rt[i].alpha_src_factor),
-                                    translate_blend_factor(state->rt[i].alpha_dst_factor));
-            glBlendEquationSeparateiARB(i, translate_blend_func(state->rt[i].rgb_func),
-                                        translate_blend_func(state->rt[i].alpha_func));
-            glEnableIndexedEXT(GL_BLEND, i);
+            vrend_gl_blend_func(ctx, i, translate_blend_factor(state->rt[i].rgb_src_factor),
+                                translate_blend_factor(state->rt[i].rgb_dst_factor),
+                                translate_blend_factor(state->rt[i].alpha_src_factor),
+                                translate_blend_factor(state->rt[i].alpha_dst_factor));
+            vrend_gl_blend_equation(ctx, i, translate_blend_func(state->rt[i].rgb_func),
+                                    translate_blend_func(state->rt[i].alpha_func));
+            vrend_gl_blend_enable(ctx, i, true);
          } else
-            glDisableIndexedEXT(GL_BLEND, i);
+            vrend_gl_blend_enable(ctx, i, false);
 
          if (state->rt[i].colormask != ctx->sub->hw_blend_state.rt[i].colormask) {
             ctx->sub->hw_blend_state.rt[i].colormask = state->rt[i].colormask;
@@ -4513,16 +5726,16 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
          if (dual_src && !has_feature(feat_dual_src_blend)) {
             vrend_printf( "dual src blend requested but not supported for rt 0\n");
          }
-         glBlendFuncSeparate(translate_blend_factor(state->rt[0].rgb_src_factor),
+         vrend_gl_blend_func(ctx, -1, translate_blend_factor(state->rt[0].rgb_src_factor),
                              translate_blend_factor(state->rt[0].rgb_dst_factor),
                              translate_blend_factor(state->rt[0].alpha_src_factor),
                              translate_blend_factor(state->rt[0].alpha_dst_factor));
-         glBlendEquationSeparate(translate_blend_func(state->rt[0].rgb_func),
+         vrend_gl_blend_equation(ctx, -1, translate_blend_func(state->rt[0].rgb_func),
                                  translate_blend_func(state->rt[0].alpha_func));
-         glEnable(GL_BLEND);
+         vrend_gl_blend_enable(ctx, -1, true);
       }
       else
-         glDisable(GL_BLEND);
+         vrend_gl_blend_enable(ctx, -1, false);
 
       if (state->rt[0].colormask != ctx->sub->hw_blend_state.rt[0].colormask) {
          int i;
@@ -4537,23 +5750,13 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
    ctx->sub->hw_blend_state.independent_blend_enable = state->independent_blend_enable;
 
    if (has_feature(feat_multisample)) {
-      if (state->alpha_to_coverage)
-         glEnable(GL_SAMPLE_ALPHA_TO_COVERAGE);
-      else
-         glDisable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+      vrend_gl_enable(ctx, VREND_GL_SAMPLE_ALPHA_TO_COVERAGE, state->alpha_to_coverage);
 
-      if (!vrend_state.use_gles) {
-         if (state->alpha_to_one)
-            glEnable(GL_SAMPLE_ALPHA_TO_ONE);
-         else
-            glDisable(GL_SAMPLE_ALPHA_TO_ONE);
-      }
+      if (!vrend_state.use_gles)
+         vrend_gl_enable(ctx, VREND_GL_SAMPLE_ALPHA_TO_ONE, state->alpha_to_one);
    }
 
-   if (state->dither)
-      glEnable(GL_DITHER);
-   else
-      glDisable(GL_DITHER);
+   vrend_gl_enable(ctx, VREND_GL_DITHER, state->dither);
 }
 
 /* there are a few reasons we might need to patch the blend state.
@@ -4613,10 +5816,7 @@ static void vrend_patch_blend_state(struct vrend_context *ctx)
       blend_color.color[3] = 0.0f;
    }
 
-   glBlendColor(blend_color.color[0],
-                blend_color.color[1],
-                blend_color.color[2],
-                blend_color.color[3]);
+   vrend_gl_blend_color(ctx, blend_color.color);
 
    ctx->sub->blend_state_dirty = false;
 }
@@ -4628,7 +5828,7 @@ void vrend_object_bind_blend(struct vrend_context *ctx,
 
    if (handle == 0) {
       memset(&ctx->sub->blend_state, 0, sizeof(ctx->sub->blend_state));
-      glDisable(GL_BLEND);
+      vrend_gl_blend_enable(ctx, -1, false);
       return;
    }
    state = vrend_object_lookup(ctx->sub->object_hash, handle, VIRGL_OBJECT_BLEND);
@@ -4649,11 +5849,11 @@ static void vrend_hw_emit_dsa(struct vrend_context *ctx)
 
    if (state->depth.enabled) {
       vrend_depth_test_enable(ctx, true);
-      glDepthFunc(GL_NEVER + state->depth.func);
+      vrend_gl_depth_func(ctx, GL_NEVER + state->depth.func);
       if (state->depth.writemask)
-         glDepthMask(GL_TRUE);
+         vrend_gl_depth_mask(ctx, GL_TRUE);
       else
-         glDepthMask(GL_FALSE);
+         vrend_gl_depth_mask(ctx, GL_FALSE);
    } else
       vrend_depth_test_enable(ctx, false);
 
@@ -4703,9 +5903,9 @@ static void vrend_update_frontface_state(struct vrend_context *ctx)
 
    front_ccw ^= (ctx->sub->inverted_fbo_content ? 0 : 1);
    if (front_ccw)
-      glFrontFace(GL_CCW);
+      vrend_gl_front_face(ctx, GL_CCW);
    else
-      glFrontFace(GL_CW);
+      vrend_gl_front_face(ctx, GL_CW);
 }
 
 void vrend_update_stencil_state(struct vrend_context *ctx)
@@ -4719,14 +5919,16 @@ void vrend_update_stencil_state(struct vrend_context *ctx)
       if (state->stencil[0].enabled) {
          vrend_stencil_test_enable(ctx, true);
 
-         glStencilOp(translate_stencil_op(state->stencil[0].fail_op),
-                     translate_stencil_op(state->stencil[0].zfail_op),
-                     translate_stencil_op(state->stencil[0].zpass_op));
+         vrend_gl_stencil_op(ctx, GL_FRONT_AND_BACK,
+                             translate_stencil_op(state->stencil[0].fail_op),
+                             translate_stencil_op(state->stencil[0].zfail_op),
+                             translate_stencil_op(state->stencil[0].zpass_op));
 
-         glStencilFunc(GL_NEVER + state->stencil[0].func,
-                       ctx->sub->stencil_refs[0],
-                       state->stencil[0].valuemask);
-         glStencilMask(state->stencil[0].writemask);
+         vrend_gl_stencil_func(ctx, GL_FRONT_AND_BACK,
+                               GL_NEVER + state->stencil[0].func,
+                               ctx->sub->stencil_refs[0],
+                               state->stencil[0].valuemask);
+         vrend_gl_stencil_mask(ctx, GL_FRONT_AND_BACK, state->stencil[0].writemask);
       } else
          vrend_stencil_test_enable(ctx, false);
    } else {
@@ -4734,15 +5936,15 @@ void vrend_update_stencil_state(struct vrend_context *ctx)
 
       for (i = 0; i < 2; i++) {
          GLenum face = (i == 1) ? GL_BACK : GL_FRONT;
-         glStencilOpSeparate(face,
+         vrend_gl_stencil_op(ctx, face,
                              translate_stencil_op(state->stencil[i].fail_op),
                              translate_stencil_op(state->stencil[i].zfail_op),
                              translate_stencil_op(state->stencil[i].zpass_op));
 
-         glStencilFuncSeparate(face, GL_NEVER + state->stencil[i].func,
+         vrend_gl_stencil_func(ctx, face, GL_NEVER + state->stencil[i].func,
                                ctx->sub->stencil_refs[i],
                                state->stencil[i].valuemask);
-         glStencilMaskSeparate(face, state->stencil[i].writemask);
+         vrend_gl_stencil_mask(ctx, face, state->stencil[i].writemask);
       }
    }
    ctx->sub->stencil_state_dirty = false;
@@ -4772,10 +5974,8 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       if (!state->depth_clip) {
          report_gles_warn(ctx, GLES_WARN_DEPTH_CLIP);
       }
-   } else if (state->depth_clip) {
-      glDisable(GL_DEPTH_CLAMP);
    } else {
-      glEnable(GL_DEPTH_CLAMP);
+      vrend_gl_enable(ctx, VREND_GL_DEPTH_CLAMP, !state->depth_clip);
    }
 
    if (vrend_state.use_gles) {
@@ -4786,24 +5986,19 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_POINT_SIZE);
       }
    } else if (state->point_size_per_vertex) {
-      glEnable(GL_PROGRAM_POINT_SIZE);
+      vrend_gl_enable(ctx, VREND_GL_PROGRAM_POINT_SIZE, true);
    } else {
-      glDisable(GL_PROGRAM_POINT_SIZE);
+      vrend_gl_enable(ctx, VREND_GL_PROGRAM_POINT_SIZE, false);
       if (state->point_size) {
-         glPointSize(state->point_size);
+         vrend_gl_point_size(ctx, state->point_size);
       }
    }
 
    /* line_width < 0 is invalid, the guest sometimes forgot to set it. */
-   glLineWidth(state->line_width <= 0 ? 1.0f : state->line_width);
+   vrend_gl_line_width(ctx, state->line_width <= 0 ? 1.0f : state->line_width);
 
-   if (state->rasterizer_discard != ctx->sub->hw_rs_state.rasterizer_discard) {
-      ctx->sub->hw_rs_state.rasterizer_discard = state->rasterizer_discard;
-      if (state->rasterizer_discard)
-         glEnable(GL_RASTERIZER_DISCARD);
-      else
-         glDisable(GL_RASTERIZER_DISCARD);
-   }
+   ctx->sub->hw_rs_state.rasterizer_discard = state->rasterizer_discard;
+   vrend_gl_enable(ctx, VREND_GL_RASTERIZER_DISCARD, state->rasterizer_discard);
 
    if (vrend_state.use_gles == true) {
       if (translate_fill(state->fill_front) != GL_FILL) {
@@ -4813,37 +6008,29 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_POLYGON_MODE);
       }
    } else if (vrend_state.use_core_profile == false) {
-      glPolygonMode(GL_FRONT, translate_fill(state->fill_front));
-      glPolygonMode(GL_BACK, translate_fill(state->fill_back));
+      vrend_gl_polygon_mode(ctx, GL_FRONT, translate_fill(state->fill_front));
+      vrend_gl_polygon_mode(ctx, GL_BACK, translate_fill(state->fill_back));
    } else if (state->fill_front == state->fill_back) {
-      glPolygonMode(GL_FRONT_AND_BACK, translate_fill(state->fill_front));
+      vrend_gl_polygon_mode(ctx, GL_FRONT_AND_BACK, translate_fill(state->fill_front));
    } else
       report_core_warn(ctx, CORE_PROFILE_WARN_POLYGON_MODE);
 
-   if (state->offset_tri) {
-      glEnable(GL_POLYGON_OFFSET_FILL);
-   } else {
-      glDisable(GL_POLYGON_OFFSET_FILL);
-   }
+   vrend_gl_enable(ctx, VREND_GL_POLYGON_OFFSET_FILL, state->offset_tri);
 
    if (vrend_state.use_gles) {
       if (state->offset_line) {
          report_gles_warn(ctx, GLES_WARN_OFFSET_LINE);
       }
-   } else if (state->offset_line) {
-      glEnable(GL_POLYGON_OFFSET_LINE);
    } else {
-      glDisable(GL_POLYGON_OFFSET_LINE);
+      vrend_gl_enable(ctx, VREND_GL_POLYGON_OFFSET_LINE, state->offset_line);
    }
 
    if (vrend_state.use_gles) {
       if (state->offset_point) {
          report_gles_warn(ctx, GLES_WARN_OFFSET_POINT);
       }
-   } else if (state->offset_point) {
-      glEnable(GL_POLYGON_OFFSET_POINT);
    } else {
-      glDisable(GL_POLYGON_OFFSET_POINT);
+      vrend_gl_enable(ctx, VREND_GL_POLYGON_OFFSET_POINT, state->offset_point);
    }
 
 
@@ -4871,16 +6058,10 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       }
    }
 
-   if (!vrend_state.use_gles && has_feature(feat_polygon_offset_clamp))
-       glPolygonOffsetClampEXT(state->offset_scale, state->offset_units, state->offset_clamp);
-   else
-       glPolygonOffset(state->offset_scale, state->offset_units);
+   vrend_gl_polygon_offset(ctx, state->offset_scale, state->offset_units, state->offset_clamp);
 
    if (vrend_state.use_core_profile == false) {
-      if (state->poly_stipple_enable)
-         glEnable(GL_POLYGON_STIPPLE);
-      else
-         glDisable(GL_POLYGON_STIPPLE);
+      vrend_gl_enable(ctx, VREND_GL_POLYGON_STIPPLE, state->poly_stipple_enable);
    } else if (state->poly_stipple_enable) {
       if (!ctx->pstip_inited)
          vrend_init_pstipple_texture(ctx);
@@ -4889,7 +6070,7 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (state->point_quad_rasterization) {
       if (vrend_state.use_core_profile == false &&
           vrend_state.use_gles == false) {
-         glEnable(GL_POINT_SPRITE);
+         vrend_gl_enable(ctx, VREND_GL_POINT_SPRITE, true);
       }
 
       if (vrend_state.use_gles == false) {
@@ -4898,35 +6079,31 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    } else {
       if (vrend_state.use_core_profile == false &&
           vrend_state.use_gles == false) {
-         glDisable(GL_POINT_SPRITE);
+         vrend_gl_enable(ctx, VREND_GL_POINT_SPRITE, false);
       }
    }
 
    if (state->cull_face != PIPE_FACE_NONE) {
       switch (state->cull_face) {
       case PIPE_FACE_FRONT:
-         glCullFace(GL_FRONT);
+         vrend_gl_cull_face(ctx, GL_FRONT);
          break;
       case PIPE_FACE_BACK:
-         glCullFace(GL_BACK);
+         vrend_gl_cull_face(ctx, GL_BACK);
          break;
       case PIPE_FACE_FRONT_AND_BACK:
-         glCullFace(GL_FRONT_AND_BACK);
+         vrend_gl_cull_face(ctx, GL_FRONT_AND_BACK);
          break;
       default:
          vrend_printf( "unhandled cull-face: %x\n", state->cull_face);
       }
-      glEnable(GL_CULL_FACE);
+      vrend_gl_enable(ctx, VREND_GL_CULL_FACE, true);
    } else
-      glDisable(GL_CULL_FACE);
+      vrend_gl_enable(ctx, VREND_GL_CULL_FACE, false);
 
    /* two sided lighting handled in shader for core profile */
-   if (vrend_state.use_core_profile == false) {
-      if (state->light_twoside)
-         glEnable(GL_VERTEX_PROGRAM_TWO_SIDE);
-      else
-         glDisable(GL_VERTEX_PROGRAM_TWO_SIDE);
-   }
+   if (vrend_state.use_core_profile == false)
+      vrend_gl_enable(ctx, VREND_GL_VERTEX_PROGRAM_TWO_SIDE, state->light_twoside);
 
    if (state->clip_plane_enable != ctx->sub->hw_rs_state.clip_plane_enable) {
       ctx->sub->hw_rs_state.clip_plane_enable = state->clip_plane_enable;
@@ -4939,10 +6116,7 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    }
    if (vrend_state.use_core_profile == false) {
       glLineStipple(state->line_stipple_factor, state->line_stipple_pattern);
-      if (state->line_stipple_enable)
-         glEnable(GL_LINE_STIPPLE);
-      else
-         glDisable(GL_LINE_STIPPLE);
+      vrend_gl_enable(ctx, VREND_GL_LINE_STIPPLE, state->line_stipple_enable);
    } else if (state->line_stipple_enable) {
       if (vrend_state.use_gles)
          report_core_warn(ctx, GLES_WARN_STIPPLE);
@@ -4955,20 +6129,16 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       if (state->line_smooth) {
          report_gles_warn(ctx, GLES_WARN_LINE_SMOOTH);
       }
-   } else if (state->line_smooth) {
-      glEnable(GL_LINE_SMOOTH);
    } else {
-      glDisable(GL_LINE_SMOOTH);
+      vrend_gl_enable(ctx, VREND_GL_LINE_SMOOTH, state->line_smooth);
    }
 
    if (vrend_state.use_gles) {
       if (state->poly_smooth) {
          report_gles_warn(ctx, GLES_WARN_POLY_SMOOTH);
       }
-   } else if (state->poly_smooth) {
-      glEnable(GL_POLYGON_SMOOTH);
    } else {
-      glDisable(GL_POLYGON_SMOOTH);
+      vrend_gl_enable(ctx, VREND_GL_POLYGON_SMOOTH, state->poly_smooth);
    }
 
    if (vrend_state.use_core_profile == false) {
@@ -4987,33 +6157,18 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    }
 
    if (has_feature(feat_multisample)) {
-      if (has_feature(feat_sample_mask)) {
-	 if (state->multisample)
-	    glEnable(GL_SAMPLE_MASK);
-	 else
-	    glDisable(GL_SAMPLE_MASK);
-      }
+      if (has_feature(feat_sample_mask))
+         vrend_gl_enable(ctx, VREND_GL_SAMPLE_MASK, state->multisample);
 
       /* GLES doesn't have GL_MULTISAMPLE */
-      if (!vrend_state.use_gles) {
-         if (state->multisample)
-            glEnable(GL_MULTISAMPLE);
-         else
-            glDisable(GL_MULTISAMPLE);
-      }
+      if (!vrend_state.use_gles)
+         vrend_gl_enable(ctx, VREND_GL_MULTISAMPLE, state->multisample);
 
-      if (has_feature(feat_sample_shading)) {
-         if (state->force_persample_interp)
-            glEnable(GL_SAMPLE_SHADING);
-         else
-            glDisable(GL_SAMPLE_SHADING);
-      }
+      if (has_feature(feat_sample_shading))
+         vrend_gl_enable(ctx, VREND_GL_SAMPLE_SHADING, state->force_persample_interp);
    }
 
-   if (state->scissor)
-      glEnable(GL_SCISSOR_TEST);
-   else
-      glDisable(GL_SCISSOR_TEST);
+   vrend_gl_enable(ctx, VREND_GL_SCISSOR_TEST, state->scissor);
 
 }
 
@@ -5117,7 +6272,7 @@ static void vrend_apply_sampler_state(struct vrend_context *ctx,
          glSamplerParameterIuiv(sampler, GL_TEXTURE_BORDER_COLOR, border_color.ui);
       }
 
-      glBindSampler(sampler_id, sampler);
+      vrend_gl_bind_sampler(ctx, sampler_id, sampler);
       return;
    }
 
@@ -5161,13 +6316,8 @@ static void vrend_apply_sampler_state(struct vrend_context *ctx,
     * way to toggle between the behaviour when running on GLES. And adding
     * warnings will spew the logs quite bad. Ignore and hope for the best.
     */
-   if (!vrend_state.use_gles) {
-      if (state->seamless_cube_map) {
-         glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-      } else {
-         glDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-      }
-   }
+   if (!vrend_state.use_gles)
+      vrend_gl_enable(ctx, VREND_GL_TEXTURE_CUBE_MAP_SEAMLESS, state->seamless_cube_map);
 
    if (memcmp(&tex->state.border_color, &state->border_color, 16) || set_all ||
        is_emulated_alpha) {
@@ -5210,21 +6360,122 @@ static GLenum tgsitargettogltarget(const enum pipe_texture_target target, int nr
    return PIPE_BUFFER;
 }
 
+static bool vrend_fence_signaled(struct vrend_fence *fence)
+{
+   GLenum glret = glClientWaitSync(fence->syncobj, 0, 0);
+
+   if (glret == GL_WAIT_FAILED)
+      vrend_printf( "wait sync failed: illegal fence object %p\n", fence->syncobj);
+   return glret != GL_TIMEOUT_EXPIRED;
+}
+
+/* poller side: start watching a new fence */
+static void vrend_poll_fence_add(struct vrend_fence *fence)
+{
+   struct vrend_fence_timeline *timeline = fence->timeline;
+
+   if (LIST_IS_EMPTY(&timeline->pending))
+      list_addtail(&timeline->poll_head, &vrend_state.fence_poll_list);
+   list_addtail(&fence->timeline_fences, &timeline->pending);
+}
+
+/* Move the fences that signaled from the front of each timeline to
+ * vrend_state.fence_done_list, a fence blocks only the ones created after
+ * it in the same context.  A timeline is left alone by the poller once
+ * its last fence is done, before the fence goes back to the main thread,
+ * so the main thread may free it after that. */
+static void vrend_poll_fence_timelines(void)
+{
+   struct vrend_fence_timeline *timeline, *tmp;
+   struct vrend_fence *fence, *stor, *last;
+
+   LIST_FOR_EACH_ENTRY_SAFE(timeline, tmp, &vrend_state.fence_poll_list, poll_head) {
+      /* a context's fences signal in order: when the newest one did, the
+       * whole backlog retires without asking about each fence */
+      last = LIST_ENTRY(struct vrend_fence, timeline->pending.prev, timeline_fences);
+      if (!vrend_fence_signaled(last))
+         last = NULL;
+
+      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &timeline->pending, timeline_fences) {
+         if (!last && !vrend_fence_signaled(fence))
+            break;
+
+         list_del(&fence->timeline_fences);
+         list_addtail(&fence->timeline_fences, &vrend_state.fence_done_list);
+      }
+
+      if (LIST_IS_EMPTY(&timeline->pending))
+         list_del(&timeline->poll_head);
+   }
+}
+
 static void vrend_free_sync_thread(void)
 {
+   uint64_t value = 1;
+
    if (!vrend_state.sync_thread)
       return;
 
-   pipe_mutex_lock(vrend_state.fence_mutex);
-   vrend_state.stop_sync_thread = true;
-   pipe_condvar_signal(vrend_state.fence_cond);
-   pipe_mutex_unlock(vrend_state.fence_mutex);
+   __atomic_store_n(&vrend_state.stop_sync_thread, 1, __ATOMIC_SEQ_CST);
+   if (write(vrend_state.sync_wake_fd, &value, sizeof(value)) != sizeof(value))
+      perror("failed to wake the sync thread");
 
    pipe_thread_wait(vrend_state.sync_thread);
    vrend_state.sync_thread = 0;
 
-   pipe_condvar_destroy(vrend_state.fence_cond);
-   pipe_mutex_destroy(vrend_state.fence_mutex);
+   close(vrend_state.sync_wake_fd);
+   vrend_state.sync_wake_fd = -1;
+   vrend_ring_fini(&vrend_state.fence_submit_ring);
+   vrend_ring_fini(&vrend_state.fence_signaled_ring);
+}
+
+/* main thread: wake the sync thread if it sleeps on what the caller just
+ * did, VREND_SYNC_WAIT_FENCES wakes it whatever it waits for */
+static void vrend_wake_sync_thread(int reason)
+{
+   uint64_t value = 1;
+   int idle;
+
+   /* pairs with the idle check of the sync thread */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   idle = __atomic_load_n(&vrend_state.sync_thread_idle, __ATOMIC_SEQ_CST);
+   if (idle == VREND_SYNC_RUNNING ||
+       (reason != VREND_SYNC_WAIT_FENCES && idle != reason))
+      return;
+   if (!__atomic_compare_exchange_n(&vrend_state.sync_thread_idle, &idle,
+                                    VREND_SYNC_RUNNING, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return;
+
+   vrend_state.sync_thread_wakeups++;
+   if (write(vrend_state.sync_wake_fd, &value, sizeof(value)) != sizeof(value))
+      perror("failed to wake the sync thread");
+}
+
+/* main thread: move fences to the sync thread as far as the ring allows */
+static void vrend_push_fences(void)
+{
+   struct vrend_fence *fence, *stor;
+
+   LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_overflow_list, timeline_fences) {
+      if (!vrend_ring_push(&vrend_state.fence_submit_ring, fence))
+         break;
+      list_del(&fence->timeline_fences);
+   }
+
+   vrend_wake_sync_thread(VREND_SYNC_WAIT_FENCES);
+}
+
+/* main thread: hand a new fence to whoever polls the fences */
+static void vrend_submit_fence(struct vrend_fence *fence)
+{
+   if (!vrend_state.sync_thread) {
+      vrend_poll_fence_add(fence);
+      return;
+   }
+
+   list_addtail(&fence->timeline_fences, &vrend_state.fence_overflow_list);
+   vrend_push_fences();
 }
 
 #ifdef HAVE_EVENTFD
@@ -5249,66 +6500,101 @@ write_full(int fd, const void *ptr, size_t count)
    return total;
 }
 
-static void wait_sync(struct vrend_fence *fence)
+static void vrend_signal_eventfd(void)
 {
-   GLenum glret;
    ssize_t n;
    uint64_t value = 1;
 
-   do {
-      glret = glClientWaitSync(fence->syncobj, 0, 1000000000);
-
-      switch (glret) {
-      case GL_WAIT_FAILED:
-         vrend_printf( "wait sync failed: illegal fence object %p\n", fence->syncobj);
-         break;
-      case GL_ALREADY_SIGNALED:
-      case GL_CONDITION_SATISFIED:
-         break;
-      default:
-         break;
-      }
-   } while (glret == GL_TIMEOUT_EXPIRED);
-
-   pipe_mutex_lock(vrend_state.fence_mutex);
-   list_addtail(&fence->fences, &vrend_state.fence_list);
-   pipe_mutex_unlock(vrend_state.fence_mutex);
-
    n = write_full(vrend_state.eventfd, &value, sizeof(value));
    if (n != sizeof(value)) {
       perror("failed to write to eventfd\n");
    }
 }
 
+/* sleep until vrend_submit_fence has something, or with
+ * VREND_SYNC_WAIT_ROOM until the main thread drained fence_signaled_ring,
+ * unless that already happened */
+static void vrend_sync_thread_idle(int reason)
+{
+   uint64_t value;
+
+   __atomic_store_n(&vrend_state.sync_thread_idle, reason, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (!vrend_ring_is_empty(&vrend_state.fence_submit_ring) ||
+       (reason == VREND_SYNC_WAIT_ROOM &&
+        vrend_ring_is_empty(&vrend_state.fence_signaled_ring)) ||
+       __atomic_load_n(&vrend_state.stop_sync_thread, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n(&vrend_state.sync_thread_idle, VREND_SYNC_RUNNING, __ATOMIC_SEQ_CST);
+      return;
+   }
+
+   while (read(vrend_state.sync_wake_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+      ;
+   __atomic_store_n(&vrend_state.sync_thread_idle, VREND_SYNC_RUNNING, __ATOMIC_SEQ_CST);
+}
+
 static int thread_sync(UNUSED void *arg)
 {
    virgl_gl_context gl_context = vrend_state.sync_context;
+   struct vrend_fence_timeline *timeline;
    struct vrend_fence *fence, *stor;
+   unsigned num_pending;
+   GLuint64 timeout;
+   bool pushed;
 
-
-   pipe_mutex_lock(vrend_state.fence_mutex);
    vrend_clicbs->make_current(gl_context);
 
-   while (!vrend_state.stop_sync_thread) {
-      if (LIST_IS_EMPTY(&vrend_state.fence_wait_list) &&
-          pipe_condvar_wait(vrend_state.fence_cond, vrend_state.fence_mutex) != 0) {
-         vrend_printf( "error while waiting on condition\n");
-         break;
-      }
+   while (!__atomic_load_n(&vrend_state.stop_sync_thread, __ATOMIC_SEQ_CST)) {
+      while ((fence = vrend_ring_pop(&vrend_state.fence_submit_ring)))
+         vrend_poll_fence_add(fence);
+
+      vrend_poll_fence_timelines();
 
-      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_wait_list, fences) {
-         if (vrend_state.stop_sync_thread)
+      pushed = false;
+      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_done_list, timeline_fences) {
+         if (!vrend_ring_push(&vrend_state.fence_signaled_ring, fence))
             break;
-         list_del(&fence->fences);
-         pipe_mutex_unlock(vrend_state.fence_mutex);
-         wait_sync(fence);
-         pipe_mutex_lock(vrend_state.fence_mutex);
+         list_del(&fence->timeline_fences);
+         pushed = true;
       }
+
+      /* one wakeup per batch, until the main thread collected it */
+      if (pushed && !__atomic_exchange_n(&vrend_state.fences_to_collect, 1, __ATOMIC_SEQ_CST)) {
+         vrend_state.fence_wakeups++;
+         vrend_signal_eventfd();
+      }
+
+      /* block on the oldest outstanding fence, but not for long when
+       * fences of other timelines could signal first or the main thread
+       * has to make room in the ring */
+      fence = NULL;
+      num_pending = 0;
+      LIST_FOR_EACH_ENTRY(timeline, &vrend_state.fence_poll_list, poll_head) {
+         struct vrend_fence *first;
+
+         first = LIST_ENTRY(struct vrend_fence, timeline->pending.next, timeline_fences);
+         if (!fence || (int32_t)(first->serial - fence->serial) < 0)
+            fence = first;
+         num_pending++;
+      }
+
+      /* the ring is full, fences signaling meanwhile only pile up */
+      if (!LIST_IS_EMPTY(&vrend_state.fence_done_list)) {
+         vrend_sync_thread_idle(VREND_SYNC_WAIT_ROOM);
+         continue;
+      }
+
+      if (!fence) {
+         vrend_sync_thread_idle(VREND_SYNC_WAIT_FENCES);
+         continue;
+      }
+
+      timeout = num_pending > 1 ? 1000000 : 1000000000;
+      glClientWaitSync(fence->syncobj, 0, timeout);
    }
 
    vrend_clicbs->make_current(0);
    vrend_clicbs->destroy_gl_context(vrend_state.sync_context);
-   pipe_mutex_unlock(vrend_state.fence_mutex);
    return 0;
 }
 
@@ -5323,7 +6609,9 @@ static void vrend_renderer_use_threaded_sync(void)
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
 
-   vrend_state.stop_sync_thread = false;
+   vrend_state.stop_sync_thread = 0;
+   vrend_state.sync_thread_idle = VREND_SYNC_RUNNING;
+   vrend_state.fences_to_collect = 0;
 
    vrend_state.sync_context = vrend_clicbs->create_gl_context(0, &ctx_params);
    if (vrend_state.sync_context == NULL) {
@@ -5338,17 +6626,29 @@ static void vrend_renderer_use_threaded_sync(void)
       return;
    }
 
-   pipe_condvar_init(vrend_state.fence_cond);
-   pipe_mutex_init(vrend_state.fence_mutex);
+   vrend_state.sync_wake_fd = eventfd(0, EFD_CLOEXEC);
+   if (vrend_state.sync_wake_fd == -1)
+      goto fail;
+
+   if (!vrend_ring_init(&vrend_state.fence_submit_ring, VREND_FENCE_RING_SIZE))
+      goto fail_wake_fd;
+   if (!vrend_ring_init(&vrend_state.fence_signaled_ring, VREND_FENCE_RING_SIZE))
+      goto fail_submit_ring;
 
    vrend_state.sync_thread = pipe_thread_create(thread_sync, NULL);
-   if (!vrend_state.sync_thread) {
-      close(vrend_state.eventfd);
-      vrend_state.eventfd = -1;
-      vrend_clicbs->destroy_gl_context(vrend_state.sync_context);
-      pipe_condvar_destroy(vrend_state.fence_cond);
-      pipe_mutex_destroy(vrend_state.fence_mutex);
-   }
+   if (vrend_state.sync_thread)
+      return;
+
+   vrend_ring_fini(&vrend_state.fence_signaled_ring);
+fail_submit_ring:
+   vrend_ring_fini(&vrend_state.fence_submit_ring);
+fail_wake_fd:
+   close(vrend_state.sync_wake_fd);
+   vrend_state.sync_wake_fd = -1;
+fail:
+   close(vrend_state.eventfd);
+   vrend_state.eventfd = -1;
+   vrend_clicbs->destroy_gl_context(vrend_state.sync_context);
 }
 #else
 static void vrend_renderer_use_threaded_sync(void)
@@ -5356,15 +6656,154 @@ static void vrend_renderer_use_threaded_sync(void)
 }
 #endif
 
+static int thread_compile(void *arg)
+{
+   virgl_gl_context gl_context = arg;
+   struct vrend_shader *shader;
+   bool ok;
+
+   vrend_clicbs->make_current(gl_context);
+
+   pipe_mutex_lock(vrend_state.compile_mutex);
+   while (!vrend_state.stop_compile_threads) {
+      if (LIST_IS_EMPTY(&vrend_state.compile_queue)) {
+         pipe_condvar_wait(vrend_state.compile_cond, vrend_state.compile_mutex);
+         continue;
+      }
+
+      shader = LIST_ENTRY(struct vrend_shader, vrend_state.compile_queue.next, compile_head);
+      list_del(&shader->compile_head);
+      shader->compile_state = VREND_COMPILE_RUNNING;
+      pipe_mutex_unlock(vrend_state.compile_mutex);
+
+      vrend_shader_start_compile(shader);
+      ok = vrend_shader_check_compiled(shader);
+      /* make the result visible to the renderer context */
+      glFinish();
+
+      pipe_mutex_lock(vrend_state.compile_mutex);
+      shader->compile_failed = !ok;
+      shader->compile_state = VREND_COMPILE_DONE;
+      pipe_condvar_broadcast(vrend_state.compile_done_cond);
+   }
+   pipe_mutex_unlock(vrend_state.compile_mutex);
+
+   vrend_clicbs->make_current(0);
+   vrend_clicbs->destroy_gl_context(gl_context);
+   return 0;
+}
+
+static void vrend_free_compile_threads(void)
+{
+   if (!vrend_state.num_compile_threads)
+      return;
+
+   pipe_mutex_lock(vrend_state.compile_mutex);
+   vrend_state.stop_compile_threads = true;
+   pipe_condvar_broadcast(vrend_state.compile_cond);
+   pipe_mutex_unlock(vrend_state.compile_mutex);
+
+   for (unsigned i = 0; i < vrend_state.num_compile_threads; i++)
+      pipe_thread_wait(vrend_state.compile_threads[i]);
+   vrend_state.num_compile_threads = 0;
+
+   pipe_condvar_destroy(vrend_state.compile_cond);
+   pipe_condvar_destroy(vrend_state.compile_done_cond);
+   pipe_mutex_destroy(vrend_state.compile_mutex);
+}
+
+/* VREND_SHADER_COMPILE_THREADS enables asynchronous shader compilation and
+ * sets how many threads compile.  If the driver compiles in parallel by
+ * itself it gets that limit and we only defer the status query, otherwise
+ * up to that many workers compile on their own shared contexts.
+ */
+static void vrend_renderer_use_async_compile(void)
+{
+   struct virgl_gl_ctx_param ctx_params;
+   unsigned num_threads;
+
+   num_threads = debug_get_num_option("VREND_SHADER_COMPILE_THREADS", 0);
+   if (!num_threads || vrend_state.num_compile_threads)
+      return;
+
+   num_threads = MIN2(num_threads, VREND_MAX_COMPILE_THREADS);
+
+   if (has_feature(feat_parallel_shader_compile)) {
+      if (epoxy_has_gl_extension("GL_KHR_parallel_shader_compile"))
+         glMaxShaderCompilerThreadsKHR(num_threads);
+      else
+         glMaxShaderCompilerThreadsARB(num_threads);
+      vrend_state.use_parallel_compile = true;
+      return;
+   }
+
+   ctx_params.shared = true;
+   ctx_params.major_ver = vrend_state.gl_major_ver;
+   ctx_params.minor_ver = vrend_state.gl_minor_ver;
+
+   list_inithead(&vrend_state.compile_queue);
+   pipe_mutex_init(vrend_state.compile_mutex);
+   pipe_condvar_init(vrend_state.compile_cond);
+   pipe_condvar_init(vrend_state.compile_done_cond);
+   vrend_state.stop_compile_threads = false;
+
+   for (unsigned i = 0; i < num_threads; i++) {
+      virgl_gl_context gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+      if (!gl_context) {
+         vrend_printf("failed to create shader compile opengl context\n");
+         break;
+      }
+
+      vrend_state.compile_threads[i] = pipe_thread_create(thread_compile, gl_context);
+      if (!vrend_state.compile_threads[i]) {
+         vrend_clicbs->destroy_gl_context(gl_context);
+         break;
+      }
+      vrend_state.num_compile_threads++;
+   }
+
+   if (!vrend_state.num_compile_threads) {
+      pipe_condvar_destroy(vrend_state.compile_cond);
+      pipe_condvar_destroy(vrend_state.compile_done_cond);
+      pipe_mutex_destroy(vrend_state.compile_mutex);
+   }
+}
+
 static void vrend_debug_cb(UNUSED GLenum source, GLenum type, UNUSED GLuint id,
                            UNUSED GLenum severity, UNUSED GLsizei length,
                            UNUSED const GLchar* message, UNUSED const void* userParam)
 {
    if (type != GL_DEBUG_TYPE_ERROR) {
       return;
-   }
+   }
+
+   vrend_printf( "ERROR: %s\n", message);
+}
+
+static void vrend_init_program_binary_cache(void)
+{
+   const char *path = getenv("VREND_PROGRAM_BINARY_CACHE_DIR");
+   const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION,
+                              GL_SHADING_LANGUAGE_VERSION };
+   GLint num_formats = 0;
+   uint64_t max_size;
+
+   if (!path || vrend_state.program_binary_cache ||
+       !has_feature(feat_get_program_binary))
+      return;
 
-   vrend_printf( "ERROR: %s\n", message);
+   glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+   if (num_formats <= 0)
+      return;
+
+   vrend_disk_cache_key_init(&vrend_state.driver_key);
+   for (unsigned i = 0; i < ARRAY_SIZE(strings); i++)
+      vrend_disk_cache_key_add_str(&vrend_state.driver_key,
+                                   (const char *)glGetString(strings[i]));
+
+   max_size = debug_get_num_option("VREND_PROGRAM_BINARY_CACHE_SIZE", 64);
+   vrend_state.program_binary_cache = vrend_disk_cache_create(path, "programs",
+                                                              max_size * 1024 * 1024);
 }
 
 int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
@@ -5384,6 +6823,20 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
    vrend_init_debug_flags();
 #endif
 
+   vrend_state.max_programs = debug_get_num_option("VREND_MAX_PROGRAMS", 1024);
+   /* in KiB, 0 uploads straight from guest memory */
+   vrend_state.upload_ring_size = debug_get_num_option("VREND_UPLOAD_RING_KB", 16384) * 1024;
+   /* pixel pack buffers for readbacks in flight, 0 reads synchronously */
+   vrend_state.max_readback_pbos = debug_get_num_option("VREND_READBACK_PBOS", 4);
+   /* storage of destroyed resources kept for reuse, 0 disables the pool */
+   vrend_state.pool_max_size = (uint64_t)debug_get_num_option("VREND_RESOURCE_POOL_MB", 64) << 20;
+   vrend_state.pool_max_age_ms = debug_get_num_option("VREND_RESOURCE_POOL_AGE_MS", 1000);
+   vrend_pool_init();
+
+   /* serial 0 is for resources the GPU never used */
+   if (!vrend_state.fence_serial)
+      vrend_state.fence_serial = 1;
+
    ctx_params.shared = false;
    for (uint32_t i = 0; i < ARRAY_SIZE(gl_versions); i++) {
       ctx_params.major_ver = gl_versions[i].major;
@@ -5428,8 +6881,26 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
 
    vrend_state.features[feat_srgb_write_control] &= virgl_has_gl_colorspace();
 
+   /* writes to non coherent mappings are flushed explicitly, reads need a
+    * barrier to see what the GPU wrote */
+   vrend_state.buffer_map_mode = debug_get_num_option("VREND_BUFFER_MAP", VREND_BUFFER_MAP_COHERENT);
+   if (!has_feature(feat_arb_buffer_storage))
+      vrend_state.buffer_map_mode = VREND_BUFFER_MAP_PER_TRANSFER;
+   else if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT &&
+            !has_feature(feat_barrier))
+      vrend_state.buffer_map_mode = VREND_BUFFER_MAP_COHERENT;
+
+   /* in KiB per slab, 0 gives every buffer its own GL buffer.  Vertex
+    * fetches past the end of a sub-allocated buffer read its neighbours
+    * instead of zeros, so this is opt-in */
+   vrend_state.heap_slab_size = debug_get_num_option("VREND_BUFFER_HEAP_KB", 0) * 1024;
+   vrend_heap_init();
+
    glGetIntegerv(GL_MAX_DRAW_BUFFERS, (GLint *) &vrend_state.max_draw_buffers);
 
+   vrend_init_program_binary_cache();
+   vrend_shader_cache_init();
+
    if (!has_feature(feat_arb_robustness) &&
        !has_feature(feat_gles_khr_robustness) &&
        !has_feature(feat_angle_robustness)) {
@@ -5468,36 +6939,141 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
 
    vrend_clicbs->destroy_gl_context(gl_context);
    list_inithead(&vrend_state.fence_list);
-   list_inithead(&vrend_state.fence_wait_list);
+   list_inithead(&vrend_state.fence_timelines);
+   list_inithead(&vrend_state.fence_free_list);
+   list_inithead(&vrend_state.fence_overflow_list);
+   list_inithead(&vrend_state.fence_poll_list);
+   list_inithead(&vrend_state.fence_done_list);
+   list_inithead(&vrend_state.readback_list);
+   list_inithead(&vrend_state.readback_free_list);
    list_inithead(&vrend_state.waiting_query_list);
    list_inithead(&vrend_state.active_ctx_list);
    /* create 0 context */
    vrend_renderer_context_create_internal(0, strlen("HOST"), "HOST");
 
    vrend_state.eventfd = -1;
+   vrend_state.sync_wake_fd = -1;
    if (flags & VREND_USE_THREAD_SYNC) {
       vrend_renderer_use_threaded_sync();
    }
+   vrend_state.use_async_readback = (flags & VREND_USE_ASYNC_READBACK) &&
+                                    vrend_state.max_readback_pbos > 0;
+   vrend_renderer_use_async_compile();
 
    return 0;
 }
 
+static void vrend_print_stats(void)
+{
+   struct vrend_shader_cache_stats shader_stats;
+   struct vrend_blitter_stats blit_stats;
+
+   vrend_shader_cache_get_stats(&shader_stats);
+   vrend_printf("shader cache: %" PRIu64 " hits (%" PRIu64 " from disk), %" PRIu64
+                " misses, %" PRIu64 " evictions\n",
+                shader_stats.hits, shader_stats.disk_hits,
+                shader_stats.misses, shader_stats.evictions);
+   vrend_printf("shader compiles: %" PRIu64 " asynchronous, %" PRIu64 " stalled\n",
+                vrend_state.shader_compiles_async,
+                vrend_state.shader_compile_stalls);
+   vrend_printf("program cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+                vrend_state.program_cache_hits,
+                vrend_state.program_cache_misses,
+                vrend_state.program_cache_evictions);
+   vrend_blitter_get_stats(&blit_stats);
+   vrend_printf("blit programs: %" PRIu64 " compiled, %" PRIu64 " reused\n",
+                blit_stats.compiles, blit_stats.hits);
+   vrend_printf("elided state updates: %" PRIu64 " viewport, %" PRIu64 " scissor, %" PRIu64
+                " blend color, %" PRIu64 " stencil ref, %" PRIu64 " sampler view, %" PRIu64
+                " constants\n",
+                vrend_state.elided.viewports, vrend_state.elided.scissors,
+                vrend_state.elided.blend_colors, vrend_state.elided.stencil_refs,
+                vrend_state.elided.sampler_views, vrend_state.elided.constants);
+   vrend_printf("shadowed GL state: %" PRIu64 " redundant calls skipped\n",
+                vrend_state.gl_calls_elided);
+   vrend_printf("fences: %" PRIu64 " created, retired in %" PRIu64 " batches, %" PRIu64
+                " main loop wakeups\n",
+                vrend_state.fences_created, vrend_state.fence_batches,
+                vrend_state.fence_wakeups);
+   if (vrend_state.sync_thread)
+      vrend_printf("fence handoff: %" PRIu64 " sync thread wakeups, rings full %" PRIu64
+                   " times on submit, %" PRIu64 " times on completion\n",
+                   vrend_state.sync_thread_wakeups,
+                   vrend_state.fence_submit_ring.full_count,
+                   vrend_state.fence_signaled_ring.full_count);
+   if (vrend_state.upload_ring.buffer)
+      vrend_printf("upload ring: %" PRIu64 " uploads, %" PRIu64 " MiB, %" PRIu64
+                   " waits for the GPU, %" PRIu64 " orphaned buffers\n",
+                   vrend_state.ring_uploads, vrend_state.ring_upload_bytes >> 20,
+                   vrend_state.ring_stalls, vrend_state.ring_orphans);
+   if (vrend_state.rows_direct_bytes || vrend_state.rows_staged_bytes)
+      vrend_printf("scatter-gather transfers: %" PRIu64 " bytes direct, %" PRIu64
+                   " bytes staged\n",
+                   vrend_state.rows_direct_bytes, vrend_state.rows_staged_bytes);
+   if (vrend_state.use_async_readback)
+      vrend_printf("readbacks: %" PRIu64 " asynchronous, %" PRIu64 " synchronous, %" PRIu64
+                   " waited for\n",
+                   vrend_state.readbacks_async, vrend_state.readbacks_sync,
+                   vrend_state.readback_stalls);
+   vrend_printf("texture copies: %" PRIu64 " copy image, %" PRIu64 " blit, %" PRIu64
+                " through a pixel buffer, %" PRIu64 " through the CPU\n",
+                vrend_state.copies_copy_image, vrend_state.copies_blit,
+                vrend_state.copies_pbo, vrend_state.copies_cpu);
+   if (vrend_state.pool_hash)
+      vrend_printf("resource pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+                   " trimmed, %" PRIu64 " KiB held\n",
+                   vrend_state.pool_hits, vrend_state.pool_misses,
+                   vrend_state.pool_trimmed, vrend_state.pool_size >> 10);
+   if (vrend_state.heap_slab_size)
+      vrend_printf("buffer heap: %" PRIu64 " buffers sub-allocated, %u slabs in use, %" PRIu64
+                   " created\n",
+                   vrend_state.heap_allocs, vrend_state.heap_num_slabs,
+                   vrend_state.heap_slabs_created);
+   vrend_decode_print_stats();
+
+   if (vrend_state.program_binary_cache) {
+      struct vrend_disk_cache_stats stats;
+
+      vrend_disk_cache_get_stats(vrend_state.program_binary_cache, &stats);
+      vrend_printf("program binary cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+                   " stores, %" PRIu64 " evictions, %" PRIu64 " bytes\n",
+                   stats.hits, stats.misses, stats.stores, stats.evictions, stats.size);
+   }
+}
+
 void
 vrend_renderer_fini(void)
 {
    if (!vrend_state.inited)
       return;
 
+   if (vrend_debug(NULL, dbg_stats))
+      vrend_print_stats();
+
+   vrend_disk_cache_destroy(vrend_state.program_binary_cache);
+   vrend_state.program_binary_cache = NULL;
+   vrend_shader_cache_fini();
+
    vrend_free_sync_thread();
    if (vrend_state.eventfd != -1) {
       close(vrend_state.eventfd);
       vrend_state.eventfd = -1;
    }
+   vrend_reset_fences();
+   vrend_upload_ring_fini();
+   vrend_copy_pbo_fini();
+   free(vrend_state.row_scratch);
+   vrend_state.row_scratch = NULL;
+   vrend_state.row_scratch_size = 0;
 
    vrend_blitter_fini();
    vrend_decode_reset(false);
    vrend_object_fini_resource_table();
    vrend_decode_reset(true);
+   vrend_pool_fini();
+   vrend_heap_fini();
+   vrend_free_compile_threads();
+   vrend_state.use_parallel_compile = false;
 
    vrend_state.current_ctx = NULL;
    vrend_state.current_hw_ctx = NULL;
@@ -5566,6 +7142,7 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
 
    vrend_resource_reference((struct vrend_resource **)&sub->ib.buffer, NULL);
 
+   util_hash_table_destroy(sub->program_hash);
    vrend_object_fini_ctx_table(sub->object_hash);
    vrend_clicbs->destroy_gl_context(sub->gl_context);
 
@@ -5609,6 +7186,7 @@ bool vrend_destroy_context(struct vrend_context *ctx)
       vrend_destroy_sub_context(sub);
 
    vrend_object_fini_ctx_table(ctx->res_hash);
+   vrend_heap_orphan_slabs(ctx);
 
    list_del(&ctx->ctx_entry);
 
@@ -5623,6 +7201,7 @@ bool vrend_destroy_context(struct vrend_context *ctx)
 struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *debug_name)
 {
    struct vrend_context *grctx = CALLOC_STRUCT(vrend_context);
+   int i;
 
    if (!grctx)
       return NULL;
@@ -5642,6 +7221,8 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    list_inithead(&grctx->active_nontimer_query_list);
 
    grctx->res_hash = vrend_object_init_ctx_table();
+   for (i = 0; i < VREND_HEAP_CLASSES; i++)
+      list_inithead(&grctx->heap_slabs[i]);
 
    grctx->shader_cfg.use_gles = vrend_state.use_gles;
    grctx->shader_cfg.use_core_profile = vrend_state.use_core_profile;
@@ -5685,6 +7266,8 @@ void vrend_renderer_resource_detach_iov(int res_handle,
    if (!res) {
       return;
    }
+   if (res->num_readbacks)
+      vrend_readback_flush_resource(res);
    if (iov_p)
       *iov_p = res->iov;
    if (num_iovs_p)
@@ -5719,85 +7302,688 @@ static int check_resource_valid(struct vrend_renderer_resource_create_args *args
          return -1;
    }
 
-   if (args->last_level > 0) {
-      /* buffer and rect textures can't have mipmaps */
-      if (args->target == PIPE_BUFFER || args->target == PIPE_TEXTURE_RECT)
-         return -1;
-      if (args->last_level > (floor(log2(MAX2(args->width, args->height))) + 1))
-         return -1;
+   if (args->last_level > 0) {
+      /* buffer and rect textures can't have mipmaps */
+      if (args->target == PIPE_BUFFER || args->target == PIPE_TEXTURE_RECT)
+         return -1;
+      if (args->last_level > (floor(log2(MAX2(args->width, args->height))) + 1))
+         return -1;
+   }
+   if (args->flags != 0 && args->flags != VIRGL_RESOURCE_Y_0_TOP)
+      return -1;
+
+   if (args->flags & VIRGL_RESOURCE_Y_0_TOP)
+      if (args->target != PIPE_TEXTURE_2D && args->target != PIPE_TEXTURE_RECT)
+         return -1;
+
+   /* array size for array textures only */
+   if (args->target == PIPE_TEXTURE_CUBE) {
+      if (args->array_size != 6)
+         return -1;
+   } else if (args->target == PIPE_TEXTURE_CUBE_ARRAY) {
+      if (!has_feature(feat_cube_map_array))
+         return -1;
+      if (args->array_size % 6)
+         return -1;
+   } else if (args->array_size > 1) {
+      if (args->target != PIPE_TEXTURE_2D_ARRAY &&
+          args->target != PIPE_TEXTURE_1D_ARRAY)
+         return -1;
+
+      if (!has_feature(feat_texture_array))
+         return -1;
+   }
+
+   if (args->bind == 0 ||
+       args->bind == VIRGL_BIND_CUSTOM ||
+       args->bind == VIRGL_BIND_INDEX_BUFFER ||
+       args->bind == VIRGL_BIND_STREAM_OUTPUT ||
+       args->bind == VIRGL_BIND_VERTEX_BUFFER ||
+       args->bind == VIRGL_BIND_CONSTANT_BUFFER ||
+       args->bind == VIRGL_BIND_QUERY_BUFFER ||
+       args->bind == VIRGL_BIND_SHADER_BUFFER) {
+      if (args->target != PIPE_BUFFER)
+         return -1;
+      if (args->height != 1 || args->depth != 1)
+         return -1;
+      if (args->bind == VIRGL_BIND_QUERY_BUFFER && !has_feature(feat_qbo))
+         return -1;
+   } else {
+      if (!((args->bind & VIRGL_BIND_SAMPLER_VIEW) ||
+            (args->bind & VIRGL_BIND_DEPTH_STENCIL) ||
+            (args->bind & VIRGL_BIND_RENDER_TARGET) ||
+            (args->bind & VIRGL_BIND_CURSOR)))
+         return -1;
+
+      if (args->target == PIPE_TEXTURE_2D ||
+          args->target == PIPE_TEXTURE_RECT ||
+          args->target == PIPE_TEXTURE_CUBE ||
+          args->target == PIPE_TEXTURE_2D_ARRAY ||
+          args->target == PIPE_TEXTURE_CUBE_ARRAY) {
+         if (args->depth != 1)
+            return -1;
+      }
+      if (args->target == PIPE_TEXTURE_1D ||
+          args->target == PIPE_TEXTURE_1D_ARRAY) {
+         if (args->height != 1 || args->depth != 1)
+            return -1;
+      }
+   }
+   return 0;
+}
+
+static uint64_t vrend_pool_time_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned pool_key_hash(void *key)
+{
+   return vrend_hash_fold(vrend_hash_data(VREND_HASH_INIT, key,
+                                          sizeof(struct vrend_pool_key)));
+}
+
+static int pool_key_compare(void *key1, void *key2)
+{
+   return memcmp(key1, key2, sizeof(struct vrend_pool_key));
+}
+
+static void pool_bucket_free(void *value)
+{
+   FREE(value);
+}
+
+static void vrend_pool_init(void)
+{
+   list_inithead(&vrend_state.pool_lru);
+   vrend_state.pool_size = 0;
+   if (!vrend_state.pool_max_size)
+      return;
+   vrend_state.pool_hash = util_hash_table_create(pool_key_hash, pool_key_compare,
+                                                  pool_bucket_free);
+}
+
+static void vrend_pool_key_init(struct vrend_pool_key *key,
+                                const struct vrend_resource *res)
+{
+   memset(key, 0, sizeof(*key));
+   key->target = res->is_buffer ? 0 : res->target;
+   key->format = res->base.format;
+   key->width = res->base.width0;
+   key->height = res->base.height0;
+   key->depth = res->base.depth0;
+   key->array_size = res->base.array_size;
+   key->last_level = res->base.last_level;
+   key->nr_samples = res->base.nr_samples;
+}
+
+/* roughly what the driver allocated for the resource */
+static uint32_t vrend_pool_resource_size(const struct vrend_resource *res)
+{
+   const struct pipe_resource *pr = &res->base;
+   uint64_t size = 0;
+   uint32_t level, layers;
+
+   if (res->is_buffer)
+      return pr->width0;
+
+   for (level = 0; level <= pr->last_level; level++) {
+      layers = res->target == GL_TEXTURE_3D ? u_minify(pr->depth0, level) :
+               res->target == GL_TEXTURE_CUBE_MAP ? 6 : MAX2(pr->array_size, 1);
+      size += (uint64_t)util_format_get_nblocks(pr->format, u_minify(pr->width0, level),
+                                                u_minify(pr->height0, level)) *
+              util_format_get_blocksize(pr->format) * layers;
+   }
+   size *= MAX2(pr->nr_samples, 1);
+   return MIN2(size, UINT32_MAX);
+}
+
+static void vrend_pool_remove(struct vrend_pool_entry *entry)
+{
+   struct vrend_pool_bucket *bucket = entry->bucket;
+
+   list_del(&entry->head);
+   list_del(&entry->bucket_head);
+   vrend_state.pool_size -= entry->size;
+   if (LIST_IS_EMPTY(&bucket->entries))
+      util_hash_table_remove(vrend_state.pool_hash, &bucket->key);
+}
+
+static void vrend_pool_free_entry(struct vrend_pool_entry *entry)
+{
+   vrend_pool_remove(entry);
+   if (entry->map) {
+      glDeleteBuffers(1, &entry->id);
+   } else {
+      glDeleteTextures(1, &entry->id);
+   }
+   FREE(entry);
+}
+
+/* free what is over the size limit or unused for too long, oldest first */
+static void vrend_pool_trim(bool all)
+{
+   struct vrend_pool_entry *entry, *tmp;
+   uint64_t now;
+
+   if (LIST_IS_EMPTY(&vrend_state.pool_lru))
+      return;
+
+   now = vrend_pool_time_ms();
+   LIST_FOR_EACH_ENTRY_SAFE(entry, tmp, &vrend_state.pool_lru, head) {
+      if (!all && vrend_state.pool_size <= vrend_state.pool_max_size &&
+          now - entry->release_ms < vrend_state.pool_max_age_ms)
+         break;
+      vrend_pool_free_entry(entry);
+      if (!all)
+         vrend_state.pool_trimmed++;
+   }
+}
+
+static void vrend_pool_fini(void)
+{
+   vrend_pool_trim(true);
+   if (vrend_state.pool_hash) {
+      util_hash_table_destroy(vrend_state.pool_hash);
+      vrend_state.pool_hash = NULL;
+   }
+}
+
+/* Keep the storage of a destroyed resource for the next one of the same
+ * shape.  Textures are cleared on reuse, which needs ARB_clear_texture;
+ * buffers are persistently mapped and cleared through the mapping once
+ * the GPU is done with them. */
+static bool vrend_pool_release(struct vrend_resource *res)
+{
+   struct vrend_pool_bucket *bucket;
+   struct vrend_pool_entry *entry;
+   struct vrend_pool_key key;
+   uint32_t size;
+
+   if (!vrend_state.pool_hash || !res->recyclable || !res->id || res->tbo_tex_id)
+      return false;
+   if (res->is_buffer && !res->map)
+      return false;
+
+   size = vrend_pool_resource_size(res);
+   if (size > vrend_state.pool_max_size / 4)
+      return false;
+
+   entry = CALLOC_STRUCT(vrend_pool_entry);
+   if (!entry)
+      return false;
+
+   vrend_pool_key_init(&key, res);
+   bucket = util_hash_table_get(vrend_state.pool_hash, &key);
+   if (!bucket) {
+      bucket = CALLOC_STRUCT(vrend_pool_bucket);
+      if (!bucket) {
+         FREE(entry);
+         return false;
+      }
+      bucket->key = key;
+      list_inithead(&bucket->entries);
+      util_hash_table_set(vrend_state.pool_hash, &bucket->key, bucket);
+   }
+
+   entry->bucket = bucket;
+   entry->id = res->id;
+   entry->map = res->map;
+   entry->size = size;
+   entry->fence_serial = res->fence_serial;
+   entry->release_ms = vrend_pool_time_ms();
+   list_addtail(&entry->bucket_head, &bucket->entries);
+   list_addtail(&entry->head, &vrend_state.pool_lru);
+   vrend_state.pool_size += size;
+
+   vrend_pool_trim(false);
+   return true;
+}
+
+/* Hand the storage of a recycled resource to res, the GL object is bound
+ * to res->target on success.  res->target and res->is_buffer have to be
+ * set up already. */
+static bool vrend_pool_acquire(struct vrend_resource *res)
+{
+   struct vrend_pool_bucket *bucket;
+   struct vrend_pool_entry *entry, *found = NULL;
+   struct vrend_pool_key key;
+   uint32_t level;
+
+   if (!vrend_state.pool_hash || !res->recyclable)
+      return false;
+
+   vrend_pool_key_init(&key, res);
+   bucket = util_hash_table_get(vrend_state.pool_hash, &key);
+   if (bucket) {
+      LIST_FOR_EACH_ENTRY(entry, &bucket->entries, bucket_head) {
+         /* the mapping is written from the CPU right away */
+         if (entry->map && (int32_t)(entry->fence_serial - vrend_state.retired_serial) > 0)
+            continue;
+         found = entry;
+         break;
+      }
+   }
+   if (!found) {
+      vrend_state.pool_misses++;
+      return false;
+   }
+
+   vrend_pool_remove(found);
+   res->id = found->id;
+   if (res->is_buffer) {
+      /* guests expect new resources to read back as zero */
+      res->map = found->map;
+      memset(res->map, 0, res->base.width0);
+      glBindBufferARB(res->target, res->id);
+      if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT)
+         glFlushMappedBufferRange(res->target, 0, res->base.width0);
+   } else {
+      GLenum glformat = tex_conv_table[res->base.format].glformat;
+      GLenum gltype = tex_conv_table[res->base.format].gltype;
+
+      glBindTexture(res->target, res->id);
+      for (level = 0; level <= res->base.last_level; level++)
+         glClearTexImage(res->id, level, glformat, gltype, NULL);
+   }
+   FREE(found);
+   vrend_state.pool_hits++;
+   return true;
+}
+
+static void vrend_heap_init(void)
+{
+   GLint align;
+   int i;
+
+   for (i = 0; i < VREND_HEAP_CLASSES; i++)
+      list_inithead(&vrend_state.heap_slabs[i]);
+   list_inithead(&vrend_state.heap_orphans);
+   list_inithead(&vrend_state.heap_pending);
+
+   /* the slabs are mapped like any other buffer, offsets into them are
+    * handed to glTexBufferRange */
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_PER_TRANSFER ||
+       !has_feature(feat_texture_buffer_range))
+      vrend_state.heap_slab_size = 0;
+   if (!vrend_state.heap_slab_size)
+      return;
+
+   /* every chunk starts at an offset any buffer binding accepts */
+   vrend_state.heap_min_chunk = 256;
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+   vrend_state.heap_min_chunk = MAX2(vrend_state.heap_min_chunk, (uint32_t)align);
+   glGetIntegerv(GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT, &align);
+   vrend_state.heap_min_chunk = MAX2(vrend_state.heap_min_chunk, (uint32_t)align);
+   if (has_feature(feat_ssbo)) {
+      glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &align);
+      vrend_state.heap_min_chunk = MAX2(vrend_state.heap_min_chunk, (uint32_t)align);
+   }
+   vrend_state.heap_min_chunk = util_next_power_of_two(vrend_state.heap_min_chunk);
+   vrend_state.heap_slab_size = MAX2(vrend_state.heap_slab_size,
+                                     4 * vrend_state.heap_min_chunk);
+}
+
+static void vrend_heap_free_slab(struct vrend_heap_slab *slab)
+{
+   list_del(&slab->head);
+   glDeleteBuffers(1, &slab->id);
+   free(slab->free_chunks);
+   FREE(slab);
+   vrend_state.heap_num_slabs--;
+}
+
+/* slabs that end up empty are freed unless they are the last of their
+ * size */
+static void vrend_heap_put_chunk(struct vrend_heap_slab *slab, uint32_t chunk, bool all)
+{
+   slab->free_chunks[slab->num_free++] = chunk;
+   if (slab->num_free == slab->num_chunks &&
+       (slab->orphan || slab->head.next != slab->head.prev || all))
+      vrend_heap_free_slab(slab);
+}
+
+/* buffers can outlive the context they were attached to, their slabs stay
+ * around until the last chunk is returned but are not used for new
+ * buffers */
+static void vrend_heap_orphan_slabs(struct vrend_context *ctx)
+{
+   struct vrend_heap_slab *slab, *tmp;
+   int i;
+
+   for (i = 0; i < VREND_HEAP_CLASSES; i++) {
+      LIST_FOR_EACH_ENTRY_SAFE(slab, tmp, &ctx->heap_slabs[i], head) {
+         if (slab->num_free == slab->num_chunks) {
+            vrend_heap_free_slab(slab);
+            continue;
+         }
+         list_del(&slab->head);
+         slab->owner = NULL;
+         slab->orphan = true;
+         list_addtail(&slab->head, &vrend_state.heap_orphans);
+      }
+   }
+}
+
+/* hand chunks back to their slabs once the GPU is done with them */
+static void vrend_heap_reclaim(bool all)
+{
+   struct vrend_heap_pending *pending, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(pending, tmp, &vrend_state.heap_pending, head) {
+      if (!all && (int32_t)(pending->fence_serial - vrend_state.retired_serial) > 0)
+         continue;
+
+      list_del(&pending->head);
+      vrend_heap_put_chunk(pending->slab, pending->chunk, all);
+      FREE(pending);
+   }
+}
+
+static void vrend_heap_fini(void)
+{
+   struct vrend_heap_slab *slab, *tmp;
+   int i;
+
+   if (!vrend_state.heap_slab_size)
+      return;
+
+   vrend_heap_reclaim(true);
+   for (i = 0; i < VREND_HEAP_CLASSES; i++) {
+      LIST_FOR_EACH_ENTRY_SAFE(slab, tmp, &vrend_state.heap_slabs[i], head)
+         vrend_heap_free_slab(slab);
+   }
+   LIST_FOR_EACH_ENTRY_SAFE(slab, tmp, &vrend_state.heap_orphans, head)
+      vrend_heap_free_slab(slab);
+}
+
+static struct vrend_heap_slab *vrend_heap_create_slab(GLenum target, uint32_t chunk_size)
+{
+   GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT;
+   struct vrend_heap_slab *slab;
+   uint32_t i;
+
+   slab = CALLOC_STRUCT(vrend_heap_slab);
+   if (!slab)
+      return NULL;
+   slab->chunk_size = chunk_size;
+   slab->num_chunks = vrend_state.heap_slab_size / chunk_size;
+   slab->free_chunks = malloc(slab->num_chunks * sizeof(uint32_t));
+   if (!slab->free_chunks) {
+      FREE(slab);
+      return NULL;
+   }
+   /* hand out the chunks from the start of the slab first */
+   for (i = 0; i < slab->num_chunks; i++)
+      slab->free_chunks[i] = slab->num_chunks - 1 - i;
+   slab->num_free = slab->num_chunks;
+
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_COHERENT)
+      flags |= GL_MAP_COHERENT_BIT;
+   glGenBuffersARB(1, &slab->id);
+   glBindBufferARB(target, slab->id);
+   glBufferStorage(target, slab->num_chunks * chunk_size, NULL, flags | GL_DYNAMIC_STORAGE_BIT);
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT)
+      flags |= GL_MAP_FLUSH_EXPLICIT_BIT;
+   slab->map = glMapBufferRange(target, 0, slab->num_chunks * chunk_size, flags);
+   glBindBufferARB(target, 0);
+   if (!slab->map) {
+      glDeleteBuffers(1, &slab->id);
+      free(slab->free_chunks);
+      FREE(slab);
+      return NULL;
+   }
+
+   vrend_state.heap_num_slabs++;
+   vrend_state.heap_slabs_created++;
+   return slab;
+}
+
+/* Sub-allocate a small buffer from a slab shared with other buffers of the
+ * same size class and owner.  Cuts down on GL buffer objects for the many
+ * small constant, index and vertex buffers guests create. */
+static bool vrend_heap_alloc(struct vrend_resource *gr, struct vrend_context *owner,
+                             uint32_t width)
+{
+   struct list_head *slabs = owner ? owner->heap_slabs : vrend_state.heap_slabs;
+   struct vrend_heap_slab *slab, *found = NULL;
+   uint32_t chunk_size = vrend_state.heap_min_chunk;
+   uint32_t chunk;
+   int cls = 0;
+
+   if (!vrend_state.heap_slab_size || !width || width > VREND_HEAP_MAX_CHUNK ||
+       width > vrend_state.heap_slab_size / 4)
+      return false;
+
+   while (chunk_size < width) {
+      chunk_size <<= 1;
+      cls++;
+   }
+   if (cls >= VREND_HEAP_CLASSES)
+      return false;
+
+   if (!LIST_IS_EMPTY(&vrend_state.heap_pending))
+      vrend_heap_reclaim(false);
+
+   LIST_FOR_EACH_ENTRY(slab, &slabs[cls], head) {
+      if (slab->num_free) {
+         found = slab;
+         break;
+      }
+   }
+   if (!found) {
+      found = vrend_heap_create_slab(gr->target, chunk_size);
+      if (!found)
+         return false;
+      found->owner = owner;
+      list_add(&found->head, &slabs[cls]);
+   }
+
+   chunk = found->free_chunks[--found->num_free];
+   gr->heap_slab = found;
+   gr->heap_offset = chunk * chunk_size;
+   gr->id = found->id;
+   gr->map = found->map + gr->heap_offset;
+
+   /* the chunk may hold what an earlier buffer left */
+   memset(gr->map, 0, width);
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT) {
+      glBindBufferARB(gr->target, gr->id);
+      glFlushMappedBufferRange(gr->target, gr->heap_offset, width);
+      glBindBufferARB(gr->target, 0);
+   }
+   return true;
+}
+
+static void vrend_heap_release(struct vrend_heap_slab *slab, uint32_t offset,
+                               uint32_t fence_serial)
+{
+   struct vrend_heap_pending *pending;
+   uint32_t chunk = offset / slab->chunk_size;
+
+   if ((int32_t)(fence_serial - vrend_state.retired_serial) <= 0) {
+      vrend_heap_put_chunk(slab, chunk, false);
+      return;
+   }
+
+   pending = CALLOC_STRUCT(vrend_heap_pending);
+   if (!pending) {
+      /* leak the chunk rather than let the GPU read a new buffer's data */
+      return;
+   }
+   pending->slab = slab;
+   pending->chunk = chunk;
+   pending->fence_serial = fence_serial;
+   list_addtail(&pending->head, &vrend_state.heap_pending);
+}
+
+/* Buffers are created before the guest attaches them to a context.  Move
+ * a heap buffer into the slabs of the first context it is attached to, so
+ * a slab never holds the buffers of two guest contexts.  Nothing but
+ * transfers touched the buffer yet, copying through the maps is enough.
+ *
+ * GL does not bound vertex fetches by the range of a sub-allocation, so a
+ * buffer attached to a second context gets a GL buffer of its own, that
+ * context must not reach the neighbours from the owner's slab. */
+static void vrend_heap_adopt(struct vrend_context *ctx, struct vrend_resource *res)
+{
+   struct vrend_heap_slab *slab = res->heap_slab;
+   uint32_t offset = res->heap_offset;
+   char *map = res->map;
+
+   if (!slab || slab->owner == ctx)
+      return;
+
+   if (slab->owner || slab->orphan ||
+       !vrend_heap_alloc(res, ctx, res->base.width0)) {
+      if (!vrend_heap_evict(res))
+         vrend_printf("unable to move a shared buffer out of the heap\n");
+      return;
+   }
+
+   memcpy(res->map, map, res->base.width0);
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT) {
+      glBindBufferARB(res->target, res->id);
+      glFlushMappedBufferRange(res->target, res->heap_offset, res->base.width0);
+      glBindBufferARB(res->target, 0);
    }
-   if (args->flags != 0 && args->flags != VIRGL_RESOURCE_Y_0_TOP)
-      return -1;
+   vrend_heap_release(slab, offset, res->fence_serial);
+}
 
-   if (args->flags & VIRGL_RESOURCE_Y_0_TOP)
-      if (args->target != PIPE_TEXTURE_2D && args->target != PIPE_TEXTURE_RECT)
-         return -1;
+/* Moves a heap buffer to a GL buffer of its own.  Buffer bindings of the
+ * owner still name the slab, vrend_heap_rebind_evicted has the sub
+ * contexts set them again before their next draw, and the texture buffer
+ * of the resource is pointed at the new buffer right here. */
+static bool vrend_heap_evict(struct vrend_resource *res)
+{
+   GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT;
+   struct vrend_heap_slab *slab = res->heap_slab;
+   uint32_t offset = res->heap_offset;
+   uint32_t width = res->base.width0;
+   GLuint id;
+   char *map;
+
+   /* the GPU may still write to the chunk */
+   if ((int32_t)(res->fence_serial - vrend_state.retired_serial) > 0)
+      vrend_buffer_map_sync();
+
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_COHERENT)
+      flags |= GL_MAP_COHERENT_BIT;
+   glGenBuffersARB(1, &id);
+   glBindBufferARB(res->target, id);
+   glBufferStorage(res->target, width, NULL, flags | GL_DYNAMIC_STORAGE_BIT);
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT)
+      flags |= GL_MAP_FLUSH_EXPLICIT_BIT;
+   map = glMapBufferRange(res->target, 0, width, flags);
+   if (!map) {
+      glBindBufferARB(res->target, 0);
+      glDeleteBuffers(1, &id);
+      return false;
+   }
 
-   /* array size for array textures only */
-   if (args->target == PIPE_TEXTURE_CUBE) {
-      if (args->array_size != 6)
-         return -1;
-   } else if (args->target == PIPE_TEXTURE_CUBE_ARRAY) {
-      if (!has_feature(feat_cube_map_array))
-         return -1;
-      if (args->array_size % 6)
-         return -1;
-   } else if (args->array_size > 1) {
-      if (args->target != PIPE_TEXTURE_2D_ARRAY &&
-          args->target != PIPE_TEXTURE_1D_ARRAY)
-         return -1;
+   memcpy(map, res->map, width);
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT)
+      glFlushMappedBufferRange(res->target, 0, width);
+   glBindBufferARB(res->target, 0);
 
-      if (!has_feature(feat_texture_array))
-         return -1;
+   if (res->tbo_tex_id) {
+      GLint old_tex, format, tbo_offset, tbo_size;
+
+      glGetIntegerv(GL_TEXTURE_BINDING_BUFFER, &old_tex);
+      glBindTexture(GL_TEXTURE_BUFFER, res->tbo_tex_id);
+      glGetTexLevelParameteriv(GL_TEXTURE_BUFFER, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+      glGetTexLevelParameteriv(GL_TEXTURE_BUFFER, 0, GL_TEXTURE_BUFFER_OFFSET, &tbo_offset);
+      glGetTexLevelParameteriv(GL_TEXTURE_BUFFER, 0, GL_TEXTURE_BUFFER_SIZE, &tbo_size);
+      glTexBufferRange(GL_TEXTURE_BUFFER, format, id, tbo_offset - offset, tbo_size);
+      glBindTexture(GL_TEXTURE_BUFFER, old_tex);
    }
 
-   if (args->bind == 0 ||
-       args->bind == VIRGL_BIND_CUSTOM ||
-       args->bind == VIRGL_BIND_INDEX_BUFFER ||
-       args->bind == VIRGL_BIND_STREAM_OUTPUT ||
-       args->bind == VIRGL_BIND_VERTEX_BUFFER ||
-       args->bind == VIRGL_BIND_CONSTANT_BUFFER ||
-       args->bind == VIRGL_BIND_QUERY_BUFFER ||
-       args->bind == VIRGL_BIND_SHADER_BUFFER) {
-      if (args->target != PIPE_BUFFER)
-         return -1;
-      if (args->height != 1 || args->depth != 1)
-         return -1;
-      if (args->bind == VIRGL_BIND_QUERY_BUFFER && !has_feature(feat_qbo))
-         return -1;
-   } else {
-      if (!((args->bind & VIRGL_BIND_SAMPLER_VIEW) ||
-            (args->bind & VIRGL_BIND_DEPTH_STENCIL) ||
-            (args->bind & VIRGL_BIND_RENDER_TARGET) ||
-            (args->bind & VIRGL_BIND_CURSOR)))
-         return -1;
+   res->id = id;
+   res->map = map;
+   res->heap_slab = NULL;
+   res->heap_offset = 0;
+   vrend_heap_release(slab, offset, res->fence_serial);
+   vrend_state.heap_evictions++;
+   return true;
+}
 
-      if (args->target == PIPE_TEXTURE_2D ||
-          args->target == PIPE_TEXTURE_RECT ||
-          args->target == PIPE_TEXTURE_CUBE ||
-          args->target == PIPE_TEXTURE_2D_ARRAY ||
-          args->target == PIPE_TEXTURE_CUBE_ARRAY) {
-         if (args->depth != 1)
-            return -1;
-      }
-      if (args->target == PIPE_TEXTURE_1D ||
-          args->target == PIPE_TEXTURE_1D_ARRAY) {
-         if (args->height != 1 || args->depth != 1)
-            return -1;
-      }
-   }
-   return 0;
+static void vrend_heap_rebind_evicted(struct vrend_sub_context *sub)
+{
+   int i;
+
+   if (sub->heap_evictions == vrend_state.heap_evictions)
+      return;
+   sub->heap_evictions = vrend_state.heap_evictions;
+
+   sub->vbo_dirty = true;
+   for (i = 0; i < PIPE_SHADER_TYPES; i++)
+      sub->const_bufs_dirty[i] = ~0;
 }
 
+/* Buffers are mapped once for their whole life when the host has buffer
+ * storage, transfers are plain copies then.  Falls back to mapping them for
+ * every transfer. */
 static void vrend_create_buffer(struct vrend_resource *gr, uint32_t width)
 {
+   GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT;
+
+   gr->is_buffer = true;
+   if (vrend_heap_alloc(gr, NULL, width)) {
+      vrend_state.heap_allocs++;
+      return;
+   }
+
+   gr->recyclable = vrend_state.buffer_map_mode != VREND_BUFFER_MAP_PER_TRANSFER && width;
+   if (vrend_pool_acquire(gr)) {
+      glBindBufferARB(gr->target, 0);
+      return;
+   }
+
    glGenBuffersARB(1, &gr->id);
    glBindBufferARB(gr->target, gr->id);
+
+   if (vrend_state.buffer_map_mode != VREND_BUFFER_MAP_PER_TRANSFER && width) {
+      if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_COHERENT)
+         flags |= GL_MAP_COHERENT_BIT;
+      /* glBufferSubData is still used when copying from iovecs fails */
+      glBufferStorage(gr->target, width, NULL, flags | GL_DYNAMIC_STORAGE_BIT);
+      if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT)
+         flags |= GL_MAP_FLUSH_EXPLICIT_BIT;
+      gr->map = glMapBufferRange(gr->target, 0, width, flags);
+      if (gr->map) {
+         glBindBufferARB(gr->target, 0);
+         return;
+      }
+
+      /* the storage is immutable, start over with a new buffer */
+      vrend_printf("unable to map buffer persistently\n");
+      gr->recyclable = false;
+      glBindBufferARB(gr->target, 0);
+      glDeleteBuffers(1, &gr->id);
+      glGenBuffersARB(1, &gr->id);
+      glBindBufferARB(gr->target, gr->id);
+   }
+
    glBufferData(gr->target, width, NULL, GL_STREAM_DRAW);
-   gr->is_buffer = true;
    glBindBufferARB(gr->target, 0);
 }
 
+/* wait for the GPU to be done with a mapped buffer and make what it wrote
+ * visible, the way mapping it for reading would */
+static void vrend_buffer_map_sync(void)
+{
+   GLsync sync;
+
+   if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT)
+      glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+   sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+   glDeleteSync(sync);
+}
+
 static inline void
 vrend_renderer_resource_copy_args(struct vrend_renderer_resource_create_args *args,
                                   struct vrend_resource *gr)
@@ -5814,6 +8000,27 @@ vrend_renderer_resource_copy_args(struct vrend_renderer_resource_create_args *ar
    gr->base.last_level = args->last_level;
    gr->base.nr_samples = args->nr_samples;
    gr->base.array_size = args->array_size;
+   gr->base.bind = args->bind;
+}
+
+static void vrend_texture_init_state(struct vrend_texture *gt)
+{
+   gt->state.max_lod = -1;
+   gt->cur_swizzle_r = gt->cur_swizzle_g = gt->cur_swizzle_b = gt->cur_swizzle_a = -1;
+   gt->cur_base = -1;
+   gt->cur_max = 10000;
+}
+
+/* whether the texture can be cleared for reuse and isn't shown or
+ * shared outside of the renderer */
+static bool vrend_texture_recyclable(struct vrend_resource *gr)
+{
+   const struct vrend_format_table *entry = &tex_conv_table[gr->base.format];
+
+   return has_feature(feat_clear_texture) &&
+          !util_format_is_compressed(gr->base.format) &&
+          entry->glformat && entry->gltype &&
+          !(gr->base.bind & (VIRGL_BIND_SCANOUT | VIRGL_BIND_DISPLAY_TARGET));
 }
 
 static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
@@ -5849,11 +8056,6 @@ static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
       gr->target = GL_TEXTURE_2D_ARRAY;
    }
 
-   glGenTextures(1, &gr->id);
-   glBindTexture(gr->target, gr->id);
-
-   debug_texture(__func__, gr);
-
    internalformat = tex_conv_table[pr->format].internalformat;
    glformat = tex_conv_table[pr->format].glformat;
    gltype = tex_conv_table[pr->format].gltype;
@@ -5864,6 +8066,18 @@ static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
       return EINVAL;
    }
 
+   gr->recyclable = !image_oes && vrend_texture_recyclable(gr);
+   if (vrend_pool_acquire(gr)) {
+      debug_texture(__func__, gr);
+      vrend_texture_init_state(gt);
+      return 0;
+   }
+
+   glGenTextures(1, &gr->id);
+   glBindTexture(gr->target, gr->id);
+
+   debug_texture(__func__, gr);
+
    if (image_oes) {
       if (epoxy_has_gl_extension("GL_OES_EGL_image_external")) {
          glEGLImageTargetTexture2DOES(gr->target, (GLeglImageOES) image_oes);
@@ -5959,10 +8173,7 @@ static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
       glTexParameteri(gr->target, GL_TEXTURE_MAX_LEVEL, pr->last_level);
    }
 
-   gt->state.max_lod = -1;
-   gt->cur_swizzle_r = gt->cur_swizzle_g = gt->cur_swizzle_b = gt->cur_swizzle_a = -1;
-   gt->cur_base = -1;
-   gt->cur_max = 10000;
+   vrend_texture_init_state(gt);
    return 0;
 }
 
@@ -6045,12 +8256,18 @@ int vrend_renderer_resource_create(struct vrend_renderer_resource_create_args *a
 
 void vrend_renderer_resource_destroy(struct vrend_resource *res)
 {
+   if (res->num_readbacks)
+      vrend_readback_flush_resource(res);
    if (res->readback_fb_id)
       glDeleteFramebuffers(1, &res->readback_fb_id);
 
    if (res->ptr)
       free(res->ptr);
-   if (res->id) {
+   if (res->heap_slab) {
+      vrend_heap_release(res->heap_slab, res->heap_offset, res->fence_serial);
+      if (res->tbo_tex_id)
+         glDeleteTextures(1, &res->tbo_tex_id);
+   } else if (res->id && !vrend_pool_release(res)) {
       if (res->is_buffer) {
          glDeleteBuffers(1, &res->id);
          if (res->tbo_tex_id)
@@ -6081,9 +8298,11 @@ void vrend_renderer_resource_unref(uint32_t res_handle)
 
    /* find in all contexts and detach also */
 
-   /* remove from any contexts */
+   /* remove from any contexts, contexts with their own handle space may
+    * use the handle for a different resource */
    LIST_FOR_EACH_ENTRY(ctx, &vrend_state.active_ctx_list, ctx_entry) {
-      vrend_renderer_detach_res_ctx_p(ctx, res->handle);
+      if (vrend_renderer_ctx_res_lookup(ctx, res->handle) == res)
+         vrend_renderer_detach_res_ctx_p(ctx, res->handle);
    }
 
    vrend_resource_remove(res->handle);
@@ -6295,6 +8514,346 @@ static bool check_iov_bounds(struct vrend_resource *res,
    return true;
 }
 
+static bool vrend_upload_ring_init(void)
+{
+   struct vrend_upload_ring *ring = &vrend_state.upload_ring;
+
+   glGenBuffers(1, &ring->buffer);
+   glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, ring->buffer);
+   if (has_feature(feat_arb_buffer_storage)) {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER_ARB, vrend_state.upload_ring_size, NULL, flags);
+      ring->map = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER_ARB, 0,
+                                   vrend_state.upload_ring_size, flags);
+      if (!ring->map) {
+         vrend_printf("unable to map the upload ring\n");
+         glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+         glDeleteBuffers(1, &ring->buffer);
+         ring->buffer = 0;
+         return false;
+      }
+   } else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, vrend_state.upload_ring_size, NULL,
+                   GL_STREAM_DRAW);
+   }
+   glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+   ring->size = vrend_state.upload_ring_size;
+   ring->offset = 0;
+   return true;
+}
+
+static void vrend_upload_ring_fini(void)
+{
+   struct vrend_upload_ring *ring = &vrend_state.upload_ring;
+   unsigned i, j;
+
+   if (!ring->buffer)
+      return;
+
+   for (i = 0; i < VREND_UPLOAD_RING_SEGMENTS; i++) {
+      for (j = 0; j < ring->num_syncs[i]; j++)
+         glDeleteSync(ring->segment_syncs[i][j]);
+   }
+   if (ring->map) {
+      glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, ring->buffer);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+      glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+   }
+   glDeleteBuffers(1, &ring->buffer);
+   memset(ring, 0, sizeof(*ring));
+}
+
+static void vrend_upload_ring_wait(GLsync sync)
+{
+   if (glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED) !=
+       GL_ALREADY_SIGNALED)
+      vrend_state.ring_stalls++;
+   glDeleteSync(sync);
+}
+
+/* fence what the current GL context uploaded from the segment */
+static void vrend_upload_ring_fence_segment(unsigned seg)
+{
+   struct vrend_upload_ring *ring = &vrend_state.upload_ring;
+   GLsync *syncs = ring->segment_syncs[seg];
+
+   /* too many contexts took turns in this segment, wait for the oldest */
+   if (ring->num_syncs[seg] == VREND_UPLOAD_RING_SYNCS) {
+      vrend_upload_ring_wait(syncs[0]);
+      memmove(syncs, syncs + 1, (VREND_UPLOAD_RING_SYNCS - 1) * sizeof(GLsync));
+      ring->num_syncs[seg]--;
+   }
+   syncs[ring->num_syncs[seg]++] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* A fence only covers the commands of the GL context it is created in.
+ * Before another context becomes current the uploads this one made from
+ * the ring get their own fence, flushed so waiting on it from another
+ * context can not hang. */
+static void vrend_upload_ring_fence_context(void)
+{
+   struct vrend_upload_ring *ring = &vrend_state.upload_ring;
+   uint32_t seg_size;
+
+   if (!ring->map || !ring->unfenced)
+      return;
+
+   seg_size = ring->size / VREND_UPLOAD_RING_SEGMENTS;
+   vrend_upload_ring_fence_segment(ring->offset ? (ring->offset - 1) / seg_size : 0);
+   glFlush();
+   ring->unfenced = false;
+}
+
+void vrend_make_current(virgl_gl_context gl_context)
+{
+   vrend_upload_ring_fence_context();
+   vrend_clicbs->make_current(gl_context);
+}
+
+/* move the write position into the next segment, the GPU has to be done
+ * with what every context uploaded from it the last time around */
+static void vrend_upload_ring_next_segment(unsigned *seg)
+{
+   struct vrend_upload_ring *ring = &vrend_state.upload_ring;
+   uint32_t i;
+
+   vrend_upload_ring_fence_segment(*seg);
+   *seg = (*seg + 1) % VREND_UPLOAD_RING_SEGMENTS;
+
+   for (i = 0; i < ring->num_syncs[*seg]; i++)
+      vrend_upload_ring_wait(ring->segment_syncs[*seg][i]);
+   ring->num_syncs[*seg] = 0;
+}
+
+/* Returns where to write size bytes of pixel data to, and their offset in
+ * the ring buffer, which is left bound to GL_PIXEL_UNPACK_BUFFER.  NULL
+ * when the data doesn't fit, uploads then come from guest memory. */
+static void *vrend_upload_ring_map(uint32_t size, uint32_t *offset)
+{
+   struct vrend_upload_ring *ring = &vrend_state.upload_ring;
+   uint32_t seg_size, start;
+   unsigned seg, last;
+   void *ptr;
+
+   if (!ring->buffer) {
+      if (!vrend_state.upload_ring_size || vrend_state.upload_ring_failed)
+         return NULL;
+      if (!vrend_upload_ring_init()) {
+         vrend_state.upload_ring_failed = true;
+         return NULL;
+      }
+   }
+
+   /* bigger uploads would wait for most of the ring */
+   if (!size || size > ring->size / 2)
+      return NULL;
+
+   /* keep the pixel rows of every upload aligned for the GPU */
+   start = align(ring->offset, 64);
+   if (start + size > ring->size)
+      start = ring->size;
+
+   glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, ring->buffer);
+   if (ring->map) {
+      seg_size = ring->size / VREND_UPLOAD_RING_SEGMENTS;
+      /* the segment the last upload ended in */
+      seg = ring->offset ? (ring->offset - 1) / seg_size : 0;
+      if (start == ring->size) {
+         start = 0;
+         last = (size - 1) / seg_size;
+         do {
+            vrend_upload_ring_next_segment(&seg);
+         } while (seg != last);
+      } else {
+         last = (start + size - 1) / seg_size;
+         while (seg != last)
+            vrend_upload_ring_next_segment(&seg);
+      }
+      ptr = ring->map + start;
+      ring->unfenced = true;
+   } else {
+      if (start == ring->size) {
+         /* the GPU may still read the old storage, get a new one */
+         glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, ring->size, NULL, GL_STREAM_DRAW);
+         vrend_state.ring_orphans++;
+         start = 0;
+      }
+      ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER_ARB, start, size,
+                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                             GL_MAP_UNSYNCHRONIZED_BIT);
+      if (!ptr) {
+         glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+         return NULL;
+      }
+   }
+
+   ring->offset = start + size;
+   *offset = start;
+   vrend_state.ring_uploads++;
+   vrend_state.ring_upload_bytes += size;
+   return ptr;
+}
+
+static void vrend_upload_ring_unmap(void)
+{
+   if (!vrend_state.upload_ring.map)
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+}
+
+/* Transfers from iovecs that the guest pages split up can still go from
+ * guest memory for the rows inside one iovec, only rows crossing into the
+ * next iovec need a copy. */
+static bool vrend_can_transfer_iov_rows(struct vrend_resource *res,
+                                        uint32_t stride, int num_iovs)
+{
+   if (num_iovs <= 1)
+      return false;
+   if (util_format_is_compressed(res->base.format) ||
+       res->base.format == (enum pipe_format)VIRGL_FORMAT_Z24X8_UNORM)
+      return false;
+   /* rows have to be flipped */
+   if (res->y_0_top)
+      return false;
+   /* packed rows of these don't match the pixel store alignment */
+   if (util_format_get_blocksize(res->base.format) % 4 &&
+       util_format_get_blocksize(res->base.format) > 2)
+      return false;
+   if (stride % util_format_get_blocksize(res->base.format))
+      return false;
+
+   switch (res->target) {
+   case GL_TEXTURE_2D:
+   case GL_TEXTURE_RECTANGLE_NV:
+   case GL_TEXTURE_CUBE_MAP:
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_CUBE_MAP_ARRAY:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static char *vrend_get_row_scratch(uint32_t size)
+{
+   char *scratch;
+
+   if (size <= vrend_state.row_scratch_size)
+      return vrend_state.row_scratch;
+
+   scratch = realloc(vrend_state.row_scratch, size);
+   if (!scratch)
+      return NULL;
+   vrend_state.row_scratch = scratch;
+   vrend_state.row_scratch_size = size;
+   return scratch;
+}
+
+static void vrend_tex_sub_image_rows(struct vrend_resource *res, int level,
+                                     int x, int y, int z, int width, int rows,
+                                     GLenum glformat, GLenum gltype, void *data)
+{
+   switch (res->target) {
+   case GL_TEXTURE_CUBE_MAP:
+      glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + z, level, x, y, width, rows,
+                      glformat, gltype, data);
+      break;
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_CUBE_MAP_ARRAY:
+      glTexSubImage3D(res->target, level, x, y, z, width, rows, 1,
+                      glformat, gltype, data);
+      break;
+   default:
+      glTexSubImage2D(res->target, level, x, y, width, rows, glformat, gltype, data);
+      break;
+   }
+}
+
+static void vrend_read_pixels(GLint x, GLint y, GLsizei width, GLsizei height,
+                              GLenum format, GLenum type, GLsizei size, void *data)
+{
+   if (has_feature(feat_arb_robustness))
+      glReadnPixelsARB(x, y, width, height, format, type, size, data);
+   else if (has_feature(feat_gles_khr_robustness))
+      glReadnPixelsKHR(x, y, width, height, format, type, size, data);
+   else if (has_feature(feat_angle_robustness))
+      glReadnPixelsEXT(x, y, width, height, format, type, size, data);
+   else
+      glReadPixels(x, y, width, height, format, type, data);
+}
+
+/* Uploads to the bound texture, or reads from the bound read framebuffer,
+ * the rows of a transfer straight from or into the iovecs they are in, and
+ * stages the ones split between two iovecs.  The alignment has to be set
+ * up by the caller, the row length is reset when done. */
+static int vrend_transfer_iov_rows(struct vrend_resource *res,
+                                   struct iovec *iov, int num_iovs,
+                                   const struct vrend_transfer_info *info,
+                                   uint32_t stride, GLenum glformat, GLenum gltype,
+                                   bool upload)
+{
+   struct vrend_iov_cursor cursor;
+   int elsize = util_format_get_blocksize(res->base.format);
+   uint32_t row_size = util_format_get_nblocksx(res->base.format, info->box->width) * elsize;
+   uint64_t layer_size = (uint64_t)stride * u_minify(res->base.height0, info->level);
+   uint64_t offset;
+   size_t rows, i;
+   char *ptr, *scratch;
+   int d, row;
+
+   vrend_iov_cursor_init(&cursor, iov, num_iovs);
+
+   for (d = 0; d < info->box->depth; d++) {
+      for (row = 0; row < info->box->height; row += rows) {
+         offset = info->offset + d * layer_size + (uint64_t)row * stride;
+         rows = vrend_iov_rows(&cursor, offset, stride, row_size,
+                               info->box->height - row, &ptr);
+
+         if (ptr) {
+            if (upload) {
+               glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / elsize);
+               vrend_tex_sub_image_rows(res, info->level, info->box->x, info->box->y + row,
+                                        info->box->z + d, info->box->width, rows,
+                                        glformat, gltype, ptr);
+            } else {
+               glPixelStorei(GL_PACK_ROW_LENGTH, stride / elsize);
+               vrend_read_pixels(info->box->x, info->box->y + row, info->box->width, rows,
+                                 glformat, gltype, (rows - 1) * stride + row_size, ptr);
+            }
+            vrend_state.rows_direct_bytes += rows * row_size;
+            continue;
+         }
+
+         scratch = vrend_get_row_scratch(rows * row_size);
+         if (!scratch)
+            return ENOMEM;
+
+         if (upload) {
+            for (i = 0; i < rows; i++)
+               vrend_read_from_iovec(iov, num_iovs, offset + i * stride,
+                                     scratch + i * row_size, row_size);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            vrend_tex_sub_image_rows(res, info->level, info->box->x, info->box->y + row,
+                                     info->box->z + d, info->box->width, rows,
+                                     glformat, gltype, scratch);
+         } else {
+            glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+            vrend_read_pixels(info->box->x, info->box->y + row, info->box->width, rows,
+                              glformat, gltype, rows * row_size, scratch);
+            for (i = 0; i < rows; i++)
+               vrend_write_to_iovec(iov, num_iovs, offset + i * stride,
+                                    scratch + i * row_size, row_size);
+         }
+         vrend_state.rows_staged_bytes += rows * row_size;
+      }
+   }
+
+   glPixelStorei(upload ? GL_UNPACK_ROW_LENGTH : GL_PACK_ROW_LENGTH, 0);
+   return 0;
+}
+
 static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
                                              struct vrend_resource *res,
                                              struct iovec *iov, int num_iovs,
@@ -6306,7 +8865,16 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       vrend_read_from_iovec(iov, num_iovs, info->offset, res->ptr + info->box->x, info->box->width);
       return 0;
    }
-   if (res->is_buffer) {
+   if (res->is_buffer && res->map) {
+      /* like the unsynchronized map below, the guest takes care of not
+       * overwriting data the GPU still uses */
+      vrend_read_from_iovec(iov, num_iovs, info->offset, res->map + info->box->x, info->box->width);
+      if (vrend_state.buffer_map_mode == VREND_BUFFER_MAP_FLUSH_EXPLICIT) {
+         glBindBufferARB(res->target, res->id);
+         glFlushMappedBufferRange(res->target, res->heap_offset + info->box->x, info->box->width);
+         glBindBufferARB(res->target, 0);
+      }
+   } else if (res->is_buffer) {
       struct virgl_sub_upload_data d;
       d.box = info->box;
       d.target = res->target;
@@ -6332,6 +8900,9 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       float depth_scale;
       GLuint send_size = 0;
       uint32_t stride = info->stride;
+      uint32_t ring_offset;
+      bool from_ring = false;
+      bool by_rows = false;
 
       if (ctx)
          vrend_use_program(ctx, 0);
@@ -6352,9 +8923,27 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
             invert = true;
       }
 
-      if (need_temp) {
-         send_size = util_format_get_nblocks(res->base.format, info->box->width,
-                                             info->box->height) * elsize * info->box->depth;
+      send_size = util_format_get_nblocks(res->base.format, info->box->width,
+                                          info->box->height) * elsize * info->box->depth;
+
+      /* copy the data once into the upload ring, the GPU takes it from
+       * there whenever it gets to the upload; depth values that need
+       * scaling on the CPU stay in system memory */
+      data = NULL;
+      if (res->base.format != (enum pipe_format)VIRGL_FORMAT_Z24X8_UNORM)
+         data = vrend_upload_ring_map(send_size, &ring_offset);
+      if (data) {
+         from_ring = true;
+         need_temp = true;
+         read_transfer_data(&res->base, iov, num_iovs, data, stride,
+                            info->box, info->level, info->offset, invert);
+         vrend_upload_ring_unmap();
+         data = (char *)(uintptr_t)ring_offset;
+      } else if (vrend_can_transfer_iov_rows(res, stride, num_iovs)) {
+         by_rows = true;
+         need_temp = false;
+         data = NULL;
+      } else if (need_temp) {
          data = malloc(send_size);
          if (!data)
             return ENOMEM;
@@ -6364,7 +8953,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          data = (char*)iov[0].iov_base + info->offset;
       }
 
-      if (stride && !need_temp) {
+      if (stride && !need_temp && !by_rows) {
          glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / elsize);
          glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, u_minify(res->base.height0, info->level));
       } else
@@ -6411,15 +9000,18 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
 
          buffers = GL_COLOR_ATTACHMENT0;
          glDrawBuffers(1, &buffers);
-         glDisable(GL_BLEND);
          if (ctx) {
+            vrend_gl_blend_enable(ctx, -1, false);
             vrend_depth_test_enable(ctx, false);
             vrend_alpha_test_enable(ctx, false);
             vrend_stencil_test_enable(ctx, false);
          } else {
+            glDisable(GL_BLEND);
             glDisable(GL_DEPTH_TEST);
             glDisable(GL_ALPHA_TEST);
             glDisable(GL_STENCIL_TEST);
+            if (vrend_state.current_hw_ctx)
+               vrend_gl_state_invalidate(&vrend_state.current_hw_ctx->sub->gl_state);
          }
          glPixelZoom(1.0f, res->y_0_top ? -1.0f : 1.0f);
          glWindowPos2i(info->box->x, res->y_0_top ? (int)res->base.height0 - info->box->y : info->box->y);
@@ -6466,7 +9058,14 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
             else
                vrend_scale_depth(data, send_size, depth_scale);
          }
-         if (res->target == GL_TEXTURE_CUBE_MAP) {
+         if (by_rows) {
+            int ret = vrend_transfer_iov_rows(res, iov, num_iovs, info, stride,
+                                              glformat, gltype, true);
+            if (ret) {
+               glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+               return ret;
+            }
+         } else if (res->target == GL_TEXTURE_CUBE_MAP) {
             GLenum ctarget = GL_TEXTURE_CUBE_MAP_POSITIVE_X + info->box->z;
             if (compressed) {
                glCompressedTexSubImage2D(ctarget, info->level, x, y,
@@ -6516,14 +9115,16 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          }
       }
 
-      if (stride && !need_temp) {
+      if (stride && !need_temp && !by_rows) {
          glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
          glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
       }
 
       glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-      if (need_temp)
+      if (from_ring)
+         glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+      else if (need_temp)
          free(data);
    }
    return 0;
@@ -6618,15 +9219,17 @@ static int vrend_transfer_send_getteximage(struct vrend_resource *res,
    return 0;
 }
 
+/* with rb set the pixels go packed into the pixel pack buffer bound by the
+ * caller, iov is unused and vrend_readback_finish copies them over later */
 static int vrend_transfer_send_readpixels(struct vrend_resource *res,
                                           struct iovec *iov, int num_iovs,
-                                          const struct vrend_transfer_info *info)
+                                          const struct vrend_transfer_info *info,
+                                          struct vrend_readback *rb)
 {
-   char *myptr = (char*)iov[0].iov_base + info->offset;
    int need_temp = 0;
    GLuint fb_id;
    char *data;
-   bool actually_invert, separate_invert = false;
+   bool actually_invert, separate_invert = false, by_rows = false;
    GLenum format, type;
    GLint y1;
    uint32_t send_size = 0;
@@ -6634,7 +9237,9 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
    int elsize = util_format_get_blocksize(res->base.format);
    float depth_scale;
    int row_stride = info->stride / elsize;
+   uint32_t stride = info->stride;
    GLint old_fbo;
+   int ret = 0;
 
    glUseProgram(0);
 
@@ -6647,10 +9252,21 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
    if (actually_invert && !has_feature(feat_mesa_invert))
       separate_invert = true;
 
-   if (num_iovs > 1 || separate_invert)
+   if (!stride)
+      stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, info->level)) * elsize;
+   if (!rb && info->box->depth == 1 && vrend_can_transfer_iov_rows(res, stride, num_iovs))
+      by_rows = true;
+
+   if ((num_iovs > 1 && !by_rows) || separate_invert || rb)
       need_temp = 1;
 
-   if (need_temp) {
+   if (by_rows) {
+      data = NULL;
+   } else if (rb) {
+      send_size = rb->size;
+      rb->separate_invert = separate_invert;
+      data = NULL;
+   } else if (need_temp) {
       send_size = util_format_get_nblocks(res->base.format, info->box->width, info->box->height) * info->box->depth * util_format_get_blocksize(res->base.format);
       data = malloc(send_size);
       if (!data) {
@@ -6659,7 +9275,7 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
       }
    } else {
       send_size = iov[0].iov_len - info->offset;
-      data = myptr;
+      data = (char*)iov[0].iov_base + info->offset;
       if (!row_stride)
          row_stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, info->level));
    }
@@ -6691,7 +9307,7 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
       glPixelStorei(GL_PACK_INVERT_MESA, 1);
    if (!vrend_format_is_ds(res->base.format))
       glReadBuffer(GL_COLOR_ATTACHMENT0);
-   if (!need_temp && row_stride)
+   if (!need_temp && !by_rows && row_stride)
       glPixelStorei(GL_PACK_ROW_LENGTH, row_stride);
 
    switch (elsize) {
@@ -6748,14 +9364,11 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
       }
    }
 
-   if (has_feature(feat_arb_robustness))
-      glReadnPixelsARB(info->box->x, y1, info->box->width, info->box->height, format, type, send_size, data);
-   else if (has_feature(feat_gles_khr_robustness))
-      glReadnPixelsKHR(info->box->x, y1, info->box->width, info->box->height, format, type, send_size, data);
-   else if (has_feature(feat_angle_robustness))
-      glReadnPixelsEXT(info->box->x, y1, info->box->width, info->box->height, format, type, send_size, data);
+   if (by_rows)
+      ret = vrend_transfer_iov_rows(res, iov, num_iovs, info, stride, format, type, false);
    else
-      glReadPixels(info->box->x, y1, info->box->width, info->box->height, format, type, data);
+      vrend_read_pixels(info->box->x, y1, info->box->width, info->box->height,
+                        format, type, send_size, data);
 
    if (res->base.format == (enum pipe_format)VIRGL_FORMAT_Z24X8_UNORM) {
       if (!vrend_state.use_core_profile)
@@ -6765,10 +9378,10 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
    }
    if (has_feature(feat_mesa_invert) && actually_invert)
       glPixelStorei(GL_PACK_INVERT_MESA, 0);
-   if (!need_temp && row_stride)
+   if (!need_temp && !by_rows && row_stride)
       glPixelStorei(GL_PACK_ROW_LENGTH, 0);
    glPixelStorei(GL_PACK_ALIGNMENT, 4);
-   if (need_temp) {
+   if (need_temp && !rb) {
       write_transfer_data(&res->base, iov, num_iovs, data,
                           info->stride, info->box, info->level, info->offset,
                           separate_invert);
@@ -6777,7 +9390,7 @@ static int vrend_transfer_send_readpixels(struct vrend_resource *res,
 
    glBindFramebuffer(GL_FRAMEBUFFER, old_fbo);
 
-   return 0;
+   return ret;
 }
 
 static int vrend_transfer_send_readonly(struct vrend_resource *res,
@@ -6822,7 +9435,12 @@ static int vrend_renderer_transfer_send_iov(struct vrend_resource *res,
       return 0;
    }
 
-   if (res->is_buffer) {
+   if (res->is_buffer && res->map) {
+      uint32_t send_size = info->box->width * util_format_get_blocksize(res->base.format);
+
+      vrend_buffer_map_sync();
+      vrend_write_to_iovec(iov, num_iovs, info->offset, res->map + info->box->x, send_size);
+   } else if (res->is_buffer) {
       uint32_t send_size = info->box->width * util_format_get_blocksize(res->base.format);
       void *data;
 
@@ -6841,7 +9459,7 @@ static int vrend_renderer_transfer_send_iov(struct vrend_resource *res,
       can_readpixels = vrend_format_can_render(res->base.format) || vrend_format_is_ds(res->base.format);
 
       if (can_readpixels) {
-         ret = vrend_transfer_send_readpixels(res, iov, num_iovs, info);
+         ret = vrend_transfer_send_readpixels(res, iov, num_iovs, info, NULL);
       } else {
          ret = vrend_transfer_send_readonly(res, iov, num_iovs, info);
       }
@@ -6855,6 +9473,195 @@ static int vrend_renderer_transfer_send_iov(struct vrend_resource *res,
    return 0;
 }
 
+static void vrend_readback_copy(struct vrend_readback *rb)
+{
+   struct vrend_resource *res = rb->res;
+   void *data;
+
+   if (!rb->fence->signaled) {
+      glClientWaitSync(rb->fence->syncobj, GL_SYNC_FLUSH_COMMANDS_BIT,
+                       GL_TIMEOUT_IGNORED);
+      vrend_state.readback_stalls++;
+   }
+
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, rb->pbo);
+   data = glMapBufferRange(GL_PIXEL_PACK_BUFFER_ARB, 0, rb->size, GL_MAP_READ_BIT);
+   if (!data) {
+      vrend_printf("unable to map readback buffer\n");
+   } else {
+      if (res->iov)
+         write_transfer_data(&res->base, res->iov, res->num_iovs, data,
+                             rb->stride, &rb->box, rb->level, rb->offset,
+                             rb->separate_invert);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER_ARB);
+   }
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+   rb->fence->readback = NULL;
+   rb->fence = NULL;
+   res->num_readbacks--;
+   list_del(&rb->head);
+   list_add(&rb->head, &vrend_state.readback_free_list);
+}
+
+/* copy a readback to the backing of its resource, waiting for the GPU when
+ * its fence didn't signal yet */
+static void vrend_readback_finish(struct vrend_readback *rb)
+{
+   struct vrend_readback *prev, *tmp;
+
+   /* fences of different contexts signal in any order, but the readbacks
+    * of a resource land in the order they were issued */
+   LIST_FOR_EACH_ENTRY_SAFE(prev, tmp, &vrend_state.readback_list, head) {
+      if (prev == rb)
+         break;
+      if (prev->res == rb->res)
+         vrend_readback_copy(prev);
+   }
+   vrend_readback_copy(rb);
+}
+
+static void vrend_readback_flush_resource(struct vrend_resource *res)
+{
+   struct vrend_readback *rb, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(rb, tmp, &vrend_state.readback_list, head) {
+      if (rb->res == res)
+         vrend_readback_copy(rb);
+   }
+}
+
+/* a fence with the given serial signals, readbacks issued before it are
+ * part of the work it reports */
+static void vrend_readback_flush_serial(uint32_t serial)
+{
+   struct vrend_readback *rb, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(rb, tmp, &vrend_state.readback_list, head) {
+      if ((int32_t)(rb->serial - serial) > 0)
+         break;
+      vrend_readback_copy(rb);
+   }
+}
+
+static struct vrend_readback *vrend_readback_get(uint32_t size)
+{
+   struct vrend_readback *rb;
+
+   if (LIST_IS_EMPTY(&vrend_state.readback_free_list) &&
+       vrend_state.num_readback_pbos >= vrend_state.max_readback_pbos) {
+      /* every buffer is in flight, the oldest one lands first */
+      rb = LIST_ENTRY(struct vrend_readback, vrend_state.readback_list.next, head);
+      vrend_readback_finish(rb);
+   }
+
+   LIST_FOR_EACH_ENTRY(rb, &vrend_state.readback_free_list, head) {
+      if (rb->pbo_size >= size) {
+         list_del(&rb->head);
+         rb->size = size;
+         return rb;
+      }
+   }
+
+   if (!LIST_IS_EMPTY(&vrend_state.readback_free_list)) {
+      rb = LIST_ENTRY(struct vrend_readback, vrend_state.readback_free_list.next, head);
+      list_del(&rb->head);
+   } else {
+      rb = CALLOC_STRUCT(vrend_readback);
+      if (!rb)
+         return NULL;
+      glGenBuffers(1, &rb->pbo);
+      vrend_state.num_readback_pbos++;
+   }
+
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, rb->pbo);
+   glBufferData(GL_PIXEL_PACK_BUFFER_ARB, size, NULL, GL_STREAM_READ);
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+   rb->pbo_size = size;
+   rb->size = size;
+   return rb;
+}
+
+/* Reads into the attached backing don't have to stall on the GPU: read into
+ * a pixel pack buffer and copy the data over when an internal fence
+ * signaled, see vrend_fence_done.  Returns false when the transfer has to
+ * be done synchronously. */
+static bool vrend_readback_issue(struct vrend_resource *res,
+                                 const struct vrend_transfer_info *info)
+{
+   struct vrend_readback *rb;
+   struct vrend_fence *fence;
+   uint32_t size, ctx_id;
+
+   if (res->is_buffer || res->target == 0)
+      return false;
+   if (!vrend_format_can_render(res->base.format) &&
+       !vrend_format_is_ds(res->base.format))
+      return false;
+   /* the depth values are scaled on the CPU in core profiles */
+   if (res->base.format == (enum pipe_format)VIRGL_FORMAT_Z24X8_UNORM)
+      return false;
+
+   size = util_format_get_nblocks(res->base.format, info->box->width, info->box->height) *
+          info->box->depth * util_format_get_blocksize(res->base.format);
+   if (!size)
+      return false;
+
+   fence = vrend_fence_alloc();
+   if (!fence)
+      return false;
+   rb = vrend_readback_get(size);
+   if (!rb) {
+      list_add(&fence->fences, &vrend_state.fence_free_list);
+      return false;
+   }
+
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, rb->pbo);
+   vrend_transfer_send_readpixels(res, NULL, 0, info, rb);
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+   rb->res = res;
+   rb->box = *info->box;
+   rb->level = info->level;
+   rb->stride = info->stride;
+   rb->offset = info->offset;
+   rb->serial = vrend_state.fence_serial;
+
+   /* the fence goes on the timeline of the context the read ran in */
+   ctx_id = vrend_state.current_hw_ctx ? (uint32_t)vrend_state.current_hw_ctx->ctx_id : 0;
+   fence->fence_id = 0;
+   fence->serial = rb->serial;
+   fence->internal = true;
+   fence->readback = rb;
+   if (vrend_insert_fence(fence, ctx_id)) {
+      list_add(&rb->head, &vrend_state.readback_free_list);
+      return false;
+   }
+
+   rb->fence = fence;
+   res->num_readbacks++;
+   list_addtail(&rb->head, &vrend_state.readback_list);
+   vrend_state.readbacks_async++;
+   return true;
+}
+
+static void vrend_free_readbacks(void)
+{
+   struct vrend_readback *rb, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(rb, tmp, &vrend_state.readback_list, head) {
+      rb->res->num_readbacks--;
+      list_del(&rb->head);
+      list_add(&rb->head, &vrend_state.readback_free_list);
+   }
+   LIST_FOR_EACH_ENTRY_SAFE(rb, tmp, &vrend_state.readback_free_list, head) {
+      list_del(&rb->head);
+      glDeleteBuffers(1, &rb->pbo);
+      FREE(rb);
+   }
+   vrend_state.num_readback_pbos = 0;
+}
+
 int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
                                 int transfer_mode)
 {
@@ -6862,6 +9669,7 @@ int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
    struct vrend_context *ctx;
    struct iovec *iov;
    int num_iovs;
+   bool to_backing = false;
 
    if (!info->box)
       return EINVAL;
@@ -6887,6 +9695,7 @@ int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
    if (res->iov && (!iov || num_iovs == 0)) {
       iov = res->iov;
       num_iovs = res->num_iovs;
+      to_backing = true;
    }
 
    if (!iov) {
@@ -6906,6 +9715,18 @@ int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
       ctx = NULL;
    }
 
+   /* only the attached backing may be written behind the caller's back */
+   if (transfer_mode == VIRGL_TRANSFER_FROM_HOST && to_backing &&
+       vrend_state.use_async_readback) {
+      if (vrend_readback_issue(res, info))
+         return 0;
+      vrend_state.readbacks_sync++;
+   }
+
+   /* anything else sees the data of earlier readbacks */
+   if (res->num_readbacks)
+      vrend_readback_flush_resource(res);
+
    switch (transfer_mode) {
    case VIRGL_TRANSFER_TO_HOST:
       return vrend_renderer_transfer_write_iov(ctx, res, iov, num_iovs, info);
@@ -6951,15 +9772,19 @@ void vrend_set_stencil_ref(struct vrend_context *ctx,
       ctx->sub->stencil_refs[0] = ref->ref_value[0];
       ctx->sub->stencil_refs[1] = ref->ref_value[1];
       ctx->sub->stencil_state_dirty = true;
-   }
+   } else
+      vrend_state.elided.stencil_refs++;
 }
 
 void vrend_set_blend_color(struct vrend_context *ctx,
                            struct pipe_blend_color *color)
 {
+   if (!memcmp(&ctx->sub->blend_color, color, sizeof(*color))) {
+      vrend_state.elided.blend_colors++;
+      return;
+   }
    ctx->sub->blend_color = *color;
-   glBlendColor(color->color[0], color->color[1], color->color[2],
-                color->color[3]);
+   vrend_gl_blend_color(ctx, color->color);
 }
 
 void vrend_set_scissor_state(struct vrend_context *ctx,
@@ -6977,7 +9802,13 @@ void vrend_set_scissor_state(struct vrend_context *ctx,
 
    for (i = 0; i < num_scissor; i++) {
       idx = start_slot + i;
+      if ((ctx->sub->scissor_state_set & (1 << idx)) &&
+          !memcmp(&ctx->sub->ss[idx], &ss[i], sizeof(ss[i]))) {
+         vrend_state.elided.scissors++;
+         continue;
+      }
       ctx->sub->ss[idx] = ss[i];
+      ctx->sub->scissor_state_set |= 1 << idx;
       ctx->sub->scissor_state_dirty |= (1 << idx);
    }
 }
@@ -7064,8 +9895,11 @@ static void vrend_hw_emit_streamout_targets(UNUSED struct vrend_context *ctx, st
    for (i = 0; i < so_obj->num_targets; i++) {
       if (!so_obj->so_targets[i])
          glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, 0);
-      else if (so_obj->so_targets[i]->buffer_offset || so_obj->so_targets[i]->buffer_size < so_obj->so_targets[i]->buffer->base.width0)
-         glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, i, so_obj->so_targets[i]->buffer->id, so_obj->so_targets[i]->buffer_offset, so_obj->so_targets[i]->buffer_size);
+      else if (so_obj->so_targets[i]->buffer_offset || so_obj->so_targets[i]->buffer_size < so_obj->so_targets[i]->buffer->base.width0 ||
+               so_obj->so_targets[i]->buffer->heap_slab)
+         glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, i, so_obj->so_targets[i]->buffer->id,
+                           so_obj->so_targets[i]->buffer_offset + so_obj->so_targets[i]->buffer->heap_offset,
+                           so_obj->so_targets[i]->buffer_size);
       else
          glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, so_obj->so_targets[i]->buffer->id);
    }
@@ -7137,7 +9971,8 @@ static void vrend_resource_buffer_copy(UNUSED struct vrend_context *ctx,
    glBindBuffer(GL_COPY_READ_BUFFER, src_res->id);
    glBindBuffer(GL_COPY_WRITE_BUFFER, dst_res->id);
 
-   glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, srcx, dstx, width);
+   glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                       srcx + src_res->heap_offset, dstx + dst_res->heap_offset, width);
    glBindBuffer(GL_COPY_READ_BUFFER, 0);
    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 }
@@ -7306,6 +10141,139 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
    free(tptr);
 }
 
+/* Copy through a pixel buffer that never leaves the GPU, for formats that
+ * can be neither copied with glCopyImageSubData nor rendered to.  With
+ * ARB_get_texture_sub_image only the box is read, otherwise the whole
+ * level (or the cube faces in the box) is and the unpack state picks the
+ * box out of it.
+ */
+static bool vrend_resource_copy_pbo(struct vrend_resource *src_res,
+                                    struct vrend_resource *dst_res,
+                                    uint32_t dst_level,
+                                    uint32_t dstx, uint32_t dsty,
+                                    uint32_t dstz, uint32_t src_level,
+                                    const struct pipe_box *src_box)
+{
+   GLenum glformat = tex_conv_table[src_res->base.format].glformat;
+   GLenum gltype = tex_conv_table[src_res->base.format].gltype;
+   int elsize = util_format_get_blocksize(src_res->base.format);
+   bool is_cube = src_res->target == GL_TEXTURE_CUBE_MAP;
+   bool sub_image = has_feature(feat_get_texture_sub_image);
+   uint32_t read_w, read_h, read_d, skip_x, skip_y, skip_z;
+   uint32_t slice_size, buf_size;
+   int i;
+
+   if (vrend_state.use_gles ||
+       util_format_is_compressed(src_res->base.format) ||
+       src_res->base.nr_samples > 1 || dst_res->base.nr_samples > 1 ||
+       src_res->target != dst_res->target || !glformat || !gltype)
+      return false;
+
+   switch (src_res->target) {
+   case GL_TEXTURE_1D:
+   case GL_TEXTURE_2D:
+   case GL_TEXTURE_RECTANGLE_NV:
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_CUBE_MAP:
+      break;
+   default:
+      return false;
+   }
+
+   if (sub_image) {
+      read_w = src_box->width;
+      read_h = src_box->height;
+      read_d = src_box->depth;
+      skip_x = skip_y = skip_z = 0;
+   } else {
+      read_w = u_minify(src_res->base.width0, src_level);
+      read_h = src_res->target == GL_TEXTURE_1D ? 1 :
+               u_minify(src_res->base.height0, src_level);
+      read_d = is_cube ? src_box->depth : vrend_get_texture_depth(src_res, src_level);
+      skip_x = src_box->x;
+      skip_y = src_box->y;
+      skip_z = is_cube ? 0 : src_box->z;
+   }
+   slice_size = read_w * read_h * elsize;
+   buf_size = slice_size * read_d;
+
+   if (!vrend_state.copy_pbo)
+      glGenBuffersARB(1, &vrend_state.copy_pbo);
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, vrend_state.copy_pbo);
+   if (buf_size > vrend_state.copy_pbo_size) {
+      glBufferData(GL_PIXEL_PACK_BUFFER_ARB, buf_size, NULL, GL_STREAM_COPY);
+      vrend_state.copy_pbo_size = buf_size;
+   }
+
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+   if (sub_image) {
+      glGetTextureSubImage(src_res->id, src_level, src_box->x, src_box->y, src_box->z,
+                           src_box->width, src_box->height, src_box->depth,
+                           glformat, gltype, buf_size, NULL);
+   } else {
+      glBindTexture(src_res->target, src_res->id);
+      if (is_cube) {
+         for (i = 0; i < src_box->depth; i++)
+            glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + src_box->z + i, src_level,
+                          glformat, gltype, (void *)(uintptr_t)(i * slice_size));
+      } else {
+         glGetTexImage(src_res->target, src_level, glformat, gltype, NULL);
+      }
+   }
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+   glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, vrend_state.copy_pbo);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   glPixelStorei(GL_UNPACK_ROW_LENGTH, read_w);
+   glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, read_h);
+   glPixelStorei(GL_UNPACK_SKIP_PIXELS, skip_x);
+   glPixelStorei(GL_UNPACK_SKIP_ROWS, skip_y);
+   glPixelStorei(GL_UNPACK_SKIP_IMAGES, skip_z);
+
+   glBindTexture(dst_res->target, dst_res->id);
+   switch (dst_res->target) {
+   case GL_TEXTURE_1D:
+      glTexSubImage1D(GL_TEXTURE_1D, dst_level, dstx, src_box->width,
+                      glformat, gltype, NULL);
+      break;
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+      glTexSubImage3D(dst_res->target, dst_level, dstx, dsty, dstz,
+                      src_box->width, src_box->height, src_box->depth,
+                      glformat, gltype, NULL);
+      break;
+   case GL_TEXTURE_CUBE_MAP:
+      for (i = 0; i < src_box->depth; i++)
+         glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + dstz + i, dst_level, dstx, dsty,
+                         src_box->width, src_box->height, glformat, gltype,
+                         (void *)(uintptr_t)(i * slice_size));
+      break;
+   default:
+      glTexSubImage2D(dst_res->target, dst_level, dstx, dsty,
+                      src_box->width, src_box->height, glformat, gltype, NULL);
+      break;
+   }
+
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+   glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+   glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+   glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+   glPixelStorei(GL_UNPACK_SKIP_IMAGES, 0);
+   glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+   return true;
+}
+
+static void vrend_copy_pbo_fini(void)
+{
+   if (vrend_state.copy_pbo)
+      glDeleteBuffers(1, &vrend_state.copy_pbo);
+   vrend_state.copy_pbo = 0;
+   vrend_state.copy_pbo_size = 0;
+}
+
 
 static inline void
 vrend_copy_sub_image(struct vrend_resource* src_res, struct vrend_resource * dst_res,
@@ -7335,8 +10303,8 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    if (ctx->in_error)
       return;
 
-   src_res = vrend_renderer_ctx_res_lookup(ctx, src_handle);
-   dst_res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
+   src_res = vrend_renderer_ctx_res_use(ctx, src_handle);
+   dst_res = vrend_renderer_ctx_res_use(ctx, dst_handle);
 
    if (!src_res) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
@@ -7360,6 +10328,15 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       /* do a buffer copy */
       VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: buffer copy %d+%d\n",
                   src_box->x, src_box->width);
+      if (src_box->x < 0 || src_box->width < 0 ||
+          !vrend_buffer_range_valid(src_res, src_box->x, src_box->width)) {
+         report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
+         return;
+      }
+      if (!vrend_buffer_range_valid(dst_res, dstx, src_box->width)) {
+         report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, dst_handle);
+         return;
+      }
       vrend_resource_buffer_copy(ctx, src_res, dst_res, dstx,
                                  src_box->x, src_box->width);
       return;
@@ -7371,14 +10348,23 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use glCopyImageSubData\n");
       vrend_copy_sub_image(src_res, dst_res, src_level, src_box,
                            dst_level, dstx, dsty, dstz);
+      vrend_state.copies_copy_image++;
       return;
    }
 
    if (!vrend_format_can_render(src_res->base.format) ||
        !vrend_format_can_render(dst_res->base.format)) {
+      if (src_res->base.format == dst_res->base.format &&
+          vrend_resource_copy_pbo(src_res, dst_res, dst_level, dstx,
+                                  dsty, dstz, src_level, src_box)) {
+         VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use resource_copy_pbo\n");
+         vrend_state.copies_pbo++;
+         return;
+      }
       VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use resource_copy_fallback\n");
       vrend_resource_copy_fallback(src_res, dst_res, dst_level, dstx,
                                    dsty, dstz, src_level, src_box);
+      vrend_state.copies_cpu++;
       return;
    }
 
@@ -7399,7 +10385,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
 
    glmask = GL_COLOR_BUFFER_BIT;
-   glDisable(GL_SCISSOR_TEST);
+   vrend_gl_enable(ctx, VREND_GL_SCISSOR_TEST, false);
 
    if (!src_res->y_0_top) {
       sy1 = src_box->y;
@@ -7425,9 +10411,10 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
                      dy2,
                      glmask, GL_NEAREST);
    glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->fb_id);
+   vrend_state.copies_blit++;
 
    if (ctx->sub->rs_state.scissor)
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(ctx, VREND_GL_SCISSOR_TEST, true);
 }
 
 static void vrend_renderer_blit_int(struct vrend_context *ctx,
@@ -7498,7 +10485,7 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       vrend_renderer_blit_gl(src_res, dst_res, info,
                              has_feature(feat_texture_srgb_decode),
                              has_feature(feat_srgb_write_control));
-      vrend_clicbs->make_current(ctx->sub->gl_context);
+      vrend_make_current(ctx->sub->gl_context);
       return;
    }
 
@@ -7528,9 +10515,9 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
    if (info->scissor_enable) {
       glScissor(info->scissor.minx, info->scissor.miny, info->scissor.maxx - info->scissor.minx, info->scissor.maxy - info->scissor.miny);
       ctx->sub->scissor_state_dirty = (1 << 0);
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(ctx, VREND_GL_SCISSOR_TEST, true);
    } else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_gl_enable(ctx, VREND_GL_SCISSOR_TEST, false);
 
    /* An GLES GL_INVALID_OPERATION is generated if one wants to blit from a
     * multi-sample fbo to a non multi-sample fbo and the source and destination
@@ -7617,10 +10604,8 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
 
       if (has_feature(feat_srgb_write_control)) {
-         if (util_format_is_srgb(info->dst.format))
-            glEnable(GL_FRAMEBUFFER_SRGB);
-         else
-            glDisable(GL_FRAMEBUFFER_SRGB);
+         vrend_gl_enable(ctx, VREND_GL_FRAMEBUFFER_SRGB,
+                         util_format_is_srgb(info->dst.format));
       }
 
       glBindFramebuffer(GL_READ_FRAMEBUFFER, intermediate_fbo);
@@ -7642,10 +10627,7 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       glDeleteFramebuffers(1, &intermediate_fbo);
    }
 
-   if (ctx->sub->rs_state.scissor)
-      glEnable(GL_SCISSOR_TEST);
-   else
-      glDisable(GL_SCISSOR_TEST);
+   vrend_gl_enable(ctx, VREND_GL_SCISSOR_TEST, ctx->sub->rs_state.scissor);
 }
 
 void vrend_renderer_blit(struct vrend_context *ctx,
@@ -7653,8 +10635,8 @@ void vrend_renderer_blit(struct vrend_context *ctx,
                          const struct pipe_blit_info *info)
 {
    struct vrend_resource *src_res, *dst_res;
-   src_res = vrend_renderer_ctx_res_lookup(ctx, src_handle);
-   dst_res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
+   src_res = vrend_renderer_ctx_res_use(ctx, src_handle);
+   dst_res = vrend_renderer_ctx_res_use(ctx, dst_handle);
 
    if (!src_res) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
@@ -7714,29 +10696,60 @@ void vrend_renderer_blit(struct vrend_context *ctx,
       vrend_pause_render_condition(ctx, false);
 }
 
-int vrend_renderer_create_fence(int client_fence_id, uint32_t ctx_id)
+static struct vrend_fence_timeline *vrend_get_fence_timeline(uint32_t ctx_id)
+{
+   struct vrend_fence_timeline *timeline;
+
+   LIST_FOR_EACH_ENTRY(timeline, &vrend_state.fence_timelines, head) {
+      if (timeline->ctx_id == ctx_id)
+         return timeline;
+   }
+
+   timeline = CALLOC_STRUCT(vrend_fence_timeline);
+   if (!timeline)
+      return NULL;
+   timeline->ctx_id = ctx_id;
+   list_inithead(&timeline->pending);
+   list_addtail(&timeline->head, &vrend_state.fence_timelines);
+   return timeline;
+}
+
+static struct vrend_fence *vrend_fence_alloc(void)
 {
    struct vrend_fence *fence;
 
-   fence = malloc(sizeof(struct vrend_fence));
-   if (!fence)
-      return ENOMEM;
+   if (!LIST_IS_EMPTY(&vrend_state.fence_free_list)) {
+      fence = LIST_ENTRY(struct vrend_fence, vrend_state.fence_free_list.next, fences);
+      list_del(&fence->fences);
+      return fence;
+   }
+   return malloc(sizeof(struct vrend_fence));
+}
+
+/* fence the commands issued so far in the current GL context and hand the
+ * fence to the poller, frees the fence on failure */
+static int vrend_insert_fence(struct vrend_fence *fence, uint32_t ctx_id)
+{
+   struct vrend_fence_timeline *timeline;
 
    fence->ctx_id = ctx_id;
-   fence->fence_id = client_fence_id;
+   fence->signaled = false;
    fence->syncobj = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
    glFlush();
 
    if (fence->syncobj == NULL)
       goto fail;
 
-   if (vrend_state.sync_thread) {
-      pipe_mutex_lock(vrend_state.fence_mutex);
-      list_addtail(&fence->fences, &vrend_state.fence_wait_list);
-      pipe_condvar_signal(vrend_state.fence_cond);
-      pipe_mutex_unlock(vrend_state.fence_mutex);
-   } else
-      list_addtail(&fence->fences, &vrend_state.fence_list);
+   timeline = vrend_get_fence_timeline(ctx_id);
+   if (!timeline) {
+      glDeleteSync(fence->syncobj);
+      goto fail;
+   }
+   fence->timeline = timeline;
+   timeline->num_outstanding++;
+   list_addtail(&fence->fences, &vrend_state.fence_list);
+
+   vrend_submit_fence(fence);
    return 0;
 
  fail:
@@ -7745,11 +10758,39 @@ int vrend_renderer_create_fence(int client_fence_id, uint32_t ctx_id)
    return ENOMEM;
 }
 
-static void free_fence_locked(struct vrend_fence *fence)
+int vrend_renderer_create_fence(int client_fence_id, uint32_t ctx_id)
 {
-   list_del(&fence->fences);
-   glDeleteSync(fence->syncobj);
-   free(fence);
+   struct vrend_context *ctx;
+   struct vrend_fence *fence;
+   int ret;
+
+   fence = vrend_fence_alloc();
+   if (!fence)
+      return ENOMEM;
+
+   /* the fence has to follow the commands of its own context */
+   ctx = vrend_lookup_renderer_ctx(ctx_id);
+   if (ctx)
+      vrend_hw_switch_context(ctx, true);
+
+   fence->fence_id = client_fence_id;
+   fence->serial = vrend_state.fence_serial++;
+   fence->internal = false;
+   fence->readback = NULL;
+   ret = vrend_insert_fence(fence, ctx_id);
+   if (!ret)
+      vrend_state.fences_created++;
+   return ret;
+}
+
+static void vrend_free_fence_list(struct list_head *list)
+{
+   struct vrend_fence *fence, *stor;
+
+   LIST_FOR_EACH_ENTRY_SAFE(fence, stor, list, fences) {
+      list_del(&fence->fences);
+      free(fence);
+   }
 }
 
 static void flush_eventfd(int fd)
@@ -7761,43 +10802,97 @@ static void flush_eventfd(int fd)
     } while ((len == -1 && errno == EINTR) || len == sizeof(value));
 }
 
+/* main thread: a fence came back from the poller */
+static void vrend_fence_done(struct vrend_fence *fence)
+{
+   struct vrend_fence_timeline *timeline = fence->timeline;
+
+   fence->signaled = true;
+   timeline->num_outstanding--;
+
+   if (fence->internal) {
+      if (fence->readback)
+         vrend_readback_finish(fence->readback);
+      return;
+   }
+
+   /* the guest may look at the data once it saw the fence */
+   if (!LIST_IS_EMPTY(&vrend_state.readback_list))
+      vrend_readback_flush_serial(fence->serial);
+
+   timeline->signaled_id = fence->fence_id;
+   timeline->report = true;
+}
+
 void vrend_renderer_check_fences(void)
 {
+   struct vrend_fence_timeline *timeline, *tmp;
    struct vrend_fence *fence, *stor;
    uint32_t latest_id = 0;
-   GLenum glret;
+   bool retired = false;
 
    if (!vrend_state.inited)
       return;
 
    if (vrend_state.sync_thread) {
       flush_eventfd(vrend_state.eventfd);
-      pipe_mutex_lock(vrend_state.fence_mutex);
-      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-         if (fence->fence_id > latest_id)
-            latest_id = fence->fence_id;
-         free_fence_locked(fence);
-      }
-      pipe_mutex_unlock(vrend_state.fence_mutex);
+      /* fences pushed after this get a new wakeup */
+      __atomic_store_n(&vrend_state.fences_to_collect, 0, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      while ((fence = vrend_ring_pop(&vrend_state.fence_signaled_ring)))
+         vrend_fence_done(fence);
+      if (!LIST_IS_EMPTY(&vrend_state.fence_overflow_list))
+         vrend_push_fences();
+      else
+         vrend_wake_sync_thread(VREND_SYNC_WAIT_ROOM);
    } else {
       vrend_renderer_force_ctx_0();
+      vrend_poll_fence_timelines();
+      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_done_list, timeline_fences) {
+         list_del(&fence->timeline_fences);
+         vrend_fence_done(fence);
+      }
+   }
 
-      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-         glret = glClientWaitSync(fence->syncobj, 0, 0);
-         if (glret == GL_ALREADY_SIGNALED){
-            latest_id = fence->fence_id;
-            free_fence_locked(fence);
-         }
-         /* don't bother checking any subsequent ones */
-         else if (glret == GL_TIMEOUT_EXPIRED) {
-            break;
+   /* Fences retire in creation order: the serials tracking resource
+    * use and the legacy callback both mean "everything up to here". */
+   LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
+      if (!fence->signaled)
+         break;
+      if (!fence->internal) {
+         latest_id = fence->fence_id;
+         vrend_state.retired_serial = fence->serial;
+         retired = true;
+      }
+      glDeleteSync(fence->syncobj);
+      list_del(&fence->fences);
+      list_add(&fence->fences, &vrend_state.fence_free_list);
+   }
+   if (retired)
+      vrend_state.fence_batches++;
+
+   if (vrend_clicbs->write_context_fence) {
+      LIST_FOR_EACH_ENTRY(timeline, &vrend_state.fence_timelines, head) {
+         if (timeline->report) {
+            timeline->report = false;
+            vrend_clicbs->write_context_fence(timeline->ctx_id, timeline->signaled_id);
          }
       }
+   } else if (retired) {
+      vrend_clicbs->write_fence(latest_id);
    }
 
-   if (latest_id == 0)
-      return;
-   vrend_clicbs->write_fence(latest_id);
+   /* the poller is done with timelines that have nothing outstanding */
+   LIST_FOR_EACH_ENTRY_SAFE(timeline, tmp, &vrend_state.fence_timelines, head) {
+      if (!timeline->num_outstanding) {
+         list_del(&timeline->head);
+         FREE(timeline);
+      }
+   }
+
+   vrend_pool_trim(false);
+   if (!LIST_IS_EMPTY(&vrend_state.heap_pending))
+      vrend_heap_reclaim(false);
 }
 
 static bool vrend_get_one_query_result(GLuint query_id, bool use_64, uint64_t *result)
@@ -7882,7 +10977,7 @@ static void vrend_finish_context_switch(struct vrend_context *ctx)
 
    vrend_state.current_hw_ctx = ctx;
 
-   vrend_clicbs->make_current(ctx->sub->gl_context);
+   vrend_make_current(ctx->sub->gl_context);
 }
 
 void
@@ -8064,13 +11159,17 @@ void vrend_get_query_result_qbo(struct vrend_context *ctx, uint32_t handle,
   if (!q)
      return;
 
-  res = vrend_renderer_ctx_res_lookup(ctx, qbo_handle);
-  if (!res) {
+  res = vrend_renderer_ctx_res_use(ctx, qbo_handle);
+  if (!res ||
+      !vrend_buffer_range_valid(res, offset,
+                                result_type == PIPE_QUERY_TYPE_I64 ||
+                                result_type == PIPE_QUERY_TYPE_U64 ? 8 : 4)) {
      report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, qbo_handle);
      return;
   }
 
   glBindBuffer(GL_QUERY_BUFFER, res->id);
+  offset += res->heap_offset;
   GLenum qtype;
 
   if (index == -1)
@@ -8175,12 +11274,17 @@ int vrend_create_so_target(struct vrend_context *ctx,
    struct vrend_so_target *target;
    struct vrend_resource *res;
    int ret_handle;
-   res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-   if (!res) {
+   res = vrend_renderer_ctx_res_use(ctx, res_handle);
+   if (!res || !vrend_clamp_buffer_range(res, buffer_offset, &buffer_size)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
       return EINVAL;
    }
 
+   /* transform feedback objects keep the GL buffer they were set up with,
+    * a later move out of the heap would leave them writing to the slab */
+   if (res->heap_slab && !vrend_heap_evict(res))
+      return ENOMEM;
+
    target = CALLOC_STRUCT(vrend_so_target);
    if (!target)
       return ENOMEM;
@@ -8880,7 +11984,7 @@ void *vrend_renderer_resource_get_priv(uint32_t res_handle)
     return res->priv;
 }
 
-void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id)
+void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id, int ctx_resource_id)
 {
    struct vrend_context *ctx = vrend_lookup_renderer_ctx(ctx_id);
    struct vrend_resource *res;
@@ -8892,7 +11996,8 @@ void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id)
    if (!res)
       return;
 
-   vrend_object_insert_nofree(ctx->res_hash, res, sizeof(*res), resource_id, 1, false);
+   vrend_heap_adopt(ctx, res);
+   vrend_object_insert_nofree(ctx->res_hash, res, sizeof(*res), ctx_resource_id, 1, false);
 }
 
 static void vrend_renderer_detach_res_ctx_p(struct vrend_context *ctx, int res_handle)
@@ -8920,6 +12025,96 @@ static struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context
    return res;
 }
 
+/* lookup for commands the GPU executes, the resource stays busy until the
+ * next fence retired */
+static struct vrend_resource *vrend_renderer_ctx_res_use(struct vrend_context *ctx, int res_handle)
+{
+   struct vrend_resource *res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+
+   if (res)
+      res->fence_serial = vrend_state.fence_serial;
+   return res;
+}
+
+static inline void vrend_stamp_resource(struct pipe_resource *pres)
+{
+   if (pres)
+      ((struct vrend_resource *)pres)->fence_serial = vrend_state.fence_serial;
+}
+
+/* Resources looked up while binding are stamped right away, but bindings
+ * outlive fences.  Stamp whatever is bound at the first draw after each
+ * fence; what gets bound later in that period was stamped on lookup. */
+static void vrend_stamp_bound_resources(struct vrend_sub_context *sub)
+{
+   uint32_t mask;
+   int i, s;
+
+   if (sub->stamped_serial == vrend_state.fence_serial)
+      return;
+   sub->stamped_serial = vrend_state.fence_serial;
+
+   for (i = 0; i < sub->nr_cbufs; i++)
+      if (sub->surf[i])
+         vrend_stamp_resource(&sub->surf[i]->texture->base);
+   if (sub->zsurf)
+      vrend_stamp_resource(&sub->zsurf->texture->base);
+
+   for (i = 0; i < sub->num_vbos; i++)
+      vrend_stamp_resource(sub->vbo[i].buffer);
+   vrend_stamp_resource(sub->ib.buffer);
+
+   for (s = 0; s < PIPE_SHADER_TYPES; s++) {
+      for (i = 0; i < sub->views[s].num_views; i++)
+         if (sub->views[s].views[i])
+            vrend_stamp_resource(&sub->views[s].views[i]->texture->base);
+
+      mask = sub->const_bufs_used_mask[s];
+      while (mask) {
+         i = u_bit_scan(&mask);
+         vrend_stamp_resource(sub->cbs[s][i].buffer);
+      }
+
+      mask = sub->images_used_mask[s];
+      while (mask) {
+         i = u_bit_scan(&mask);
+         if (sub->image_views[s][i].texture)
+            vrend_stamp_resource(&sub->image_views[s][i].texture->base);
+      }
+
+      mask = sub->ssbo_used_mask[s];
+      while (mask) {
+         i = u_bit_scan(&mask);
+         if (sub->ssbo[s][i].res)
+            vrend_stamp_resource(&sub->ssbo[s][i].res->base);
+      }
+   }
+
+   mask = sub->abo_used_mask;
+   while (mask) {
+      i = u_bit_scan(&mask);
+      if (sub->abo[i].res)
+         vrend_stamp_resource(&sub->abo[i].res->base);
+   }
+
+   if (sub->current_so) {
+      for (i = 0; i < (int)sub->current_so->num_targets; i++)
+         if (sub->current_so->so_targets[i])
+            vrend_stamp_resource(&sub->current_so->so_targets[i]->buffer->base);
+   }
+}
+
+bool vrend_renderer_resource_busy(uint32_t res_handle)
+{
+   struct vrend_resource *res = vrend_resource_lookup(res_handle, 0);
+
+   if (!res)
+      return false;
+   if (res->num_readbacks)
+      return true;
+   return (int32_t)(res->fence_serial - vrend_state.retired_serial) > 0;
+}
+
 void vrend_context_set_debug_flags(struct vrend_context *ctx, const char *flagstring)
 {
    if (vrend_debug_can_override()) {
@@ -8995,7 +12190,7 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
    sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
-   vrend_clicbs->make_current(sub->gl_context);
+   vrend_make_current(sub->gl_context);
 
    /* enable if vrend_renderer_init function has done it as well */
    if (has_feature(feat_debug_cb)) {
@@ -9022,6 +12217,10 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    list_inithead(&sub->programs);
    list_inithead(&sub->streamout_list);
 
+   sub->program_hash = util_hash_table_create(program_key_hash,
+                                              program_key_compare,
+                                              program_hash_free);
+
    sub->object_hash = vrend_object_init_ctx_table();
 
    ctx->sub = sub;
@@ -9060,7 +12259,7 @@ void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    if (tofree) {
       if (ctx->sub == tofree) {
          ctx->sub = ctx->sub0;
-         vrend_clicbs->make_current(ctx->sub->gl_context);
+         vrend_make_current(ctx->sub->gl_context);
       }
       vrend_destroy_sub_context(tofree);
    }
@@ -9077,7 +12276,7 @@ void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    LIST_FOR_EACH_ENTRY(sub, &ctx->sub_ctxs, head) {
       if (sub->sub_ctx_id == sub_ctx_id) {
          ctx->sub = sub;
-         vrend_clicbs->make_current(sub->gl_context);
+         vrend_make_current(sub->gl_context);
          break;
       }
    }
@@ -9085,17 +12284,27 @@ void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 
 static void vrend_reset_fences(void)
 {
+   struct vrend_fence_timeline *timeline, *tmp;
    struct vrend_fence *fence, *stor;
 
-   if (vrend_state.sync_thread)
-      pipe_mutex_lock(vrend_state.fence_mutex);
+   vrend_free_readbacks();
 
+   /* the sync thread is gone, the rings and the poller's lists only point
+    * at fences in fence_list */
    LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-      free_fence_locked(fence);
+      list_del(&fence->fences);
+      glDeleteSync(fence->syncobj);
+      free(fence);
    }
+   vrend_free_fence_list(&vrend_state.fence_free_list);
+   list_inithead(&vrend_state.fence_overflow_list);
+   list_inithead(&vrend_state.fence_poll_list);
+   list_inithead(&vrend_state.fence_done_list);
 
-   if (vrend_state.sync_thread)
-      pipe_mutex_unlock(vrend_state.fence_mutex);
+   LIST_FOR_EACH_ENTRY_SAFE(timeline, tmp, &vrend_state.fence_timelines, head) {
+      list_del(&timeline->head);
+      FREE(timeline);
+   }
 }
 
 void vrend_renderer_reset(void)
@@ -9105,10 +12314,14 @@ void vrend_renderer_reset(void)
       vrend_state.stop_sync_thread = false;
    }
    vrend_reset_fences();
+   vrend_upload_ring_fini();
+   vrend_copy_pbo_fini();
    vrend_blitter_fini();
    vrend_decode_reset(false);
    vrend_object_fini_resource_table();
    vrend_decode_reset(true);
+   vrend_pool_trim(true);
+   vrend_heap_fini();
    vrend_object_init_resource_table();
    vrend_renderer_context_create_internal(0, strlen("HOST"), "HOST");
 }
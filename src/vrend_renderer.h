@@ -66,9 +66,22 @@ struct vrend_resource {
 
    void *priv;
    char *ptr;
+   /* buffers stay mapped when the host can, see vrend_create_buffer */
+   char *map;
    struct iovec *iov;
    uint32_t num_iovs;
    uint64_t mipmap_offsets[VR_MAX_TEXTURE_2D_LEVELS];
+
+   /* fence serial of the last GPU use, see vrend_renderer_resource_busy */
+   uint32_t fence_serial;
+   /* the storage can go back to the resource pool when destroyed */
+   bool recyclable;
+   /* small buffers share a GL buffer, id and map are those of the slab
+    * and heap_offset has to be added to every offset into the buffer */
+   struct vrend_heap_slab *heap_slab;
+   uint32_t heap_offset;
+   /* readbacks into iov that didn't land yet */
+   uint32_t num_readbacks;
 };
 
 #define VIRGL_BIND_NEED_SWIZZLE (1 << 28)
@@ -101,6 +114,8 @@ struct vrend_transfer_info {
 
 struct vrend_if_cbs {
    void (*write_fence)(unsigned fence_id);
+   /* optional, reports fences per context instead of write_fence */
+   void (*write_context_fence)(uint32_t ctx_id, uint32_t fence_id);
 
    virgl_gl_context (*create_gl_context)(int scanout, struct virgl_gl_ctx_param *params);
    void (*destroy_gl_context)(virgl_gl_context ctx);
@@ -108,6 +123,7 @@ struct vrend_if_cbs {
 };
 
 #define VREND_USE_THREAD_SYNC 1
+#define VREND_USE_ASYNC_READBACK 2
 
 int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags);
 
@@ -306,6 +322,7 @@ void vrend_set_tess_state(struct vrend_context *ctx, const float tess_factors[6]
 void vrend_renderer_fini(void);
 
 int vrend_decode_block(uint32_t ctx_id, uint32_t *block, int ndw);
+void vrend_decode_print_stats(void);
 struct vrend_context *vrend_lookup_renderer_ctx(uint32_t ctx_id);
 
 int vrend_renderer_create_fence(int client_fence_id, uint32_t ctx_id);
@@ -370,7 +387,7 @@ void vrend_renderer_force_ctx_0(void);
 
 void vrend_renderer_get_rect(int resource_id, struct iovec *iov, unsigned int num_iovs,
                              uint32_t offset, int x, int y, int width, int height);
-void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id);
+void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id, int ctx_resource_id);
 void vrend_renderer_detach_res_ctx(int ctx_id, int resource_id);
 
 struct vrend_renderer_resource_info {
@@ -387,6 +404,8 @@ struct vrend_renderer_resource_info {
 int vrend_renderer_resource_get_info(int res_handle,
                                      struct vrend_renderer_resource_info *info);
 
+bool vrend_renderer_resource_busy(uint32_t res_handle);
+
 #define VREND_CAP_SET 1
 #define VREND_CAP_SET2 2
 
@@ -412,6 +431,13 @@ void vrend_renderer_blit_gl(struct vrend_resource *src_res,
                             const struct pipe_blit_info *info,
                             bool has_texture_srgb_decode,
                             bool has_srgb_write_control);
+
+struct vrend_blitter_stats {
+   uint64_t compiles;
+   uint64_t hits;
+};
+
+void vrend_blitter_get_stats(struct vrend_blitter_stats *stats);
 void vrend_blitter_fini(void);
 
 void vrend_renderer_reset(void);
@@ -435,4 +461,7 @@ static const struct gl_version gl_versions[] = { {4,5}, {4,4}, {4,3}, {4,2}, {4,
                                                  {3,3}, {3,2}, {3,1}, {3,0} };
 
 extern struct vrend_if_cbs *vrend_clicbs;
+
+/* switches the GL context of the renderer thread */
+void vrend_make_current(virgl_gl_context gl_context);
 #endif
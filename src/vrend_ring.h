@@ -0,0 +1,104 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef VREND_RING_H
+#define VREND_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Ring of pointers handed from one thread to another without a lock.
+ * There must be a single producer calling vrend_ring_push and a single
+ * consumer calling vrend_ring_pop; each index is only written by its
+ * owner and published with release semantics.
+ */
+struct vrend_ring {
+   void **slots;
+   uint32_t mask;
+
+   /* written by the consumer */
+   uint32_t head __attribute__((aligned(64)));
+   /* written by the producer */
+   uint32_t tail __attribute__((aligned(64)));
+   /* pushes that found the ring full, producer side */
+   uint64_t full_count;
+};
+
+/* size must be a power of two */
+static inline bool vrend_ring_init(struct vrend_ring *ring, uint32_t size)
+{
+   ring->slots = calloc(size, sizeof(void *));
+   if (!ring->slots)
+      return false;
+   ring->mask = size - 1;
+   ring->head = 0;
+   ring->tail = 0;
+   ring->full_count = 0;
+   return true;
+}
+
+static inline void vrend_ring_fini(struct vrend_ring *ring)
+{
+   free(ring->slots);
+   ring->slots = NULL;
+}
+
+static inline bool vrend_ring_push(struct vrend_ring *ring, void *item)
+{
+   uint32_t tail = ring->tail;
+   uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+   if (tail - head > ring->mask) {
+      ring->full_count++;
+      return false;
+   }
+
+   ring->slots[tail & ring->mask] = item;
+   __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
+/* returns NULL when the ring is empty */
+static inline void *vrend_ring_pop(struct vrend_ring *ring)
+{
+   uint32_t head = ring->head;
+   uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+   void *item;
+
+   if (head == tail)
+      return NULL;
+
+   item = ring->slots[head & ring->mask];
+   __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+   return item;
+}
+
+/* consumer side */
+static inline bool vrend_ring_is_empty(struct vrend_ring *ring)
+{
+   return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif
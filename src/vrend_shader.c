@@ -21,10 +21,18 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  *
  **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include "tgsi/tgsi_info.h"
 #include "tgsi/tgsi_iterate.h"
+#include "tgsi/tgsi_parse.h"
 #include "tgsi/tgsi_scan.h"
+#include "os/os_thread.h"
+#include "util/u_debug.h"
+#include "util/u_double_list.h"
+#include "util/u_hash_table.h"
 #include "util/u_memory.h"
 #include "util/u_math.h"
 #include <string.h>
@@ -33,6 +41,8 @@
 #include <errno.h>
 #include "vrend_shader.h"
 #include "vrend_debug.h"
+#include "vrend_hash.h"
+#include "vrend_disk_cache.h"
 
 #include "vrend_strbuf.h"
 
@@ -5936,13 +5946,13 @@ static boolean analyze_instruction(struct tgsi_iterate_context *iter,
    return true;
 }
 
-bool vrend_convert_shader(struct vrend_context *rctx,
-			  struct vrend_shader_cfg *cfg,
-			  const struct tgsi_token *tokens,
-			  uint32_t req_local_mem,
-			  struct vrend_shader_key *key,
-			  struct vrend_shader_info *sinfo,
-                          struct vrend_strarray *shader)
+static bool convert_shader(struct vrend_context *rctx,
+                           struct vrend_shader_cfg *cfg,
+                           const struct tgsi_token *tokens,
+                           uint32_t req_local_mem,
+                           struct vrend_shader_key *key,
+                           struct vrend_shader_info *sinfo,
+                           struct vrend_strarray *shader)
 {
    struct dump_ctx ctx;
    boolean bret;
@@ -6219,3 +6229,505 @@ bool vrend_patch_vertex_shader_interpolants(struct vrend_context *rctx,
 
    return true;
 }
+
+/* Only the first num_prev_generic_and_patch_outputs entries of the layout
+ * array are read by the translator, so they are the only ones taken into
+ * account when hashing and comparing keys. */
+#define KEY_LAYOUT_START offsetof(struct vrend_shader_key, prev_stage_generic_and_patch_outputs_layout)
+#define KEY_LAYOUT_END   (KEY_LAYOUT_START + \
+                          sizeof(((struct vrend_shader_key *)0)->prev_stage_generic_and_patch_outputs_layout))
+
+static unsigned shader_key_num_layouts(const struct vrend_shader_key *key)
+{
+   return MIN2(key->num_prev_generic_and_patch_outputs,
+               ARRAY_SIZE(key->prev_stage_generic_and_patch_outputs_layout));
+}
+
+uint64_t vrend_shader_key_hash(const struct vrend_shader_key *key)
+{
+   const uint8_t *p = (const uint8_t *)key;
+   uint64_t hash = VREND_HASH_INIT;
+
+   hash = vrend_hash_data(hash, p, KEY_LAYOUT_START);
+   hash = vrend_hash_data(hash, key->prev_stage_generic_and_patch_outputs_layout,
+                          shader_key_num_layouts(key) * sizeof(struct vrend_layout_info));
+   return vrend_hash_data(hash, p + KEY_LAYOUT_END, sizeof(*key) - KEY_LAYOUT_END);
+}
+
+bool vrend_shader_key_equal(const struct vrend_shader_key *a,
+                            const struct vrend_shader_key *b)
+{
+   const uint8_t *pa = (const uint8_t *)a;
+   const uint8_t *pb = (const uint8_t *)b;
+
+   if (memcmp(pa, pb, KEY_LAYOUT_START) ||
+       memcmp(pa + KEY_LAYOUT_END, pb + KEY_LAYOUT_END, sizeof(*a) - KEY_LAYOUT_END))
+      return false;
+
+   return !memcmp(a->prev_stage_generic_and_patch_outputs_layout,
+                  b->prev_stage_generic_and_patch_outputs_layout,
+                  shader_key_num_layouts(a) * sizeof(struct vrend_layout_info));
+}
+
+/* Translation cache
+ *
+ * The GLSL emitted for a shader only depends on the TGSI tokens, the
+ * shader key, the shader config and the part of the shader info that is
+ * set when the selector is created, so identical shaders sent by different
+ * contexts are only translated once per process. The cache can optionally
+ * be backed by a disk cache that is shared between processes.
+ */
+
+#define SHADER_CACHE_VERSION 1
+
+struct shader_cache_entry {
+   struct vrend_disk_cache_key key;
+   struct list_head head;
+   uint8_t *data;
+   size_t size;
+};
+
+struct shader_cache_blob_header {
+   uint32_t num_strings;
+   uint32_t string_size[SHADER_MAX_STRINGS];
+   uint32_t has_interpinfo;
+   uint32_t num_so_names;
+   /* pointers are cleared, the arrays follow the strings */
+   struct vrend_shader_info sinfo;
+};
+
+struct shader_blob {
+   uint8_t *data;
+   size_t size;
+   size_t offset;
+};
+
+static struct {
+   bool inited;
+   pipe_mutex mutex;
+   struct util_hash_table *hash;
+   /* in least recently used order */
+   struct list_head lru;
+   size_t size;
+   size_t max_size;
+   struct vrend_disk_cache *disk;
+   struct vrend_shader_cache_stats stats;
+} shader_cache;
+
+static unsigned shader_cache_hash(void *key)
+{
+   return vrend_hash_fold(((struct vrend_disk_cache_key *)key)->hash[0]);
+}
+
+static int shader_cache_compare(void *key1, void *key2)
+{
+   return memcmp(key1, key2, sizeof(struct vrend_disk_cache_key));
+}
+
+static void shader_cache_entry_free(void *value)
+{
+   struct shader_cache_entry *entry = value;
+
+   free(entry->data);
+   FREE(entry);
+}
+
+void vrend_shader_cache_init(void)
+{
+   const char *path = getenv("VREND_SHADER_CACHE_DIR");
+
+   if (shader_cache.inited)
+      return;
+
+   shader_cache.hash = util_hash_table_create(shader_cache_hash,
+                                              shader_cache_compare,
+                                              shader_cache_entry_free);
+   if (!shader_cache.hash)
+      return;
+
+   pipe_mutex_init(shader_cache.mutex);
+   list_inithead(&shader_cache.lru);
+   shader_cache.max_size = debug_get_num_option("VREND_SHADER_CACHE_SIZE", 32) * 1024 * 1024;
+   if (path)
+      shader_cache.disk = vrend_disk_cache_create(path, "glsl", shader_cache.max_size);
+   memset(&shader_cache.stats, 0, sizeof(shader_cache.stats));
+   shader_cache.inited = true;
+}
+
+void vrend_shader_cache_fini(void)
+{
+   if (!shader_cache.inited)
+      return;
+
+   util_hash_table_destroy(shader_cache.hash);
+   vrend_disk_cache_destroy(shader_cache.disk);
+   pipe_mutex_destroy(shader_cache.mutex);
+   shader_cache.hash = NULL;
+   shader_cache.disk = NULL;
+   shader_cache.size = 0;
+   shader_cache.inited = false;
+}
+
+void vrend_shader_cache_get_stats(struct vrend_shader_cache_stats *stats)
+{
+   if (!shader_cache.inited) {
+      memset(stats, 0, sizeof(*stats));
+      return;
+   }
+
+   pipe_mutex_lock(shader_cache.mutex);
+   *stats = shader_cache.stats;
+   if (shader_cache.disk) {
+      struct vrend_disk_cache_stats disk_stats;
+      vrend_disk_cache_get_stats(shader_cache.disk, &disk_stats);
+      stats->disk_hits = disk_stats.hits;
+   }
+   pipe_mutex_unlock(shader_cache.mutex);
+}
+
+static void shader_cache_key_add_u32(struct vrend_disk_cache_key *key, uint32_t val)
+{
+   vrend_disk_cache_key_add(key, &val, sizeof(val));
+}
+
+static void shader_cache_build_key(struct vrend_disk_cache_key *key,
+                                   const struct vrend_shader_cfg *cfg,
+                                   const struct tgsi_token *tokens,
+                                   uint32_t req_local_mem,
+                                   const struct vrend_shader_key *shader_key,
+                                   const struct vrend_shader_info *sinfo)
+{
+   const struct pipe_stream_output_info *so = &sinfo->so_info;
+   unsigned num_layouts = MIN2(shader_key->num_prev_generic_and_patch_outputs,
+                               ARRAY_SIZE(shader_key->prev_stage_generic_and_patch_outputs_layout));
+
+   vrend_disk_cache_key_init(key);
+   /* the disk cache is shared with other builds */
+   vrend_disk_cache_key_add_str(key, PACKAGE_VERSION);
+   shader_cache_key_add_u32(key, SHADER_CACHE_VERSION);
+   shader_cache_key_add_u32(key, sizeof(struct vrend_shader_info));
+
+   vrend_disk_cache_key_add(key, tokens, tgsi_num_tokens(tokens) * sizeof(struct tgsi_token));
+
+   shader_cache_key_add_u32(key, cfg->glsl_version);
+   shader_cache_key_add_u32(key, cfg->max_draw_buffers);
+   shader_cache_key_add_u32(key, cfg->use_gles);
+   shader_cache_key_add_u32(key, cfg->use_core_profile);
+   shader_cache_key_add_u32(key, cfg->use_explicit_locations);
+   shader_cache_key_add_u32(key, cfg->has_arrays_of_arrays);
+   shader_cache_key_add_u32(key, req_local_mem);
+
+   vrend_disk_cache_key_add(key, shader_key,
+                            offsetof(struct vrend_shader_key, prev_stage_generic_and_patch_outputs_layout));
+   vrend_disk_cache_key_add(key, shader_key->prev_stage_generic_and_patch_outputs_layout,
+                            num_layouts * sizeof(struct vrend_layout_info));
+   vrend_disk_cache_key_add(key, &shader_key->prev_stage_num_clip_out,
+                            sizeof(*shader_key) -
+                            offsetof(struct vrend_shader_key, prev_stage_num_clip_out));
+
+   shader_cache_key_add_u32(key, so->num_outputs);
+   for (unsigned i = 0; i < PIPE_MAX_SO_BUFFERS; i++)
+      shader_cache_key_add_u32(key, so->stride[i]);
+   for (unsigned i = 0; i < so->num_outputs; i++) {
+      uint32_t out[7] = { so->output[i].register_index,
+                          so->output[i].start_component,
+                          so->output[i].num_components,
+                          so->output[i].output_buffer,
+                          so->output[i].dst_offset,
+                          so->output[i].stream,
+                          so->output[i].need_temp };
+      vrend_disk_cache_key_add(key, out, sizeof(out));
+   }
+
+   /* the translator only updates these when it finds indirect access */
+   shader_cache_key_add_u32(key, sinfo->num_indirect_generic_inputs);
+   shader_cache_key_add_u32(key, sinfo->num_indirect_patch_inputs);
+   shader_cache_key_add_u32(key, sinfo->num_indirect_generic_outputs);
+   shader_cache_key_add_u32(key, sinfo->num_indirect_patch_outputs);
+}
+
+static void blob_write(struct shader_blob *blob, const void *data, size_t size)
+{
+   if (blob->data)
+      memcpy(blob->data + blob->offset, data, size);
+   blob->offset += size;
+}
+
+static bool blob_read(struct shader_blob *blob, void *data, size_t size)
+{
+   if (size > blob->size - blob->offset)
+      return false;
+   memcpy(data, blob->data + blob->offset, size);
+   blob->offset += size;
+   return true;
+}
+
+static void shader_cache_write_blob(struct shader_blob *blob,
+                                    const struct vrend_shader_info *sinfo,
+                                    const struct vrend_strarray *shader,
+                                    bool has_interpinfo)
+{
+   struct shader_cache_blob_header hdr;
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.num_strings = shader->num_strings;
+   for (int i = 0; i < shader->num_strings; i++)
+      hdr.string_size[i] = shader->strings[i].size;
+   hdr.has_interpinfo = has_interpinfo;
+   hdr.num_so_names = sinfo->so_names ? sinfo->so_info.num_outputs : 0;
+   hdr.sinfo = *sinfo;
+   hdr.sinfo.sampler_arrays = NULL;
+   hdr.sinfo.image_arrays = NULL;
+   hdr.sinfo.interpinfo = NULL;
+   hdr.sinfo.so_names = NULL;
+   blob_write(blob, &hdr, sizeof(hdr));
+
+   for (int i = 0; i < shader->num_strings; i++)
+      blob_write(blob, shader->strings[i].buf, shader->strings[i].size);
+
+   if (has_interpinfo)
+      blob_write(blob, sinfo->interpinfo, sinfo->num_interps * sizeof(struct vrend_interp_info));
+   blob_write(blob, sinfo->sampler_arrays, sinfo->num_sampler_arrays * sizeof(struct vrend_array));
+   blob_write(blob, sinfo->image_arrays, sinfo->num_image_arrays * sizeof(struct vrend_array));
+
+   for (unsigned i = 0; i < hdr.num_so_names; i++) {
+      uint32_t len = sinfo->so_names[i] ? strlen(sinfo->so_names[i]) + 1 : 0;
+      blob_write(blob, &len, sizeof(len));
+      blob_write(blob, sinfo->so_names[i], len);
+   }
+}
+
+static void *read_array(struct shader_blob *blob, size_t size, bool *ok)
+{
+   void *data;
+
+   if (!size || !*ok)
+      return NULL;
+
+   data = malloc(size);
+   if (!data || !blob_read(blob, data, size)) {
+      free(data);
+      *ok = false;
+      return NULL;
+   }
+   return data;
+}
+
+/* Restore the translation results into sinfo and shader, mirroring what
+ * convert_shader does with the previous contents of sinfo. */
+static bool shader_cache_read_blob(struct shader_blob *blob,
+                                   struct vrend_shader_info *sinfo,
+                                   struct vrend_strarray *shader)
+{
+   struct shader_cache_blob_header hdr;
+   struct vrend_strbuf strings[SHADER_MAX_STRINGS];
+   struct vrend_interp_info *interpinfo;
+   struct vrend_array *sampler_arrays, *image_arrays;
+   char **so_names = NULL;
+   bool ok = true;
+   uint32_t i;
+
+   if (!blob_read(blob, &hdr, sizeof(hdr)) ||
+       hdr.num_strings > SHADER_MAX_STRINGS ||
+       hdr.num_so_names != (hdr.num_so_names ? sinfo->so_info.num_outputs : 0))
+      return false;
+
+   memset(strings, 0, sizeof(strings));
+   for (i = 0; i < hdr.num_strings && ok; i++) {
+      ok = strbuf_alloc(&strings[i], hdr.string_size[i] + 1) &&
+           blob_read(blob, strings[i].buf, hdr.string_size[i]);
+      if (ok) {
+         strings[i].buf[hdr.string_size[i]] = 0;
+         strings[i].size = hdr.string_size[i];
+      }
+   }
+
+   interpinfo = hdr.has_interpinfo ?
+      read_array(blob, hdr.sinfo.num_interps * sizeof(struct vrend_interp_info), &ok) : NULL;
+   sampler_arrays = read_array(blob, hdr.sinfo.num_sampler_arrays * sizeof(struct vrend_array), &ok);
+   image_arrays = read_array(blob, hdr.sinfo.num_image_arrays * sizeof(struct vrend_array), &ok);
+
+   if (ok && hdr.num_so_names) {
+      so_names = calloc(hdr.num_so_names, sizeof(char *));
+      ok = so_names != NULL;
+   }
+   for (i = 0; i < hdr.num_so_names && ok; i++) {
+      uint32_t len;
+      ok = blob_read(blob, &len, sizeof(len));
+      if (ok && len) {
+         so_names[i] = read_array(blob, len, &ok);
+         ok = ok && so_names[i][len - 1] == 0;
+      }
+   }
+
+   if (!ok) {
+      for (i = 0; i < SHADER_MAX_STRINGS; i++)
+         strbuf_free(&strings[i]);
+      free(interpinfo);
+      free(sampler_arrays);
+      free(image_arrays);
+      for (i = 0; so_names && i < hdr.num_so_names; i++)
+         free(so_names[i]);
+      free(so_names);
+      return false;
+   }
+
+   if (sinfo->so_names) {
+      for (i = 0; i < sinfo->so_info.num_outputs; i++)
+         free(sinfo->so_names[i]);
+      free(sinfo->so_names);
+   }
+   free(sinfo->sampler_arrays);
+   free(sinfo->image_arrays);
+   if (hdr.has_interpinfo)
+      free(sinfo->interpinfo);
+   else
+      interpinfo = sinfo->interpinfo;
+
+   hdr.sinfo.so_info = sinfo->so_info;
+   *sinfo = hdr.sinfo;
+   sinfo->interpinfo = interpinfo;
+   sinfo->sampler_arrays = sampler_arrays;
+   sinfo->image_arrays = image_arrays;
+   sinfo->so_names = so_names;
+
+   for (i = 0; i < hdr.num_strings; i++)
+      strarray_addstrbuf(shader, &strings[i]);
+   return true;
+}
+
+/* called with the cache mutex held */
+static void shader_cache_insert(const struct vrend_disk_cache_key *key,
+                                uint8_t *data, size_t size)
+{
+   struct shader_cache_entry *entry, *tmp;
+
+   if (size > shader_cache.max_size ||
+       util_hash_table_get(shader_cache.hash, (void *)key)) {
+      free(data);
+      return;
+   }
+
+   LIST_FOR_EACH_ENTRY_SAFE(entry, tmp, &shader_cache.lru, head) {
+      if (shader_cache.size + size <= shader_cache.max_size)
+         break;
+      shader_cache.size -= entry->size;
+      shader_cache.stats.evictions++;
+      list_del(&entry->head);
+      util_hash_table_remove(shader_cache.hash, &entry->key);
+   }
+
+   entry = CALLOC_STRUCT(shader_cache_entry);
+   if (!entry) {
+      free(data);
+      return;
+   }
+   entry->key = *key;
+   entry->data = data;
+   entry->size = size;
+   list_addtail(&entry->head, &shader_cache.lru);
+   util_hash_table_set(shader_cache.hash, &entry->key, entry);
+   shader_cache.size += size;
+}
+
+/* returns true and fills in sinfo and shader on a hit */
+static bool shader_cache_lookup(const struct vrend_disk_cache_key *key,
+                                struct vrend_shader_info *sinfo,
+                                struct vrend_strarray *shader)
+{
+   struct shader_cache_entry *entry;
+   struct shader_blob blob = { 0 };
+   bool hit = false;
+
+   pipe_mutex_lock(shader_cache.mutex);
+   entry = util_hash_table_get(shader_cache.hash, (void *)key);
+   if (entry) {
+      blob.data = entry->data;
+      blob.size = entry->size;
+      hit = shader_cache_read_blob(&blob, sinfo, shader);
+      list_del(&entry->head);
+      list_addtail(&entry->head, &shader_cache.lru);
+   }
+   if (hit)
+      shader_cache.stats.hits++;
+   pipe_mutex_unlock(shader_cache.mutex);
+
+   if (hit || !shader_cache.disk)
+      return hit;
+
+   blob.offset = 0;
+   blob.data = vrend_disk_cache_get(shader_cache.disk, key, &blob.size);
+   if (!blob.data)
+      return false;
+
+   hit = shader_cache_read_blob(&blob, sinfo, shader);
+   pipe_mutex_lock(shader_cache.mutex);
+   if (hit) {
+      shader_cache.stats.hits++;
+      shader_cache_insert(key, blob.data, blob.size);
+   } else
+      free(blob.data);
+   pipe_mutex_unlock(shader_cache.mutex);
+   return hit;
+}
+
+static void shader_cache_store(const struct vrend_disk_cache_key *key,
+                               const struct vrend_shader_info *sinfo,
+                               const struct vrend_strarray *shader,
+                               bool has_interpinfo)
+{
+   struct shader_blob blob = { 0 };
+
+   shader_cache_write_blob(&blob, sinfo, shader, has_interpinfo);
+   blob.size = blob.offset;
+   blob.offset = 0;
+   blob.data = malloc(blob.size);
+   if (!blob.data)
+      return;
+   shader_cache_write_blob(&blob, sinfo, shader, has_interpinfo);
+
+   if (shader_cache.disk)
+      vrend_disk_cache_put(shader_cache.disk, key, blob.data, blob.size);
+
+   pipe_mutex_lock(shader_cache.mutex);
+   shader_cache_insert(key, blob.data, blob.size);
+   pipe_mutex_unlock(shader_cache.mutex);
+}
+
+bool vrend_convert_shader(struct vrend_context *rctx,
+                          struct vrend_shader_cfg *cfg,
+                          const struct tgsi_token *tokens,
+                          uint32_t req_local_mem,
+                          struct vrend_shader_key *key,
+                          struct vrend_shader_info *sinfo,
+                          struct vrend_strarray *shader)
+{
+   struct vrend_disk_cache_key cache_key;
+   const struct tgsi_processor *proc = (const struct tgsi_processor *)&tokens[1];
+   bool ret;
+
+   if (!shader_cache.inited)
+      return convert_shader(rctx, cfg, tokens, req_local_mem, key, sinfo, shader);
+
+   shader_cache_build_key(&cache_key, cfg, tokens, req_local_mem, key, sinfo);
+   if (shader_cache_lookup(&cache_key, sinfo, shader)) {
+      VREND_DEBUG(dbg_shader_glsl, rctx, "GLSL (cached):");
+      VREND_DEBUG_EXT(dbg_shader_glsl, rctx, strarray_dump(shader));
+      VREND_DEBUG(dbg_shader_glsl, rctx, "\n");
+      return true;
+   }
+
+   pipe_mutex_lock(shader_cache.mutex);
+   shader_cache.stats.misses++;
+   pipe_mutex_unlock(shader_cache.mutex);
+
+   ret = convert_shader(rctx, cfg, tokens, req_local_mem, key, sinfo, shader);
+   if (ret) {
+      /* see fill_interpolants */
+      bool has_interpinfo = sinfo->num_interps &&
+                            proc->Processor != TGSI_PROCESSOR_VERTEX &&
+                            proc->Processor != TGSI_PROCESSOR_GEOMETRY;
+      shader_cache_store(&cache_key, sinfo, shader, has_interpinfo);
+   }
+   return ret;
+}
@@ -128,6 +128,13 @@ struct vrend_shader_cfg {
    bool has_arrays_of_arrays;
 };
 
+struct vrend_shader_cache_stats {
+   uint64_t hits;
+   uint64_t disk_hits;
+   uint64_t misses;
+   uint64_t evictions;
+};
+
 struct vrend_context;
 
 #define SHADER_MAX_STRINGS 3
@@ -154,4 +161,15 @@ const char *vrend_shader_samplertypeconv(bool use_gles, int sampler_type, int *i
 char vrend_shader_samplerreturnconv(enum tgsi_return_type type);
 
 int shader_lookup_sampler_array(struct vrend_shader_info *sinfo, int index);
+
+void vrend_shader_cache_init(void);
+
+void vrend_shader_cache_fini(void);
+
+void vrend_shader_cache_get_stats(struct vrend_shader_cache_stats *stats);
+
+uint64_t vrend_shader_key_hash(const struct vrend_shader_key *key);
+
+bool vrend_shader_key_equal(const struct vrend_shader_key *a,
+                            const struct vrend_shader_key *b);
 #endif
@@ -0,0 +1,543 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/* Decoder throughput benchmark.  vrend_decode.c is linked against the stubs
+ * below instead of the renderer, so only the command parsing is measured.
+ *
+ * usage: bench_decode [iterations] [stream]
+ *
+ * The stream is a file of raw command dwords as the guest would submit
+ * them, without it a synthetic stream of typical draw state is used.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vrend_renderer.h"
+#include "vrend_object.h"
+#include "virgl_protocol.h"
+
+static int dummy_ctx;
+
+int vrend_begin_query(struct vrend_context *ctx, uint32_t handle)
+{
+   return 0;
+}
+
+void vrend_bind_sampler_states(struct vrend_context *ctx,
+                               uint32_t shader_type,
+                               uint32_t start_slot,
+                               uint32_t num_states,
+                               uint32_t *handles)
+{
+}
+
+void vrend_bind_shader(struct vrend_context *ctx,
+                       uint32_t type,
+                       uint32_t handle)
+{
+}
+
+void vrend_bind_vertex_elements_state(struct vrend_context *ctx,
+                                      uint32_t handle)
+{
+}
+
+void vrend_clear(struct vrend_context *ctx,
+                 unsigned buffers,
+                 const union pipe_color_union *color,
+                 double depth, unsigned stencil)
+{
+}
+
+void vrend_context_set_debug_flags(struct vrend_context *ctx, const char *flags)
+{
+}
+
+struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *debug_name)
+{
+   return (struct vrend_context *)&dummy_ctx;
+}
+
+int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
+                       uint32_t query_type, uint32_t query_index,
+                       uint32_t res_handle, uint32_t offset)
+{
+   return 0;
+}
+
+int vrend_create_sampler_state(struct vrend_context *ctx,
+                               uint32_t handle,
+                               struct pipe_sampler_state *templ)
+{
+   return 0;
+}
+
+int vrend_create_sampler_view(struct vrend_context *ctx,
+                              uint32_t handle,
+                              uint32_t res_handle, uint32_t format,
+                              uint32_t val0, uint32_t val1, uint32_t swizzle_packed)
+{
+   return 0;
+}
+
+int vrend_create_shader(struct vrend_context *ctx,
+                        uint32_t handle,
+                        const struct pipe_stream_output_info *stream_output,
+                        uint32_t req_local_mem,
+                        const char *shd_text, uint32_t offlen, uint32_t num_tokens,
+                        uint32_t type, uint32_t pkt_length)
+{
+   return 0;
+}
+
+int vrend_create_so_target(struct vrend_context *ctx,
+                           uint32_t handle,
+                           uint32_t res_handle,
+                           uint32_t buffer_offset,
+                           uint32_t buffer_size)
+{
+   return 0;
+}
+
+int vrend_create_surface(struct vrend_context *ctx,
+                         uint32_t handle,
+                         uint32_t res_handle, uint32_t format,
+                         uint32_t val0, uint32_t val1)
+{
+   return 0;
+}
+
+int vrend_create_vertex_elements_state(struct vrend_context *ctx,
+                                       uint32_t handle,
+                                       unsigned num_elements,
+                                       const struct pipe_vertex_element *elements)
+{
+   return 0;
+}
+
+bool vrend_destroy_context(struct vrend_context *ctx)
+{
+   return false;
+}
+
+int vrend_draw_vbo(struct vrend_context *ctx,
+                   const struct pipe_draw_info *info,
+                   uint32_t cso, uint32_t indirect_handle, uint32_t indirect_draw_count_handle)
+{
+   return 0;
+}
+
+int vrend_end_query(struct vrend_context *ctx, uint32_t handle)
+{
+   return 0;
+}
+
+void vrend_get_query_result(struct vrend_context *ctx, uint32_t handle,
+                            uint32_t wait)
+{
+}
+
+void vrend_get_query_result_qbo(struct vrend_context *ctx, uint32_t handle,
+                                uint32_t qbo_handle,
+                                uint32_t wait, uint32_t result_type, uint32_t offset,
+                                int32_t index)
+{
+}
+
+bool vrend_hw_switch_context(struct vrend_context *ctx, bool now)
+{
+   return true;
+}
+
+void vrend_launch_grid(struct vrend_context *ctx,
+                       uint32_t *block,
+                       uint32_t *grid,
+                       uint32_t indirect_handle,
+                       uint32_t indirect_offset)
+{
+}
+
+void vrend_memory_barrier(struct vrend_context *ctx,
+                          unsigned flags)
+{
+}
+
+void vrend_object_bind_blend(struct vrend_context *ctx,
+                             uint32_t handle)
+{
+}
+
+void vrend_object_bind_dsa(struct vrend_context *ctx,
+                           uint32_t handle)
+{
+}
+
+void vrend_object_bind_rasterizer(struct vrend_context *ctx,
+                                  uint32_t handle)
+{
+}
+
+void vrend_render_condition(struct vrend_context *ctx,
+                            uint32_t handle,
+                            bool condtion,
+                            uint mode)
+{
+}
+
+void vrend_renderer_blit(struct vrend_context *ctx,
+                         uint32_t dst_handle, uint32_t src_handle,
+                         const struct pipe_blit_info *info)
+{
+}
+
+void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
+{
+}
+
+void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
+{
+}
+
+void vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle)
+{
+}
+
+uint32_t vrend_renderer_object_insert(struct vrend_context *ctx, void *data,
+                                      uint32_t size, uint32_t handle, enum virgl_object_type type)
+{
+   return handle;
+}
+
+void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
+                                         uint32_t dst_handle, uint32_t dst_level,
+                                         uint32_t dstx, uint32_t dsty, uint32_t dstz,
+                                         uint32_t src_handle, uint32_t src_level,
+                                         const struct pipe_box *src_box)
+{
+}
+
+void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
+{
+}
+
+int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info, int transfer_mode)
+{
+   return 0;
+}
+
+void vrend_report_buffer_error(struct vrend_context *ctx, int cmd)
+{
+}
+
+void vrend_set_blend_color(struct vrend_context *ctx, struct pipe_blend_color *color)
+{
+}
+
+void vrend_set_clip_state(struct vrend_context *ctx, struct pipe_clip_state *ucp)
+{
+}
+
+void vrend_set_constants(struct vrend_context *ctx,
+                         uint32_t shader,
+                         uint32_t index,
+                         uint32_t num_constant,
+                         float *data)
+{
+}
+
+void vrend_set_framebuffer_state(struct vrend_context *ctx,
+                                 uint32_t nr_cbufs, uint32_t surf_handle[PIPE_MAX_COLOR_BUFS],
+                                 uint32_t zsurf_handle)
+{
+}
+
+void vrend_set_framebuffer_state_no_attach(struct vrend_context *ctx,
+                                           uint32_t width, uint32_t height,
+                                           uint32_t layers, uint32_t samples)
+{
+}
+
+void vrend_set_index_buffer(struct vrend_context *ctx,
+                            uint32_t res_handle,
+                            uint32_t index_size,
+                            uint32_t offset)
+{
+}
+
+void vrend_set_min_samples(struct vrend_context *ctx, unsigned min_samples)
+{
+}
+
+void vrend_set_num_sampler_views(struct vrend_context *ctx,
+                                 uint32_t shader_type,
+                                 uint32_t start_slot,
+                                 uint32_t num_sampler_views)
+{
+}
+
+void vrend_set_num_vbo(struct vrend_context *ctx,
+                       int num_vbo)
+{
+}
+
+void vrend_set_polygon_stipple(struct vrend_context *ctx, struct pipe_poly_stipple *ps)
+{
+}
+
+void vrend_set_sample_mask(struct vrend_context *ctx, unsigned sample_mask)
+{
+}
+
+void vrend_set_scissor_state(struct vrend_context *ctx,
+                             uint32_t start_slot,
+                             uint32_t num_scissor,
+                             struct pipe_scissor_state *ss)
+{
+}
+
+void vrend_set_single_abo(struct vrend_context *ctx,
+                          uint32_t index,
+                          uint32_t offset, uint32_t length,
+                          uint32_t handle)
+{
+}
+
+void vrend_set_single_image_view(struct vrend_context *ctx,
+                                 uint32_t shader_type,
+                                 uint32_t index,
+                                 uint32_t format, uint32_t access,
+                                 uint32_t layer_offset, uint32_t level_size,
+                                 uint32_t handle)
+{
+}
+
+void vrend_set_single_sampler_view(struct vrend_context *ctx,
+                                   uint32_t shader_type,
+                                   uint32_t index,
+                                   uint32_t res_handle)
+{
+}
+
+void vrend_set_single_ssbo(struct vrend_context *ctx,
+                           uint32_t shader_type,
+                           uint32_t index,
+                           uint32_t offset, uint32_t length,
+                           uint32_t handle)
+{
+}
+
+void vrend_set_single_vbo(struct vrend_context *ctx,
+                          uint32_t index,
+                          uint32_t stride,
+                          uint32_t buffer_offset,
+                          uint32_t res_handle)
+{
+}
+
+void vrend_set_stencil_ref(struct vrend_context *ctx, struct pipe_stencil_ref *ref)
+{
+}
+
+void vrend_set_streamout_targets(struct vrend_context *ctx,
+                                 uint32_t append_bitmask,
+                                 uint32_t num_targets,
+                                 uint32_t *handles)
+{
+}
+
+void vrend_set_tess_state(struct vrend_context *ctx, const float tess_factors[6])
+{
+}
+
+void vrend_set_uniform_buffer(struct vrend_context *ctx, uint32_t shader,
+                              uint32_t index, uint32_t offset, uint32_t length,
+                              uint32_t res_handle)
+{
+}
+
+void vrend_set_viewport_states(struct vrend_context *ctx,
+                               uint32_t start_slot, uint32_t num_viewports,
+                               const struct pipe_viewport_state *state)
+{
+}
+
+void vrend_texture_barrier(struct vrend_context *ctx,
+                           unsigned flags)
+{
+}
+
+int vrend_transfer_inline_write(struct vrend_context *ctx,
+                                struct vrend_transfer_info *info,
+                                unsigned usage)
+{
+   return 0;
+}
+
+void vrend_print_context_name(struct vrend_context *ctx)
+{
+}
+
+unsigned vrend_context_has_debug_flag(struct vrend_context *ctx,
+                                      enum virgl_debug_flags flag)
+{
+   return 0;
+}
+
+static uint32_t *load_stream(const char *path, int *ndw)
+{
+   FILE *fp = fopen(path, "rb");
+   uint32_t *buf;
+   long size;
+
+   if (!fp)
+      return NULL;
+
+   fseek(fp, 0, SEEK_END);
+   size = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+
+   buf = malloc(size);
+   if (buf && fread(buf, 1, size, fp) != (size_t)size) {
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fp);
+
+   *ndw = size / sizeof(uint32_t);
+   return buf;
+}
+
+/* state changes and a draw, roughly what a guest sends per draw call */
+static uint32_t *build_stream(int draws, int *ndw)
+{
+   uint32_t *buf = calloc(draws, 128 * sizeof(uint32_t));
+   int i, j, n = 0;
+
+   if (!buf)
+      return NULL;
+
+   for (i = 0; i < draws; i++) {
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_BIND_OBJECT, VIRGL_OBJECT_BLEND, 1);
+      buf[n++] = 1;
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_BIND_OBJECT, VIRGL_OBJECT_DSA, 1);
+      buf[n++] = 2;
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_BIND_OBJECT, VIRGL_OBJECT_RASTERIZER, 1);
+      buf[n++] = 3;
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_BIND_SHADER, 0, VIRGL_BIND_SHADER_SIZE);
+      buf[n++] = 4;
+      buf[n++] = PIPE_SHADER_VERTEX;
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_BIND_SHADER, 0, VIRGL_BIND_SHADER_SIZE);
+      buf[n++] = 5;
+      buf[n++] = PIPE_SHADER_FRAGMENT;
+
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_SET_VERTEX_BUFFERS, 0, VIRGL_SET_VERTEX_BUFFERS_SIZE(2));
+      for (j = 0; j < 2; j++) {
+         buf[n++] = 16;
+         buf[n++] = 0;
+         buf[n++] = 6 + j;
+      }
+
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_SET_SAMPLER_VIEWS, 0, 2 + 2);
+      buf[n++] = PIPE_SHADER_FRAGMENT;
+      buf[n++] = 0;
+      buf[n++] = 8;
+      buf[n++] = 9;
+
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_SET_CONSTANT_BUFFER, 0, 2 + 16);
+      buf[n++] = PIPE_SHADER_VERTEX;
+      buf[n++] = 0;
+      for (j = 0; j < 16; j++)
+         buf[n++] = fui(j * 0.5f);
+
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_SET_SCISSOR_STATE, 0, VIRGL_SET_SCISSOR_STATE_SIZE(1));
+      buf[n++] = 0;
+      buf[n++] = 0;
+      buf[n++] = (768 << 16) | 1024;
+
+      buf[n++] = VIRGL_CMD0(VIRGL_CCMD_DRAW_VBO, 0, VIRGL_DRAW_VBO_SIZE);
+      buf[n++] = 0;
+      buf[n++] = 3 * (i + 1);
+      buf[n++] = PIPE_PRIM_TRIANGLES;
+      for (j = 0; j < VIRGL_DRAW_VBO_SIZE - 3; j++)
+         buf[n++] = 0;
+   }
+
+   *ndw = n;
+   return buf;
+}
+
+static uint64_t count_commands(const uint32_t *buf, int ndw)
+{
+   uint64_t count = 0;
+   int i = 0;
+
+   while (i < ndw) {
+      i += (buf[i] >> 16) + 1;
+      count++;
+   }
+   return count;
+}
+
+int main(int argc, char **argv)
+{
+   int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+   struct timespec start, end;
+   uint32_t *buf;
+   uint64_t num_cmds;
+   double secs;
+   int ndw, i;
+
+   if (argc > 2)
+      buf = load_stream(argv[2], &ndw);
+   else
+      buf = build_stream(64, &ndw);
+   if (!buf) {
+      fprintf(stderr, "failed to set up command stream\n");
+      return 1;
+   }
+
+   vrend_renderer_context_create_internal(0, strlen("BENCH"), "BENCH");
+   num_cmds = count_commands(buf, ndw);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i = 0; i < iterations; i++) {
+      if (vrend_decode_block(0, buf, ndw)) {
+         fprintf(stderr, "decoding failed\n");
+         return 1;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("%d iterations of %llu commands (%d dwords) in %.3f s\n",
+          iterations, (unsigned long long)num_cmds, ndw, secs);
+   printf("%.0f commands/s, %.1f MB/s\n", num_cmds * iterations / secs,
+          ndw * sizeof(uint32_t) * iterations / secs / (1024 * 1024));
+
+   free(buf);
+   return 0;
+}
@@ -0,0 +1,132 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/* Fence round trip benchmark.  Creates fences in batches and waits until
+ * the last one of a batch is reported, the way a guest throttling its
+ * frames would.  With the sync thread the waiting is done on the poll fd,
+ * otherwise by polling the renderer.
+ *
+ * usage: bench_fence [iterations] [batch] [--no-thread]
+ */
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "virglrenderer.h"
+
+static uint32_t last_fence;
+static int cookie;
+
+static void bench_write_fence(void *data, uint32_t fence_id)
+{
+   (void)data;
+   last_fence = fence_id;
+}
+
+static struct virgl_renderer_callbacks bench_cbs = {
+   .version = 1,
+   .write_fence = bench_write_fence,
+};
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+   int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+   int batch = argc > 2 ? atoi(argv[2]) : 1;
+   int flags = VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_SURFACELESS;
+   uint64_t wakeups = 0;
+   uint32_t fence_id = 0;
+   double start, begin, latency, max_latency = 0, total_latency = 0, secs;
+   int poll_fd, i, j;
+
+   if (argc <= 3 || strcmp(argv[3], "--no-thread"))
+      flags |= VIRGL_RENDERER_THREAD_SYNC;
+   if (iterations <= 0 || batch <= 0) {
+      fprintf(stderr, "usage: %s [iterations] [batch] [--no-thread]\n", argv[0]);
+      return 1;
+   }
+
+   if (virgl_renderer_init(&cookie, flags, &bench_cbs)) {
+      fprintf(stderr, "failed to initialize the renderer\n");
+      return 1;
+   }
+   if (virgl_renderer_context_create(1, strlen("bench"), "bench")) {
+      fprintf(stderr, "failed to create a context\n");
+      return 1;
+   }
+   poll_fd = virgl_renderer_get_poll_fd();
+
+   start = now();
+   for (i = 0; i < iterations; i++) {
+      begin = now();
+      for (j = 0; j < batch; j++) {
+         if (virgl_renderer_create_fence(++fence_id, 1)) {
+            fprintf(stderr, "failed to create a fence\n");
+            return 1;
+         }
+      }
+
+      while (last_fence != fence_id) {
+         if (poll_fd >= 0) {
+            struct pollfd pfd = { .fd = poll_fd, .events = POLLIN };
+
+            if (poll(&pfd, 1, -1) < 0) {
+               perror("poll");
+               return 1;
+            }
+         } else {
+            nanosleep((struct timespec[]){{0, 20000}}, NULL);
+         }
+         wakeups++;
+         virgl_renderer_poll();
+      }
+
+      latency = now() - begin;
+      total_latency += latency;
+      if (latency > max_latency)
+         max_latency = latency;
+   }
+   secs = now() - start;
+
+   printf("%d batches of %d fences in %.3f s, %s\n", iterations, batch, secs,
+          poll_fd >= 0 ? "sync thread" : "polling");
+   printf("round trip: %.1f us avg, %.1f us max\n",
+          total_latency / iterations * 1e6, max_latency * 1e6);
+   printf("%.0f fences/s, %.0f wakeups/s, %.2f wakeups per fence\n",
+          (double)iterations * batch / secs, wakeups / secs,
+          (double)wakeups / ((double)iterations * batch));
+
+   virgl_renderer_context_destroy(1);
+   virgl_renderer_cleanup(&cookie);
+   return 0;
+}
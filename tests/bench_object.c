@@ -0,0 +1,159 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/* Object lookup benchmark.  Fills a context object table the way a guest
+ * does and times lookups in random order, once with the small handles
+ * guests hand out and once with handles past the dense range that take
+ * the hash fallback.  A plain util_hash_table is timed as a reference.
+ *
+ * usage: bench_object [objects] [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "util/u_hash_table.h"
+#include "util/u_pointer.h"
+#include "vrend_object.h"
+
+#define SPARSE_BASE (1u << 24)
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned hash_func(void *key)
+{
+   return (unsigned)(pointer_to_intptr(key) & 0xffffffff);
+}
+
+static int compare(void *key1, void *key2)
+{
+   return key1 < key2 ? -1 : key1 > key2 ? 1 : 0;
+}
+
+static void free_nothing(void *value)
+{
+   (void)value;
+}
+
+static uint32_t *make_order(int objects, int lookups)
+{
+   uint32_t *order = malloc(lookups * sizeof(*order));
+   int i;
+
+   if (!order)
+      return NULL;
+   srand(1);
+   for (i = 0; i < lookups; i++)
+      order[i] = 1 + rand() % objects;
+   return order;
+}
+
+static int bench_table(const char *name, uint32_t base, uint32_t stride,
+                       int objects, int lookups, const uint32_t *order)
+{
+   struct vrend_object_table *table = vrend_object_init_ctx_table();
+   int hits = 0;
+   double start, secs;
+   int i;
+
+   if (!table)
+      return 1;
+
+   for (i = 1; i <= objects; i++) {
+      /* no destroy callback is set, inserted data is freed on fini */
+      if (!vrend_object_insert(table, malloc(1), 1, base + i * stride,
+                               VIRGL_OBJECT_SAMPLER_VIEW))
+         return 1;
+   }
+
+   start = now();
+   for (i = 0; i < lookups; i++)
+      hits += vrend_object_lookup(table, base + order[i] * stride,
+                                  VIRGL_OBJECT_SAMPLER_VIEW) != NULL;
+   secs = now() - start;
+
+   printf("%-16s %8d objects: %6.2f ns/lookup\n", name, objects,
+          secs / lookups * 1e9);
+   vrend_object_fini_ctx_table(table);
+   return hits != lookups;
+}
+
+static int bench_hash(int objects, int lookups, const uint32_t *order)
+{
+   struct util_hash_table *hash;
+   int hits = 0;
+   double start, secs;
+   int i;
+
+   hash = util_hash_table_create(hash_func, compare, free_nothing);
+   if (!hash)
+      return 1;
+
+   for (i = 1; i <= objects; i++)
+      util_hash_table_set(hash, intptr_to_pointer(i), intptr_to_pointer(i));
+
+   start = now();
+   for (i = 0; i < lookups; i++)
+      hits += util_hash_table_get(hash, intptr_to_pointer(order[i])) != NULL;
+   secs = now() - start;
+
+   printf("%-16s %8d objects: %6.2f ns/lookup\n", "util_hash_table",
+          objects, secs / lookups * 1e9);
+   util_hash_table_destroy(hash);
+   return hits != lookups;
+}
+
+int main(int argc, char **argv)
+{
+   int objects = argc > 1 ? atoi(argv[1]) : 4096;
+   int lookups = argc > 2 ? atoi(argv[2]) : 10000000;
+   uint32_t *order;
+   int ret = 0;
+
+   if (objects <= 0 || lookups <= 0) {
+      fprintf(stderr, "usage: %s [objects] [lookups]\n", argv[0]);
+      return 1;
+   }
+
+   order = make_order(objects, lookups);
+   if (!order) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   ret |= bench_table("dense handles", 0, 1, objects, lookups, order);
+   ret |= bench_table("sparse handles", SPARSE_BASE, 7919, objects, lookups, order);
+   ret |= bench_hash(objects, lookups, order);
+
+   free(order);
+   if (ret)
+      fprintf(stderr, "lookups failed\n");
+   return ret;
+}
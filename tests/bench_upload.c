@@ -0,0 +1,164 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/* Texture upload throughput.  Writes the whole level 0 of 2D textures of a
+ * few sizes and formats from their backing, and waits for a fence at the
+ * end so the GPU side of the uploads is part of the time.  Compare runs
+ * with VREND_UPLOAD_RING_KB=0 to see uploads straight from guest memory.
+ *
+ * usage: bench_upload [MiB per case]
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "virglrenderer.h"
+#include "virgl_hw.h"
+#include "pipe/p_defines.h"
+
+static uint32_t last_fence;
+static int cookie;
+
+static void bench_write_fence(void *data, uint32_t fence_id)
+{
+   (void)data;
+   last_fence = fence_id;
+}
+
+static struct virgl_renderer_callbacks bench_cbs = {
+   .version = 1,
+   .write_fence = bench_write_fence,
+};
+
+static const struct {
+   enum virgl_formats format;
+   const char *name;
+   uint32_t cpp;
+} formats[] = {
+   { VIRGL_FORMAT_B8G8R8A8_UNORM, "B8G8R8A8_UNORM", 4 },
+   { VIRGL_FORMAT_R8_UNORM, "R8_UNORM", 1 },
+   { VIRGL_FORMAT_R16G16B16A16_FLOAT, "R16G16B16A16_FLOAT", 8 },
+};
+
+static const uint32_t sizes[] = { 64, 256, 1024, 2048 };
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wait_fence(uint32_t fence_id)
+{
+   virgl_renderer_create_fence(fence_id, 0);
+   while (last_fence != fence_id) {
+      nanosleep((struct timespec[]){{0, 20000}}, NULL);
+      virgl_renderer_poll();
+   }
+}
+
+int main(int argc, char **argv)
+{
+   uint64_t bytes_per_case = (argc > 1 ? atoi(argv[1]) : 256) * (uint64_t)(1 << 20);
+   int flags = VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_SURFACELESS;
+   uint32_t handle = 1, fence_id = 0;
+   unsigned f, s;
+
+   if (!bytes_per_case) {
+      fprintf(stderr, "usage: %s [MiB per case]\n", argv[0]);
+      return 1;
+   }
+   if (virgl_renderer_init(&cookie, flags, &bench_cbs)) {
+      fprintf(stderr, "failed to initialize the renderer\n");
+      return 1;
+   }
+
+   printf("%-20s %6s %10s %10s\n", "format", "size", "uploads", "MB/s");
+   for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+      for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+         struct virgl_renderer_resource_create_args args;
+         struct virgl_box box;
+         struct iovec iov;
+         uint32_t size = sizes[s];
+         uint64_t i, count;
+         double start, secs;
+
+         memset(&args, 0, sizeof(args));
+         args.handle = handle;
+         args.target = PIPE_TEXTURE_2D;
+         args.format = formats[f].format;
+         args.bind = VIRGL_BIND_SAMPLER_VIEW;
+         args.width = size;
+         args.height = size;
+         args.depth = 1;
+         args.array_size = 1;
+         if (virgl_renderer_resource_create(&args, NULL, 0)) {
+            fprintf(stderr, "failed to create a %s texture\n", formats[f].name);
+            return 1;
+         }
+
+         iov.iov_len = (size_t)size * size * formats[f].cpp;
+         iov.iov_base = malloc(iov.iov_len);
+         if (!iov.iov_base)
+            return 1;
+         memset(iov.iov_base, 0x5a, iov.iov_len);
+         virgl_renderer_resource_attach_iov(handle, &iov, 1);
+
+         box.x = box.y = box.z = 0;
+         box.w = box.h = size;
+         box.d = 1;
+
+         count = bytes_per_case / iov.iov_len;
+         if (count < 16)
+            count = 16;
+
+         /* first upload allocates the storage */
+         virgl_renderer_transfer_write_iov(handle, 0, 0, 0, 0, &box, 0, NULL, 0);
+         wait_fence(++fence_id);
+
+         start = now();
+         for (i = 0; i < count; i++)
+            virgl_renderer_transfer_write_iov(handle, 0, 0, 0, 0, &box, 0, NULL, 0);
+         wait_fence(++fence_id);
+         secs = now() - start;
+
+         printf("%-20s %6u %10" PRIu64 " %10.1f\n", formats[f].name, size, count,
+                count * iov.iov_len / secs / 1e6);
+
+         virgl_renderer_resource_detach_iov(handle, NULL, NULL);
+         virgl_renderer_resource_unref(handle);
+         free(iov.iov_base);
+         handle++;
+      }
+   }
+
+   virgl_renderer_cleanup(&cookie);
+   return 0;
+}
@@ -0,0 +1,380 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/* vtest server benchmark, compares the forking server with the multi
+ * client one.  Every client connects at the same time and measures how
+ * long it takes until it has the caps, then uploads a buffer, submits a
+ * command and waits for it to finish, in a loop.
+ *
+ * usage: bench_vtest server [clients] [iterations] [server options...]
+ *
+ * e.g. bench_vtest vtest/virgl_test_server 8 1000 --use-egl-surfaceless
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "pipe/p_defines.h"
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "vtest_protocol.h"
+
+#define BENCH_BUFFER_SIZE 4096
+#define BENCH_MAX_CLIENTS 256
+
+struct bench_client {
+   pthread_t thread;
+   const char *socket_path;
+   int iterations;
+   double setup_secs;
+   double run_secs;
+   int failed;
+};
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+   const char *ptr = buf;
+   ssize_t ret;
+
+   while (size) {
+      ret = write(fd, ptr, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return -1;
+      ptr += ret;
+      size -= ret;
+   }
+   return 0;
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+   char *ptr = buf;
+   ssize_t ret;
+
+   while (size) {
+      ret = read(fd, ptr, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return -1;
+      ptr += ret;
+      size -= ret;
+   }
+   return 0;
+}
+
+static int send_cmd(int fd, uint32_t cmd, uint32_t length,
+                    const void *payload, size_t size)
+{
+   uint32_t hdr[VTEST_HDR_SIZE];
+
+   hdr[VTEST_CMD_LEN] = length;
+   hdr[VTEST_CMD_ID] = cmd;
+   if (write_all(fd, hdr, sizeof(hdr)))
+      return -1;
+   return size ? write_all(fd, payload, size) : 0;
+}
+
+static int connect_server(const char *path)
+{
+   struct sockaddr_un un;
+   int fd;
+
+   fd = socket(PF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0)
+      return -1;
+
+   memset(&un, 0, sizeof(un));
+   un.sun_family = AF_UNIX;
+   snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+
+   if (connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/* connection up to the point a guest driver could start rendering */
+static int client_setup(int fd)
+{
+   static const char name[] = "bench_vtest";
+   uint32_t hdr[VTEST_HDR_SIZE];
+   char *caps;
+   int ret;
+
+   if (send_cmd(fd, VCMD_CREATE_RENDERER, sizeof(name), name, sizeof(name)) ||
+       send_cmd(fd, VCMD_GET_CAPS2, 0, NULL, 0) ||
+       read_all(fd, hdr, sizeof(hdr)) || hdr[VTEST_CMD_LEN] < 1)
+      return -1;
+
+   caps = malloc(hdr[VTEST_CMD_LEN] - 1);
+   if (!caps)
+      return -1;
+   ret = read_all(fd, caps, hdr[VTEST_CMD_LEN] - 1);
+   free(caps);
+   return ret;
+}
+
+static int client_create_buffer(int fd, uint32_t handle)
+{
+   uint32_t args[VCMD_RES_CREATE_SIZE] = {0};
+
+   args[VCMD_RES_CREATE_RES_HANDLE] = handle;
+   args[VCMD_RES_CREATE_TARGET] = PIPE_BUFFER;
+   args[VCMD_RES_CREATE_FORMAT] = VIRGL_FORMAT_R8_UNORM;
+   args[VCMD_RES_CREATE_BIND] = VIRGL_BIND_VERTEX_BUFFER;
+   args[VCMD_RES_CREATE_WIDTH] = BENCH_BUFFER_SIZE;
+   args[VCMD_RES_CREATE_HEIGHT] = 1;
+   args[VCMD_RES_CREATE_DEPTH] = 1;
+   args[VCMD_RES_CREATE_ARRAY_SIZE] = 1;
+   return send_cmd(fd, VCMD_RESOURCE_CREATE, VCMD_RES_CREATE_SIZE,
+                   args, sizeof(args));
+}
+
+static int client_frame(int fd, uint32_t handle, int i, char *data)
+{
+   uint32_t thdr[VCMD_TRANSFER_HDR_SIZE] = {0};
+   uint32_t cmd[1 + VIRGL_SET_BLEND_COLOR_SIZE];
+   uint32_t wait[VCMD_BUSY_WAIT_SIZE];
+   uint32_t reply[VTEST_HDR_SIZE + 1];
+   float color = (i % 256) / 255.0f;
+   int c;
+
+   memset(data, i, BENCH_BUFFER_SIZE);
+   thdr[VCMD_TRANSFER_RES_HANDLE] = handle;
+   thdr[VCMD_TRANSFER_WIDTH] = BENCH_BUFFER_SIZE;
+   thdr[VCMD_TRANSFER_HEIGHT] = 1;
+   thdr[VCMD_TRANSFER_DEPTH] = 1;
+   thdr[VCMD_TRANSFER_DATA_SIZE] = BENCH_BUFFER_SIZE;
+   if (send_cmd(fd, VCMD_TRANSFER_PUT, VCMD_TRANSFER_HDR_SIZE, thdr, sizeof(thdr)) ||
+       write_all(fd, data, BENCH_BUFFER_SIZE))
+      return -1;
+
+   cmd[0] = VIRGL_CMD0(VIRGL_CCMD_SET_BLEND_COLOR, 0, VIRGL_SET_BLEND_COLOR_SIZE);
+   for (c = 0; c < VIRGL_SET_BLEND_COLOR_SIZE; c++)
+      memcpy(&cmd[1 + c], &color, sizeof(color));
+   if (send_cmd(fd, VCMD_SUBMIT_CMD, sizeof(cmd) / 4, cmd, sizeof(cmd)))
+      return -1;
+
+   wait[VCMD_BUSY_WAIT_HANDLE] = handle;
+   wait[VCMD_BUSY_WAIT_FLAGS] = VCMD_BUSY_WAIT_FLAG_WAIT;
+   if (send_cmd(fd, VCMD_RESOURCE_BUSY_WAIT, VCMD_BUSY_WAIT_SIZE, wait, sizeof(wait)))
+      return -1;
+
+   return read_all(fd, reply, sizeof(reply));
+}
+
+static void *client_thread(void *arg)
+{
+   struct bench_client *client = arg;
+   uint32_t handle = 1;
+   char *data;
+   double start;
+   int fd, i;
+
+   client->failed = 1;
+
+   start = now();
+   fd = connect_server(client->socket_path);
+   if (fd < 0)
+      return NULL;
+   if (client_setup(fd))
+      goto out;
+   client->setup_secs = now() - start;
+
+   data = malloc(BENCH_BUFFER_SIZE);
+   if (!data || client_create_buffer(fd, handle)) {
+      free(data);
+      goto out;
+   }
+
+   start = now();
+   for (i = 0; i < client->iterations; i++) {
+      if (client_frame(fd, handle, i, data))
+         break;
+   }
+   client->run_secs = now() - start;
+   free(data);
+
+   if (i == client->iterations &&
+       !send_cmd(fd, VCMD_RESOURCE_UNREF, VCMD_RES_UNREF_SIZE,
+                 &handle, sizeof(handle)))
+      client->failed = 0;
+
+out:
+   close(fd);
+   return NULL;
+}
+
+static pid_t start_server(char **argv)
+{
+   pid_t pid = fork();
+
+   if (pid == 0) {
+      execv(argv[0], argv);
+      perror("failed to start the server");
+      _exit(1);
+   }
+   return pid;
+}
+
+static int wait_for_server(const char *path)
+{
+   int fd, i;
+
+   for (i = 0; i < 500; i++) {
+      fd = connect_server(path);
+      if (fd >= 0) {
+         /* the forking server serves this one and moves on */
+         close(fd);
+         return 0;
+      }
+      usleep(10000);
+   }
+   return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+   kill(pid, SIGTERM);
+   waitpid(pid, NULL, 0);
+}
+
+static int run(const char *mode, char **server_argv, const char *path,
+               int num_clients, int iterations)
+{
+   struct bench_client clients[BENCH_MAX_CLIENTS];
+   double setup_max = 0, setup_sum = 0, run_max = 0;
+   int failed = 0, i;
+   pid_t pid;
+
+   pid = start_server(server_argv);
+   if (pid < 0 || wait_for_server(path)) {
+      fprintf(stderr, "%s: server did not come up\n", mode);
+      if (pid > 0)
+         stop_server(pid);
+      return -1;
+   }
+
+   for (i = 0; i < num_clients; i++) {
+      clients[i].socket_path = path;
+      clients[i].iterations = iterations;
+      clients[i].setup_secs = 0;
+      clients[i].run_secs = 0;
+      pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+   }
+
+   for (i = 0; i < num_clients; i++) {
+      pthread_join(clients[i].thread, NULL);
+      failed += clients[i].failed;
+      setup_sum += clients[i].setup_secs;
+      if (clients[i].setup_secs > setup_max)
+         setup_max = clients[i].setup_secs;
+      if (clients[i].run_secs > run_max)
+         run_max = clients[i].run_secs;
+   }
+
+   stop_server(pid);
+
+   if (failed) {
+      fprintf(stderr, "%s: %d of %d clients failed\n", mode, failed, num_clients);
+      return -1;
+   }
+
+   printf("%-13s setup avg %.2f ms max %.2f ms, %.0f frames/s total\n", mode,
+          setup_sum / num_clients * 1000, setup_max * 1000,
+          num_clients * iterations / run_max);
+   return 0;
+}
+
+static void server_args(char **out, char **argv, int argc, char *path,
+                        char *threads)
+{
+   int n = 0, i;
+
+   out[n++] = argv[1];
+   out[n++] = "--socket-path";
+   out[n++] = path;
+   if (threads) {
+      out[n++] = "--multi-clients";
+      out[n++] = "--threads";
+      out[n++] = threads;
+   }
+   for (i = 4; i < argc; i++)
+      out[n++] = argv[i];
+   out[n] = NULL;
+}
+
+int main(int argc, char **argv)
+{
+   int num_clients = argc > 2 ? atoi(argv[2]) : 8;
+   int iterations = argc > 3 ? atoi(argv[3]) : 1000;
+   char path[64], threads[16];
+   char *server_argv[64];
+   int ret = 0;
+
+   if (argc < 2 || num_clients < 1 || num_clients > BENCH_MAX_CLIENTS ||
+       iterations < 1 || argc > 48) {
+      fprintf(stderr, "usage: %s server [clients] [iterations] [server options...]\n",
+              argv[0]);
+      return 1;
+   }
+
+   /* a dying server should fail the run, not kill it */
+   signal(SIGPIPE, SIG_IGN);
+
+   snprintf(path, sizeof(path), "/tmp/.bench_vtest.%d", (int)getpid());
+   snprintf(threads, sizeof(threads), "%d", num_clients < 4 ? num_clients : 4);
+
+   printf("%d clients, %d iterations of a %d byte upload, submit and wait\n",
+          num_clients, iterations, BENCH_BUFFER_SIZE);
+
+   server_args(server_argv, argv, argc, path, NULL);
+   ret |= run("fork", server_argv, path, num_clients, iterations);
+
+   server_args(server_argv, argv, argc, path, threads);
+   ret |= run("multi-clients", server_argv, path, num_clients, iterations);
+
+   unlink(path);
+   return ret ? 1 : 0;
+}
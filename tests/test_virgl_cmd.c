@@ -139,6 +139,92 @@ START_TEST(virgl_test_clear)
 }
 END_TEST 
 
+/* reads into the backing land once the resource is idle or a later fence
+ * was reported */
+START_TEST(virgl_test_clear_async_readback)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res;
+    struct virgl_surface surf;
+    struct pipe_framebuffer_state fb_state;
+    union pipe_color_union color;
+    struct virgl_box box;
+    uint32_t *ptr;
+    int saved_flags = context_flags;
+    int ret;
+    int i;
+
+    context_flags |= VIRGL_RENDERER_ASYNC_READBACK;
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    context_flags = saved_flags;
+    ck_assert_int_eq(ret, 0);
+
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, 50, 50);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+    memset(&surf, 0, sizeof(surf));
+    surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    surf.handle = 1;
+    surf.base.texture = &res.base;
+    virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf.base;
+    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+    color.f[0] = 0.0;
+    color.f[1] = 1.0;
+    color.f[2] = 0.0;
+    color.f[3] = 1.0;
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+    virgl_renderer_submit_cmd(ctx.cbuf->buf, ctx.ctx_id, ctx.cbuf->cdw);
+    ctx.cbuf->cdw = 0;
+
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = 5;
+    box.h = 1;
+    box.d = 1;
+    ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 50, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    while (virgl_renderer_resource_busy(res.handle)) {
+	virgl_renderer_poll();
+	nanosleep((struct timespec[]){{0, 50000}}, NULL);
+    }
+
+    ptr = res.iovs[0].iov_base;
+    for (i = 0; i < 5; i++)
+	ck_assert_int_eq(ptr[i], 0xff00ff00);
+
+    /* a fence created after the read covers it */
+    memset(ptr, 0, 5 * 4);
+    ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 50, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    testvirgl_reset_fence();
+    ret = virgl_renderer_create_fence(1, ctx.ctx_id);
+    ck_assert_int_eq(ret, 0);
+
+    do {
+	virgl_renderer_poll();
+	if (testvirgl_get_last_fence() >= 1)
+	    break;
+	nanosleep((struct timespec[]){{0, 50000}}, NULL);
+    } while(1);
+
+    for (i = 0; i < 5; i++)
+	ck_assert_int_eq(ptr[i], 0xff00ff00);
+
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+    testvirgl_destroy_backed_res(&res);
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 START_TEST(virgl_test_blit_simple)
 {
     struct virgl_context ctx;
@@ -230,6 +316,73 @@ START_TEST(virgl_test_blit_simple)
 }
 END_TEST
 
+/* resources used by a submit stay busy until a fence after it retires */
+START_TEST(virgl_test_resource_busy)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res, res2, res3;
+    struct pipe_box box;
+    int ret;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, 50, 50);
+    ck_assert_int_eq(ret, 0);
+    ret = testvirgl_create_backed_simple_2d_res(&res2, 2, 50, 50);
+    ck_assert_int_eq(ret, 0);
+    ret = testvirgl_create_backed_simple_2d_res(&res3, 3, 50, 50);
+    ck_assert_int_eq(ret, 0);
+
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res2.handle);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res3.handle);
+
+    ck_assert(!virgl_renderer_resource_busy(res.handle));
+    ck_assert(!virgl_renderer_resource_busy(res2.handle));
+
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.width = 10;
+    box.height = 10;
+    box.depth = 1;
+    virgl_encode_resource_copy_region(&ctx, &res2, 0, 0, 0, 0, &res, 0, &box);
+    virgl_renderer_submit_cmd(ctx.cbuf->buf, ctx.ctx_id, ctx.cbuf->cdw);
+
+    ck_assert(virgl_renderer_resource_busy(res.handle));
+    ck_assert(virgl_renderer_resource_busy(res2.handle));
+    ck_assert(!virgl_renderer_resource_busy(res3.handle));
+
+    testvirgl_reset_fence();
+    ret = virgl_renderer_create_fence(1, ctx.ctx_id);
+    ck_assert_int_eq(ret, 0);
+
+    do {
+	int fence;
+
+	virgl_renderer_poll();
+	fence = testvirgl_get_last_fence();
+	if (fence >= 1)
+	    break;
+	nanosleep((struct timespec[]){{0, 50000}}, NULL);
+    } while(1);
+
+    ck_assert(!virgl_renderer_resource_busy(res.handle));
+    ck_assert(!virgl_renderer_resource_busy(res2.handle));
+
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res3.handle);
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res2.handle);
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+    testvirgl_destroy_backed_res(&res);
+    testvirgl_destroy_backed_res(&res2);
+    testvirgl_destroy_backed_res(&res3);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 struct vertex {
    float position[4];
    float color[4];
@@ -1022,7 +1175,9 @@ static Suite *virgl_init_suite(void)
   s = suite_create("virgl_clear");
   tc_core = tcase_create("clear");
   tcase_add_test(tc_core, virgl_test_clear);
+  tcase_add_test(tc_core, virgl_test_clear_async_readback);
   tcase_add_test(tc_core, virgl_test_blit_simple);
+  tcase_add_test(tc_core, virgl_test_resource_busy);
   tcase_add_test(tc_core, virgl_test_overlap_obj_id);
   tcase_add_test(tc_core, virgl_test_large_shader);
   tcase_add_test(tc_core, virgl_test_render_simple);
@@ -30,6 +30,7 @@
 #include <check.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <virglrenderer.h>
 #include <gbm.h>
 #include <sys/uio.h>
@@ -253,6 +254,51 @@ START_TEST(virgl_init_egl_create_ctx_reset)
 }
 END_TEST
 
+static uint32_t ctx_fences[3];
+
+static void test_write_context_fence(UNUSED void *cookie, uint32_t ctx_id,
+                                     uint32_t fence_id)
+{
+  ck_assert(ctx_id < 3);
+  ctx_fences[ctx_id] = fence_id;
+}
+
+/* with the v3 callback every context reports its own fences */
+START_TEST(virgl_init_egl_context_fences)
+{
+  struct virgl_renderer_callbacks cbs;
+  int ret;
+
+  memset(&cbs, 0, sizeof(cbs));
+  cbs.version = 3;
+  cbs.write_context_fence = test_write_context_fence;
+  ret = virgl_renderer_init(&mystruct, context_flags, &cbs);
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_context_create(1, strlen("test1"), "test1");
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_context_create(2, strlen("test2"), "test2");
+  ck_assert_int_eq(ret, 0);
+
+  memset(ctx_fences, 0, sizeof(ctx_fences));
+  ret = virgl_renderer_create_fence(5, 1);
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_create_fence(3, 2);
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_create_fence(6, 1);
+  ck_assert_int_eq(ret, 0);
+
+  while (ctx_fences[1] != 6 || ctx_fences[2] != 3) {
+    virgl_renderer_poll();
+    nanosleep((struct timespec[]){{0, 50000}}, NULL);
+  }
+  ck_assert_int_eq(ctx_fences[0], 0);
+
+  virgl_renderer_context_destroy(2);
+  virgl_renderer_context_destroy(1);
+  virgl_renderer_cleanup(&mystruct);
+}
+END_TEST
+
 START_TEST(virgl_init_get_caps_set0)
 {
   int ret;
@@ -461,6 +507,7 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_init_egl_destroy_ctx_illegal);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_leak);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_reset);
+  tcase_add_test(tc_core, virgl_init_egl_context_fences);
   tcase_add_test(tc_core, virgl_init_get_caps_set0);
   tcase_add_test(tc_core, virgl_init_get_caps_set1);
   tcase_add_test(tc_core, virgl_init_get_caps_null);
@@ -31,9 +31,12 @@
 #include <check.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <virglrenderer.h>
 #include "virgl_hw.h"
 #include "testvirgl.h"
+#include "testvirgl_encode.h"
 
 #include "pipe/p_defines.h"
 #include "pipe/p_format.h"
@@ -304,6 +307,159 @@ START_TEST(private_ptr)
 }
 END_TEST
 
+/* small buffers sharing a slab of the buffer heap keep their own contents */
+START_TEST(buffer_heap)
+{
+  struct virgl_renderer_resource_create_args args;
+  unsigned char data[50], out[50];
+  struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+  struct iovec out_iov = { .iov_base = out, .iov_len = sizeof(out) };
+  struct virgl_box box = { .w = 50, .h = 1, .d = 1 };
+  int ret, i, j;
+
+  setenv("VREND_BUFFER_HEAP_KB", "64", 1);
+  ret = testvirgl_init_single_ctx();
+  unsetenv("VREND_BUFFER_HEAP_KB");
+  ck_assert_int_eq(ret, 0);
+
+  for (i = 1; i <= 8; i++) {
+    testvirgl_init_simple_buffer(&args, i);
+    args.bind = i & 1 ? VIRGL_BIND_CONSTANT_BUFFER : VIRGL_BIND_INDEX_BUFFER;
+    ret = virgl_renderer_resource_create(&args, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(1, i);
+
+    memset(data, i, sizeof(data));
+    ret = virgl_renderer_transfer_write_iov(i, 1, 0, 0, 0, &box, 0, &iov, 1);
+    ck_assert_int_eq(ret, 0);
+  }
+
+  for (i = 1; i <= 8; i++) {
+    ret = virgl_renderer_transfer_read_iov(i, 1, 0, 0, 0, &box, 0, &out_iov, 1);
+    ck_assert_int_eq(ret, 0);
+    for (j = 0; j < 50; j++)
+      ck_assert_int_eq(out[j], i);
+    virgl_renderer_ctx_detach_resource(1, i);
+    virgl_renderer_resource_unref(i);
+  }
+
+  testvirgl_fini_single_ctx();
+}
+END_TEST
+
+/* buffers written before they are attached keep their contents when they
+ * move to the slabs of their context, and copies past the end of a buffer
+ * do not reach the buffer next to it */
+START_TEST(buffer_heap_copy_bounds)
+{
+  struct virgl_context ctx;
+  struct virgl_resource res[3];
+  unsigned char data[50], out[50];
+  struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+  struct iovec out_iov = { .iov_base = out, .iov_len = sizeof(out) };
+  struct virgl_box box = { .w = 50, .h = 1, .d = 1 };
+  struct pipe_box copy_box = { .width = 50, .height = 1, .depth = 1 };
+  int ret, i, j;
+
+  setenv("VREND_BUFFER_HEAP_KB", "64", 1);
+  ret = testvirgl_init_ctx_cmdbuf(&ctx);
+  unsetenv("VREND_BUFFER_HEAP_KB");
+  ck_assert_int_eq(ret, 0);
+
+  for (i = 0; i < 3; i++) {
+    ret = testvirgl_create_backed_simple_buffer(&res[i], i + 1, 50,
+                                                VIRGL_BIND_CONSTANT_BUFFER);
+    ck_assert_int_eq(ret, 0);
+
+    memset(data, i ? 0 : 0xaa, sizeof(data));
+    ret = virgl_renderer_transfer_write_iov(res[i].handle, 0, 0, 0, 0, &box, 0, &iov, 1);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res[i].handle);
+  }
+
+  /* the second copy is rejected, it would write into the third buffer */
+  virgl_encode_resource_copy_region(&ctx, &res[1], 0, 0, 0, 0, &res[0], 0, &copy_box);
+  copy_box.width = 50 + 256;
+  virgl_encode_resource_copy_region(&ctx, &res[1], 0, 0, 0, 0, &res[0], 0, &copy_box);
+  virgl_renderer_submit_cmd(ctx.cbuf->buf, ctx.ctx_id, ctx.cbuf->cdw);
+
+  for (i = 0; i < 3; i++) {
+    ret = virgl_renderer_transfer_read_iov(res[i].handle, ctx.ctx_id, 0, 0, 0, &box, 0, &out_iov, 1);
+    ck_assert_int_eq(ret, 0);
+    for (j = 0; j < 50; j++)
+      ck_assert_int_eq(out[j], i < 2 ? 0xaa : 0);
+  }
+
+  for (i = 0; i < 3; i++) {
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res[i].handle);
+    testvirgl_destroy_backed_res(&res[i]);
+  }
+  testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* a heap buffer attached to a second context moves to a GL buffer of its
+ * own and keeps its contents */
+START_TEST(buffer_heap_shared)
+{
+  struct virgl_renderer_resource_create_args args;
+  struct virgl_renderer_resource_info info[2];
+  unsigned char data[50], out[50];
+  struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+  struct iovec out_iov = { .iov_base = out, .iov_len = sizeof(out) };
+  struct virgl_box box = { .w = 50, .h = 1, .d = 1 };
+  bool same_slab;
+  int ret, i, j;
+
+  setenv("VREND_BUFFER_HEAP_KB", "64", 1);
+  ret = testvirgl_init_single_ctx();
+  unsetenv("VREND_BUFFER_HEAP_KB");
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_context_create(2, strlen("test2"), "test2");
+  ck_assert_int_eq(ret, 0);
+
+  for (i = 1; i <= 2; i++) {
+    testvirgl_init_simple_buffer(&args, i);
+    args.bind = VIRGL_BIND_VERTEX_BUFFER;
+    ret = virgl_renderer_resource_create(&args, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(1, i);
+
+    memset(data, i, sizeof(data));
+    ret = virgl_renderer_transfer_write_iov(i, 1, 0, 0, 0, &box, 0, &iov, 1);
+    ck_assert_int_eq(ret, 0);
+  }
+
+  for (i = 0; i < 2; i++) {
+    ret = virgl_renderer_resource_get_info(i + 1, &info[i]);
+    ck_assert_int_eq(ret, 0);
+  }
+  /* the host may not sub-allocate at all */
+  same_slab = info[0].tex_id == info[1].tex_id;
+
+  virgl_renderer_ctx_attach_resource(2, 1);
+  ret = virgl_renderer_resource_get_info(1, &info[0]);
+  ck_assert_int_eq(ret, 0);
+  if (same_slab)
+    ck_assert(info[0].tex_id != info[1].tex_id);
+
+  for (i = 1; i <= 2; i++) {
+    ret = virgl_renderer_transfer_read_iov(i, i == 1 ? 2 : 1, 0, 0, 0, &box, 0, &out_iov, 1);
+    ck_assert_int_eq(ret, 0);
+    for (j = 0; j < 50; j++)
+      ck_assert_int_eq(out[j], i);
+  }
+
+  virgl_renderer_ctx_detach_resource(2, 1);
+  for (i = 1; i <= 2; i++) {
+    virgl_renderer_ctx_detach_resource(1, i);
+    virgl_renderer_resource_unref(i);
+  }
+  virgl_renderer_context_destroy(2);
+  testvirgl_fini_single_ctx();
+}
+END_TEST
+
 static Suite *virgl_init_suite(void)
 {
   Suite *s;
@@ -315,6 +471,9 @@ static Suite *virgl_init_suite(void)
   tcase_add_loop_test(tc_core, virgl_res_tests, 0, ARRAY_SIZE(testlist));
   tcase_add_loop_test(tc_core, cubemaparray_res_tests, 0, ARRAY_SIZE(cubemaparray_testlist));
   tcase_add_test(tc_core, private_ptr);
+  tcase_add_test(tc_core, buffer_heap);
+  tcase_add_test(tc_core, buffer_heap_copy_bounds);
+  tcase_add_test(tc_core, buffer_heap_shared);
   suite_add_tcase(s, tc_core);
   return s;
 
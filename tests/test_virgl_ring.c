@@ -0,0 +1,206 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#include <check.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include "../src/vrend_ring.h"
+
+/* Test the ring the fences are handed to the sync thread with */
+
+#define STRESS_COUNT 1000000
+
+START_TEST(ring_push_pop)
+{
+   struct vrend_ring ring;
+   uintptr_t i;
+   bool ret;
+
+   ret = vrend_ring_init(&ring, 4);
+   ck_assert_int_eq(ret, true);
+   ck_assert_int_eq(vrend_ring_is_empty(&ring), true);
+   ck_assert_ptr_eq(vrend_ring_pop(&ring), NULL);
+
+   for (i = 1; i <= 4; i++)
+      ck_assert_int_eq(vrend_ring_push(&ring, (void *)i), true);
+   ck_assert_int_eq(vrend_ring_push(&ring, (void *)5), false);
+   ck_assert_int_eq(ring.full_count, 1);
+
+   for (i = 1; i <= 4; i++)
+      ck_assert_ptr_eq(vrend_ring_pop(&ring), (void *)i);
+   ck_assert_int_eq(vrend_ring_is_empty(&ring), true);
+   ck_assert_ptr_eq(vrend_ring_pop(&ring), NULL);
+   vrend_ring_fini(&ring);
+}
+END_TEST
+
+/* the indices wrap around the 32 bit range */
+START_TEST(ring_wrap)
+{
+   struct vrend_ring ring;
+   uintptr_t i;
+   bool ret;
+
+   ret = vrend_ring_init(&ring, 8);
+   ck_assert_int_eq(ret, true);
+   ring.head = ring.tail = UINT32_MAX - 3;
+
+   for (i = 1; i <= 8; i++)
+      ck_assert_int_eq(vrend_ring_push(&ring, (void *)i), true);
+   ck_assert_int_eq(vrend_ring_push(&ring, (void *)9), false);
+   for (i = 1; i <= 8; i++)
+      ck_assert_ptr_eq(vrend_ring_pop(&ring), (void *)i);
+   ck_assert_ptr_eq(vrend_ring_pop(&ring), NULL);
+   vrend_ring_fini(&ring);
+}
+END_TEST
+
+struct stress_fence {
+   uint32_t id;
+   bool signaled;
+};
+
+struct stress_state {
+   struct vrend_ring submit;
+   struct vrend_ring signaled;
+   uint64_t empty_polls;
+   uint32_t errors;
+};
+
+/* the sync thread side: take fences, signal them, hand them back */
+static void *stress_sync_thread(void *arg)
+{
+   struct stress_state *state = arg;
+   struct stress_fence *fence;
+   uint32_t expected = 1;
+
+   while (expected <= STRESS_COUNT) {
+      fence = vrend_ring_pop(&state->submit);
+      if (!fence) {
+         state->empty_polls++;
+         sched_yield();
+         continue;
+      }
+
+      if (fence->id != expected || fence->signaled)
+         state->errors++;
+      expected++;
+
+      fence->signaled = true;
+      while (!vrend_ring_push(&state->signaled, fence))
+         sched_yield();
+   }
+   return NULL;
+}
+
+/* create and collect fences from two threads as fast as possible, every
+ * fence has to come back once, in order and signaled */
+START_TEST(ring_fence_stress)
+{
+   struct stress_state state;
+   struct stress_fence *fence, *next = NULL;
+   pthread_t thread;
+   uint32_t next_id = 1, expected = 1;
+   bool progress;
+   int ret;
+
+   memset(&state, 0, sizeof(state));
+   ck_assert_int_eq(vrend_ring_init(&state.submit, 64), true);
+   ck_assert_int_eq(vrend_ring_init(&state.signaled, 64), true);
+
+   ret = pthread_create(&thread, NULL, stress_sync_thread, &state);
+   ck_assert_int_eq(ret, 0);
+
+   while (expected <= STRESS_COUNT) {
+      progress = false;
+
+      if (!next && next_id <= STRESS_COUNT) {
+         next = calloc(1, sizeof(*next));
+         ck_assert_ptr_ne(next, NULL);
+         next->id = next_id++;
+      }
+      if (next && vrend_ring_push(&state.submit, next)) {
+         next = NULL;
+         progress = true;
+      }
+
+      while ((fence = vrend_ring_pop(&state.signaled))) {
+         ck_assert_int_eq(fence->id, expected);
+         ck_assert_int_eq(fence->signaled, true);
+         expected++;
+         free(fence);
+         progress = true;
+      }
+
+      if (!progress)
+         sched_yield();
+   }
+
+   pthread_join(thread, NULL);
+   ck_assert_int_eq(state.errors, 0);
+   ck_assert_int_eq(vrend_ring_is_empty(&state.submit), true);
+   ck_assert_int_eq(vrend_ring_is_empty(&state.signaled), true);
+
+   printf("ring stress: submit ring full %llu times, signaled ring full %llu times, "
+          "%llu empty polls\n",
+          (unsigned long long)state.submit.full_count,
+          (unsigned long long)state.signaled.full_count,
+          (unsigned long long)state.empty_polls);
+
+   vrend_ring_fini(&state.submit);
+   vrend_ring_fini(&state.signaled);
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("vrend_ring");
+  tc_core = tcase_create("ring");
+  tcase_set_timeout(tc_core, 60);
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, ring_push_pop);
+  tcase_add_test(tc_core, ring_wrap);
+  tcase_add_test(tc_core, ring_fence_stress);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -25,6 +25,7 @@
 /* transfer and iov related tests */
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/uio.h>
 #include <errno.h>
 #include <virglrenderer.h>
@@ -320,6 +321,125 @@ START_TEST(virgl_test_transfer_1d)
 }
 END_TEST
 
+/* rows split between iovecs, the way guest pages split them */
+static void transfer_2d_split_iov(void)
+{
+    struct virgl_resource res;
+    unsigned char data[50*50*4], out[50*50*4];
+    const size_t write_split[] = { 1010, 4096, 3000, 1894 };
+    const size_t read_split[] = { 2048, 2048, 2048, 2048, 1808 };
+    struct iovec write_iovs[4], read_iovs[5];
+    struct virgl_box box;
+    size_t offset;
+    unsigned i;
+    int ret;
+
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, 50, 50);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(1, res.handle);
+
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = i * 7;
+    memset(out, 0, sizeof(out));
+
+    for (i = 0, offset = 0; i < 4; offset += write_split[i], i++) {
+        write_iovs[i].iov_base = data + offset;
+        write_iovs[i].iov_len = write_split[i];
+    }
+    for (i = 0, offset = 0; i < 5; offset += read_split[i], i++) {
+        read_iovs[i].iov_base = out + offset;
+        read_iovs[i].iov_len = read_split[i];
+    }
+
+    box.x = box.y = box.z = 0;
+    box.w = 50;
+    box.h = 50;
+    box.d = 1;
+    ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0, &box, 0, write_iovs, 4);
+    ck_assert_int_eq(ret, 0);
+    ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0, &box, 0, read_iovs, 5);
+    ck_assert_int_eq(ret, 0);
+
+    /* the X channel isn't kept */
+    for (i = 0; i < sizeof(data); i++) {
+        if (i % 4 != 3)
+            ck_assert_int_eq(out[i], data[i]);
+    }
+
+    virgl_renderer_ctx_detach_resource(1, res.handle);
+    testvirgl_destroy_backed_res(&res);
+}
+
+START_TEST(virgl_test_transfer_2d_split_iov)
+{
+    transfer_2d_split_iov();
+}
+END_TEST
+
+/* without the upload ring the rows inside one iovec go to GL directly */
+START_TEST(virgl_test_transfer_2d_split_iov_no_ring)
+{
+    int ret;
+
+    testvirgl_fini_single_ctx();
+    setenv("VREND_UPLOAD_RING_KB", "0", 1);
+    ret = testvirgl_init_single_ctx();
+    unsetenv("VREND_UPLOAD_RING_KB");
+    ck_assert_int_eq(ret, 0);
+
+    transfer_2d_split_iov();
+}
+END_TEST
+
+/* the storage of destroyed resources may be reused, but never with the
+ * old contents */
+START_TEST(virgl_test_transfer_recycled_res_cleared)
+{
+    struct virgl_renderer_resource_create_args args[2];
+    unsigned char data[50*50*4], out[50*50*4];
+    struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+    struct iovec out_iov = { .iov_base = out, .iov_len = sizeof(out) };
+    struct virgl_box box;
+    unsigned i, j;
+    int ret;
+
+    testvirgl_init_simple_buffer(&args[0], 1);
+    testvirgl_init_simple_2d_resource(&args[1], 1);
+
+    for (i = 0; i < 2; i++) {
+        box.x = box.y = box.z = 0;
+        box.w = args[i].width;
+        box.h = args[i].height;
+        box.d = 1;
+
+        for (j = 0; j < 2; j++) {
+            ret = virgl_renderer_resource_create(&args[i], NULL, 0);
+            ck_assert_int_eq(ret, 0);
+            virgl_renderer_ctx_attach_resource(1, args[i].handle);
+
+            if (j == 0) {
+                memset(data, 0xab, sizeof(data));
+                ret = virgl_renderer_transfer_write_iov(args[i].handle, 1, 0, 0, 0, &box, 0, &iov, 1);
+                ck_assert_int_eq(ret, 0);
+            } else {
+                memset(out, 0xcd, sizeof(out));
+                ret = virgl_renderer_transfer_read_iov(args[i].handle, 1, 0, 0, 0, &box, 0, &out_iov, 1);
+                ck_assert_int_eq(ret, 0);
+                for (unsigned k = 0; k < box.w * box.h * (i ? 4 : 1); k++) {
+                    /* the X channel isn't kept */
+                    if (i && k % 4 == 3)
+                        continue;
+                    ck_assert_int_eq(out[k], 0);
+                }
+            }
+
+            virgl_renderer_ctx_detach_resource(1, args[i].handle);
+            virgl_renderer_resource_unref(args[i].handle);
+        }
+    }
+}
+END_TEST
+
 START_TEST(virgl_test_transfer_1d_bad_iov)
 {
     struct virgl_renderer_resource_create_args res;
@@ -749,6 +869,9 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_test_transfer_read_1d_array_bad_box);
   tcase_add_test(tc_core, virgl_test_transfer_read_3d_bad_box);
   tcase_add_test(tc_core, virgl_test_transfer_1d);
+  tcase_add_test(tc_core, virgl_test_transfer_2d_split_iov);
+  tcase_add_test(tc_core, virgl_test_transfer_2d_split_iov_no_ring);
+  tcase_add_test(tc_core, virgl_test_transfer_recycled_res_cleared);
   tcase_add_test(tc_core, virgl_test_transfer_1d_bad_iov);
   tcase_add_test(tc_core, virgl_test_transfer_1d_bad_iov_offset);
   tcase_add_test(tc_core, virgl_test_transfer_1d_bad_layer_stride);
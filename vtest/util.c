@@ -49,3 +49,50 @@ int vtest_wait_for_fd_read(int fd)
 
    return -1;
 }
+
+int vtest_wait_for_fd_write(int fd)
+{
+   fd_set write_fds;
+
+   int ret;
+   FD_ZERO(&write_fds);
+   FD_SET(fd, &write_fds);
+
+   ret = select(fd + 1, NULL, &write_fds, NULL, NULL);
+   if (ret < 0) {
+      return ret;
+   }
+
+   if (FD_ISSET(fd, &write_fds)) {
+      return 0;
+   }
+
+   return -1;
+}
+
+int vtest_wait_for_fds_read(int fd, int other_fd)
+{
+   fd_set read_fds;
+
+   int ret;
+   FD_ZERO(&read_fds);
+   FD_SET(fd, &read_fds);
+   if (other_fd >= 0) {
+      FD_SET(other_fd, &read_fds);
+   }
+
+   ret = select((fd > other_fd ? fd : other_fd) + 1, &read_fds, NULL, NULL, NULL);
+   if (ret < 0) {
+      return ret;
+   }
+
+   if (FD_ISSET(fd, &read_fds)) {
+      return 0;
+   }
+
+   if (other_fd >= 0 && FD_ISSET(other_fd, &read_fds)) {
+      return 1;
+   }
+
+   return -1;
+}
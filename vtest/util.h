@@ -26,5 +26,9 @@
 #define VTEST_UTIL_H
 
 int vtest_wait_for_fd_read(int fd);
+/* for the non blocking fds of the multi client server */
+int vtest_wait_for_fd_write(int fd);
+/* returns 0 when fd is readable, 1 when only other_fd is, -1 on error */
+int vtest_wait_for_fds_read(int fd, int other_fd);
 
 #endif /* VTEST_UTIL_H */
@@ -0,0 +1,526 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/* Replays a trace written with VREND_CAPTURE_FILE against the host driver.
+ *
+ * Usage: virgl_replay [--use-glx] [--use-gles] [--per-command] [--loop N] file
+ *
+ * Fences mark frame boundaries: the replay waits for every fence it creates
+ * and reports frame times.  With --per-command each command buffer is split
+ * and submitted one command at a time, which gives the CPU time spent in
+ * the decoder and renderer for every opcode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "os/os_misc.h"
+#include "util/u_hash_table.h"
+#include "util/u_math.h"
+#include "util/u_memory.h"
+#include "util/u_pointer.h"
+#include "virglrenderer.h"
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "vrend_capture.h"
+
+struct replay_backing {
+   struct iovec iov;
+};
+
+struct replay_cmd_stats {
+   uint64_t count;
+   uint64_t total_ns;
+};
+
+static struct {
+   bool use_glx;
+   bool use_gles;
+   bool per_command;
+   int loops;
+
+   uint8_t *trace;
+   size_t trace_size;
+   uint64_t trace_duration_ns;
+
+   struct util_hash_table *backings;
+   uint32_t last_fence;
+
+   uint64_t frames;
+   uint64_t frame_start_ns;
+   uint64_t frame_min_ns;
+   uint64_t frame_max_ns;
+   uint64_t frame_total_ns;
+
+   struct replay_cmd_stats cmd_stats[VIRGL_MAX_COMMANDS];
+} replay;
+
+static void replay_write_fence(UNUSED void *cookie, uint32_t fence)
+{
+   replay.last_fence = fence;
+}
+
+static struct virgl_renderer_callbacks replay_cbs = {
+   .version = 1,
+   .write_fence = replay_write_fence,
+};
+
+static uint64_t replay_time(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned hash_handle(void *key)
+{
+   return (unsigned)(pointer_to_intptr(key) & 0xffffffff);
+}
+
+static int compare_handle(void *key1, void *key2)
+{
+   if (key1 < key2)
+      return -1;
+   else if (key1 > key2)
+      return 1;
+   return 0;
+}
+
+static void free_backing(void *value)
+{
+   struct replay_backing *backing = value;
+
+   free(backing->iov.iov_base);
+   FREE(backing);
+}
+
+static bool load_trace(const char *path)
+{
+   struct vrend_capture_header header;
+   struct stat st;
+   FILE *fp;
+
+   fp = fopen(path, "rb");
+   if (!fp) {
+      fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+      return false;
+   }
+
+   if (fstat(fileno(fp), &st) || st.st_size < (off_t)sizeof(header)) {
+      fprintf(stderr, "%s is not a capture file\n", path);
+      fclose(fp);
+      return false;
+   }
+
+   replay.trace_size = st.st_size;
+   replay.trace = malloc(replay.trace_size);
+   if (!replay.trace ||
+       fread(replay.trace, 1, replay.trace_size, fp) != replay.trace_size) {
+      fprintf(stderr, "failed to read %s\n", path);
+      fclose(fp);
+      return false;
+   }
+   fclose(fp);
+
+   memcpy(&header, replay.trace, sizeof(header));
+   if (header.magic != VREND_CAPTURE_MAGIC ||
+       header.version != VREND_CAPTURE_VERSION) {
+      fprintf(stderr, "%s: unsupported capture (magic 0x%08x version %u)\n",
+              path, header.magic, header.version);
+      return false;
+   }
+   return true;
+}
+
+static void replay_backing_detach(uint32_t handle)
+{
+   if (util_hash_table_get(replay.backings, intptr_to_pointer(handle)))
+      util_hash_table_remove(replay.backings, intptr_to_pointer(handle));
+}
+
+static int replay_attach_backing(const uint64_t *rec)
+{
+   struct replay_backing *backing;
+   uint32_t handle = (uint32_t)rec[0];
+
+   backing = CALLOC_STRUCT(replay_backing);
+   if (!backing)
+      return ENOMEM;
+
+   backing->iov.iov_len = rec[1];
+   backing->iov.iov_base = calloc(1, rec[1] ? rec[1] : 1);
+   if (!backing->iov.iov_base) {
+      FREE(backing);
+      return ENOMEM;
+   }
+
+   replay_backing_detach(handle);
+   util_hash_table_set(replay.backings, intptr_to_pointer(handle), backing);
+   return virgl_renderer_resource_attach_iov(handle, &backing->iov, 1);
+}
+
+static int replay_backing_data(const uint8_t *data, uint32_t size)
+{
+   struct replay_backing *backing;
+   uint32_t hdr[3];
+   uint64_t offset;
+
+   if (size < sizeof(hdr))
+      return EINVAL;
+   memcpy(hdr, data, sizeof(hdr));
+   offset = hdr[1] | ((uint64_t)hdr[2] << 32);
+   size -= sizeof(hdr);
+
+   backing = util_hash_table_get(replay.backings, intptr_to_pointer(hdr[0]));
+   if (!backing || offset > backing->iov.iov_len ||
+       size > backing->iov.iov_len - offset)
+      return EINVAL;
+
+   memcpy((uint8_t *)backing->iov.iov_base + offset, data + sizeof(hdr), size);
+   return 0;
+}
+
+static int replay_submit(uint32_t *buf, uint32_t ctx_id, uint32_t ndw)
+{
+   uint32_t i = 0;
+   int ret = 0;
+
+   if (!replay.per_command)
+      return virgl_renderer_submit_cmd(buf, ctx_id, ndw);
+
+   while (i < ndw && !ret) {
+      uint32_t header = buf[i];
+      uint32_t len = header >> 16;
+      uint32_t cmd = header & 0xff;
+      uint64_t start;
+
+      if (i + len + 1 > ndw)
+         return EINVAL;
+
+      start = replay_time();
+      ret = virgl_renderer_submit_cmd(buf + i, ctx_id, len + 1);
+      if (cmd < VIRGL_MAX_COMMANDS) {
+         replay.cmd_stats[cmd].count++;
+         replay.cmd_stats[cmd].total_ns += replay_time() - start;
+      }
+      i += len + 1;
+   }
+   return ret;
+}
+
+static int replay_transfer(const uint8_t *data, uint32_t size)
+{
+   struct vrend_capture_transfer rec;
+   struct virgl_box box;
+   struct iovec iov;
+   uint8_t *buf = NULL;
+   int ret;
+
+   if (size < sizeof(rec))
+      return EINVAL;
+   memcpy(&rec, data, sizeof(rec));
+
+   box.x = rec.box[0];
+   box.y = rec.box[1];
+   box.z = rec.box[2];
+   box.w = rec.box[3];
+   box.h = rec.box[4];
+   box.d = rec.box[5];
+
+   if (rec.user_iov) {
+      buf = calloc(1, rec.offset + rec.data_size + 1);
+      if (!buf)
+         return ENOMEM;
+      if (rec.direction == VIRGL_TRANSFER_TO_HOST) {
+         if (size - sizeof(rec) < rec.data_size) {
+            free(buf);
+            return EINVAL;
+         }
+         memcpy(buf + rec.offset, data + sizeof(rec), rec.data_size);
+      }
+      iov.iov_base = buf;
+      iov.iov_len = rec.offset + rec.data_size;
+   }
+
+   if (rec.direction == VIRGL_TRANSFER_TO_HOST)
+      ret = virgl_renderer_transfer_write_iov(rec.handle, rec.ctx_id, rec.level,
+                                              rec.stride, rec.layer_stride, &box,
+                                              rec.offset, buf ? &iov : NULL,
+                                              buf ? 1 : 0);
+   else
+      ret = virgl_renderer_transfer_read_iov(rec.handle, rec.ctx_id, rec.level,
+                                             rec.stride, rec.layer_stride, &box,
+                                             rec.offset, buf ? &iov : NULL,
+                                             buf ? 1 : 0);
+   free(buf);
+   return ret;
+}
+
+static int replay_fence(const uint32_t *rec)
+{
+   uint64_t now, frame_ns;
+   int ret;
+
+   ret = virgl_renderer_create_fence(rec[0], rec[1]);
+   if (ret)
+      return ret;
+
+   while (replay.last_fence < rec[0])
+      virgl_renderer_poll();
+
+   now = replay_time();
+   frame_ns = now - replay.frame_start_ns;
+   replay.frame_start_ns = now;
+
+   if (!replay.frames || frame_ns < replay.frame_min_ns)
+      replay.frame_min_ns = frame_ns;
+   if (frame_ns > replay.frame_max_ns)
+      replay.frame_max_ns = frame_ns;
+   replay.frame_total_ns += frame_ns;
+   replay.frames++;
+   return 0;
+}
+
+static int replay_record(uint32_t type, uint8_t *data, uint32_t size)
+{
+   struct virgl_renderer_resource_create_args args;
+   struct vrend_capture_resource res;
+   uint32_t dw[2] = { 0, 0 };
+   uint64_t qw[2];
+
+   memcpy(dw, data, MIN2(size, sizeof(dw)));
+
+   switch (type) {
+   case VREND_CAPTURE_CONTEXT_CREATE:
+      if (size < 4)
+         return EINVAL;
+      return virgl_renderer_context_create(dw[0], size - 4, (char *)data + 4);
+   case VREND_CAPTURE_CONTEXT_DESTROY:
+      virgl_renderer_context_destroy(dw[0]);
+      return 0;
+   case VREND_CAPTURE_RESOURCE_CREATE:
+      if (size < sizeof(res))
+         return EINVAL;
+      memcpy(&res, data, sizeof(res));
+      args.handle = res.handle;
+      args.target = res.target;
+      args.format = res.format;
+      args.bind = res.bind;
+      args.width = res.width;
+      args.height = res.height;
+      args.depth = res.depth;
+      args.array_size = res.array_size;
+      args.last_level = res.last_level;
+      args.nr_samples = res.nr_samples;
+      args.flags = res.flags;
+      return virgl_renderer_resource_create(&args, NULL, 0);
+   case VREND_CAPTURE_RESOURCE_UNREF:
+      virgl_renderer_resource_unref(dw[0]);
+      replay_backing_detach(dw[0]);
+      return 0;
+   case VREND_CAPTURE_ATTACH_BACKING:
+      if (size < sizeof(qw))
+         return EINVAL;
+      memcpy(qw, data, sizeof(qw));
+      return replay_attach_backing(qw);
+   case VREND_CAPTURE_DETACH_BACKING:
+      virgl_renderer_resource_detach_iov(dw[0], NULL, NULL);
+      replay_backing_detach(dw[0]);
+      return 0;
+   case VREND_CAPTURE_CTX_ATTACH_RESOURCE:
+      virgl_renderer_ctx_attach_resource(dw[0], dw[1]);
+      return 0;
+   case VREND_CAPTURE_CTX_DETACH_RESOURCE:
+      virgl_renderer_ctx_detach_resource(dw[0], dw[1]);
+      return 0;
+   case VREND_CAPTURE_CTX_ATTACH_RESOURCE_AS: {
+      uint32_t rec[3];
+
+      if (size < sizeof(rec))
+         return EINVAL;
+      memcpy(rec, data, sizeof(rec));
+      virgl_renderer_ctx_attach_resource_as(rec[0], rec[1], rec[2]);
+      return 0;
+   }
+   case VREND_CAPTURE_BACKING_DATA:
+      return replay_backing_data(data, size);
+   case VREND_CAPTURE_SUBMIT_CMD:
+      if (size < 4)
+         return EINVAL;
+      return replay_submit((uint32_t *)data + 1, dw[0], (size - 4) / 4);
+   case VREND_CAPTURE_TRANSFER:
+      return replay_transfer(data, size);
+   case VREND_CAPTURE_CREATE_FENCE:
+      if (size < sizeof(dw))
+         return EINVAL;
+      return replay_fence(dw);
+   default:
+      fprintf(stderr, "unknown record type %u\n", type);
+      return EINVAL;
+   }
+}
+
+static int replay_trace(void)
+{
+   size_t pos = sizeof(struct vrend_capture_header);
+   struct vrend_capture_record rec;
+   int ret;
+
+   while (pos + sizeof(rec) <= replay.trace_size) {
+      memcpy(&rec, replay.trace + pos, sizeof(rec));
+      pos += sizeof(rec);
+
+      if (rec.size > replay.trace_size - pos) {
+         fprintf(stderr, "truncated record at offset %zu\n", pos - sizeof(rec));
+         return EINVAL;
+      }
+
+      ret = replay_record(rec.type, replay.trace + pos, rec.size);
+      if (ret)
+         fprintf(stderr, "record type %u at offset %zu failed (%d)\n",
+                 rec.type, pos - sizeof(rec), ret);
+
+      replay.trace_duration_ns = rec.time_ns;
+      pos += align(rec.size, 8);
+   }
+   return 0;
+}
+
+static void print_stats(uint64_t total_ns)
+{
+   unsigned i;
+
+   printf("replayed %d time(s) in %.3f ms, captured run took %.3f ms\n",
+          replay.loops, total_ns / 1e6, replay.trace_duration_ns / 1e6);
+
+   if (replay.frames)
+      printf("%" PRIu64 " frames: min %.3f ms, avg %.3f ms, max %.3f ms\n",
+             replay.frames, replay.frame_min_ns / 1e6,
+             replay.frame_total_ns / 1e6 / replay.frames,
+             replay.frame_max_ns / 1e6);
+
+   if (!replay.per_command)
+      return;
+
+   printf("%6s %12s %12s %10s\n", "cmd", "count", "total ms", "avg us");
+   for (i = 0; i < VIRGL_MAX_COMMANDS; i++) {
+      const struct replay_cmd_stats *stats = &replay.cmd_stats[i];
+
+      if (!stats->count)
+         continue;
+      printf("%6u %12" PRIu64 " %12.3f %10.3f\n", i, stats->count,
+             stats->total_ns / 1e6, stats->total_ns / 1e3 / stats->count);
+   }
+}
+
+static void usage(const char *name)
+{
+   printf("Usage: %s [--use-glx] [--use-gles] [--per-command] [--loop N] file\n",
+          name);
+   exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+   static struct option long_options[] = {
+      {"use-glx",     no_argument,       NULL, 'x'},
+      {"use-gles",    no_argument,       NULL, 'e'},
+      {"per-command", no_argument,       NULL, 'c'},
+      {"loop",        required_argument, NULL, 'l'},
+      {0, 0, 0, 0}
+   };
+   uint64_t start, total_ns;
+   int flags, ret, i;
+
+   replay.loops = 1;
+
+   while ((ret = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (ret) {
+      case 'x':
+         replay.use_glx = true;
+         break;
+      case 'e':
+         replay.use_gles = true;
+         break;
+      case 'c':
+         replay.per_command = true;
+         break;
+      case 'l':
+         replay.loops = MAX2(atoi(optarg), 1);
+         break;
+      default:
+         usage(argv[0]);
+      }
+   }
+
+   if (optind != argc - 1)
+      usage(argv[0]);
+
+   if (!load_trace(argv[optind]))
+      return EXIT_FAILURE;
+
+   flags = replay.use_glx ? VIRGL_RENDERER_USE_GLX :
+           VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_SURFACELESS;
+   if (replay.use_gles)
+      flags |= VIRGL_RENDERER_USE_GLES;
+
+   ret = virgl_renderer_init(&replay, flags, &replay_cbs);
+   if (ret) {
+      fprintf(stderr, "failed to initialise renderer.\n");
+      return EXIT_FAILURE;
+   }
+
+   replay.backings = util_hash_table_create(hash_handle, compare_handle,
+                                            free_backing);
+
+   start = replay_time();
+   for (i = 0; i < replay.loops; i++) {
+      /* every pass recreates the contexts and resources it uses */
+      replay.last_fence = 0;
+      replay.frame_start_ns = replay_time();
+      ret = replay_trace();
+      virgl_renderer_reset();
+      util_hash_table_clear(replay.backings);
+      if (ret)
+         break;
+   }
+   total_ns = replay_time() - start;
+
+   print_stats(total_ns);
+
+   util_hash_table_destroy(replay.backings);
+   virgl_renderer_cleanup(&replay);
+   free(replay.trace);
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -26,32 +26,56 @@
 #define VTEST_H
 
 #include <errno.h>
+#include <stdint.h>
 
-int vtest_create_renderer(int in_fd, int out_fd, uint32_t length,
-                          int ctx_flags);
+struct vtest_context;
 
-int vtest_send_caps(uint32_t length_dw);
-int vtest_send_caps2(uint32_t length_dw);
-int vtest_create_resource(uint32_t length_dw);
-int vtest_create_resource2(uint32_t length_dw);
-int vtest_resource_unref(uint32_t length_dw);
-int vtest_submit_cmd(uint32_t length_dw);
+int vtest_init_renderer(int ctx_flags);
+void vtest_cleanup_renderer(void);
 
-int vtest_transfer_get(uint32_t length_dw);
-int vtest_transfer_get2(uint32_t length_dw);
-int vtest_transfer_put(uint32_t length_dw);
-int vtest_transfer_put2(uint32_t length_dw);
+/* One per client; all of these must be called from the thread that
+ * initialized the renderer. */
+struct vtest_context *vtest_new_context(int in_fd, int out_fd);
+void vtest_destroy_context(struct vtest_context *ctx);
+
+/* Makes the commands read their payload from data instead of in_fd, for
+ * servers that read whole messages ahead.  Pass NULL to read in_fd again. */
+void vtest_set_context_input(struct vtest_context *ctx, const void *data,
+                             uint32_t size);
+
+/* what the client and server agreed on with VCMD_PROTOCOL_VERSION */
+unsigned vtest_context_protocol_version(struct vtest_context *ctx);
+
+int vtest_dispatch_command(struct vtest_context *ctx, uint32_t cmd,
+                           uint32_t length_dw);
+
+int vtest_create_renderer(struct vtest_context *ctx, uint32_t length);
+
+int vtest_send_caps(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_send_caps2(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_create_resource(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_create_resource2(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_resource_unref(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_submit_cmd(struct vtest_context *ctx, uint32_t length_dw);
+
+int vtest_transfer_get(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_transfer_get2(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_transfer_put(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_transfer_put2(struct vtest_context *ctx, uint32_t length_dw);
 
 int vtest_block_read(int fd, void *buf, int size);
 
-int vtest_resource_busy_wait(uint32_t length_dw);
-int vtest_renderer_create_fence(void);
+int vtest_resource_busy_wait(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_renderer_create_fence(struct vtest_context *ctx);
+int vtest_fence_wait(struct vtest_context *ctx, uint32_t length_dw);
 int vtest_poll(void);
 
-int vtest_ping_protocol_version(uint32_t length_dw);
-int vtest_protocol_version(uint32_t length_dw);
+int vtest_ping_protocol_version(struct vtest_context *ctx, uint32_t length_dw);
+int vtest_protocol_version(struct vtest_context *ctx, uint32_t length_dw);
 
-void vtest_destroy_renderer(void);
+/* Serves every client from this process, see vtest_multi_server.c.
+ * Only returns on failure. */
+int vtest_run_multi_client_server(int socket, int num_threads);
 
 #endif
 
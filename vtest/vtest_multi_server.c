@@ -0,0 +1,597 @@
+/**************************************************************************
+ *
+ * Copyright (C) 2026 The virglrenderer Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/* Serves all clients from one process.
+ *
+ * The renderer and its GL contexts are bound to the thread that created
+ * them, so every command runs on the calling thread, driven by an epoll
+ * loop over the listening socket, the renderer poll fd and an eventfd.
+ * The worker threads only do the socket reads: each worker owns a set of
+ * non blocking clients, collects whatever they sent and queues each
+ * message for the renderer thread once it is complete, so a slow client
+ * never holds up the others of its worker.  Clients are armed one shot, a
+ * client is not read again until its previous message was executed, which
+ * keeps replies in order and lets the commands write to the socket
+ * directly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "os/os_thread.h"
+#include "util/u_double_list.h"
+#include "util/u_math.h"
+#include "util/u_memory.h"
+#include "vtest.h"
+#include "vtest_protocol.h"
+#include "virglrenderer.h"
+
+#define VTEST_MAX_THREADS 64
+#define VTEST_MAX_EVENTS 16
+
+/* bytes a worker reads off one client before serving the others */
+#define VTEST_READ_BUDGET (1024 * 1024)
+
+/* bigger messages are treated as a broken client */
+#define VTEST_MAX_MESSAGE_SIZE (256 * 1024 * 1024)
+
+struct vtest_worker {
+   pipe_thread thread;
+   int epoll_fd;
+};
+
+struct vtest_message {
+   struct list_head head;
+   struct vtest_client *client;
+   /* the client hung up or sent garbage */
+   bool disconnect;
+   uint32_t header[VTEST_HDR_SIZE];
+   uint32_t size;
+   char data[];
+};
+
+/* The client fds are non blocking, a worker reads what has arrived and
+ * keeps the partial message here until the rest comes in. */
+struct vtest_client {
+   struct list_head head;
+   int fd;
+   struct vtest_context *ctx;
+   struct vtest_worker *worker;
+   /* cached for the worker, which must not touch ctx */
+   unsigned protocol_version;
+
+   uint32_t header[VTEST_HDR_SIZE];
+   uint32_t header_read;
+   /* allocated once the header is in, msg->size is what is expected */
+   struct vtest_message *msg;
+   uint32_t data_read;
+   /* dword of the payload holding the size of trailing data, or -1 */
+   int data_size_dw;
+};
+
+static struct {
+   int event_fd;
+   /* signaled to stop the workers */
+   int quit_fd;
+   pipe_mutex lock;
+   /* messages waiting for the renderer thread */
+   struct list_head messages;
+
+   struct list_head clients;
+   struct vtest_worker workers[VTEST_MAX_THREADS];
+   int num_workers;
+   int next_worker;
+} server;
+
+/* Size of the payload following the header.  The transfer puts carry
+ * their data after a fixed size header, *data_size_dw is set to the dword
+ * of that header which holds the data size, or -1. */
+static int vtest_payload_size(const uint32_t header[VTEST_HDR_SIZE],
+                              unsigned protocol_version,
+                              uint32_t *size, int *data_size_dw)
+{
+   uint32_t length = header[VTEST_CMD_LEN];
+
+   *data_size_dw = -1;
+
+   switch (header[VTEST_CMD_ID]) {
+   case VCMD_GET_CAPS:
+   case VCMD_GET_CAPS2:
+   case VCMD_PING_PROTOCOL_VERSION:
+      *size = 0;
+      break;
+   case VCMD_CREATE_RENDERER:
+      /* the only command whose length is in bytes */
+      *size = length;
+      break;
+   case VCMD_SUBMIT_CMD:
+      if (length > VTEST_MAX_MESSAGE_SIZE / 4) {
+         return -1;
+      }
+      *size = length * 4;
+      break;
+   case VCMD_RESOURCE_CREATE:
+      *size = VCMD_RES_CREATE_SIZE * 4;
+      break;
+   case VCMD_RESOURCE_CREATE2:
+      *size = VCMD_RES_CREATE2_SIZE * 4;
+      break;
+   case VCMD_RESOURCE_UNREF:
+      *size = VCMD_RES_UNREF_SIZE * 4;
+      break;
+   case VCMD_TRANSFER_GET:
+      *size = VCMD_TRANSFER_HDR_SIZE * 4;
+      break;
+   case VCMD_TRANSFER_GET2:
+      *size = VCMD_TRANSFER2_HDR_SIZE * 4;
+      break;
+   case VCMD_TRANSFER_PUT:
+      *size = VCMD_TRANSFER_HDR_SIZE * 4;
+      *data_size_dw = VCMD_TRANSFER_DATA_SIZE;
+      break;
+   case VCMD_TRANSFER_PUT2:
+      *size = VCMD_TRANSFER2_HDR_SIZE * 4;
+      /* the data is in shared memory from version 2 on */
+      if (protocol_version < 2) {
+         *data_size_dw = VCMD_TRANSFER2_DATA_SIZE;
+      }
+      break;
+   case VCMD_RESOURCE_BUSY_WAIT:
+      *size = VCMD_BUSY_WAIT_SIZE * 4;
+      break;
+   case VCMD_PROTOCOL_VERSION:
+      *size = VCMD_PROTOCOL_VERSION_SIZE * 4;
+      break;
+   case VCMD_FENCE_WAIT:
+      *size = VCMD_FENCE_WAIT_SIZE * 4;
+      break;
+   default:
+      return -1;
+   }
+
+   return *size <= VTEST_MAX_MESSAGE_SIZE ? 0 : -1;
+}
+
+/* Reads up to size bytes into buf and adds them to *done.  Returns 1 once
+ * all came in, 0 if the client has nothing more for now and -1 if it hung
+ * up or failed. */
+static int vtest_read_some(int fd, void *buf, uint32_t size, uint32_t *done,
+                           uint32_t *budget)
+{
+   ssize_t ret;
+
+   while (*done < size) {
+      if (!*budget) {
+         return 0;
+      }
+
+      ret = read(fd, (char *)buf + *done, MIN2(size - *done, *budget));
+      if (ret < 0 && errno == EINTR) {
+         continue;
+      }
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         return 0;
+      }
+      if (ret <= 0) {
+         return -1;
+      }
+
+      *done += ret;
+      *budget -= ret;
+   }
+
+   return 1;
+}
+
+static void vtest_reset_client_input(struct vtest_client *client)
+{
+   client->header_read = 0;
+   client->msg = NULL;
+   client->data_read = 0;
+   client->data_size_dw = -1;
+}
+
+static void vtest_queue_message(struct vtest_message *msg)
+{
+   uint64_t one = 1;
+
+   pipe_mutex_lock(server.lock);
+   list_addtail(&msg->head, &server.messages);
+   pipe_mutex_unlock(server.lock);
+
+   if (write(server.event_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("failed to signal the renderer thread");
+   }
+}
+
+static void vtest_arm_client(struct vtest_client *client, int op)
+{
+   struct epoll_event ev;
+
+   ev.events = EPOLLIN | EPOLLONESHOT;
+   ev.data.ptr = client;
+   if (epoll_ctl(client->worker->epoll_fd, op, client->fd, &ev) < 0) {
+      perror("failed to arm client");
+   }
+}
+
+/* Reads whatever the client sent since the last call.  A complete
+ * message is queued for the renderer thread, which re-arms the client
+ * once it ran it, otherwise the client is re-armed for the rest. */
+static void vtest_read_client(struct vtest_client *client)
+{
+   struct vtest_message *msg;
+   uint32_t budget = VTEST_READ_BUDGET;
+   uint32_t size, data_size;
+   int ret;
+
+   if (!client->msg) {
+      ret = vtest_read_some(client->fd, client->header,
+                            sizeof(client->header), &client->header_read,
+                            &budget);
+      if (ret <= 0) {
+         goto partial;
+      }
+
+      if (vtest_payload_size(client->header, client->protocol_version,
+                             &size, &client->data_size_dw)) {
+         goto fail;
+      }
+
+      client->msg = malloc(sizeof(*client->msg) + size);
+      if (!client->msg) {
+         goto fail;
+      }
+      client->msg->size = size;
+   }
+
+   while (1) {
+      ret = vtest_read_some(client->fd, client->msg->data, client->msg->size,
+                            &client->data_read, &budget);
+      if (ret <= 0) {
+         goto partial;
+      }
+
+      if (client->data_size_dw < 0) {
+         break;
+      }
+
+      /* the header of a transfer put is in, now read its data */
+      size = client->msg->size;
+      memcpy(&data_size, client->msg->data + client->data_size_dw * 4, 4);
+      client->data_size_dw = -1;
+      if (data_size > VTEST_MAX_MESSAGE_SIZE - size) {
+         goto fail;
+      }
+
+      msg = realloc(client->msg, sizeof(*msg) + size + data_size);
+      if (!msg) {
+         goto fail;
+      }
+      client->msg = msg;
+      client->msg->size = size + data_size;
+   }
+
+   msg = client->msg;
+   msg->client = client;
+   msg->disconnect = false;
+   memcpy(msg->header, client->header, sizeof(client->header));
+   vtest_reset_client_input(client);
+   vtest_queue_message(msg);
+   return;
+
+partial:
+   if (ret == 0) {
+      vtest_arm_client(client, EPOLL_CTL_MOD);
+      return;
+   }
+fail:
+   free(client->msg);
+   vtest_reset_client_input(client);
+
+   msg = CALLOC_STRUCT(vtest_message);
+   if (!msg) {
+      /* can't tell the renderer thread, the client stays disarmed */
+      fprintf(stderr, "out of memory dropping client\n");
+      return;
+   }
+   msg->client = client;
+   msg->disconnect = true;
+   vtest_queue_message(msg);
+}
+
+static PIPE_THREAD_ROUTINE(vtest_worker_thread, arg)
+{
+   struct vtest_worker *worker = arg;
+   struct epoll_event events[VTEST_MAX_EVENTS];
+   int i, n;
+
+   while (1) {
+      n = epoll_wait(worker->epoll_fd, events, VTEST_MAX_EVENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("epoll_wait failed");
+         break;
+      }
+
+      for (i = 0; i < n; i++) {
+         /* the server is shutting down */
+         if (!events[i].data.ptr) {
+            return 0;
+         }
+         vtest_read_client(events[i].data.ptr);
+      }
+   }
+
+   return 0;
+}
+
+static void vtest_accept_client(int socket)
+{
+   struct vtest_client *client;
+   int fd;
+
+   fd = accept(socket, NULL, NULL);
+   if (fd < 0) {
+      perror("Failed to accept socket.");
+      return;
+   }
+
+   /* a worker must never sleep on one client while others wait */
+   if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+      perror("Failed to make the client non blocking.");
+      close(fd);
+      return;
+   }
+
+   client = CALLOC_STRUCT(vtest_client);
+   if (!client) {
+      close(fd);
+      return;
+   }
+
+   client->fd = fd;
+   vtest_reset_client_input(client);
+   client->ctx = vtest_new_context(fd, fd);
+   if (!client->ctx) {
+      FREE(client);
+      close(fd);
+      return;
+   }
+
+   client->worker = &server.workers[server.next_worker];
+   server.next_worker = (server.next_worker + 1) % server.num_workers;
+
+   list_addtail(&client->head, &server.clients);
+   vtest_arm_client(client, EPOLL_CTL_ADD);
+}
+
+static void vtest_remove_client(struct vtest_client *client)
+{
+   epoll_ctl(client->worker->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+   list_del(&client->head);
+
+   vtest_destroy_context(client->ctx);
+   close(client->fd);
+   free(client->msg);
+   FREE(client);
+}
+
+static void vtest_run_message(struct vtest_message *msg)
+{
+   struct vtest_client *client = msg->client;
+   int ret;
+
+   if (msg->disconnect) {
+      vtest_remove_client(client);
+      return;
+   }
+
+   vtest_set_context_input(client->ctx, msg->data, msg->size);
+   vtest_poll();
+   ret = vtest_dispatch_command(client->ctx, msg->header[VTEST_CMD_ID],
+                                msg->header[VTEST_CMD_LEN]);
+   vtest_set_context_input(client->ctx, NULL, 0);
+
+   if (ret < 0) {
+      fprintf(stderr, "client failed (%d) - closing its context\n", ret);
+      vtest_remove_client(client);
+      return;
+   }
+
+   client->protocol_version = vtest_context_protocol_version(client->ctx);
+   vtest_arm_client(client, EPOLL_CTL_MOD);
+}
+
+static void vtest_run_messages(void)
+{
+   struct list_head messages;
+   struct vtest_message *msg, *tmp;
+   uint64_t count;
+
+   if (read(server.event_fd, &count, sizeof(count)) != sizeof(count)) {
+      return;
+   }
+
+   list_inithead(&messages);
+   pipe_mutex_lock(server.lock);
+   if (!LIST_IS_EMPTY(&server.messages)) {
+      list_replace(&server.messages, &messages);
+      list_inithead(&server.messages);
+   }
+   pipe_mutex_unlock(server.lock);
+
+   LIST_FOR_EACH_ENTRY_SAFE(msg, tmp, &messages, head) {
+      list_del(&msg->head);
+      vtest_run_message(msg);
+      free(msg);
+   }
+}
+
+static int vtest_epoll_add(int epoll_fd, int fd)
+{
+   struct epoll_event ev;
+
+   ev.events = EPOLLIN;
+   ev.data.fd = fd;
+   return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void vtest_stop_workers(int num_started)
+{
+   uint64_t one = 1;
+   int i;
+
+   if (num_started &&
+       write(server.quit_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("failed to stop the workers");
+      return;
+   }
+
+   for (i = 0; i < num_started; i++) {
+      pipe_thread_wait(server.workers[i].thread);
+   }
+}
+
+int vtest_run_multi_client_server(int socket, int num_threads)
+{
+   struct epoll_event events[VTEST_MAX_EVENTS];
+   struct epoll_event quit_ev;
+   struct vtest_client *client, *tmp_client;
+   struct vtest_message *msg, *tmp_msg;
+   int epoll_fd, poll_fd;
+   int num_started = 0;
+   int i, n;
+
+   server.num_workers = MIN2(num_threads, VTEST_MAX_THREADS);
+   server.next_worker = 0;
+   list_inithead(&server.messages);
+   list_inithead(&server.clients);
+   pipe_mutex_init(server.lock);
+   for (i = 0; i < server.num_workers; i++) {
+      server.workers[i].epoll_fd = -1;
+   }
+
+   server.event_fd = eventfd(0, EFD_CLOEXEC);
+   server.quit_fd = eventfd(0, EFD_CLOEXEC);
+   epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (server.event_fd < 0 || server.quit_fd < 0 || epoll_fd < 0) {
+      perror("Failed to setup the event loop.");
+      goto out;
+   }
+
+   poll_fd = virgl_renderer_get_poll_fd();
+   if (vtest_epoll_add(epoll_fd, socket) < 0 ||
+       vtest_epoll_add(epoll_fd, server.event_fd) < 0 ||
+       (poll_fd != -1 && vtest_epoll_add(epoll_fd, poll_fd) < 0)) {
+      perror("Failed to setup the event loop.");
+      goto out;
+   }
+
+   quit_ev.events = EPOLLIN;
+   quit_ev.data.ptr = NULL;
+   for (i = 0; i < server.num_workers; i++) {
+      server.workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      if (server.workers[i].epoll_fd < 0 ||
+          epoll_ctl(server.workers[i].epoll_fd, EPOLL_CTL_ADD,
+                    server.quit_fd, &quit_ev) < 0) {
+         perror("Failed to setup a worker.");
+         goto out;
+      }
+      server.workers[i].thread = pipe_thread_create(vtest_worker_thread,
+                                                    &server.workers[i]);
+      if (!server.workers[i].thread) {
+         fprintf(stderr, "Failed to start a worker.\n");
+         goto out;
+      }
+      num_started++;
+   }
+
+   printf("%s: serving clients with %d threads.\n", __func__,
+          server.num_workers);
+
+   while (1) {
+      n = epoll_wait(epoll_fd, events, VTEST_MAX_EVENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("epoll_wait failed");
+         break;
+      }
+
+      for (i = 0; i < n; i++) {
+         if (events[i].data.fd == socket) {
+            vtest_accept_client(socket);
+         } else if (events[i].data.fd == server.event_fd) {
+            vtest_run_messages();
+         } else {
+            vtest_poll();
+         }
+      }
+   }
+
+out:
+   vtest_stop_workers(num_started);
+
+   LIST_FOR_EACH_ENTRY_SAFE(msg, tmp_msg, &server.messages, head) {
+      list_del(&msg->head);
+      free(msg);
+   }
+   LIST_FOR_EACH_ENTRY_SAFE(client, tmp_client, &server.clients, head) {
+      vtest_remove_client(client);
+   }
+
+   for (i = 0; i < server.num_workers; i++) {
+      if (server.workers[i].epoll_fd >= 0) {
+         close(server.workers[i].epoll_fd);
+      }
+   }
+   if (epoll_fd >= 0) {
+      close(epoll_fd);
+   }
+   if (server.quit_fd >= 0) {
+      close(server.quit_fd);
+   }
+   if (server.event_fd >= 0) {
+      close(server.event_fd);
+   }
+   pipe_mutex_destroy(server.lock);
+
+   /* the loop only ends when the event loop broke */
+   return -1;
+}
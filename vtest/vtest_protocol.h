@@ -26,7 +26,22 @@
 #define VTEST_PROTOCOL
 
 #define VTEST_DEFAULT_SOCKET_NAME "/tmp/.virgl_test"
-#define VTEST_PROTOCOL_VERSION 1
+/* Version 2 shares resource backings with the client: the server replies
+ * to VCMD_RESOURCE_CREATE2 by passing a memfd of the requested size with
+ * SCM_RIGHTS (along with a single byte of data).  VCMD_TRANSFER_PUT2 then
+ * carries no data, the client writes to the mapping before sending it, and
+ * VCMD_TRANSFER_GET2 sends no data back, the mapping holds the result once
+ * a VCMD_RESOURCE_BUSY_WAIT sent after it returns.
+ */
+/* Version 3 pipelines submits.  Each VCMD_SUBMIT_CMD is answered with a
+ * VCMD_SUBMIT_CMD reply carrying the fence sequence number of the submit,
+ * numbered from 1 per context.  Whenever fences signal the server pushes
+ * an unsolicited VCMD_FENCE_SIGNALED with the newest signaled sequence
+ * number, older ones are signaled too.  VCMD_FENCE_WAIT with the wait flag
+ * is answered once the fence signaled, without stalling the server.  As
+ * these arrive between other replies, clients dispatch on the reply id.
+ */
+#define VTEST_PROTOCOL_VERSION 3
 
 /* 32-bit length field */
 /* 32-bit cmd field */
@@ -64,6 +79,11 @@
 #define VCMD_TRANSFER_GET2 13
 #define VCMD_TRANSFER_PUT2 14
 
+/* protocol version 3 */
+#define VCMD_FENCE_WAIT 15
+/* server to client only, 1 dword: sequence number */
+#define VCMD_FENCE_SIGNALED 16
+
 #define VCMD_RES_CREATE_SIZE 10
 #define VCMD_RES_CREATE_RES_HANDLE 0
 #define VCMD_RES_CREATE_TARGET 1
@@ -128,4 +148,11 @@
 #define VCMD_PROTOCOL_VERSION_SIZE 1
 #define VCMD_PROTOCOL_VERSION_VERSION 0
 
+/* reply is 1 dword: 1 when signaled */
+#define VCMD_FENCE_WAIT_FLAG_WAIT 1
+
+#define VCMD_FENCE_WAIT_SIZE 2
+#define VCMD_FENCE_WAIT_SEQNO 0
+#define VCMD_FENCE_WAIT_FLAGS 1
+
 #endif
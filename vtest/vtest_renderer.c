@@ -22,6 +22,10 @@
  *
  **************************************************************************/
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,6 +37,8 @@
 #include "virglrenderer.h"
 
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include "vtest.h"
 #include "vtest_protocol.h"
 #include "util.h"
@@ -40,31 +46,88 @@
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "util/u_hash_table.h"
+#include "util/u_double_list.h"
 
 
-static int ctx_id = 1;
-static int fence_id = 1;
+/* the renderer rejects context ids of 64 and above, 0 is its own */
+#define VTEST_MAX_CONTEXTS 64
 
-static int last_fence;
-static void vtest_write_fence(UNUSED void *cookie, uint32_t fence_id_in)
-{
-   last_fence = fence_id_in;
-}
+struct vtest_renderer {
+   bool initialized;
+   /* bit n is set while context id n is in use */
+   uint64_t ctx_ids;
+   uint32_t next_res_handle;
+   /* handles of unreferenced resources, handed out again before new ones
+    * so the handle space stays as small as the live resources */
+   uint32_t *free_handles;
+   uint32_t num_free_handles;
+   uint32_t max_free_handles;
+   uint32_t next_fence_id;
+   /* all vtest_contexts, to hand signaled fences to */
+   struct list_head contexts;
+};
 
-struct virgl_renderer_callbacks vtest_cbs = {
-   .version = 1,
-   .write_fence = vtest_write_fence,
+static struct vtest_renderer renderer = {
+   .ctx_ids = 1,
+   .next_res_handle = 1,
+   .next_fence_id = 1,
+   .contexts = { &renderer.contexts, &renderer.contexts },
 };
 
-struct vtest_renderer {
+/* A submit fence of a protocol version 3 client.  The renderer numbers
+ * fences across all contexts, clients see their own sequence. */
+struct vtest_fence {
+   struct list_head head;
+   uint32_t fence_id;
+   uint32_t seqno;
+};
+
+/* Resources are created under a server wide handle and attached to the
+ * context under the handle the client picked, so clients sharing the
+ * renderer each get their own handle space.
+ */
+struct vtest_resource {
+   uint32_t ctx_id;
+   uint32_t client_handle;
+   uint32_t server_handle;
+   struct iovec *iovec;
+   /* iovec is a mapping shared with the client */
+   bool shm;
+};
+
+/* shared memory backing needs memfd_create */
+#ifdef HAVE_MEMFD_CREATE
+#define VTEST_SERVER_PROTOCOL_VERSION VTEST_PROTOCOL_VERSION
+#else
+#define VTEST_SERVER_PROTOCOL_VERSION 1
+#endif
+
+struct vtest_context {
    int in_fd;
    int out_fd;
+   uint32_t ctx_id;
    unsigned protocol_version;
-   struct util_hash_table *iovec_hash;
+   struct util_hash_table *resources;
+
+   /* last fence created for this context and the last one signaled,
+    * the renderer signals them per context */
+   uint32_t last_fence;
+   uint32_t signaled_fence;
+
+   struct list_head head;
+   /* unsignaled vtest_fences, oldest first */
+   struct list_head fences;
+   uint32_t next_seqno;
+   uint32_t signaled_seqno;
+   /* seqno of a VCMD_FENCE_WAIT still to be answered, or 0 */
+   uint32_t wait_seqno;
+
+   /* message payload read ahead by a multi client server, the commands
+    * read from it instead of in_fd when set */
+   const char *input;
+   uint32_t input_size;
 };
 
-struct vtest_renderer renderer;
-
 static int
 __failed_call(const char* func, const char *called, int ret)
 {
@@ -93,7 +156,7 @@ hash_func(void *key)
 }
 
 static int
-compare_iovecs(void *key1, void *key2)
+compare_handles(void *key1, void *key2)
 {
    if (key1 < key2) {
       return -1;
@@ -104,12 +167,52 @@ compare_iovecs(void *key1, void *key2)
    }
 }
 
-static void free_iovec(void *value)
+static uint32_t vtest_get_res_handle(void)
+{
+   if (renderer.num_free_handles) {
+      return renderer.free_handles[--renderer.num_free_handles];
+   }
+
+   return renderer.next_res_handle++;
+}
+
+static void vtest_put_res_handle(uint32_t handle)
+{
+   if (renderer.num_free_handles == renderer.max_free_handles) {
+      uint32_t max = MAX2(renderer.max_free_handles * 2, 64);
+      uint32_t *handles;
+
+      handles = realloc(renderer.free_handles, max * sizeof(*handles));
+      if (!handles) {
+         /* the handle is lost, a new one is taken next time */
+         return;
+      }
+      renderer.free_handles = handles;
+      renderer.max_free_handles = max;
+   }
+
+   renderer.free_handles[renderer.num_free_handles++] = handle;
+}
+
+static void free_resource(void *value)
 {
-   struct iovec *iovec = value;
+   struct vtest_resource *res = value;
+
+   virgl_renderer_ctx_detach_resource(res->ctx_id, res->client_handle);
+
+   if (res->iovec) {
+      virgl_renderer_resource_detach_iov(res->server_handle, NULL, NULL);
+      if (res->shm) {
+         munmap(res->iovec->iov_base, res->iovec->iov_len);
+      } else {
+         free(res->iovec->iov_base);
+      }
+      FREE(res->iovec);
+   }
 
-   free(iovec->iov_base);
-   free(iovec);
+   virgl_renderer_resource_unref(res->server_handle);
+   vtest_put_res_handle(res->server_handle);
+   FREE(res);
 }
 
 static int vtest_block_write(int fd, void *buf, int size)
@@ -122,6 +225,11 @@ static int vtest_block_write(int fd, void *buf, int size)
    do {
       ret = write(fd, ptr, left);
       if (ret < 0) {
+         /* the multi client server has the clients non blocking */
+         if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+             !vtest_wait_for_fd_write(fd)) {
+            continue;
+         }
          return -errno;
       }
 
@@ -142,6 +250,10 @@ static int vtest_block_write_zero(int fd, int size)
    do {
       ret = write(fd, zero, MIN2(left, 256));
       if (ret < 0) {
+         if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+             !vtest_wait_for_fd_write(fd)) {
+            continue;
+         }
          return -errno;
       }
 
@@ -187,52 +299,219 @@ int vtest_block_read(int fd, void *buf, int size)
    return size;
 }
 
-int vtest_create_renderer(int in_fd, int out_fd, uint32_t length,
-                          int ctx_flags)
+static int vtest_send_fence_reply(struct vtest_context *ctx, uint32_t cmd,
+                                  uint32_t value)
 {
-   char *vtestname;
-   int ret;
+   uint32_t buf[VTEST_HDR_SIZE + 1];
 
-   renderer.iovec_hash = util_hash_table_create(hash_func, compare_iovecs, free_iovec);
-   renderer.in_fd = in_fd;
-   renderer.out_fd = out_fd;
+   buf[VTEST_CMD_LEN] = 1;
+   buf[VTEST_CMD_ID] = cmd;
+   buf[VTEST_CMD_DATA_START] = value;
+   return vtest_block_write(ctx->out_fd, buf, sizeof(buf));
+}
 
-   /* By default we support version 0 unless VCMD_PROTOCOL_VERSION is sent */
-   renderer.protocol_version = 0;
+static void vtest_retire_fences(struct vtest_context *ctx)
+{
+   struct vtest_fence *fence, *tmp;
+   uint32_t seqno = ctx->signaled_seqno;
+
+   LIST_FOR_EACH_ENTRY_SAFE(fence, tmp, &ctx->fences, head) {
+      if ((int32_t)(fence->fence_id - ctx->signaled_fence) > 0) {
+         break;
+      }
+      seqno = fence->seqno;
+      list_del(&fence->head);
+      FREE(fence);
+   }
+
+   if (seqno == ctx->signaled_seqno) {
+      return;
+   }
+   ctx->signaled_seqno = seqno;
+
+   /* a dead client is noticed when its socket is read next */
+   vtest_send_fence_reply(ctx, VCMD_FENCE_SIGNALED, seqno);
+
+   if (ctx->wait_seqno && (int32_t)(ctx->wait_seqno - seqno) <= 0) {
+      ctx->wait_seqno = 0;
+      vtest_send_fence_reply(ctx, VCMD_FENCE_WAIT, 1);
+   }
+}
+
+static void vtest_write_context_fence(UNUSED void *cookie, uint32_t ctx_id,
+                                      uint32_t fence_id)
+{
+   struct vtest_context *ctx;
+
+   LIST_FOR_EACH_ENTRY(ctx, &renderer.contexts, head) {
+      if (ctx->ctx_id != ctx_id) {
+         continue;
+      }
+
+      ctx->signaled_fence = fence_id;
+      if (!LIST_IS_EMPTY(&ctx->fences)) {
+         vtest_retire_fences(ctx);
+      }
+      break;
+   }
+}
+
+struct virgl_renderer_callbacks vtest_cbs = {
+   .version = 3,
+   .write_context_fence = vtest_write_context_fence,
+};
+
+static int vtest_context_read(struct vtest_context *ctx, void *buf, int size)
+{
+   if (!ctx->input) {
+      return vtest_block_read(ctx->in_fd, buf, size);
+   }
+
+   if (size < 0 || (uint32_t)size > ctx->input_size) {
+      return -EINVAL;
+   }
+
+   memcpy(buf, ctx->input, size);
+   ctx->input += size;
+   ctx->input_size -= size;
+   return size;
+}
+
+int vtest_init_renderer(int ctx_flags)
+{
+   int ret;
 
    ret = virgl_renderer_init(&renderer,
-         ctx_flags | VIRGL_RENDERER_THREAD_SYNC, &vtest_cbs);
+         ctx_flags | VIRGL_RENDERER_THREAD_SYNC | VIRGL_RENDERER_ASYNC_READBACK,
+         &vtest_cbs);
    if (ret) {
       fprintf(stderr, "failed to initialise renderer.\n");
       return -1;
    }
 
+   renderer.initialized = true;
+   return 0;
+}
+
+void vtest_cleanup_renderer(void)
+{
+   if (!renderer.initialized) {
+      return;
+   }
+
+   virgl_renderer_cleanup(&renderer);
+   renderer.initialized = false;
+
+   free(renderer.free_handles);
+   renderer.free_handles = NULL;
+   renderer.num_free_handles = 0;
+   renderer.max_free_handles = 0;
+   renderer.next_res_handle = 1;
+}
+
+struct vtest_context *vtest_new_context(int in_fd, int out_fd)
+{
+   struct vtest_context *ctx;
+
+   ctx = CALLOC_STRUCT(vtest_context);
+   if (!ctx) {
+      return NULL;
+   }
+
+   ctx->resources = util_hash_table_create(hash_func, compare_handles, free_resource);
+   if (!ctx->resources) {
+      FREE(ctx);
+      return NULL;
+   }
+
+   ctx->in_fd = in_fd;
+   ctx->out_fd = out_fd;
+   ctx->next_seqno = 1;
+   list_inithead(&ctx->fences);
+   list_addtail(&ctx->head, &renderer.contexts);
+
+   /* By default we support version 0 unless VCMD_PROTOCOL_VERSION is sent */
+   ctx->protocol_version = 0;
+
+   return ctx;
+}
+
+void vtest_destroy_context(struct vtest_context *ctx)
+{
+   struct vtest_fence *fence, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(fence, tmp, &ctx->fences, head) {
+      FREE(fence);
+   }
+   list_del(&ctx->head);
+
+   /* drop the resources the client leaked before the context goes away */
+   util_hash_table_destroy(ctx->resources);
+
+   if (ctx->ctx_id) {
+      virgl_renderer_context_destroy(ctx->ctx_id);
+      renderer.ctx_ids &= ~(1ull << ctx->ctx_id);
+   }
+
+   FREE(ctx);
+}
+
+void vtest_set_context_input(struct vtest_context *ctx, const void *data,
+                             uint32_t size)
+{
+   ctx->input = data;
+   ctx->input_size = size;
+}
+
+int vtest_create_renderer(struct vtest_context *ctx, uint32_t length)
+{
+   char *vtestname;
+   uint32_t ctx_id;
+   int ret;
+
+   if (ctx->ctx_id) {
+      return report_failure("renderer already created", -EINVAL);
+   }
+
+   for (ctx_id = 1; ctx_id < VTEST_MAX_CONTEXTS; ctx_id++) {
+      if (!(renderer.ctx_ids & (1ull << ctx_id)))
+         break;
+   }
+   if (ctx_id == VTEST_MAX_CONTEXTS) {
+      return report_failure("too many contexts", -EBUSY);
+   }
+
    vtestname = calloc(1, length + 1);
    if (!vtestname) {
       return -1;
    }
 
-   ret = vtest_block_read(renderer.in_fd, vtestname, length);
+   ret = vtest_context_read(ctx, vtestname, length);
    if (ret != (int)length) {
       ret = -1;
       goto end;
    }
 
    ret = virgl_renderer_context_create(ctx_id, strlen(vtestname), vtestname);
+   if (!ret) {
+      ctx->ctx_id = ctx_id;
+      renderer.ctx_ids |= 1ull << ctx_id;
+   }
 
 end:
    free(vtestname);
    return ret;
 }
 
-int vtest_ping_protocol_version(UNUSED uint32_t length_dw)
+int vtest_ping_protocol_version(struct vtest_context *ctx,
+                                UNUSED uint32_t length_dw)
 {
    uint32_t hdr_buf[VTEST_HDR_SIZE];
    int ret;
 
    hdr_buf[VTEST_CMD_LEN] = VCMD_PING_PROTOCOL_VERSION_SIZE;
    hdr_buf[VTEST_CMD_ID] = VCMD_PING_PROTOCOL_VERSION;
-   ret = vtest_block_write(renderer.out_fd, hdr_buf, sizeof(hdr_buf));
+   ret = vtest_block_write(ctx->out_fd, hdr_buf, sizeof(hdr_buf));
    if (ret < 0) {
       return ret;
    }
@@ -240,30 +519,31 @@ int vtest_ping_protocol_version(UNUSED uint32_t length_dw)
    return 0;
 }
 
-int vtest_protocol_version(UNUSED uint32_t length_dw)
+int vtest_protocol_version(struct vtest_context *ctx,
+                           UNUSED uint32_t length_dw)
 {
    uint32_t hdr_buf[VTEST_HDR_SIZE];
    uint32_t version_buf[VCMD_PROTOCOL_VERSION_SIZE];
    int ret;
 
-   ret = vtest_block_read(renderer.in_fd, &version_buf, sizeof(version_buf));
+   ret = vtest_context_read(ctx, &version_buf, sizeof(version_buf));
    if (ret != sizeof(version_buf))
       return -1;
 
-   renderer.protocol_version = MIN2(version_buf[VCMD_PROTOCOL_VERSION_VERSION],
-                                    VTEST_PROTOCOL_VERSION);
+   ctx->protocol_version = MIN2(version_buf[VCMD_PROTOCOL_VERSION_VERSION],
+                                VTEST_SERVER_PROTOCOL_VERSION);
 
    hdr_buf[VTEST_CMD_LEN] = VCMD_PROTOCOL_VERSION_SIZE;
    hdr_buf[VTEST_CMD_ID] = VCMD_PROTOCOL_VERSION;
 
-   version_buf[VCMD_PROTOCOL_VERSION_VERSION] = renderer.protocol_version;
+   version_buf[VCMD_PROTOCOL_VERSION_VERSION] = ctx->protocol_version;
 
-   ret = vtest_block_write(renderer.out_fd, hdr_buf, sizeof(hdr_buf));
+   ret = vtest_block_write(ctx->out_fd, hdr_buf, sizeof(hdr_buf));
    if (ret < 0) {
       return ret;
    }
 
-   ret = vtest_block_write(renderer.out_fd, version_buf, sizeof(version_buf));
+   ret = vtest_block_write(ctx->out_fd, version_buf, sizeof(version_buf));
    if (ret < 0) {
       return ret;
    }
@@ -271,15 +551,7 @@ int vtest_protocol_version(UNUSED uint32_t length_dw)
    return 0;
 }
 
-void vtest_destroy_renderer(void)
-{
-   virgl_renderer_context_destroy(ctx_id);
-   virgl_renderer_cleanup(&renderer);
-   renderer.in_fd = -1;
-   renderer.out_fd = -1;
-}
-
-int vtest_send_caps2(UNUSED uint32_t length_dw)
+int vtest_send_caps2(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t hdr_buf[2];
    void *caps_buf;
@@ -301,12 +573,12 @@ int vtest_send_caps2(UNUSED uint32_t length_dw)
 
    hdr_buf[0] = max_size + 1;
    hdr_buf[1] = 2;
-   ret = vtest_block_write(renderer.out_fd, hdr_buf, 8);
+   ret = vtest_block_write(ctx->out_fd, hdr_buf, 8);
    if (ret < 0) {
       goto end;
    }
 
-   vtest_block_write(renderer.out_fd, caps_buf, max_size);
+   vtest_block_write(ctx->out_fd, caps_buf, max_size);
    if (ret < 0) {
       goto end;
    }
@@ -316,7 +588,7 @@ end:
    return 0;
 }
 
-int vtest_send_caps(UNUSED uint32_t length_dw)
+int vtest_send_caps(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t  max_ver, max_size;
    void *caps_buf;
@@ -334,12 +606,12 @@ int vtest_send_caps(UNUSED uint32_t length_dw)
 
    hdr_buf[0] = max_size + 1;
    hdr_buf[1] = 1;
-   ret = vtest_block_write(renderer.out_fd, hdr_buf, 8);
+   ret = vtest_block_write(ctx->out_fd, hdr_buf, 8);
    if (ret < 0) {
       goto end;
    }
 
-   vtest_block_write(renderer.out_fd, caps_buf, max_size);
+   vtest_block_write(ctx->out_fd, caps_buf, max_size);
    if (ret < 0) {
       goto end;
    }
@@ -349,13 +621,62 @@ end:
    return 0;
 }
 
-int vtest_create_resource(UNUSED uint32_t length_dw)
+static struct vtest_resource *
+vtest_lookup_resource(struct vtest_context *ctx, uint32_t handle)
+{
+   return util_hash_table_get(ctx->resources, intptr_to_pointer(handle));
+}
+
+/* creates the resource under a fresh server handle and makes it visible
+ * to the context as args->handle */
+static int vtest_add_resource(struct vtest_context *ctx,
+                              struct virgl_renderer_resource_create_args *args,
+                              struct iovec *iovec)
+{
+   struct vtest_resource *res;
+   uint32_t client_handle = args->handle;
+   int ret;
+
+   // Check that the handle doesn't already exist.
+   if (vtest_lookup_resource(ctx, client_handle)) {
+      return -EEXIST;
+   }
+
+   res = CALLOC_STRUCT(vtest_resource);
+   if (!res) {
+      return -ENOMEM;
+   }
+
+   args->handle = vtest_get_res_handle();
+   ret = virgl_renderer_resource_create(args, NULL, 0);
+   if (ret) {
+      vtest_put_res_handle(args->handle);
+      FREE(res);
+      return ret;
+   }
+
+   res->ctx_id = ctx->ctx_id;
+   res->client_handle = client_handle;
+   res->server_handle = args->handle;
+   virgl_renderer_ctx_attach_resource_as(ctx->ctx_id, res->server_handle,
+                                         client_handle);
+
+   if (iovec) {
+      virgl_renderer_resource_attach_iov(res->server_handle, iovec, 1);
+      res->iovec = iovec;
+   }
+
+   util_hash_table_set(ctx->resources, intptr_to_pointer(client_handle), res);
+   return 0;
+}
+
+int vtest_create_resource(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t res_create_buf[VCMD_RES_CREATE_SIZE];
    struct virgl_renderer_resource_create_args args;
    int ret;
 
-   ret = vtest_block_read(renderer.in_fd, &res_create_buf, sizeof(res_create_buf));
+   ret = vtest_context_read(ctx, &res_create_buf, sizeof(res_create_buf));
    if (ret != sizeof(res_create_buf)) {
       return -1;
    }
@@ -373,20 +694,126 @@ int vtest_create_resource(UNUSED uint32_t length_dw)
    args.nr_samples = res_create_buf[VCMD_RES_CREATE_NR_SAMPLES];
    args.flags = 0;
 
-   ret = virgl_renderer_resource_create(&args, NULL, 0);
+   return vtest_add_resource(ctx, &args, NULL);
+}
 
-   virgl_renderer_ctx_attach_resource(ctx_id, args.handle);
-   return ret;
+static int vtest_send_fd(int socket, int fd)
+{
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   char cmsg_buf[CMSG_SPACE(sizeof(int))];
+   char dummy = 0;
+   struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+   int ret;
+
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cmsg_buf;
+   msg.msg_controllen = sizeof(cmsg_buf);
+
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+   do {
+      ret = sendmsg(socket, &msg, MSG_NOSIGNAL);
+   } while (ret < 0 && (errno == EINTR ||
+                        ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                         !vtest_wait_for_fd_write(socket))));
+
+   /* a saved stream is replayed into /dev/null, nobody to pass it to */
+   if (ret < 0 && errno == ENOTSOCK) {
+      return 0;
+   }
+
+   return ret < 0 ? -errno : 0;
+}
+
+/* The backing is a memfd mapped by both sides, the client gets the fd
+ * right after the command.  Transfers then only move data between the
+ * mapping and the host resource, see VTEST_PROTOCOL_VERSION. */
+static int
+vtest_create_shm_resource(struct vtest_context *ctx,
+                          struct virgl_renderer_resource_create_args *args,
+                          uint32_t size)
+{
+#ifdef HAVE_MEMFD_CREATE
+   struct vtest_resource *res;
+   struct iovec *iovec;
+   uint32_t client_handle = args->handle;
+   void *ptr;
+   int fd, ret;
+
+   if (!size) {
+      return report_failure("shared backing without a size", -EINVAL);
+   }
+
+   fd = memfd_create("vtest-res", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (fd < 0) {
+      return report_failed_call("memfd_create", -errno);
+   }
+
+   /* the client may map it, but must not be able to shrink it under us */
+   if (ftruncate(fd, size) < 0 ||
+       fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+      ret = -errno;
+      close(fd);
+      return report_failed_call("ftruncate", ret);
+   }
+
+   ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (ptr == MAP_FAILED) {
+      ret = -errno;
+      close(fd);
+      return report_failed_call("mmap", ret);
+   }
+
+   iovec = CALLOC_STRUCT(iovec);
+   if (!iovec) {
+      munmap(ptr, size);
+      close(fd);
+      return -ENOMEM;
+   }
+   iovec->iov_base = ptr;
+   iovec->iov_len = size;
+
+   ret = vtest_add_resource(ctx, args, iovec);
+   if (ret) {
+      FREE(iovec);
+      munmap(ptr, size);
+      close(fd);
+      return ret;
+   }
+
+   res = vtest_lookup_resource(ctx, client_handle);
+   res->shm = true;
+
+   ret = vtest_send_fd(ctx->out_fd, fd);
+   close(fd);
+   if (ret < 0) {
+      return report_failed_call("vtest_send_fd", ret);
+   }
+
+   return 0;
+#else
+   (void)ctx;
+   (void)args;
+   (void)size;
+   return report_failure("shared backing not supported", -ENOTSUP);
+#endif
 }
 
-int vtest_create_resource2(UNUSED uint32_t length_dw)
+int vtest_create_resource2(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t res_create_buf[VCMD_RES_CREATE2_SIZE];
    struct virgl_renderer_resource_create_args args;
    struct iovec *iovec;
    int ret;
 
-   ret = vtest_block_read(renderer.in_fd, &res_create_buf, sizeof(res_create_buf));
+   ret = vtest_context_read(ctx, &res_create_buf, sizeof(res_create_buf));
    if (ret != sizeof(res_create_buf)) {
       return -1;
    }
@@ -404,18 +831,11 @@ int vtest_create_resource2(UNUSED uint32_t length_dw)
    args.nr_samples = res_create_buf[VCMD_RES_CREATE2_NR_SAMPLES];
    args.flags = 0;
 
-   // Check that the handle doesn't already exist.
-   if (util_hash_table_get(renderer.iovec_hash, intptr_to_pointer(args.handle))) {
-      return -EEXIST;
-   }
-
-   ret = virgl_renderer_resource_create(&args, NULL, 0);
-   if (ret) {
-      return ret;
+   if (ctx->protocol_version >= 2) {
+      return vtest_create_shm_resource(ctx, &args,
+                                       res_create_buf[VCMD_RES_CREATE2_DATA_SIZE]);
    }
 
-   virgl_renderer_ctx_attach_resource(ctx_id, args.handle);
-
    iovec = CALLOC_STRUCT(iovec);
    if (!iovec) {
       return -ENOMEM;
@@ -428,34 +848,33 @@ int vtest_create_resource2(UNUSED uint32_t length_dw)
       return -ENOMEM;
    }
 
-   virgl_renderer_resource_attach_iov(args.handle, iovec, 1);
-   util_hash_table_set(renderer.iovec_hash, intptr_to_pointer(args.handle), iovec);
+   ret = vtest_add_resource(ctx, &args, iovec);
+   if (ret) {
+      free(iovec->iov_base);
+      FREE(iovec);
+   }
 
    return ret;
 }
 
-int vtest_resource_unref(UNUSED uint32_t length_dw)
+int vtest_resource_unref(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t res_unref_buf[VCMD_RES_UNREF_SIZE];
    int ret;
    uint32_t handle;
 
-   ret = vtest_block_read(renderer.in_fd, &res_unref_buf, sizeof(res_unref_buf));
+   ret = vtest_context_read(ctx, &res_unref_buf, sizeof(res_unref_buf));
    if (ret != sizeof(res_unref_buf)) {
       return -1;
    }
 
+   /* detaches, releases the backing and unrefs through free_resource */
    handle = res_unref_buf[VCMD_RES_UNREF_RES_HANDLE];
-   virgl_renderer_ctx_attach_resource(ctx_id, handle);
-
-   virgl_renderer_resource_detach_iov(handle, NULL, NULL);
-   util_hash_table_remove(renderer.iovec_hash, intptr_to_pointer(handle));
-
-   virgl_renderer_resource_unref(handle);
+   util_hash_table_remove(ctx->resources, intptr_to_pointer(handle));
    return 0;
 }
 
-int vtest_submit_cmd(uint32_t length_dw)
+int vtest_submit_cmd(struct vtest_context *ctx, uint32_t length_dw)
 {
    uint32_t *cbuf;
    int ret;
@@ -469,13 +888,13 @@ int vtest_submit_cmd(uint32_t length_dw)
       return -1;
    }
 
-   ret = vtest_block_read(renderer.in_fd, cbuf, length_dw * 4);
+   ret = vtest_context_read(ctx, cbuf, length_dw * 4);
    if (ret != (int)length_dw * 4) {
       free(cbuf);
       return -1;
    }
 
-   virgl_renderer_submit_cmd(cbuf, ctx_id, length_dw);
+   virgl_renderer_submit_cmd(cbuf, ctx->ctx_id, length_dw);
 
    free(cbuf);
    return 0;
@@ -497,7 +916,7 @@ int vtest_submit_cmd(uint32_t length_dw)
    } while(0)
 
 
-int vtest_transfer_get(UNUSED uint32_t length_dw)
+int vtest_transfer_get(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t thdr_buf[VCMD_TRANSFER_HDR_SIZE];
    int ret;
@@ -508,7 +927,7 @@ int vtest_transfer_get(UNUSED uint32_t length_dw)
    void *ptr;
    struct iovec iovec;
 
-   ret = vtest_block_read(renderer.in_fd, thdr_buf, VCMD_TRANSFER_HDR_SIZE * 4);
+   ret = vtest_context_read(ctx, thdr_buf, VCMD_TRANSFER_HDR_SIZE * 4);
    if (ret != VCMD_TRANSFER_HDR_SIZE * 4) {
       return ret;
    }
@@ -520,10 +939,11 @@ int vtest_transfer_get(UNUSED uint32_t length_dw)
       return -ENOMEM;
    }
 
+   /* the context resolves its own handle */
    iovec.iov_len = data_size;
    iovec.iov_base = ptr;
    ret = virgl_renderer_transfer_read_iov(handle,
-         ctx_id,
+         ctx->ctx_id,
          level,
          stride,
          layer_stride,
@@ -534,13 +954,13 @@ int vtest_transfer_get(UNUSED uint32_t length_dw)
       fprintf(stderr," transfer read failed %d\n", ret);
    }
 
-   ret = vtest_block_write(renderer.out_fd, ptr, data_size);
+   ret = vtest_block_write(ctx->out_fd, ptr, data_size);
 
    free(ptr);
    return ret < 0 ? ret : 0;
 }
 
-int vtest_transfer_put(UNUSED uint32_t length_dw)
+int vtest_transfer_put(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t thdr_buf[VCMD_TRANSFER_HDR_SIZE];
    int ret;
@@ -551,7 +971,7 @@ int vtest_transfer_put(UNUSED uint32_t length_dw)
    void *ptr;
    struct iovec iovec;
 
-   ret = vtest_block_read(renderer.in_fd, thdr_buf, VCMD_TRANSFER_HDR_SIZE * 4);
+   ret = vtest_context_read(ctx, thdr_buf, VCMD_TRANSFER_HDR_SIZE * 4);
    if (ret != VCMD_TRANSFER_HDR_SIZE * 4) {
       return ret;
    }
@@ -563,15 +983,16 @@ int vtest_transfer_put(UNUSED uint32_t length_dw)
       return -ENOMEM;
    }
 
-   ret = vtest_block_read(renderer.in_fd, ptr, data_size);
+   ret = vtest_context_read(ctx, ptr, data_size);
    if (ret < 0) {
+      free(ptr);
       return ret;
    }
 
    iovec.iov_len = data_size;
    iovec.iov_base = ptr;
    ret = virgl_renderer_transfer_write_iov(handle,
-                                           ctx_id,
+                                           ctx->ctx_id,
                                            level,
                                            stride,
                                            layer_stride,
@@ -601,7 +1022,7 @@ int vtest_transfer_put(UNUSED uint32_t length_dw)
    } while(0)
 
 
-int vtest_transfer_get2(UNUSED uint32_t length_dw)
+int vtest_transfer_get2(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t thdr_buf[VCMD_TRANSFER2_HDR_SIZE];
    int ret;
@@ -611,43 +1032,55 @@ int vtest_transfer_get2(UNUSED uint32_t length_dw)
    uint32_t data_size;
    uint32_t offset;
    uint32_t extra_data = 0;
+   struct vtest_resource *res;
    struct iovec *iovec;
 
-   ret = vtest_block_read(renderer.in_fd, thdr_buf, sizeof(thdr_buf));
+   ret = vtest_context_read(ctx, thdr_buf, sizeof(thdr_buf));
    if (ret != sizeof(thdr_buf)) {
       return ret;
    }
 
    DECODE_TRANSFER2;
 
-   iovec = util_hash_table_get(renderer.iovec_hash, intptr_to_pointer(handle));
-   if (!iovec) {
+   res = vtest_lookup_resource(ctx, handle);
+   if (!res || !res->iovec) {
       return report_failed_call("util_hash_table_get", -ESRCH);
    }
+   iovec = res->iovec;
 
    if (offset >= iovec->iov_len) {
       return report_failure("offset larger then length of backing store", -EFAULT);
    }
 
+   /* Reads into the attached backing may land later, which is fine for
+    * shared mappings, but the data is sent right away otherwise.  Passing
+    * the backing explicitly keeps the read synchronous. */
    ret = virgl_renderer_transfer_read_iov(handle,
-                                          ctx_id,
+                                          ctx->ctx_id,
                                           level,
                                           0,
                                           0,
                                           &box,
                                           offset,
-                                          NULL, 0);
+                                          res->shm ? NULL : iovec,
+                                          res->shm ? 0 : 1);
    if (ret) {
       return report_failed_call("virgl_renderer_transfer_read_iov", ret);
    }
 
+   /* the data is in the shared mapping once the client saw a reply to a
+    * later command, e.g. a busy wait */
+   if (res->shm) {
+      return 0;
+   }
+
    /* Make sure we don't read out of bounds. */
    if (data_size > (iovec->iov_len - offset)) {
       extra_data = data_size - (iovec->iov_len - offset);
       data_size -= extra_data;
    }
 
-   ret = vtest_block_write(renderer.out_fd,
+   ret = vtest_block_write(ctx->out_fd,
                            iovec->iov_base + offset,
                            data_size);
    if (ret < 0) {
@@ -655,7 +1088,7 @@ int vtest_transfer_get2(UNUSED uint32_t length_dw)
    }
 
    if (extra_data) {
-      ret = vtest_block_write_zero(renderer.out_fd, extra_data);
+      ret = vtest_block_write_zero(ctx->out_fd, extra_data);
       if (ret < 0) {
          return report_failed_call("vtest_block_write_zero", ret);
       }
@@ -664,7 +1097,7 @@ int vtest_transfer_get2(UNUSED uint32_t length_dw)
    return ret < 0 ? ret : 0;
 }
 
-int vtest_transfer_put2(UNUSED uint32_t length_dw)
+int vtest_transfer_put2(struct vtest_context *ctx, UNUSED uint32_t length_dw)
 {
    uint32_t thdr_buf[VCMD_TRANSFER2_HDR_SIZE];
    int ret;
@@ -673,27 +1106,37 @@ int vtest_transfer_put2(UNUSED uint32_t length_dw)
    struct virgl_box box;
    uint32_t data_size;
    uint32_t offset;
+   struct vtest_resource *res;
    struct iovec *iovec;
 
-   ret = vtest_block_read(renderer.in_fd, thdr_buf, sizeof(thdr_buf));
+   ret = vtest_context_read(ctx, thdr_buf, sizeof(thdr_buf));
    if (ret != sizeof(thdr_buf)) {
       return ret;
    }
 
    DECODE_TRANSFER2;
 
-   iovec = util_hash_table_get(renderer.iovec_hash, intptr_to_pointer(handle));
-   if (!iovec) {
+   res = vtest_lookup_resource(ctx, handle);
+   if (!res || !res->iovec) {
       return report_failed_call("util_hash_table_get", -ESRCH);
    }
+   iovec = res->iovec;
 
-   ret = vtest_block_read(renderer.in_fd, iovec->iov_base + offset, data_size);
-   if (ret < 0) {
-      return report_failed_call("vtest_block_read", ret);
+   /* a shared server must not let one client write past its backing */
+   if (offset > iovec->iov_len || data_size > iovec->iov_len - offset) {
+      return report_failure("transfer larger then backing store", -EFAULT);
+   }
+
+   /* the client already wrote shared backings directly */
+   if (!res->shm) {
+      ret = vtest_context_read(ctx, iovec->iov_base + offset, data_size);
+      if (ret < 0) {
+         return report_failed_call("vtest_block_read", ret);
+      }
    }
 
    ret = virgl_renderer_transfer_write_iov(handle,
-                                           ctx_id,
+                                           ctx->ctx_id,
                                            level,
                                            0,
                                            0,
@@ -707,26 +1150,45 @@ int vtest_transfer_put2(UNUSED uint32_t length_dw)
    return 0;
 }
 
-int vtest_resource_busy_wait(UNUSED uint32_t length_dw)
+static bool vtest_context_busy(struct vtest_context *ctx)
+{
+   /* fences of a context retire in order */
+   return (int32_t)(ctx->last_fence - ctx->signaled_fence) > 0;
+}
+
+/* resources the GPU is done with don't wait for the rest of the queue */
+static bool vtest_resource_busy(struct vtest_context *ctx,
+                                struct vtest_resource *res)
+{
+   if (!res) {
+      return vtest_context_busy(ctx);
+   }
+   return virgl_renderer_resource_busy(res->server_handle);
+}
+
+int vtest_resource_busy_wait(struct vtest_context *ctx,
+                             UNUSED uint32_t length_dw)
 {
    uint32_t bw_buf[VCMD_BUSY_WAIT_SIZE];
    int ret, fd;
    int flags;
    uint32_t hdr_buf[VTEST_HDR_SIZE];
    uint32_t reply_buf[1];
+   struct vtest_resource *res;
    bool busy = false;
 
-   ret = vtest_block_read(renderer.in_fd, &bw_buf, sizeof(bw_buf));
+   ret = vtest_context_read(ctx, &bw_buf, sizeof(bw_buf));
    if (ret != sizeof(bw_buf)) {
       return -1;
    }
 
-   /*  handle = bw_buf[VCMD_BUSY_WAIT_HANDLE]; unused as of now */
+   /* unknown handles wait for all of the context's work */
+   res = vtest_lookup_resource(ctx, bw_buf[VCMD_BUSY_WAIT_HANDLE]);
    flags = bw_buf[VCMD_BUSY_WAIT_FLAGS];
 
    if (flags == VCMD_BUSY_WAIT_FLAG_WAIT) {
       do {
-         if (last_fence == (fence_id - 1)) {
+         if (!vtest_resource_busy(ctx, res)) {
             break;
          }
 
@@ -740,19 +1202,19 @@ int vtest_resource_busy_wait(UNUSED uint32_t length_dw)
 
       busy = false;
    } else {
-      busy = last_fence != (fence_id - 1);
+      busy = vtest_resource_busy(ctx, res);
    }
 
    hdr_buf[VTEST_CMD_LEN] = 1;
    hdr_buf[VTEST_CMD_ID] = VCMD_RESOURCE_BUSY_WAIT;
    reply_buf[0] = busy ? 1 : 0;
 
-   ret = vtest_block_write(renderer.out_fd, hdr_buf, sizeof(hdr_buf));
+   ret = vtest_block_write(ctx->out_fd, hdr_buf, sizeof(hdr_buf));
    if (ret < 0) {
       return ret;
    }
 
-   ret = vtest_block_write(renderer.out_fd, reply_buf, sizeof(reply_buf));
+   ret = vtest_block_write(ctx->out_fd, reply_buf, sizeof(reply_buf));
    if (ret < 0) {
       return ret;
    }
@@ -760,14 +1222,131 @@ int vtest_resource_busy_wait(UNUSED uint32_t length_dw)
    return 0;
 }
 
-int vtest_renderer_create_fence(void)
+int vtest_renderer_create_fence(struct vtest_context *ctx)
 {
-   virgl_renderer_create_fence(fence_id++, ctx_id);
+   ctx->last_fence = renderer.next_fence_id++;
+   virgl_renderer_create_fence(ctx->last_fence, ctx->ctx_id);
+   return 0;
+}
+
+/* the reply to a submit, the client's id for the submit fence */
+static int vtest_submit_fence(struct vtest_context *ctx)
+{
+   struct vtest_fence *fence;
+
+   fence = CALLOC_STRUCT(vtest_fence);
+   if (!fence) {
+      return -ENOMEM;
+   }
+
+   vtest_renderer_create_fence(ctx);
+   fence->fence_id = ctx->last_fence;
+   fence->seqno = ctx->next_seqno++;
+   list_addtail(&fence->head, &ctx->fences);
+
+   return vtest_send_fence_reply(ctx, VCMD_SUBMIT_CMD, fence->seqno);
+}
+
+int vtest_fence_wait(struct vtest_context *ctx, UNUSED uint32_t length_dw)
+{
+   uint32_t wait_buf[VCMD_FENCE_WAIT_SIZE];
+   uint32_t seqno;
+   bool signaled;
+   int ret;
+
+   ret = vtest_context_read(ctx, &wait_buf, sizeof(wait_buf));
+   if (ret != sizeof(wait_buf)) {
+      return -1;
+   }
+
+   if (ctx->protocol_version < 3) {
+      return report_failure("fences need protocol version 3", -EINVAL);
+   }
+
+   seqno = wait_buf[VCMD_FENCE_WAIT_SEQNO];
+   if ((int32_t)(seqno - ctx->next_seqno) >= 0) {
+      return report_failure("waiting on a fence never submitted", -EINVAL);
+   }
+
+   signaled = (int32_t)(seqno - ctx->signaled_seqno) <= 0;
+   if (signaled || !(wait_buf[VCMD_FENCE_WAIT_FLAGS] & VCMD_FENCE_WAIT_FLAG_WAIT)) {
+      ret = vtest_send_fence_reply(ctx, VCMD_FENCE_WAIT, signaled);
+      return ret < 0 ? ret : 0;
+   }
+
+   if (ctx->wait_seqno) {
+      return report_failure("already waiting on a fence", -EBUSY);
+   }
+
+   /* answered from vtest_retire_fences, the server goes on meanwhile */
+   ctx->wait_seqno = seqno;
    return 0;
 }
 
+unsigned vtest_context_protocol_version(struct vtest_context *ctx)
+{
+   return ctx->protocol_version;
+}
+
 int vtest_poll(void)
 {
    virgl_renderer_poll();
    return 0;
 }
+
+typedef int (*vtest_cmd_fptr_t)(struct vtest_context *, uint32_t);
+
+static const vtest_cmd_fptr_t vtest_commands[] = {
+   NULL /* CMD ids starts at 1 */,
+   vtest_send_caps,
+   vtest_create_resource,
+   vtest_resource_unref,
+   vtest_transfer_get,
+   vtest_transfer_put,
+   vtest_submit_cmd,
+   vtest_resource_busy_wait,
+   NULL, /* vtest_create_renderer is a specific case */
+   vtest_send_caps2,
+   vtest_ping_protocol_version,
+   vtest_protocol_version,
+   vtest_create_resource2,
+   vtest_transfer_get2,
+   vtest_transfer_put2,
+   vtest_fence_wait,
+};
+
+int vtest_dispatch_command(struct vtest_context *ctx, uint32_t cmd,
+                           uint32_t length_dw)
+{
+   int ret;
+
+   /* The first command MUST be VCMD_CREATE_RENDERER */
+   if (!ctx->ctx_id) {
+      if (cmd != VCMD_CREATE_RENDERER) {
+         return report_failure("renderer not created", -EINVAL);
+      }
+      return vtest_create_renderer(ctx, length_dw);
+   }
+
+   if (cmd == 0 || cmd >= ARRAY_SIZE(vtest_commands) ||
+       vtest_commands[cmd] == NULL) {
+      return report_failure("invalid command", -EINVAL);
+   }
+
+   ret = vtest_commands[cmd](ctx, length_dw);
+   if (ret < 0) {
+      return ret;
+   }
+
+   /* version 3 clients get told about their submit fences */
+   if (cmd == VCMD_SUBMIT_CMD && ctx->protocol_version >= 3) {
+      return vtest_submit_fence(ctx);
+   }
+
+   /* GL draws are fenced, while possible fence creations are too */
+   if (cmd == VCMD_SUBMIT_CMD || cmd == VCMD_RESOURCE_CREATE ||
+       cmd == VCMD_RESOURCE_CREATE2)
+      vtest_renderer_create_fence(ctx);
+
+   return 0;
+}
@@ -52,6 +52,8 @@ struct vtest_program
 
    bool do_fork;
    bool loop;
+   bool multi_clients;
+   int num_threads;
 
    bool use_glx;
    bool use_egl_surfaceless;
@@ -68,6 +70,8 @@ struct vtest_program prog = {
    .out_fd = -1,
    .do_fork = true,
    .loop = true,
+   .multi_clients = false,
+   .num_threads = 1,
 };
 
 static void vtest_main_getenv(void);
@@ -110,6 +114,22 @@ while (__AFL_LOOP(1000)) {
       goto start;
    }
 
+   if (prog.multi_clients) {
+      int ret;
+
+      /* a client going away must not take the others down */
+      signal(SIGPIPE, SIG_IGN);
+      vtest_main_set_signal_segv();
+      vtest_main_open_socket();
+      if (vtest_init_renderer(ctx_flags) < 0) {
+         exit(EXIT_FAILURE);
+      }
+      ret = vtest_run_multi_client_server(prog.socket, prog.num_threads);
+      vtest_cleanup_renderer();
+      vtest_main_close_socket();
+      exit(ret < 0 ? EXIT_FAILURE : 0);
+   }
+
    if (prog.do_fork) {
       vtest_main_set_signal_child();
    }
@@ -149,6 +169,9 @@ start:
 #define OPT_USE_GLX 'x'
 #define OPT_USE_EGL_SURFACELESS 's'
 #define OPT_USE_GLES 'e'
+#define OPT_MULTI_CLIENTS 'm'
+#define OPT_THREADS 't'
+#define OPT_SOCKET_PATH 'p'
 
 static void vtest_main_parse_args(int argc, char **argv)
 {
@@ -160,6 +183,9 @@ static void vtest_main_parse_args(int argc, char **argv)
       {"use-glx",             no_argument, NULL, OPT_USE_GLX},
       {"use-egl-surfaceless", no_argument, NULL, OPT_USE_EGL_SURFACELESS},
       {"use-gles",            no_argument, NULL, OPT_USE_GLES},
+      {"multi-clients",       no_argument, NULL, OPT_MULTI_CLIENTS},
+      {"threads",             required_argument, NULL, OPT_THREADS},
+      {"socket-path",         required_argument, NULL, OPT_SOCKET_PATH},
       {0, 0, 0, 0}
    };
 
@@ -188,9 +214,19 @@ static void vtest_main_parse_args(int argc, char **argv)
       case OPT_USE_GLES:
          prog.use_gles = true;
          break;
+      case OPT_MULTI_CLIENTS:
+         prog.multi_clients = true;
+         break;
+      case OPT_THREADS:
+         prog.num_threads = atoi(optarg);
+         break;
+      case OPT_SOCKET_PATH:
+         prog.socket_name = optarg;
+         break;
       default:
          printf("Usage: %s [--no-fork] [--no-loop-or-fork] [--use-glx] "
-                "[--use-egl-surfaceless] [--use-egl] [file]\n", argv[0]);
+                "[--use-egl-surfaceless] [--use-egl] [--multi-clients] "
+                "[--threads N] [--socket-path PATH] [file]\n", argv[0]);
          exit(EXIT_FAILURE);
          break;
       }
@@ -201,6 +237,12 @@ static void vtest_main_parse_args(int argc, char **argv)
       prog.read_file = argv[optind];
       prog.loop = false;
       prog.do_fork = false;
+      prog.multi_clients = false;
+   }
+
+   if (prog.num_threads < 1) {
+      fprintf(stderr, "Need at least one thread.\n");
+      exit(EXIT_FAILURE);
    }
 }
 
@@ -292,7 +334,7 @@ static void vtest_main_open_socket(void)
       goto err;
    }
 
-   if (listen(prog.socket, 1) < 0){
+   if (listen(prog.socket, prog.multi_clients ? SOMAXCONN : 1) < 0){
       goto err;
    }
 
@@ -332,90 +374,58 @@ static void vtest_main_wait_for_socket_accept(void)
    prog.out_fd = new_fd;
 }
 
-typedef int (*vtest_cmd_fptr_t)(uint32_t);
-
-static const vtest_cmd_fptr_t vtest_commands[] = {
-   NULL /* CMD ids starts at 1 */,
-   vtest_send_caps,
-   vtest_create_resource,
-   vtest_resource_unref,
-   vtest_transfer_get,
-   vtest_transfer_put,
-   vtest_submit_cmd,
-   vtest_resource_busy_wait,
-   NULL, /* vtest_create_renderer is a specific case */
-   vtest_send_caps2,
-   vtest_ping_protocol_version,
-   vtest_protocol_version,
-   vtest_create_resource2,
-   vtest_transfer_get2,
-   vtest_transfer_put2,
-};
-
 static void vtest_main_run_renderer(int in_fd, int out_fd, int ctx_flags)
 {
+   struct vtest_context *ctx;
    int err, ret;
    uint32_t header[VTEST_HDR_SIZE];
-   int initialized = 0;
+
+   if (vtest_init_renderer(ctx_flags) < 0) {
+      return;
+   }
+
+   ctx = vtest_new_context(in_fd, out_fd);
+   if (!ctx) {
+      vtest_cleanup_renderer();
+      return;
+   }
 
    do {
-      ret = vtest_wait_for_fd_read(in_fd);
+      /* fence signals are pushed to the client while it is quiet */
+      ret = vtest_wait_for_fds_read(in_fd, virgl_renderer_get_poll_fd());
       if (ret < 0) {
          err = 1;
          break;
       }
 
-      ret = vtest_block_read(in_fd, &header, sizeof(header));
-      if (ret < 0 || (size_t)ret < sizeof(header)) {
-         err = 2;
-         break;
-      }
-
-      if (!initialized) {
-         /* The first command MUST be VCMD_CREATE_RENDERER */
-         if (header[1] != VCMD_CREATE_RENDERER) {
-            err = 3;
-            break;
-         }
-
-         ret = vtest_create_renderer(in_fd, out_fd, header[0], ctx_flags);
-         if (ret < 0) {
-            err = 4;
-            break;
-         }
-         initialized = 1;
-         printf("%s: vtest initialized.\n", __func__);
+      if (ret == 1) {
          vtest_poll();
          continue;
       }
 
-      vtest_poll();
-      if (header[1] <= 0 || header[1] >= ARRAY_SIZE(vtest_commands)) {
-         err = 5;
-         break;
-      }
-
-      if (vtest_commands[header[1]] == NULL) {
-         err = 6;
+      ret = vtest_block_read(in_fd, &header, sizeof(header));
+      if (ret < 0 || (size_t)ret < sizeof(header)) {
+         err = 2;
          break;
       }
 
-      ret = vtest_commands[header[1]](header[0]);
+      vtest_poll();
+      ret = vtest_dispatch_command(ctx, header[1], header[0]);
       if (ret < 0) {
-         err = 7;
+         err = 3;
          break;
       }
 
-      /* GL draws are fenced, while possible fence creations are too */
-      if (header[1] == VCMD_SUBMIT_CMD || header[1] == VCMD_RESOURCE_CREATE ||
-          header[1] == VCMD_RESOURCE_CREATE2)
-         vtest_renderer_create_fence();
-
+      if (header[1] == VCMD_CREATE_RENDERER) {
+         printf("%s: vtest initialized.\n", __func__);
+         vtest_poll();
+      }
    } while (1);
 
    fprintf(stderr, "socket failed (%d) - closing renderer\n", err);
 
-   vtest_destroy_renderer();
+   vtest_destroy_context(ctx);
+   vtest_cleanup_renderer();
 }
 
 static void vtest_main_tidy_fds(void)